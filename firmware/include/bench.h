@@ -0,0 +1,141 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Microbenchmark of hot path functions (instrumentation build option)
+ */
+
+#pragma once
+
+#include "usb_cdc.h"
+#include <stdint.h>
+
+// BENCH_ENABLE: Includes the microbenchmark, which can be run with the
+// vendor-specific RUN_BENCH request.
+#if defined(BENCH_ENABLE)
+#define BENCH 1
+#else
+#define BENCH 0
+#endif
+
+// BENCH_SUITE_ENABLE: Additionally includes the benchmark suite of the hot path
+// kernels. It runs when the host opens the first serial port (DTR set) and
+// reports the results as text on the port's DATA IN endpoint. Requires BENCH_ENABLE.
+#if defined(BENCH_SUITE_ENABLE)
+#define BENCH_SUITE 1
+#else
+#define BENCH_SUITE 0
+#endif
+
+#if BENCH_SUITE == 1 && BENCH == 0
+#error "BENCH_SUITE_ENABLE requires BENCH_ENABLE"
+#endif
+
+/// Benchmark flag: hot path functions of the firmware run from RAM (`RAMFUNC_ENABLE`)
+#define BENCH_FLAG_RAMFUNC 0x01
+/// Benchmark flag: hot path functions of the USB library run from RAM (`QSB_RAMFUNC_ENABLE`)
+#define BENCH_FLAG_QSB_RAMFUNC 0x02
+
+/**
+ * @brief Benchmark results.
+ * 
+ * All durations are in clock cycles for a 64 byte packet (best of several runs,
+ * call overhead subtracted).
+ * 
+ * The structure is transmitted as is (little-endian, in the order of declaration)
+ * in response to the vendor-specific RUN_BENCH request.
+ */
+struct bench_results
+{
+    /// Clock frequency of durations (in Hz)
+    uint32_t clock_freq;
+    /// Build flags (`BENCH_FLAG_xxx`)
+    uint32_t flags;
+    /// Duration of `qsb_fsdev_copy_to_pma()` (word-aligned source buffer)
+    uint32_t copy_to_pma;
+    /// Duration of `qsb_fsdev_copy_to_pma()` (odd source buffer address)
+    uint32_t copy_to_pma_unaligned;
+    /// Duration of `qsb_fsdev_copy_chunks_to_pma()` (two chunks of 32 bytes)
+    uint32_t copy_chunks_to_pma;
+    /// Duration of `qsb_fsdev_copy_from_pma()` (word-aligned target buffer)
+    uint32_t copy_from_pma;
+    /// Duration of `qsb_fsdev_copy_from_pma()` (odd target buffer address)
+    uint32_t copy_from_pma_unaligned;
+    /// Duration of simple reference loop copying to PMA (word-aligned source buffer)
+    uint32_t ref_copy_to_pma;
+    /// Duration of simple reference loop copying to PMA (odd source buffer address)
+    uint32_t ref_copy_to_pma_unaligned;
+    /// Duration of simple reference loop copying from PMA (word-aligned target buffer)
+    uint32_t ref_copy_from_pma;
+    /// Duration of simple reference loop copying from PMA (odd target buffer address)
+    uint32_t ref_copy_from_pma_unaligned;
+};
+
+/// Result of a kernel of the benchmark suite
+struct bench_suite_result
+{
+    /// Kernel name (as used in the report)
+    const char *name;
+    /// Number of bytes processed per call
+    uint16_t bytes;
+    /// Fastest run (in clock cycles, call overhead subtracted)
+    uint32_t min_cycles;
+    /// Slowest run (in clock cycles, call overhead subtracted)
+    uint32_t max_cycles;
+};
+
+/**
+ * @brief Microbenchmark of hot path functions.
+ */
+class bench_impl
+{
+public:
+    /// Benchmark results
+    bench_results results;
+
+    /**
+     * @brief Runs the benchmark.
+     * 
+     * The benchmark uses a PMA area beyond the endpoint buffers and
+     * does not interfere with USB communication. It takes less than 1ms.
+     */
+    void run();
+
+#if BENCH_SUITE == 1
+    /// Requests the benchmark suite to be run and reported (called when the host opens the port)
+    void request_suite() { is_suite_requested = true; }
+
+    /**
+     * @brief Runs the requested benchmark suite and sends the report.
+     * 
+     * Must be called from the main loop (after `usb_cdc_poll()`). The report is
+     * sent on the DATA IN endpoint of the first serial port, one line per packet:
+     * 
+     *     BENCH 1 clock=<Hz> flags=<BENCH_FLAG_xxx> runs=<n>
+     *     <kernel> <bytes> <min cycles> <max cycles>
+     *     ...
+     *     END
+     * 
+     * @return `true` while the suite is being reported (the serial port must not be polled)
+     */
+    bool poll_suite();
+
+private:
+    void run_suite();
+    int format_report_line(int index, char *line);
+
+    bool is_suite_requested;
+    // Index of the next report line (-1 if no report is being sent)
+    int report_line = -1;
+    int num_suite_results;
+    bench_suite_result suite_results[16];
+    // Report line being sent (kept until copied to packet memory)
+    char report_packet[CDCACM_PACKET_SIZE] __attribute__((aligned(4)));
+#endif
+};
+
+/// Global benchmark
+extern bench_impl bench;
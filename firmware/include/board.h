@@ -0,0 +1,36 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Board performance profile selection
+ */
+
+#pragma once
+
+// Clock configurations (see BOARD_CLOCK)
+#define BOARD_CLOCK_HSI48 1             // 48 MHz internal oscillator trimmed by USB SOF packets (CRS)
+#define BOARD_CLOCK_HSE_BYPASS_16MHZ 2  // 16 MHz external clock, PLL x3 = 48 MHz
+#define BOARD_CLOCK_HSE_8MHZ_72MHZ 3    // 8 MHz crystal, PLL x9 = 72 MHz, USB clock PLL / 1.5
+
+// Each profile defines the fastest clock configuration of the MCU, the USART and DMA
+// channels giving the highest bit rate, the default buffer sizes and the BTABLE type.
+// The profile is selected with BOARD_STM32F042, BOARD_STM32F070 or BOARD_STM32F103
+// (see platformio.ini). If none is defined, it is derived from the MCU.
+#if defined(BOARD_STM32F042)
+#include "boards/stm32f042.h"
+#elif defined(BOARD_STM32F070)
+#include "boards/stm32f070.h"
+#elif defined(BOARD_STM32F103)
+#include "boards/stm32f103.h"
+#elif defined(STM32F070x6) || defined(STM32F070xB)
+#include "boards/stm32f070.h"
+#elif defined(STM32F0)
+#include "boards/stm32f042.h"
+#elif defined(STM32F1)
+#include "boards/stm32f103.h"
+#else
+#error "No board profile for this MCU"
+#endif
@@ -0,0 +1,30 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Board profile: STM32F042 (crystal-less, 6KB RAM)
+ * 
+ * Clock: 48 MHz internal HSI48 oscillator, trimmed to the USB SOF packets by the CRS.
+ * UART: USART2 on APB1 (48 MHz), oversampling by 8, i.e. up to 6 Mbps.
+ * Peak throughput (estimate from the clock tree): limited by the UART at 6 Mbps (600 KB/s
+ * per direction with 8N1). The host simulation reaches 574 KB/s per direction in full duplex;
+ * not yet measured on hardware.
+ */
+
+#pragma once
+
+#define BOARD_NAME "STM32F042"
+#define BOARD_CLOCK BOARD_CLOCK_HSI48
+#define BOARD_SYSCLK_FREQ 48000000
+#define BOARD_MAX_BAUDRATE 6000000
+
+// Default UART buffer size (per direction, halved with DUAL_CDC_ENABLE)
+#define BOARD_UART_BUF_LEN 1024
+
+// BTABLE entry size of the USB peripheral (see QSB_FSDEV_BTABLE_TYPE)
+#define BOARD_BTABLE_TYPE 2
+
+#include "stm32f0_usart2.h"
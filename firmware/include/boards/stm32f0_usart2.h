@@ -0,0 +1,89 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Pins and DMA channels of STM32F0 boards (USART2, and USART1 for the second port)
+ */
+
+#pragma once
+
+// --- USB pins and clocks
+
+#define USB_DP_PORT GPIOA
+#define USB_DP_PIN GPIO12
+#define USB_PORT_RCC RCC_GPIOA
+#define USB_ISR usb_isr
+
+// --- USART pins and clocks (USART2 is on APB1, which runs at the system clock on the STM32F0)
+
+#define USART USART2
+#define USART_PORT GPIOA
+#define USART_PORT_RCC RCC_GPIOA
+#define USART_TX_GPIO GPIO2
+#define USART_RX_GPIO GPIO3
+#define USART_GPIO_AF GPIO_AF1
+#define USART_RCC RCC_USART2
+#define USART_RTS_PORT GPIOA
+#define USART_RTS_GPIO GPIO1
+#define USART_FLOW_CONTROL USART_FLOWCONTROL_CTS
+// USART interrupt (only used by the event-driven main loop)
+#define USART_IRQ NVIC_USART2_IRQ
+#define USART_IRQ_HANDLER usart2_isr
+
+// Minimum oversampling (8 with USART_CR1_OVER8, i.e. maximum bit rate is clock / 8)
+#define USART_MIN_OVERSAMPLING 8
+
+// --- USART DMA channels and clocks (TX and RX channel share an interrupt)
+
+#define USART_DMA DMA1
+#define USART_DMA_TX_CHAN 4
+#define USART_DMA_RX_CHAN 5
+#define USART_DMA_RCC RCC_DMA
+#define USART_DMA_TX_IRQ NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ
+#define USART_DMA_RX_IRQ NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ
+#define USART_DMA_ISR dma1_channel4_7_dma2_channel3_5_isr
+
+// --- USART pins and clocks of second serial port (PB6/PB7 require a package with at least 32 pins)
+
+#define USART_2 USART1
+#define USART_2_PORT GPIOB
+#define USART_2_PORT_RCC RCC_GPIOB
+#define USART_2_TX_GPIO GPIO6
+#define USART_2_RX_GPIO GPIO7
+#define USART_2_GPIO_AF GPIO_AF0
+#define USART_2_RCC RCC_USART1
+#define USART_2_RTS_PORT GPIOB
+#define USART_2_RTS_GPIO GPIO1
+#define USART_2_FLOW_CONTROL USART_FLOWCONTROL_CTS
+#define USART_2_IRQ NVIC_USART1_IRQ
+#define USART_2_IRQ_HANDLER usart1_isr
+
+// --- USART DMA channels and clocks of second serial port
+
+#define USART_2_DMA DMA1
+#define USART_2_DMA_TX_CHAN 2
+#define USART_2_DMA_RX_CHAN 3
+#define USART_2_DMA_TX_IRQ NVIC_DMA1_CHANNEL2_3_DMA2_CHANNEL1_2_IRQ
+#define USART_2_DMA_RX_IRQ NVIC_DMA1_CHANNEL2_3_DMA2_CHANNEL1_2_IRQ
+#define USART_2_DMA_ISR dma1_channel2_3_dma2_channel1_2_isr
+
+// --- Microsecond timebase (16-bit timer, extended to 32 bits by its update interrupt)
+
+#define MICROS_TIMER TIM3
+#define MICROS_TIMER_RCC RCC_TIM3
+#define MICROS_TIMER_IRQ NVIC_TIM3_IRQ
+#define MICROS_TIMER_ISR tim3_isr
+
+// --- Reset and BOOT0 pins of the target MCU (TARGET_CTRL_ENABLE, unused pins otherwise)
+
+#define TARGET_CTRL_PORT GPIOA
+#define TARGET_NRST_GPIO GPIO4
+#define TARGET_BOOT0_GPIO GPIO5
+
+// --- Unused pins (configured as inputs with pull-down)
+
+#define BOARD_UNUSED_GPIOA (GPIO0 | GPIO4 | GPIO5 | GPIO6 | GPIO7 | GPIO13 | GPIO14)
+#define BOARD_UNUSED_GPIOB GPIO1
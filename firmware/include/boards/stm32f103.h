@@ -0,0 +1,114 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Board profile: STM32F103 (Blue Pill, 8 MHz crystal, 20KB RAM)
+ * 
+ * Clock: 8 MHz crystal, PLL x9 = 72 MHz; APB1 36 MHz, APB2 72 MHz, USB clock 72 MHz / 1.5.
+ * UART: USART1 on APB2 (72 MHz), oversampling by 16 (the only mode), i.e. up to 4.5 Mbps.
+ * Peak throughput (estimate from the clock tree, not yet measured): limited by the UART
+ * at 4.5 Mbps (450 KB/s per direction with 8N1).
+ * 
+ * Unverified: this profile (72 MHz clock, USART1 on APB2, 4 KB buffers, 32-bit BTABLE)
+ * has not yet been compiled with the ARM toolchain or tested on hardware.
+ * 
+ * The CTS input of USART1 (PA11) is used by USB. So the serial port has no hardware
+ * CTS flow control. RTS (controlled by software) is available on PA1.
+ */
+
+#pragma once
+
+#define BOARD_NAME "STM32F103"
+#define BOARD_CLOCK BOARD_CLOCK_HSE_8MHZ_72MHZ
+#define BOARD_SYSCLK_FREQ 72000000
+#define BOARD_MAX_BAUDRATE 4500000
+
+// Default UART buffer size (per direction, halved with DUAL_CDC_ENABLE)
+#define BOARD_UART_BUF_LEN 4096
+
+// BTABLE entry size of the USB peripheral (see QSB_FSDEV_BTABLE_TYPE)
+#define BOARD_BTABLE_TYPE 4
+
+// --- USB pins and clocks
+
+#define USB_DP_PORT GPIOA
+#define USB_DP_PIN GPIO12
+#define USB_PORT_RCC RCC_GPIOA
+#define USB_ISR usb_lp_can_rx0_isr
+
+// --- USART pins and clocks
+
+#define USART USART1
+#define USART_PORT GPIOA
+#define USART_PORT_RCC RCC_GPIOA
+#define USART_TX_GPIO GPIO9
+#define USART_RX_GPIO GPIO10
+#define USART_GPIO_AF 0 // no alternate function mapping on the STM32F1
+#define USART_RCC RCC_USART1
+#define USART_RTS_PORT GPIOA
+#define USART_RTS_GPIO GPIO1
+#define USART_FLOW_CONTROL USART_FLOWCONTROL_NONE
+// USART interrupt (only used by the event-driven main loop)
+#define USART_IRQ NVIC_USART1_IRQ
+#define USART_IRQ_HANDLER usart1_isr
+
+// Minimum oversampling (the STM32F1 only supports oversampling by 16)
+#define USART_MIN_OVERSAMPLING 16
+
+// --- USART DMA channels and clocks (separate interrupts for TX and RX channel)
+
+#define USART_DMA DMA1
+#define USART_DMA_TX_CHAN 4
+#define USART_DMA_RX_CHAN 5
+#define USART_DMA_RCC RCC_DMA1
+#define USART_DMA_TX_IRQ NVIC_DMA1_CHANNEL4_IRQ
+#define USART_DMA_RX_IRQ NVIC_DMA1_CHANNEL5_IRQ
+#define USART_DMA_ISR dma1_channel4_isr
+#define USART_DMA_RX_ISR dma1_channel5_isr
+
+// --- USART pins and clocks of second serial port (USART2 on APB1, up to 2.25 Mbps, CTS on PA0)
+
+#define USART_2 USART2
+#define USART_2_PORT GPIOA
+#define USART_2_PORT_RCC RCC_GPIOA
+#define USART_2_TX_GPIO GPIO2
+#define USART_2_RX_GPIO GPIO3
+#define USART_2_GPIO_AF 0
+#define USART_2_RCC RCC_USART2
+#define USART_2_RTS_PORT GPIOB
+#define USART_2_RTS_GPIO GPIO1
+#define USART_2_FLOW_CONTROL USART_FLOWCONTROL_CTS
+#define USART_2_IRQ NVIC_USART2_IRQ
+#define USART_2_IRQ_HANDLER usart2_isr
+
+// --- USART DMA channels and clocks of second serial port
+
+#define USART_2_DMA DMA1
+#define USART_2_DMA_TX_CHAN 7
+#define USART_2_DMA_RX_CHAN 6
+#define USART_2_DMA_TX_IRQ NVIC_DMA1_CHANNEL7_IRQ
+#define USART_2_DMA_RX_IRQ NVIC_DMA1_CHANNEL6_IRQ
+#define USART_2_DMA_ISR dma1_channel7_isr
+#define USART_2_DMA_RX_ISR dma1_channel6_isr
+
+// --- Microsecond timebase (16-bit timer, extended to 32 bits by its update interrupt)
+
+#define MICROS_TIMER TIM3
+#define MICROS_TIMER_RCC RCC_TIM3
+#define MICROS_TIMER_IRQ NVIC_TIM3_IRQ
+#define MICROS_TIMER_ISR tim3_isr
+
+// --- Reset and BOOT0 pins of the target MCU (TARGET_CTRL_ENABLE, unused pins otherwise)
+
+#define TARGET_CTRL_PORT GPIOA
+#define TARGET_NRST_GPIO GPIO4
+#define TARGET_BOOT0_GPIO GPIO5
+
+// --- Unused pins (configured as inputs with pull-down, i.e. the CTS input PA0 of the second
+// port is asserted if unconnected, SWD pins PA13/PA14 are left alone)
+
+#define BOARD_UNUSED_GPIOA (GPIO0 | GPIO4 | GPIO5 | GPIO6 | GPIO7)
+#define BOARD_UNUSED_GPIOB GPIO0
@@ -0,0 +1,57 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Boot timing (time to USB configuration and to the first data byte)
+ */
+
+#pragma once
+
+#include "common.h"
+#include <stdint.h>
+
+/**
+ * @brief Boot timing.
+ * 
+ * Records when the USB device has first been configured and when the first
+ * data byte has passed the bridge (in either direction) after a reset.
+ * The times are measured with `micros()`, i.e. from the start of the
+ * microsecond timer at the end of `common_init()`; the oscillator and PLL
+ * start-up before it are not included.
+ */
+class boot_timing_impl
+{
+public:
+    /// Call when the USB device has been configured
+    void on_configured()
+    {
+        if (configured_time == 0)
+            configured_time = timestamp();
+    }
+
+    /// Call when data has been transmitted via USB or UART
+    void on_data()
+    {
+        if (first_byte_time == 0)
+            first_byte_time = timestamp();
+    }
+
+    /// Gets the time from the start of the microsecond timer to the first USB configuration (in µs, 0 if not yet configured)
+    uint32_t configured_us() { return configured_time; }
+
+    /// Gets the time from the start of the microsecond timer to the first data byte (in µs, 0 if no data has passed yet)
+    uint32_t first_byte_us() { return first_byte_time; }
+
+private:
+    // timestamp that is never 0 (0 indicates that the event has not occurred)
+    static uint32_t timestamp() { return std::max(micros(), (uint32_t)1); }
+
+    uint32_t configured_time;
+    uint32_t first_byte_time;
+};
+
+/// Global boot timing
+extern boot_timing_impl boot_timing;
@@ -0,0 +1,74 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Clock synchronization with the USB frames (build option)
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// CLOCK_SYNC_ENABLE: Latches the USB frame number and a local timestamp at each
+// start of frame (SOF). They can be read with the vendor-specific GET_FRAME_TIME request.
+#if defined(CLOCK_SYNC_ENABLE)
+#define CLOCK_SYNC 1
+#else
+#define CLOCK_SYNC 0
+#endif
+
+/**
+ * @brief USB frame time.
+ * 
+ * The structure is transmitted as is (little-endian, in the order of declaration)
+ * in response to the vendor-specific GET_FRAME_TIME request.
+ */
+struct clock_sync_data
+{
+    /// Frame number of the last SOF packet (11 bits, from USB_FNR)
+    uint32_t frame_number;
+    /// Number of SOF packets received (extends the frame number)
+    uint32_t sof_count;
+    /// Millisecond counter at the last SOF packet
+    uint32_t millis;
+    /// SysTick counter value at the last SOF packet (counting down)
+    uint32_t systick;
+    /// High-resolution timestamp at the last SOF packet (see `clock_ticks()`)
+    uint32_t sof_ticks;
+    /// High-resolution timestamp when the request was processed
+    uint32_t request_ticks;
+    /// Clock frequency of the high-resolution timestamps (in Hz)
+    uint32_t clock_freq;
+};
+
+/**
+ * @brief Clock synchronization with the USB frames.
+ * 
+ * The USB host sends a SOF packet at the start of each 1 ms frame, which is a clock
+ * shared by host and device. The timestamp is taken when the SOF event is processed,
+ * i.e. it lags the SOF packet by up to one main loop iteration.
+ */
+class clock_sync_impl
+{
+public:
+    /// Call when a SOF packet has been received
+    void on_sof();
+
+    /**
+     * @brief Gets the frame time of the last SOF packet.
+     * 
+     * @return frame time, incl. the current timestamp
+     */
+    const clock_sync_data &frame_time();
+
+private:
+    clock_sync_data data;
+};
+
+#if CLOCK_SYNC == 1
+/// Global clock synchronization
+extern clock_sync_impl clock_sync;
+#endif
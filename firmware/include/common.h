@@ -10,9 +10,17 @@
 
 #pragma once
 
+#include "event_loop.h"
 #include <libopencmsis/core_cm3.h>
 #include <algorithm>
 
+#ifdef RAMFUNC_ENABLE
+// Places the function in SRAM (copied at startup, executed without flash wait states)
+#define RAMFUNC __attribute__((section(".ramtext"), noinline))
+#else
+#define RAMFUNC
+#endif
+
 /**
  * @brief Initializes common services
  */
@@ -38,3 +46,48 @@ void delay(uint32_t ms);
  * @return `true` if timeout time has been reached or passed, `false` otherwise
  */
 bool has_expired(uint32_t timeout);
+
+/**
+ * @brief Gets a high-resolution timestamp.
+ * 
+ * The timestamp is derived from the system tick timer and
+ * `millis()`. It wraps around after about 89s (at 48 MHz).
+ * It can also be called with interrupts masked or from an interrupt
+ * handler with a higher priority than the system tick.
+ * 
+ * @return number of clock cycles since a fixed time in the past
+ */
+uint32_t clock_ticks();
+
+/**
+ * @brief Gets a high-resolution timestamp and the values it is derived from.
+ * 
+ * @param ms receives the millisecond counter (see `millis()`)
+ * @param systick receives the system tick counter value (counting down)
+ * @return same timestamp as `clock_ticks()`
+ */
+uint32_t clock_ticks(uint32_t *ms, uint32_t *systick);
+
+/**
+ * @brief Gets the time with microsecond resolution.
+ * 
+ * The time is derived from a free-running 16-bit timer, extended
+ * to 32 bits in its update interrupt. It wraps around after about 71
+ * minutes. Unlike `millis()`, it is suitable for timeouts shorter than a USB frame.
+ * 
+ * @return number of microseconds since a fixed time in the past
+ */
+uint32_t micros();
+
+#if EVENT_LOOP == 1
+/**
+ * @brief Wakes up the event-driven main loop at the specified time.
+ * 
+ * Times 1 ms or more in the future are ignored as the system tick wakes
+ * up the main loop every millisecond. If an earlier wake-up is already
+ * pending, it is kept.
+ * 
+ * @param time wake-up time, derived from a call to micros()
+ */
+void wake_at(uint32_t time);
+#endif
@@ -0,0 +1,94 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Event-driven main loop (build option)
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// EVENT_LOOP_ENABLE: Runs the main loop event-driven. The interrupt handlers set
+// wake flags, the main loop only runs the handlers of the sources that have fired
+// and sleeps (WFI) otherwise. Requires QSB_ISR_MODE_ENABLE.
+#if defined(EVENT_LOOP_ENABLE)
+#define EVENT_LOOP 1
+#else
+#define EVENT_LOOP 0
+#endif
+
+#if EVENT_LOOP == 1 && !defined(QSB_ISR_MODE_ENABLE)
+#error "EVENT_LOOP_ENABLE requires QSB_ISR_MODE_ENABLE"
+#endif
+
+/**
+ * @brief Wake sources of the main loop (bit mask).
+ */
+enum wake_source : uint32_t
+{
+    /// USB interrupt (events queued for `qsb_dev_poll()`)
+    wake_usb = 1 << 0,
+    /// System tick (1 ms timers such as the holdback time and notification intervals)
+    wake_systick = 1 << 1,
+    /// Wake-up time requested with `wake_at()` (timeouts shorter than 1 ms)
+    wake_timer = 1 << 2,
+    /// UART TX DMA transfer complete (first serial port; shifted by 2 bits per port)
+    wake_uart_tx = 1 << 3,
+    /// UART RX DMA half or full transfer, start of reception or idle line (first serial port)
+    wake_uart_rx = 1 << 4,
+    /// All sources
+    wake_all = 0xffffffff
+};
+
+/// Wake source of the UART TX DMA transfer of the specified serial port
+constexpr uint32_t wake_uart_tx_port(int port_index) { return wake_uart_tx << (2 * port_index); }
+
+/// Wake sources of the UART RX side of the specified serial port
+constexpr uint32_t wake_uart_rx_port(int port_index) { return wake_uart_rx << (2 * port_index); }
+
+/// Wake sources of the UART of the specified serial port
+constexpr uint32_t wake_uart_port(int port_index) { return wake_uart_tx_port(port_index) | wake_uart_rx_port(port_index); }
+
+#if EVENT_LOOP == 1
+
+/**
+ * @brief Wake flags of the event-driven main loop.
+ *
+ * The system tick wakes the loop every millisecond, so all timers expire
+ * with the same resolution as in the polled loop. Data and USB events wake
+ * the loop immediately.
+ */
+class event_loop_impl
+{
+public:
+    /**
+     * @brief Signals that one or more wake sources have fired.
+     *
+     * Can be called from interrupt handlers and from the main loop
+     * (to request another pass of the handlers without sleeping).
+     *
+     * @param sources wake sources (bit mask of `wake_source`)
+     */
+    void signal(uint32_t sources);
+
+    /**
+     * @brief Waits until at least one wake source has fired.
+     *
+     * Sleeps with WFI while no source is pending.
+     *
+     * @return wake sources that have fired since the last call (bit mask of `wake_source`)
+     */
+    uint32_t wait();
+
+private:
+    volatile uint32_t pending_sources;
+};
+
+/// Global main loop wake flags
+extern event_loop_impl event_loop;
+
+#endif
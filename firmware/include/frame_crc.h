@@ -0,0 +1,82 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * CRC check of received frames with the CRC unit (build option)
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// FRAME_CRC_ENABLE: Checks the trailing CRC of each delimiter-terminated frame
+// received on the first serial port with the CRC calculation unit.
+#if defined(FRAME_CRC_ENABLE)
+#define FRAME_CRC 1
+#else
+#define FRAME_CRC 0
+#endif
+
+#if FRAME_CRC == 1 && defined(STM32F1)
+#error "FRAME_CRC_ENABLE requires the CRC unit of the STM32F0 (byte writes, initial value, bit reversal)"
+#endif
+
+/**
+ * @brief CRC check of received frames.
+ * 
+ * The received data is written to the CRC unit as it is scanned for the
+ * delimiter (32 bits per write where possible). A frame consists of the
+ * data between two delimiters, with a 32-bit CRC as its last four bytes.
+ * Instead of extracting and comparing the trailer, the CRC unit processes
+ * it as well: for a valid frame, it then holds a fixed residue, which is
+ * determined by the CRC unit itself when the CRC variant is configured.
+ * 
+ * The polynomial of the CRC units of the STM32F042 and STM32F070 is fixed
+ * (0x04C11DB7). The variant (bit order, initial value, final XOR) is
+ * selected with the `USB_SERIAL_CRC_...` flags.
+ */
+class frame_crc_impl
+{
+public:
+    /**
+     * @brief Configures the CRC variant.
+     * 
+     * The next byte processed starts a new frame (see `resync()`).
+     * 
+     * @param flags combination of `USB_SERIAL_CRC_...` flags, 0 to disable
+     */
+    void configure(uint32_t flags);
+
+    /// Skips the data up to the next delimiter (e.g. after data has been lost)
+    void resync() { is_resyncing = true; }
+
+    /**
+     * @brief Processes received data.
+     * 
+     * @param data received data
+     * @param len length of data, in bytes
+     * @param delimiter delimiter byte ending a frame
+     * @return number of frames with an invalid CRC completed in this data
+     */
+    int process(const uint8_t *data, size_t len, uint8_t delimiter);
+
+private:
+    void feed(const uint8_t *data, size_t len);
+    void start_frame();
+
+    // CRC register value after a valid frame (incl. trailer)
+    uint32_t residue;
+    // Number of bytes of the frame in progress
+    uint32_t frame_len;
+    // Indicates that data is skipped up to the next delimiter
+    bool is_resyncing;
+};
+
+#if FRAME_CRC == 1
+/// Global frame CRC check (first serial port)
+extern frame_crc_impl frame_crc;
+#endif
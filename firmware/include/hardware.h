@@ -10,25 +10,14 @@
 
 #pragma once
 
-// --- USB pins and clocks
+// --- Board profile (clock, pins, DMA channels, buffer sizes)
 
-#define USB_DP_PORT GPIOA
-#define USB_DP_PIN GPIO12
-#define USB_PORT_RCC RCC_GPIOA
+#include "board.h"
 
-// --- USART pins and clocks
+// --- Second serial port (build option)
 
-#define USART USART2
-#define USART_RX_DATA_REG USART2_RDR
-#define USART_TX_DATA_REG USART2_TDR
-#define USART_PORT GPIOA
-#define USART_TX_GPIO GPIO2
-#define USART_RX_GPIO GPIO3
-#define USART_RCC RCC_USART2
-
-// --- USART DMA channels and clocks
-
-#define USART_DMA DMA1
-#define USART_DMA_TX_CHAN 4
-#define USART_DMA_RX_CHAN 5
-#define USART_DMA_RCC RCC_DMA
\ No newline at end of file
+#ifdef DUAL_CDC_ENABLE
+#define DUAL_CDC 1
+#else
+#define DUAL_CDC 0
+#endif
@@ -0,0 +1,71 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Main loop statistics (instrumentation build option)
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// LOOP_STATS_ENABLE: Enables the main loop statistics (loop period histogram
+// and idle iterations). Adds a few cycles to each main loop iteration.
+#if defined(LOOP_STATS_ENABLE)
+#define LOOP_STATS 1
+#else
+#define LOOP_STATS 0
+#endif
+
+/// Number of histogram buckets (bucket n counts periods of 2^(n-1) to 2^n - 1 clock cycles)
+#define LOOP_STATS_NUM_BUCKETS 24
+
+/**
+ * @brief Main loop statistics data.
+ * 
+ * The structure is transmitted as is (little-endian, in the order of declaration)
+ * in response to the vendor-specific GET_LOOP_STATS request.
+ */
+struct loop_stats_data
+{
+    /// Number of main loop iterations
+    uint32_t iterations;
+    /// Number of main loop iterations that did no work
+    uint32_t idle_iterations;
+    /// Longest loop period (in clock cycles)
+    uint32_t max_period;
+    /// Clock frequency of periods (in Hz)
+    uint32_t clock_freq;
+    /// Histogram of loop periods (log2 buckets)
+    uint32_t histogram[LOOP_STATS_NUM_BUCKETS];
+};
+
+/**
+ * @brief Main loop statistics.
+ */
+class loop_stats_impl
+{
+public:
+    /// Statistics data
+    loop_stats_data data;
+
+    /// Call at the top of each main loop iteration
+    void on_loop_start();
+
+    /// Call when the current main loop iteration has done some work
+    void on_work_done() { has_done_work = true; }
+
+    /// Resets the statistics
+    void reset();
+
+private:
+    uint32_t last_timestamp;
+    bool has_done_work;
+    bool is_first_iteration;
+};
+
+/// Global main loop statistics
+extern loop_stats_impl loop_stats;
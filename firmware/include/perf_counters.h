@@ -0,0 +1,62 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Performance counters of the data path
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief Performance counters of the data path.
+ * 
+ * The counters are updated from the main loop only. They are transmitted as is
+ * (little-endian, in the order of declaration) in response to the vendor-specific
+ * GET_COUNTERS request. New counters must be appended at the end.
+ */
+struct perf_counters_impl
+{
+    /// Number of bytes received via USB (host to device)
+    uint32_t usb_out_bytes;
+    /// Number of bytes transmitted via USB (device to host)
+    uint32_t usb_in_bytes;
+    /// Number of USB OUT packets received
+    uint32_t usb_out_packets;
+    /// Number of USB IN packets submitted (incl. zero-length packets)
+    uint32_t usb_in_packets;
+    /// Number of zero-length IN packets submitted
+    uint32_t usb_in_zlps;
+    /// Number of times the OUT endpoint has been paused
+    uint32_t out_pauses;
+    /// Total time the OUT endpoint has been paused (in ms, completed pauses only)
+    uint32_t out_paused_time;
+    /// Number of RX buffer overruns
+    uint32_t rx_overruns;
+    /// Number of times a parity error was detected
+    uint32_t parity_errors;
+    /// Number of times a framing error was detected
+    uint32_t framing_errors;
+    /// Peak fill level of the UART TX buffer (in bytes)
+    uint32_t tx_buf_peak;
+    /// Peak fill level of the UART RX buffer (in bytes)
+    uint32_t rx_buf_peak;
+    /// Number of bytes lost due to RX buffer overruns
+    uint32_t rx_lost_bytes;
+    /// Number of SERIAL_STATE notifications sent
+    uint32_t serial_state_notifs;
+    /// Number of received frames with a checked CRC (see `FRAME_CRC_ENABLE`)
+    uint32_t rx_crc_frames;
+    /// Number of received frames with an invalid CRC
+    uint32_t rx_crc_errors;
+
+    /// Resets all counters to 0
+    void reset();
+};
+
+/// Global performance counters
+extern perf_counters_impl perf_counters;
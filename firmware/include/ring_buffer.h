@@ -0,0 +1,192 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Ring buffer for byte streams
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief Ring buffer for byte streams.
+ * 
+ * The buffer uses free-running head and tail counters. The buffer positions
+ * are derived from them by masking as the size is a power of 2. So the fill
+ * level is a simple subtraction, and full and empty buffers can be distinguished
+ * without wasting an element.
+ * 
+ * The buffer provides contiguous spans for DMA producers and consumers. If
+ * `Slack` is greater than 0, the buffer has additional space at the end so
+ * that a producer can write up to `Slack` contiguous bytes even at the wrap
+ * around. On commit, the bytes written into the slack area are copied to the
+ * start of the buffer.
+ * 
+ * Producer and consumer can be in different execution contexts (e.g. main loop
+ * and interrupt handler) as long as each counter is only modified by one of them.
+ * 
+ * @tparam N buffer size (power of 2)
+ * @tparam Slack additional space at the end of the buffer (in bytes)
+ * @tparam Count type of head and tail counters (unsigned, able to hold 2 * N)
+ */
+template <uint32_t N, uint32_t Slack = 0, typename Count = uint16_t>
+class ring_buffer
+{
+    static_assert((N & (N - 1)) == 0, "ring buffer size must be a power of 2");
+    static_assert(N <= ((Count)~(Count)0 >> 1) + 1, "ring buffer size too big for counter type");
+
+public:
+    /// Buffer size
+    static constexpr uint32_t size_max = N;
+
+    /// Empties the buffer
+    void clear() { head = tail = 0; }
+
+    /// Number of bytes in the buffer
+    Count size() const { return (Count)(head - tail); }
+
+    /// Free space in the buffer (in bytes)
+    Count avail() const { return (Count)(N - size()); }
+
+    /// Indicates if the buffer is empty
+    bool empty() const { return head == tail; }
+
+    /// Total number of bytes ever added (modulo the counter range)
+    Count head_count() const { return head; }
+
+    /// Total number of bytes ever removed (modulo the counter range)
+    Count tail_count() const { return tail; }
+
+    // --- Producer side
+
+    /// Gets a pointer to the position where the next byte will be written
+    uint8_t *write_ptr() { return buf + (head & (N - 1)); }
+
+    /**
+     * @brief Gets the length of the contiguous free space starting at `write_ptr()`.
+     * 
+     * The length includes the slack area.
+     * 
+     * @return length, in bytes
+     */
+    Count write_span() const
+    {
+        Count h = head;
+        Count span = N + Slack - (h & (N - 1));
+        Count free = (Count)(N - (Count)(h - tail));
+        return span < free ? span : free;
+    }
+
+    /**
+     * @brief Adds bytes written to `write_ptr()` to the buffer.
+     * 
+     * Bytes written into the slack area are moved to the start of the buffer.
+     * 
+     * @param len number of bytes (at most `write_span()`)
+     */
+    void commit(Count len)
+    {
+        uint32_t end = (head & (N - 1)) + len;
+        if (Slack > 0 && end > N)
+            memcpy(buf, buf + N, end - N);
+        head = (Count)(head + len);
+    }
+
+    /**
+     * @brief Sets the head counter.
+     * 
+     * For producers writing to the buffer without calling `commit()`,
+     * e.g. a circular DMA transfer.
+     * 
+     * @param count new head counter
+     */
+    void set_head(Count count) { head = count; }
+
+    /**
+     * @brief Adds a single byte to the buffer.
+     * 
+     * The buffer must not be full.
+     * 
+     * @param b byte
+     */
+    void put(uint8_t b)
+    {
+        buf[head & (N - 1)] = b;
+        head = (Count)(head + 1);
+    }
+
+    // --- Consumer side
+
+    /// Gets a pointer to the next byte to be read
+    const uint8_t *read_ptr() const { return buf + (tail & (N - 1)); }
+
+    /**
+     * @brief Gets the length of the contiguous data starting at `read_ptr()`.
+     * 
+     * @return length, in bytes
+     */
+    Count read_span() const
+    {
+        Count t = tail;
+        Count span = N - (t & (N - 1));
+        Count len = (Count)(head - t);
+        return span < len ? span : len;
+    }
+
+    /**
+     * @brief Gets the data in the buffer as two contiguous chunks.
+     * 
+     * The second chunk is empty unless the data wraps around.
+     * 
+     * @param chunk1 receives pointer to first chunk
+     * @param len1 receives length of first chunk
+     * @param chunk2 receives pointer to second chunk (start of buffer)
+     * @param len2 receives length of second chunk
+     * @return total length, in bytes
+     */
+    Count peek_chunks(const uint8_t **chunk1, Count *len1, const uint8_t **chunk2, Count *len2) const
+    {
+        Count t = tail;
+        Count len = (Count)(head - t);
+        Count span = N - (t & (N - 1));
+        *chunk1 = buf + (t & (N - 1));
+        *len1 = span < len ? span : len;
+        *chunk2 = buf;
+        *len2 = (Count)(len - *len1);
+        return len;
+    }
+
+    /**
+     * @brief Removes bytes from the buffer.
+     * 
+     * @param len number of bytes (at most `size()`)
+     */
+    void consume(Count len) { tail = (Count)(tail + len); }
+
+    /**
+     * @brief Removes a single byte from the buffer.
+     * 
+     * The buffer must not be empty.
+     * 
+     * @return byte
+     */
+    uint8_t get()
+    {
+        uint8_t b = buf[tail & (N - 1)];
+        tail = (Count)(tail + 1);
+        return b;
+    }
+
+    /// Gets the start of the buffer memory (for setting up DMA)
+    uint8_t *data() { return buf; }
+
+private:
+    uint8_t buf[N + Slack];
+    volatile Count head;
+    volatile Count tail;
+};
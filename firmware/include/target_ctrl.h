@@ -0,0 +1,85 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Reset and boot mode control of the target MCU (build option)
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// TARGET_CTRL_ENABLE: Drives the reset (NRST) and BOOT0 pins of the MCU connected
+// to the serial port from the DTR and RTS control lines of the first port.
+#if defined(TARGET_CTRL_ENABLE)
+#define TARGET_CTRL 1
+#else
+#define TARGET_CTRL 0
+#endif
+
+#ifndef TARGET_BOOT0_HOLD_TIME
+/// Time BOOT0 remains asserted after the reset has been released (in ms)
+#define TARGET_BOOT0_HOLD_TIME 10
+#endif
+
+/**
+ * @brief Reset and boot mode control of the target MCU.
+ * 
+ * The control lines are decoded like the common two-transistor auto-reset circuit:
+ * 
+ * | DTR | RTS | NRST     | BOOT0    |
+ * |-----|-----|----------|----------|
+ * | 0   | 0   | released | low      |
+ * | 1   | 1   | released | low      |
+ * | 0   | 1   | asserted | low      |
+ * | 1   | 0   | released | high     |
+ * 
+ * So opening the serial port (which sets both lines) does not reset the target.
+ * Both lines are changed with a single request, so there are no intermediate states.
+ * When the reset is released, BOOT0 is set first and held for at least
+ * `TARGET_BOOT0_HOLD_TIME` so the target samples it reliably.
+ */
+class target_ctrl_impl
+{
+public:
+    /// Initializes the pins (reset released, BOOT0 low)
+    void init();
+
+    /**
+     * @brief Sets the state of the control lines.
+     * 
+     * @param dtr `true` if DTR is asserted
+     * @param rts `true` if RTS is asserted
+     */
+    void set_control_lines(bool dtr, bool rts);
+
+    /// Releases BOOT0 if the hold time has expired (call from main loop)
+    void poll()
+    {
+        if (is_boot0_release_pending)
+            release_boot0();
+    }
+
+    /// Indicates if the target is held in reset
+    bool is_in_reset() { return is_reset_asserted; }
+
+    /// Indicates if BOOT0 is asserted
+    bool is_boot0_set() { return is_boot0_asserted; }
+
+private:
+    void set_boot0(bool asserted);
+    void release_boot0();
+
+    uint32_t boot0_hold_until;
+    bool is_reset_asserted;
+    bool is_boot0_asserted;
+    bool is_boot0_release_pending;
+};
+
+#if TARGET_CTRL == 1
+/// Global target control
+extern target_ctrl_impl target_ctrl;
+#endif
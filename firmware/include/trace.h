@@ -0,0 +1,152 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Event trace (instrumentation build option)
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// TRACE_ENABLE: Records data path events (endpoint pauses, DMA transfers, overruns etc.)
+// in a trace ring in RAM. It can be read with the vendor-specific GET_TRACE request.
+#if defined(TRACE_ENABLE)
+#define TRACE 1
+#else
+#define TRACE 0
+#endif
+
+// TRACE_LEN: Number of records in the trace ring (power of 2, 8 bytes each)
+#if !defined(TRACE_LEN)
+#define TRACE_LEN 64
+#endif
+
+/**
+ * @brief Trace events.
+ * 
+ * Bit 7 of the event ID in a record indicates the serial port (0 for the first,
+ * 1 for the second port). Events not related to a port always use the first port.
+ */
+enum class trace_event : uint8_t
+{
+    /// USB bus reset
+    bus_reset = 1,
+    /// USB device configured (argument: configuration value)
+    configured = 2,
+    /// DATA OUT endpoint(s) paused (argument: free space in TX buffer)
+    ep_pause = 3,
+    /// DATA OUT endpoint(s) unpaused (argument: free space in TX buffer)
+    ep_unpause = 4,
+    /// UART TX DMA transfer started (argument: chunk size)
+    tx_dma_start = 5,
+    /// UART TX DMA transfer completed (argument: chunk size)
+    tx_dma_done = 6,
+    /// UART RX buffer overrun (argument: number of lost bytes)
+    rx_overrun = 7,
+    /// Line coding set (argument: baud rate)
+    set_line_coding = 8,
+    /// Control line state set (argument: DTR in bit 0, RTS in bit 1)
+    set_control_line_state = 9,
+};
+
+/**
+ * @brief Trace record.
+ * 
+ * The records are transmitted as is (little-endian) in response to the vendor-specific
+ * GET_TRACE request.
+ */
+struct trace_record
+{
+    /// Timestamp (see `clock_ticks()`)
+    uint32_t timestamp;
+    /// Event ID (bits 0 to 7) and argument (bits 8 to 31)
+    uint32_t event_arg;
+};
+
+/**
+ * @brief Header of the GET_TRACE response.
+ * 
+ * The structure is transmitted as is (little-endian, in the order of declaration),
+ * followed by the trace records.
+ */
+struct trace_header
+{
+    /// Number of records written since startup
+    uint32_t write_count;
+    /// Sequence number of the first record in the response
+    uint32_t first;
+    /// Clock frequency of timestamps (in Hz)
+    uint32_t clock_freq;
+};
+
+#if TRACE == 1
+
+/**
+ * @brief Trace ring.
+ * 
+ * Fixed-size ring of trace records. If it is full, the oldest records are overwritten.
+ * Records can be added from the main loop and from interrupt handlers.
+ */
+class trace_impl
+{
+    static_assert((TRACE_LEN & (TRACE_LEN - 1)) == 0, "TRACE_LEN must be a power of 2");
+
+public:
+    /**
+     * @brief Adds a record.
+     * 
+     * @param event event ID (incl. port bit)
+     * @param arg argument (24 bits)
+     */
+    void add(uint8_t event, uint32_t arg);
+
+    /**
+     * @brief Copies records to a buffer.
+     * 
+     * The buffer receives a `trace_header` followed by the records starting at sequence
+     * number `first`, or at the oldest record if it has already been overwritten.
+     * 
+     * @param first sequence number of the first requested record (modulo 65536)
+     * @param buf buffer
+     * @param len buffer length (in bytes)
+     * @return number of bytes copied
+     */
+    uint16_t read(uint16_t first, uint8_t *buf, uint16_t len);
+
+private:
+    trace_record records[TRACE_LEN];
+    uint32_t write_count;
+};
+
+/// Global trace ring
+extern trace_impl trace_ring;
+
+#endif
+
+#if TRACE == 1
+
+/**
+ * @brief Records an event.
+ * 
+ * Compiles to nothing if the trace is not included in the build
+ * (the arguments are not evaluated either).
+ * 
+ * @param event event
+ * @param arg argument (24 bits)
+ * @param port_index serial port (0 or 1)
+ */
+inline void trace(trace_event event, uint32_t arg = 0, uint8_t port_index = 0)
+{
+    trace_ring.add((uint8_t)event | (port_index << 7), arg);
+}
+
+#else
+
+// drops the arguments as they might read registers
+#define trace(...) ((void)0)
+
+#endif
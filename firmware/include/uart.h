@@ -12,9 +12,51 @@
 
 #include <stdint.h>
 #include <stdlib.h>
-
-#define UART_TX_BUF_LEN 1024
-#define UART_RX_BUF_LEN 1024
+#include "event_loop.h"
+#include "hardware.h"
+#include "ring_buffer.h"
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/cm3/nvic.h>
+
+// Buffer sizes (powers of 2), can be overridden with build flags
+// (the defaults are halved if the second serial port is enabled)
+#ifndef UART_TX_BUF_LEN
+#define UART_TX_BUF_LEN (DUAL_CDC == 1 ? BOARD_UART_BUF_LEN / 2 : BOARD_UART_BUF_LEN)
+#endif
+#ifndef UART_RX_BUF_LEN
+#define UART_RX_BUF_LEN (DUAL_CDC == 1 ? BOARD_UART_BUF_LEN / 2 : BOARD_UART_BUF_LEN)
+#endif
+#ifndef UART_2_TX_BUF_LEN
+#define UART_2_TX_BUF_LEN UART_TX_BUF_LEN
+#endif
+#ifndef UART_2_RX_BUF_LEN
+#define UART_2_RX_BUF_LEN UART_RX_BUF_LEN
+#endif
+// Slack at the end of the TX buffer so a USB packet is never split at the wrap around
+#define UART_TX_BUF_SLACK 64
+// Number of entries in the baud rate alias table
+#define UART_BAUD_ALIAS_TABLE_LEN 8
+
+// RX_TIMESTAMPS_ENABLE: Records when received data arrives in the RX buffer
+// (required for the framed RX mode with arrival timestamps).
+#if defined(RX_TIMESTAMPS_ENABLE)
+#define RX_TIMESTAMPS 1
+#else
+#define RX_TIMESTAMPS 0
+#endif
+// Number of entries in the RX arrival log
+#define UART_RX_ARRIVAL_LOG_LEN 16
+
+// TELEMETRY_ENABLE: Sends periodic telemetry records to the host (see
+// `usb_serial_param::telemetry_interval`); the buffer peaks are tracked per record.
+#if defined(TELEMETRY_ENABLE)
+#define TELEMETRY 1
+#else
+#define TELEMETRY 0
+#endif
 
 enum class uart_stopbits
 {
@@ -32,12 +74,91 @@ enum class uart_parity
 };
 
 
+/**
+ * @brief Baud rate alias.
+ * 
+ * Maps a requested (usually legacy) baud rate to the baud rate actually used.
+ * This allows host software to select high baud rates that are difficult to
+ * set with the operating system's serial API.
+ */
+struct uart_baud_alias
+{
+    /// Requested baud rate (0 for an unused entry)
+    uint32_t requested;
+    /// Baud rate used instead
+    uint32_t actual;
+};
+
+
+/**
+ * @brief Hardware resources and buffer sizes of the first serial port.
+ */
+struct uart_1_hw
+{
+    static constexpr uint32_t usart = USART;
+    static constexpr rcc_periph_clken usart_rcc = USART_RCC;
+    static constexpr uint32_t port = USART_PORT;
+    static constexpr rcc_periph_clken port_rcc = USART_PORT_RCC;
+    static constexpr uint16_t tx_gpio = USART_TX_GPIO;
+    static constexpr uint16_t rx_gpio = USART_RX_GPIO;
+    static constexpr uint8_t gpio_af = USART_GPIO_AF;
+    static constexpr uint32_t rts_port = USART_RTS_PORT;
+    static constexpr uint16_t rts_gpio = USART_RTS_GPIO;
+    static constexpr uint32_t flow_control = USART_FLOW_CONTROL;
+    static constexpr uint32_t dma = USART_DMA;
+    static constexpr uint8_t dma_tx_chan = USART_DMA_TX_CHAN;
+    static constexpr uint8_t dma_rx_chan = USART_DMA_RX_CHAN;
+    static constexpr uint8_t dma_tx_irq = USART_DMA_TX_IRQ;
+    static constexpr uint8_t dma_rx_irq = USART_DMA_RX_IRQ;
+    static constexpr uint8_t usart_irq = USART_IRQ;
+    static constexpr uint32_t tx_buf_len = UART_TX_BUF_LEN;
+    static constexpr uint32_t rx_buf_len = UART_RX_BUF_LEN;
+    static constexpr uint8_t port_index = 0;
+};
+
+/**
+ * @brief Hardware resources and buffer sizes of the second serial port.
+ */
+struct uart_2_hw
+{
+    static constexpr uint32_t usart = USART_2;
+    static constexpr rcc_periph_clken usart_rcc = USART_2_RCC;
+    static constexpr uint32_t port = USART_2_PORT;
+    static constexpr rcc_periph_clken port_rcc = USART_2_PORT_RCC;
+    static constexpr uint16_t tx_gpio = USART_2_TX_GPIO;
+    static constexpr uint16_t rx_gpio = USART_2_RX_GPIO;
+    static constexpr uint8_t gpio_af = USART_2_GPIO_AF;
+    static constexpr uint32_t rts_port = USART_2_RTS_PORT;
+    static constexpr uint16_t rts_gpio = USART_2_RTS_GPIO;
+    static constexpr uint32_t flow_control = USART_2_FLOW_CONTROL;
+    static constexpr uint32_t dma = USART_2_DMA;
+    static constexpr uint8_t dma_tx_chan = USART_2_DMA_TX_CHAN;
+    static constexpr uint8_t dma_rx_chan = USART_2_DMA_RX_CHAN;
+    static constexpr uint8_t dma_tx_irq = USART_2_DMA_TX_IRQ;
+    static constexpr uint8_t dma_rx_irq = USART_2_DMA_RX_IRQ;
+    static constexpr uint8_t usart_irq = USART_2_IRQ;
+    static constexpr uint32_t tx_buf_len = UART_2_TX_BUF_LEN;
+    static constexpr uint32_t rx_buf_len = UART_2_RX_BUF_LEN;
+    static constexpr uint8_t port_index = 1;
+};
+
+
 /**
  * @brief UART implementation
+ * 
+ * Each instance operates a USART with its own DMA channels, buffers and flow control.
+ * 
+ * @tparam HW hardware resources and buffer sizes (see `uart_1_hw`)
  */
+template <class HW>
 class uart_impl
 {
 public:
+    /// Size of transmit buffer
+    static constexpr uint32_t tx_buf_len = HW::tx_buf_len;
+    /// Size of receive buffer
+    static constexpr uint32_t rx_buf_len = HW::rx_buf_len;
+
     /// Initializes UART.
     void init();
 
@@ -50,26 +171,59 @@ public:
     void poll();
 
     /**
-     * @brief Submits the specified data for transmission.
+     * @brief Reserves contiguous space in the transmit buffer.
+     * 
+     * The caller can directly write up to `len` bytes into the returned
+     * buffer and then submit them for transmission by calling `commit_tx()`.
+     * The reserved space is never split by the wrap around of the transmit buffer.
+     * 
+     * @param len number of bytes to reserve (at most `UART_TX_BUF_SLACK`)
+     * @return pointer to reserved space, or `nullptr` if not enough space is available
+     */
+    uint8_t *reserve_tx(size_t len);
+
+    /**
+     * @brief Submits data written to the reserved space for transmission.
      * 
-     * The specified data is added to the transmission
-     * buffer and transmitted asynchronously.
+     * The data is transmitted asynchronously.
+     * 
+     * @param len number of bytes written (at most the length reserved with `reserve_tx()`)
+     */
+    void commit_tx(size_t len);
+
+    /**
+     * @brief Gets the received data without removing it from the receive buffer.
+     * 
+     * Due to the wrap-around of the circular buffer, the data can consist of
+     * up to two chunks. If there is no wrap-around, the second chunk is empty.
+     * The data is not modified (see `rx_data_mask()` for 7 bit data).
+     * 
+     * Once the data has been processed, `consume_rx()` must be called
+     * to remove it from the buffer.
+     * 
+     * @param chunk1 receives the pointer to the first chunk
+     * @param len1 receives the length of the first chunk
+     * @param chunk2 receives the pointer to the second chunk
+     * @param len2 receives the length of the second chunk
+     * @return total length of data, in number of bytes
+     */
+    size_t peek_rx_chunks(const uint8_t **chunk1, size_t *len1, const uint8_t **chunk2, size_t *len2);
+
+    /**
+     * @brief Removes data from the receive buffer.
      * 
-     * @param data pointer to byte array
-     * @param len length of byte array
+     * @param len number of bytes to remove (at most the length returned by `peek_rx_chunks()`)
      */
-    void transmit(const uint8_t *data, size_t len);
+    void consume_rx(size_t len);
 
     /**
-     * @brief Copies data from the receive buffer into the specified array.
+     * @brief Gets the bit mask to apply to received data.
      * 
-     * The copied data is removed from the buffer.
+     * With 7 data bits, the high bit of each byte must be cleared.
      * 
-     * @param data pointer to byte array
-     * @param len length of the byte array
-     * @return number of bytes copied to the byte array
+     * @return bit mask
      */
-    size_t copy_rx_data(uint8_t *data, size_t len);
+    uint8_t rx_data_mask() { return _databits == 7 ? 0x7f : 0xff; }
 
     /**
      * @brief Returns the length of received data in the receive buffer
@@ -78,6 +232,49 @@ public:
      */
     size_t rx_data_len();
 
+    /**
+     * @brief Gets the position of the next byte to be read in the received data stream.
+     * 
+     * @return number of bytes removed from the receive buffer since the UART was enabled (modulo 2^32)
+     */
+    uint32_t rx_read_count() { return rx_buf.tail_count(); }
+
+#if RX_TIMESTAMPS == 1
+    /**
+     * @brief Gets the time a received byte was first seen in the receive buffer.
+     * 
+     * The arrival is detected when the DMA transfer count is read, i.e. with the
+     * resolution of the main loop. If the byte is older than the entries of the
+     * arrival log, the oldest logged time is returned.
+     * 
+     * @param count position of the byte in the received data stream (see `rx_read_count()`)
+     * @return timestamp (see `clock_ticks()`)
+     */
+    uint32_t rx_arrival_time(uint32_t count);
+#endif
+
+#if TELEMETRY == 1
+    /**
+     * @brief Gets the peak fill levels of the transmit and receive buffer
+     * since the last call of `restart_buf_peaks()`.
+     * 
+     * @param tx_peak receives the TX buffer peak (in bytes)
+     * @param rx_peak receives the RX buffer peak (in bytes)
+     */
+    void buf_peaks(size_t *tx_peak, size_t *rx_peak)
+    {
+        *tx_peak = tx_buf_report_peak;
+        *rx_peak = rx_buf_report_peak;
+    }
+
+    /// Restarts the measurement of the peak fill levels returned by `buf_peaks()`
+    void restart_buf_peaks()
+    {
+        tx_buf_report_peak = tx_buf.size();
+        rx_buf_report_peak = rx_data_len();
+    }
+#endif
+
     /**
      * Indicates of an RX buffer overrun has occurred.
      * 
@@ -88,6 +285,17 @@ public:
      */
     bool has_rx_overrun_occurred();
 
+    /**
+     * Indicates if the RX line has become idle after receiving data.
+     * 
+     * An idle line (no start bit for the duration of a character)
+     * marks the end of a burst of received data. This function will
+     * return `true` once for each idle period.
+     * 
+     * @return `true` if the line has become idle
+     */
+    bool has_rx_burst_ended();
+
     /**
      * @brief Returns the available space in the transmit buffer
      * 
@@ -108,10 +316,45 @@ public:
     /**
      * @brief Gets the baud rate.
      * 
+     * The baud rate is the rate actually achieved with the
+     * clock and the baud rate register.
+     * 
      * @return baud rate, in bps
      */
     int baudrate() { return _baudrate; }
 
+    /**
+     * @brief Gets the deviation of the achieved baud rate from the target baud rate.
+     * 
+     * The target baud rate is the requested baud rate after applying the alias table.
+     * 
+     * @return deviation, in ppm
+     */
+    int baudrate_error_ppm() { return baudrate_error; }
+
+    /**
+     * @brief Gets an entry of the baud rate alias table.
+     * 
+     * @param index index of the entry (0 to UART_BAUD_ALIAS_TABLE_LEN - 1)
+     * @param alias receives the entry
+     * @return `true` if successful, `false` if the index is invalid
+     */
+    bool get_baud_alias(int index, uart_baud_alias *alias);
+
+    /**
+     * @brief Sets an entry of the baud rate alias table.
+     * 
+     * The alias takes effect with the next line coding change.
+     * 
+     * @param index index of the entry (0 to UART_BAUD_ALIAS_TABLE_LEN - 1)
+     * @param alias entry (requested baud rate 0 to clear it)
+     * @return `true` if successful, `false` if the index or the baud rate is invalid
+     */
+    bool set_baud_alias(int index, const uart_baud_alias *alias);
+
+    /// Resets the baud rate alias table to the default entries
+    void reset_baud_aliases();
+
     /**
      * @brief Gets the data bits per byte.
      * 
@@ -133,23 +376,119 @@ public:
      */
     uart_parity parity() { return _parity; }
 
-private:
-    /// Check if a chunk of data has been transmitted
-    void poll_tx_complete();
+    /**
+     * @brief Called when the TX DMA transfer has completed.
+     * 
+     * Called from the DMA interrupt handler. Immediately starts
+     * the transmission of the next chunk (if data is available)
+     * so the UART transmits without gaps.
+     */
+    void on_tx_complete();
+
+    /**
+     * @brief Called when the RX DMA has filled half or all of the buffer.
+     * 
+     * Called from the DMA interrupt handler.
+     */
+    void on_rx_half_complete();
 
+    /**
+     * @brief Called from the interrupt handler of the DMA channels.
+     * 
+     * Dispatches to `on_tx_complete()` and `on_rx_half_complete()`.
+     */
+    void on_dma_interrupt();
+
+#if EVENT_LOOP == 1
+    /**
+     * @brief Called from the USART interrupt handler.
+     * 
+     * Wakes up the main loop at the start of reception (first byte
+     * after the receive buffer has become empty) and when the RX line
+     * has become idle.
+     */
+    void on_usart_interrupt();
+#endif
+
+    /**
+     * @brief Gets the maximum chunk size for transmission.
+     * 
+     * Smaller chunks free up space in the transmit buffer sooner.
+     * 
+     * @return chunk size, in bytes (the last adapted size if not set by the host)
+     */
+    int tx_chunk_size() { return tx_max_chunk_size; }
+
+    /// Gets the maximum chunk size setting (0 for automatic)
+    int tx_chunk_size_setting() { return tx_max_chunk_size_setting; }
+
+    /**
+     * @brief Sets the maximum chunk size for transmission.
+     * 
+     * @param size chunk size, in bytes, or 0 to adapt it to the rate the TX buffer is filled at
+     */
+    void set_tx_chunk_size(int size);
+
+    /**
+     * @brief Sets the free space in the TX buffer below which the producer pauses.
+     * 
+     * The adaptive chunk size aims at freeing up space before the producer
+     * has to pause.
+     * 
+     * @param threshold free space, in bytes
+     */
+    void set_tx_pause_threshold(int threshold) { tx_pause_threshold = threshold; }
+
+    /**
+     * @brief Gets the RX buffer high-water mark.
+     * 
+     * @return high-water mark, in bytes
+     */
+    int rx_high_water() { return rx_high_water_mark; }
+
+    /**
+     * @brief Sets the RX buffer high-water mark.
+     * 
+     * @param mark high-water mark, in bytes, or 0 to derive it from the baud rate
+     */
+    void set_rx_high_water(int mark);
+
+private:
     /// Try to transmit more data
     void start_transmission();
 
+#if EVENT_LOOP == 1
+    /// Enables the RXNE interrupt if the receive buffer is empty
+    void arm_rx_start_wake();
+#endif
+
     /**
-     * @brief Checks if RX buffer has been overrun.
+     * @brief Gets the number of bytes written to the RX buffer by the DMA controller.
      * 
-     * If it has been overrun, data is discarded and the error state reset.
+     * The count is monotonic (modulo 2^32) and exact as long as the
+     * DMA interrupt is not delayed by more than the buffer size.
      * 
-     * This functions must be called frequently in order to reliably detect an overrun
-     * (more often than: RX buffer size * 10 bit/byte / maximum bit rate / 2)
+     * @return number of bytes
+     */
+    uint32_t rx_write_count();
+
+    /// Updates the head of the RX buffer from the DMA transfer count (and logs the arrival of new data)
+    void update_rx_head();
+
+    /**
+     * @brief Checks if RX buffer has been overrun.
+     * 
+     * If it has been overrun, the oldest data is discarded, keeping the
+     * newest half of the buffer, and the lost bytes are counted.
      */
     void check_rx_overrun();
 
+    /// Check for parity and framing errors (and update the performance counters)
+    void check_rx_errors();
+
+    /// Gets the clock of the USART peripheral
+    uint32_t usart_clock();
+
     /**
      * @brief Sets the baudrate
      * 
@@ -160,6 +499,30 @@ private:
      */
     void set_baudrate(int baud);
 
+    /// Updates the maximum TX chunk size from the baud rate or the value set by the host
+    void update_tx_chunk_size();
+
+    /// Computes the TX chunk size from the free space in the TX buffer and the fill rate
+    int adaptive_tx_chunk_size();
+
+    /// Measures the rate at which the TX buffer is filled (data received via USB)
+    void measure_tx_fill_rate();
+
+    /// Updates the RX high-water and low-water mark from the baud rate, the drain rate or the value set by the host
+    void update_rx_high_water_mark();
+
+    /// Measures the rate at which received data is drained (transmitted via USB)
+    void measure_rx_drain_rate();
+
+    /**
+     * @brief Updates the RTS signal.
+     * 
+     * RTS is deasserted when the RX buffer fill level reaches the
+     * high-water mark, and asserted again when it drops below the
+     * low-water mark.
+     */
+    void update_rts();
+
     /**
      * Deletes the high bit of each byte.
      * 
@@ -167,48 +530,92 @@ private:
      */
     static void clear_high_bits(uint8_t* buf, int buf_len);
 
+    // the benchmark suite measures clear_high_bits()
+    friend class bench_impl;
+
     // Buffer for data to be transmitted via UART
-    //  *  0 <= head < buf_len
-    //  *  0 <= tail < buf_len
-    //  *  head == tail => empty
-    //  *  head + 1 == tail => full (modulo UART_TX_BUF_LEN)
-    // `tx_buf_head` points to the positions where the next character
-    // should be inserted. `tx_buf_tail` points to the character after
-    // the last character that has been transmitted.
-    uint8_t tx_buf[UART_TX_BUF_LEN];
-    int tx_buf_head;
-    int tx_buf_tail;
+    // Reserved space can extend into the slack after the end of the buffer.
+    // When committed, the part in the slack is moved to the start of the buffer.
+    // The tail is updated from the DMA interrupt handler.
+    ring_buffer<HW::tx_buf_len, UART_TX_BUF_SLACK> tx_buf;
 
     // The number of bytes currently being transmitted
     int tx_size;
 
     // Buffer of data received via UART
-    //  *  0 <= head < buf_len
-    //  *  0 <= tail < buf_len
-    //  *  head == tail => empty
-    //  *  head + 1 == tail => full (modulo UART_RX_BUF_LEN)
-    // `rx_buf_head` points to the positions where the next character
-    // should be inserted. `rx_buf_tail` points to the character after
-    // the last character that has been transmitted.
-    uint8_t rx_buf[UART_RX_BUF_LEN];
-    // int rx_buf_head: : managed by circular DMA controller
-    int rx_buf_tail;
-
-    // Last measured RX buffer size (to detect overrun)
-    size_t last_rx_size;
+    // The head is managed by the circular DMA controller and updated from
+    // rx_write_count() before the buffer is accessed. 32-bit counters are
+    // used so overruns can be detected exactly: size() > rx_buf_len
+    // indicates an overrun.
+    ring_buffer<HW::rx_buf_len, 0, uint32_t> rx_buf;
+
+    // Number of bytes written by the DMA controller as of the last
+    // half or full transfer interrupt (multiple of rx_buf_len / 2)
+    volatile uint32_t rx_dma_count;
 
     int _baudrate;
+    int baudrate_error;
     int _databits;
     uart_stopbits _stopbits;
     uart_parity _parity;
 
     int rx_high_water_mark;
+    int rx_low_water_mark;
     int tx_max_chunk_size;
 
-    bool is_transmitting;
+    // RX drain rate (in bytes per ms, measured over RX_DRAIN_WINDOW ms)
+    int rx_drain_rate;
+    uint32_t rx_drain_window_start;
+    uint32_t rx_drain_window_count;
+
+    // TX fill rate (measured over TX_FILL_WINDOW ms) relative to the line rate:
+    // ratio line rate / fill rate in 8.8 fixed point format
+    uint32_t tx_chunk_scale;
+    uint32_t tx_fill_window_start;
+    uint16_t tx_fill_window_count;
+    int tx_pause_threshold;
+
+    bool is_rts_deasserted;
+
+    // Values set by host (0 if derived from baud rate)
+    int rx_high_water_mark_setting;
+    int tx_max_chunk_size_setting;
+
+    uart_baud_alias baud_aliases[UART_BAUD_ALIAS_TABLE_LEN];
+
+    volatile bool is_transmitting;
     bool is_enabled;
     bool rx_overrun_occurred;
+
+#if defined(STM32F1)
+    // The error and idle flags are only cleared when the DMA controller reads the next
+    // byte (reading the data register would take it from the DMA controller). So they
+    // are only handled again once data has been received since (see rx_write_count()).
+    uint32_t error_flag_rx_count;
+    uint32_t idle_flag_rx_count;
+#endif
+
+#if RX_TIMESTAMPS == 1
+    // Arrival log: each entry has the position of the first byte of newly arrived data
+    // in the received data stream and the time it was first seen
+    struct rx_arrival
+    {
+        uint32_t count;
+        uint32_t ticks;
+    };
+    rx_arrival rx_arrivals[UART_RX_ARRIVAL_LOG_LEN];
+    uint8_t rx_arrival_index;
+#endif
+
+#if TELEMETRY == 1
+    // Peak fill levels since the last telemetry record (see `buf_peaks()`)
+    size_t tx_buf_report_peak;
+    size_t rx_buf_report_peak;
+#endif
 };
 
-/// Global UART instance
-extern uart_impl uart;
+/// UART instance of first serial port
+extern uart_impl<uart_1_hw> uart;
+
+/// UART instance of second serial port (if enabled with DUAL_CDC_ENABLE)
+extern uart_impl<uart_2_hw> uart_2;
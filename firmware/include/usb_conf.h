@@ -10,10 +10,142 @@
 
 #pragma once
 
+#include "hardware.h"
 #include "qsb_device.h"
+#include "usb_cdc.h"
+
+// USB functions of the first serial port (values for USB_FUNCTIONS)
+#define USB_FUNC_CDC 1        // CDC ACM function (virtual serial port)
+#define USB_FUNC_VENDOR 2     // vendor-specific interface (bound to WinUSB on Windows)
+#define USB_FUNC_CDC_VENDOR 3 // CDC ACM function and vendor-specific interface
+
+/// USB functions providing access to the first serial port (can also be set as a build flag)
+#ifndef USB_FUNCTIONS
+#define USB_FUNCTIONS USB_FUNC_CDC
+#endif
+
+#if USB_FUNCTIONS < USB_FUNC_CDC || USB_FUNCTIONS > USB_FUNC_CDC_VENDOR
+#error "Invalid value for USB_FUNCTIONS"
+#endif
+#if USB_FUNCTIONS != USB_FUNC_CDC && DUAL_CDC == 1
+#error "The vendor-specific interface cannot be combined with DUAL_CDC_ENABLE"
+#endif
 
 #define DATA_OUT_1 0x01
 #define DATA_IN_1 0x82
 #define COMM_IN_1 0x83
 
+// Endpoints of second serial port (if enabled with DUAL_CDC_ENABLE)
+#define DATA_OUT_2 0x04
+#define DATA_IN_2 0x85
+#define COMM_IN_2 0x86
+
+// Interfaces (COMM must be immediately before DATA because of Associated Interface Descriptor)
+#define INTF_COMM_1 0
+#define INTF_DATA_1 1
+#define INTF_COMM_2 2
+#define INTF_DATA_2 3
+
+#if USB_FUNCTIONS == USB_FUNC_VENDOR
+// Vendor-specific interface only: it uses the endpoints of the CDC data interface
+#define INTF_VENDOR 0
+#define VENDOR_OUT DATA_OUT_1
+#define VENDOR_IN DATA_IN_1
+#else
+// Vendor-specific interface after the CDC ACM function
+#define INTF_VENDOR 2
+#define VENDOR_OUT 0x04
+#define VENDOR_IN 0x85
+#endif
+
+#if USB_FUNCTIONS != USB_FUNC_CDC
+#if QSB_WIN_WCID != 1
+#error "The vendor-specific interface requires QSB_WIN_WCID_ENABLE"
+#elif QSB_WIN_WCID_INTERFACE != INTF_VENDOR
+#error "QSB_WIN_WCID_INTERFACE must be set to the vendor-specific interface"
+#endif
+#endif
+
+#if QSB_FSDEV_BTABLE_TYPE != BOARD_BTABLE_TYPE
+#error "QSB_FSDEV_BTABLE_TYPE does not match the BTABLE type of the board profile"
+#endif
+
+/// Size of USB packet memory (PMA) usable for buffer descriptors and buffers
+#if QSB_FSDEV_BTABLE_TYPE == 2
+#define USB_PMA_SIZE 1024
+#else
+#define USB_PMA_SIZE 512
+#endif
+
+/// Maximum packet size of control endpoint 0 (64 is the maximum for full-speed devices)
+#ifndef USB_EP0_PACKET_SIZE
+#if USB_PMA_SIZE < 1024 && defined(BENCH_ENABLE)
+#define USB_EP0_PACKET_SIZE 32 // leave room for the benchmark buffer
+#else
+#define USB_EP0_PACKET_SIZE 64
+#endif
+#endif
+
+/// Size of control buffer for control requests with DATA OUT stage, vendor responses and runtime
+/// string descriptors (serial number). Configuration and other string descriptors are sent from flash.
+#define USB_CONTROL_BUF_SIZE 128
+
+/// Maximum packet size of COMM_IN_1 endpoint (notifications)
+#if defined(TELEMETRY_ENABLE)
+#define USB_COMM_PACKET_SIZE 32 // telemetry notification: 8 bytes header and 16 bytes record
+#else
+#define USB_COMM_PACKET_SIZE 16
+#endif
+
+/// Polling interval of the COMM endpoints (in ms, 1 to 255)
+#ifndef USB_COMM_INTERVAL
+#define USB_COMM_INTERVAL 16
+#endif
+
+/**
+ * @brief Packet memory plan of configuration 1.
+ * 
+ * `qsb_dev_ep_setup()` allocates the endpoint buffers in this order, following
+ * the buffer descriptor table. The allocation restarts with the control endpoint
+ * on each bus reset and SET_CONFIGURATION, so repeated configuration does not
+ * use up packet memory.
+ * 
+ * The bulk endpoints are double buffered. Full-speed bulk packets are limited to
+ * 64 bytes and the peripheral has no more than two buffers per endpoint, so
+ * the plan cannot use more than this for the data endpoints. Spare packet
+ * memory is instead used for the maximum control packet size, which reduces the
+ * number of transactions for descriptors and vendor responses.
+ */
+namespace usb_pma_plan {
+
+/// Buffer descriptor table (8 endpoints)
+constexpr int btable = 8 * 8;
+/// Control endpoint (RX and TX buffer)
+constexpr int ep0 = 2 * USB_EP0_PACKET_SIZE;
+/// DATA_OUT_1 (double buffered)
+constexpr int data_out = 2 * CDCACM_PACKET_SIZE;
+/// DATA_IN_1 (double buffered)
+constexpr int data_in = 2 * CDCACM_PACKET_SIZE;
+/// COMM_IN_1
+constexpr int comm_in = USB_FUNCTIONS != USB_FUNC_VENDOR ? USB_COMM_PACKET_SIZE : 0;
+#if USB_FUNCTIONS == USB_FUNC_CDC_VENDOR
+/// VENDOR_OUT and VENDOR_IN (double buffered)
+constexpr int vendor = data_out + data_in;
+#else
+constexpr int vendor = 0;
+#endif
+#if DUAL_CDC == 1
+/// Second serial port (DATA_OUT_2, DATA_IN_2, COMM_IN_2, same sizes as the first port)
+constexpr int port_2 = data_out + data_in + comm_in;
+#else
+constexpr int port_2 = 0;
+#endif
+
+/// Total packet memory used
+constexpr int total = btable + ep0 + data_out + data_in + comm_in + vendor + port_2;
+
+static_assert(total <= USB_PMA_SIZE, "endpoint buffers exceed USB packet memory");
+
+} // namespace usb_pma_plan
+
 qsb_device *usb_conf_init();
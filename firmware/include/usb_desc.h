@@ -0,0 +1,210 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Compile-time builder for USB descriptors
+ */
+
+#pragma once
+
+#include <array>
+#include <stddef.h>
+#include <stdint.h>
+#include "qsb_std_data.h"
+#include "qsb_cdc.h"
+
+/**
+ * @brief Functions for building USB descriptors at compile time.
+ * 
+ * The descriptors are built as byte arrays in the format sent to the host.
+ * If the result is assigned to a `constexpr` variable, it is placed in flash
+ * and can be sent without being assembled in RAM first.
+ */
+namespace usb_desc {
+
+/// Descriptor data
+template <size_t N>
+using blob = std::array<uint8_t, N>;
+
+namespace detail {
+
+template <size_t N, size_t M>
+constexpr void append(blob<N>& target, size_t& pos, const blob<M>& part)
+{
+    for (size_t i = 0; i < M; i++)
+        target[pos++] = part[i];
+}
+
+constexpr uint8_t lo(uint16_t value) { return value & 0xff; }
+constexpr uint8_t hi(uint16_t value) { return value >> 8; }
+
+} // namespace detail
+
+/**
+ * @brief Concatenates descriptors.
+ * 
+ * @param parts descriptors
+ * @return concatenated descriptors
+ */
+template <size_t... Ns>
+constexpr blob<(Ns + ...)> concat(const blob<Ns>&... parts)
+{
+    blob<(Ns + ...)> result{};
+    size_t pos = 0;
+    (detail::append(result, pos, parts), ...);
+    return result;
+}
+
+/**
+ * @brief Builds a complete configuration descriptor.
+ * 
+ * The configuration descriptor header is prepended to the interface, endpoint and
+ * functional descriptors. `wTotalLength` is set to the total length.
+ * 
+ * @param num_interfaces number of interfaces
+ * @param config_value value to select this configuration
+ * @param iconfiguration index of string descriptor describing this configuration
+ * @param attributes configuration attributes (`QSB_CONFIG_ATTR_xxx`)
+ * @param max_power maximum power consumption (in units of 2mA)
+ * @param parts interface, endpoint and functional descriptors
+ * @return configuration descriptor
+ */
+template <size_t... Ns>
+constexpr blob<QSB_DT_CONFIGURATION_SIZE + (Ns + ...)> configuration(uint8_t num_interfaces, uint8_t config_value,
+    uint8_t iconfiguration, uint8_t attributes, uint8_t max_power, const blob<Ns>&... parts)
+{
+    constexpr uint16_t total_length = QSB_DT_CONFIGURATION_SIZE + (Ns + ...);
+    blob<QSB_DT_CONFIGURATION_SIZE> header = {
+        QSB_DT_CONFIGURATION_SIZE,
+        QSB_DT_CONFIGURATION,
+        detail::lo(total_length),
+        detail::hi(total_length),
+        num_interfaces,
+        config_value,
+        iconfiguration,
+        attributes,
+        max_power,
+    };
+    return concat(header, parts...);
+}
+
+/// Builds an interface association descriptor
+constexpr blob<QSB_DT_INTERFACE_ASSOCIATION_SIZE> iface_assoc(uint8_t first_interface, uint8_t interface_count,
+    uint8_t function_class, uint8_t function_subclass, uint8_t function_protocol, uint8_t ifunction)
+{
+    return {
+        QSB_DT_INTERFACE_ASSOCIATION_SIZE,
+        QSB_DT_INTERFACE_ASSOCIATION,
+        first_interface,
+        interface_count,
+        function_class,
+        function_subclass,
+        function_protocol,
+        ifunction,
+    };
+}
+
+/// Builds an interface descriptor
+constexpr blob<QSB_DT_INTERFACE_SIZE> interface(uint8_t interface_number, uint8_t alternate_setting,
+    uint8_t num_endpoints, uint8_t interface_class, uint8_t interface_subclass, uint8_t interface_protocol,
+    uint8_t iinterface)
+{
+    return {
+        QSB_DT_INTERFACE_SIZE,
+        QSB_DT_INTERFACE,
+        interface_number,
+        alternate_setting,
+        num_endpoints,
+        interface_class,
+        interface_subclass,
+        interface_protocol,
+        iinterface,
+    };
+}
+
+/// Builds an endpoint descriptor
+constexpr blob<QSB_DT_ENDPOINT_SIZE> endpoint(uint8_t address, uint8_t attributes, uint16_t max_packet_size,
+    uint8_t interval)
+{
+    return {
+        QSB_DT_ENDPOINT_SIZE,
+        QSB_DT_ENDPOINT,
+        address,
+        attributes,
+        detail::lo(max_packet_size),
+        detail::hi(max_packet_size),
+        interval,
+    };
+}
+
+/// Builds a CDC header functional descriptor
+constexpr blob<sizeof(qsb_cdc_header_desc)> cdc_header(uint16_t bcd_cdc)
+{
+    return {
+        sizeof(qsb_cdc_header_desc),
+        QSB_CDC_FUNC_DT_INTERFACE,
+        QSB_CDC_FUNC_SUBTYPE_HEADER,
+        detail::lo(bcd_cdc),
+        detail::hi(bcd_cdc),
+    };
+}
+
+/// Builds a PSTN call management functional descriptor (see chapter 5.3.1 in PSTN120)
+constexpr blob<sizeof(qsb_pstn_call_management_desc)> cdc_call_management(uint8_t capabilities,
+    uint8_t data_interface)
+{
+    return {
+        sizeof(qsb_pstn_call_management_desc),
+        QSB_CDC_FUNC_DT_INTERFACE,
+        QSB_CDC_FUNC_SUBTYPE_CALL_MANAGEMENT,
+        capabilities,
+        data_interface,
+    };
+}
+
+/// Builds a PSTN abstract control management functional descriptor (see chapter 5.3.2 in PSTN120)
+constexpr blob<sizeof(qsb_cdc_acm_desc)> cdc_acm(uint8_t capabilities)
+{
+    return {
+        sizeof(qsb_cdc_acm_desc),
+        QSB_CDC_FUNC_DT_INTERFACE,
+        QSB_CDC_FUNC_SUBTYPE_ACM,
+        capabilities,
+    };
+}
+
+/// Builds a CDC union functional descriptor
+constexpr blob<sizeof(qsb_cdc_union_desc)> cdc_union(uint8_t control_interface, uint8_t subordinate_interface)
+{
+    return {
+        sizeof(qsb_cdc_union_desc),
+        QSB_CDC_FUNC_DT_INTERFACE,
+        QSB_CDC_FUNC_SUBTYPE_UNION,
+        control_interface,
+        subordinate_interface,
+    };
+}
+
+/**
+ * @brief Builds a string descriptor.
+ * 
+ * The string is converted from Latin-1 to UTF-16.
+ * 
+ * @param str string literal
+ * @return string descriptor
+ */
+template <size_t N>
+constexpr blob<2 * N> string(const char (&str)[N])
+{
+    blob<2 * N> result{};
+    result[0] = 2 * N;
+    result[1] = QSB_DT_STRING;
+    for (size_t i = 0; i < N - 1; i++)
+        result[2 + 2 * i] = (uint8_t)str[i];
+    return result;
+}
+
+} // namespace usb_desc
@@ -10,9 +10,21 @@
 
 #pragma once
 
+#include "frame_crc.h"
 #include "qsb_device.h"
 #include "qsb_cdc.h"
+#include "uart.h"
+#include "usb_conf.h"
+#include "usb_vendor.h"
 
+// SOF_SCHED_ENABLE: Schedules IN packets with the USB start-of-frame (SOF) events.
+// Short packets are only submitted at the start of a frame and the holdback
+// timeout counts frames instead of milliseconds.
+#if defined(SOF_SCHED_ENABLE)
+#define SOF_SCHED 1
+#else
+#define SOF_SCHED 0
+#endif
 
 /**
  * @brief Interrupts the host is notified about
@@ -22,26 +34,76 @@ enum class usb_serial_interrupt : uint16_t
     /// Data overrun (received data has been discarded)
     data_overrun = 64,
     /// Parity error
-    parity_error = 32
+    parity_error = 32,
+    /// Frame with invalid CRC received (reported as framing error, see `FRAME_CRC_ENABLE`)
+    crc_error = 16
+};
+
+
+/**
+ * @brief USB endpoints and UART of the first serial port
+ * 
+ * Depending on `USB_FUNCTIONS`, the data endpoints belong to the CDC data interface
+ * or the vendor-specific interface, or the port has both.
+ */
+struct usb_serial_1_port
+{
+    static constexpr uint8_t comm_intf = INTF_COMM_1;
+    static constexpr uint8_t data_out = DATA_OUT_1;
+    static constexpr uint8_t data_in = DATA_IN_1;
+    static constexpr uint8_t comm_in = COMM_IN_1;
+    static constexpr bool has_comm = USB_FUNCTIONS != USB_FUNC_VENDOR;
+    static constexpr bool has_vendor_intf = USB_FUNCTIONS == USB_FUNC_CDC_VENDOR;
+    static constexpr uint8_t vendor_out = VENDOR_OUT;
+    static constexpr uint8_t vendor_in = VENDOR_IN;
+    static constexpr uint8_t port_index = 0;
+    static uart_impl<uart_1_hw>& uart() { return ::uart; }
+};
+
+
+/**
+ * @brief USB endpoints and UART of the second serial port
+ */
+struct usb_serial_2_port
+{
+    static constexpr uint8_t comm_intf = INTF_COMM_2;
+    static constexpr uint8_t data_out = DATA_OUT_2;
+    static constexpr uint8_t data_in = DATA_IN_2;
+    static constexpr uint8_t comm_in = COMM_IN_2;
+    static constexpr bool has_comm = true;
+    static constexpr bool has_vendor_intf = false;
+    static constexpr uint8_t vendor_out = 0;
+    static constexpr uint8_t vendor_in = 0;
+    static constexpr uint8_t port_index = 1;
+    static uart_impl<uart_2_hw>& uart() { return ::uart_2; }
 };
 
 
 /**
  * @brief USB Serial implementation
  * 
- * Implements a USB CDC PSTN class device.
+ * Implements a USB CDC PSTN class function. Each instance bridges
+ * a pair of CDC interfaces to a UART, with its own flow control.
+ * 
+ * If the port has an additional vendor-specific interface (`has_vendor_intf`),
+ * data received on either bulk OUT endpoint is transmitted via the UART. Data
+ * received via the UART is sent on the CDC data interface while the host has
+ * the serial port open (DTR set) and on the vendor-specific interface otherwise.
+ * 
+ * @tparam Port USB endpoints and UART (see `usb_serial_1_port`)
  */
+template <class Port>
 class usb_serial_impl
 {
 public:
-    /// Initializes the UART and the USB connection
+    /// Initializes the UART
     void init();
 
     /// Called when the USB interface is configured
     void on_usb_configured();
 
     /**
-     * @brief Gets the line coding information from the global UART instance
+     * @brief Gets the line coding information from the UART
      * 
      * Used to implement a GET_LINE_CODING request.
      * 
@@ -50,7 +112,7 @@ public:
     void get_line_coding(qsb_pstn_line_coding *line_coding);
 
     /**
-     * @brief Sets the line coding information of the global UART instance
+     * @brief Sets the line coding information of the UART
      * 
      * This member function is called to process a SET_LINE_CODING request.
      * 
@@ -60,17 +122,19 @@ public:
     bool set_line_coding(qsb_pstn_line_coding *line_coding);
 
     /**
-     * @brief Sets the control line state of the global UART instance.
+     * @brief Sets the control line state of the UART.
      * 
      * This member function is called to process a SET_CONTROL_LINE_STATE request.
-     * It sets the DTR output signal.
+     * The DTR signal selects the interface for data received via UART (see class description).
+     * With `TARGET_CTRL_ENABLE`, DTR and RTS of the first port control the target's reset
+     * and BOOT0 pins.
      * 
      * @param state control line state, in format defined by USB CDC PSTN standard
      */
     void set_control_line_state(uint16_t state);
 
     /**
-     * @brief Gets the serial state from global UART instance.
+     * @brief Gets the serial state from the UART.
      * 
      * The serial state consists of the DCD and DSR input signal
      * as well as error conditions.
@@ -82,7 +146,8 @@ public:
     /**
      * @brief Sends the serial state to the USB host.
      * 
-     * The serial state is sent using a SERIAL_STATE notification.
+     * The serial state is sent using a SERIAL_STATE notification
+     * (unless a notification is still in flight).
      */
     void send_serial_state();
 
@@ -92,8 +157,11 @@ public:
      * Transmits the received data via the UART.
      * 
      * @param dev USB device
+     * @param ep endpoint address (CDC data or vendor-specific OUT endpoint)
+     * @param len packet length (in bytes)
+     * @param offset packet buffer offset (only used with QSB_STATIC_EP_DISPATCH_ENABLE)
      */
-    void on_usb_data_received(qsb_device *dev);
+    void on_usb_data_received(qsb_device *dev, uint8_t ep, uint32_t len, uint8_t offset);
 
     /**
      * @brief Called when data has been transmitted via USB.
@@ -122,6 +190,9 @@ public:
     /**
      * @brief Notifies the host that an interrupt has occurred.
      * 
+     * The interrupt is merged with other pending interrupts. They are sent with
+     * the next SERIAL_STATE notification once no notification is in flight.
+     * 
      * @param interrupt interrupt
      */
     void on_interrupt_occurred(usb_serial_interrupt interrupt);
@@ -129,10 +200,50 @@ public:
     /**
      * @brief Called when controlled data has been transmitted or received via USB.
      * 
+     * The SERIAL_STATE or telemetry notification in flight has been delivered.
      * Checks if further notifications are pending.
      */
     void on_usb_ctrl_completed();
 
+    /**
+     * @brief Called when the host has reset the performance counters.
+     * 
+     * The next telemetry record covers the time since the reset.
+     */
+    void on_counters_reset();
+
+    /**
+     * @brief Gets a parameter value.
+     * 
+     * Used to implement the vendor-specific GET_PARAM request.
+     * 
+     * @param param parameter ID
+     * @param value receives the parameter value
+     * @return `true` if successful, `false` if the parameter is not supported
+     */
+    bool get_param(usb_serial_param param, uint32_t *value);
+
+    /**
+     * @brief Sets a parameter value.
+     * 
+     * Used to implement the vendor-specific SET_PARAM request.
+     * The value is kept until the USB device is configured again.
+     * 
+     * @param param parameter ID
+     * @param value parameter value
+     * @return `true` if successful, `false` if the parameter is not supported or the value is invalid
+     */
+    bool set_param(usb_serial_param param, uint32_t value);
+
+#if SOF_SCHED == 1
+    /**
+     * @brief Called when a USB SOF packet has been received (start of a 1 ms frame).
+     * 
+     * Packets that are not full are submitted at the next call of `poll()`.
+     */
+    void on_sof();
+#endif
+
     /**
      * Indicates if the USB CDC connection if configured.
      * 
@@ -142,6 +253,28 @@ public:
 
 private:
     void notify_serial_state(uint16_t state);
+    void update_serial_state();
+    void select_data_in();
+    void scan_rx_delimiter(const uint8_t *chunk1, size_t len1, const uint8_t *chunk2, size_t len);
+#if FRAME_CRC == 1
+    void check_rx_crc(const uint8_t *chunk1, size_t len1, const uint8_t *chunk2, size_t len);
+#endif
+    uint32_t holdback_clock();
+    void set_holdback_time_us(uint32_t time);
+    uint32_t holdback_time_us();
+    bool start_upload_mode(uint32_t baudrate);
+    void end_upload_mode();
+#if RX_TIMESTAMPS == 1
+    int transmit_framed(const uint8_t *chunk1, size_t len1, const uint8_t *chunk2, size_t len2);
+#endif
+#if TELEMETRY == 1
+    void update_telemetry();
+    void restart_telemetry();
+    uint32_t total_paused_time();
+#endif
+
+    // UART of this serial port
+    static auto& uart() { return Port::uart(); }
 
     // indicates if zero-length packet is needed as previously transmitted packet was equal to maximum packet size
     bool needs_zlp;
@@ -153,12 +286,107 @@ private:
     // Last serial state sent to host
     uint16_t last_serial_state;
 
-    // Timestamp of last data transmitted via USB (in milliseconds)
+    // Timestamp of last data transmitted via USB (in µs, or USB frames with SOF_SCHED)
     uint32_t tx_timestamp;
 
-    // Interrupt the host needs to be notified about
+#if SOF_SCHED == 1
+    // Number of USB frames (SOF packets) since a fixed time in the past
+    uint32_t sof_count;
+
+    // Indicates that a new frame has started since the last check for data to transmit
+    bool is_sof_pending;
+#endif
+
+    // Indicates that the UART RX line has become idle since the received data was last submitted completely
+    bool is_rx_burst_ended;
+
+    // Interrupts the host needs to be notified about (merged until they can be sent)
     uint16_t pending_interrupt;
+
+    // Indicates that a SERIAL_STATE notification has been submitted and not yet delivered
+    bool is_notif_in_flight;
+
+    // Indicates if the host has set DTR (serial port open)
+    bool is_dtr_set;
+
+    // Endpoint used for data received via UART (DATA IN or vendor-specific IN endpoint)
+    uint8_t data_in_ep;
+
+    // Number of bytes submitted via USB but not yet removed from the UART RX buffer (DMA copy pending)
+    size_t rx_consume_pending;
+
+    // Max time to hold back data for transmission (in µs, or USB frames with SOF_SCHED)
+    uint32_t holdback_time;
+
+    // Max number of bytes to hold back for transmission
+    uint32_t holdback_len;
+
+    // Delimiter byte ending a frame (or USB_SERIAL_NO_DELIMITER)
+    uint32_t flush_delimiter;
+
+    // Number of bytes at the start of the UART RX data that have been scanned for the delimiter
+    size_t rx_scanned_len;
+
+    // Number of bytes at the start of the UART RX data up to and including the last delimiter
+    size_t rx_flush_len;
+
+    // Indicates if IN packets start with a header with the arrival time (framed RX mode)
+    bool is_framed_rx;
+
+    // CRC check of received frames (`USB_SERIAL_CRC_...` flags, 0 if disabled)
+    uint32_t rx_frame_crc;
+
+    // Number of bytes at the start of the UART RX data that have been processed by the CRC check
+    size_t rx_crc_len;
+
+#if RX_TIMESTAMPS == 1
+    // Packet assembled in framed RX mode (kept until copied to packet memory)
+    uint8_t framed_packet[CDCACM_PACKET_SIZE] __attribute__((aligned(4)));
+#endif
+
+    // Free space in UART transmit buffer below which the DATA OUT endpoint is paused
+    // (0 for deferred acknowledgement: packets not fitting are left in packet memory)
+    uint32_t nak_threshold;
+
+    // Minimum NAK threshold: each double-buffered OUT endpoint can receive two more packets after it has been paused
+    static constexpr uint32_t min_nak_threshold = (Port::has_vendor_intf ? 4 : 2) * CDCACM_PACKET_SIZE;
+
+    // Length of the packet deferred on the CDC data (index 0) and vendor-specific
+    // OUT endpoint (index 1) until it fits into the UART transmit buffer (0 if none)
+    uint8_t deferred_out_len[2];
+
+    /// Retries the packets deferred on the OUT endpoints once they fit into the UART transmit buffer
+    void retry_deferred_out();
+
+    // Time the DATA OUT endpoint was paused (in ms)
+    uint32_t pause_timestamp;
+
+    // Baud rate requested by the host before upload mode was started (0 if not in upload mode)
+    int upload_saved_baudrate;
+
+    // TX chunk size setting before upload mode was started
+    int upload_saved_chunk_size;
+
+#if TELEMETRY == 1
+    // Interval of the telemetry notifications (in ms, 0 if disabled)
+    uint32_t telemetry_interval;
+
+    // Time the last telemetry record was sent (in ms)
+    uint32_t telemetry_timestamp;
+
+    // Sequence number of the next telemetry record
+    uint16_t telemetry_seq;
+
+    // Counter values covered by the previous telemetry records
+    uint32_t reported_out_bytes;
+    uint32_t reported_in_bytes;
+    uint32_t reported_paused_time;
+    uint32_t reported_overruns;
+#endif
 };
 
-/// Global USB Serial instance
-extern usb_serial_impl usb_serial;
+/// USB Serial instance of first serial port
+extern usb_serial_impl<usb_serial_1_port> usb_serial;
+
+/// USB Serial instance of second serial port (if enabled with DUAL_CDC_ENABLE)
+extern usb_serial_impl<usb_serial_2_port> usb_serial_2;
@@ -0,0 +1,150 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Vendor-specific USB control requests
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief Vendor-specific control requests.
+ * 
+ * All requests are addressed to the device (`bmRequestType` 0xC0 for
+ * requests returning data, 0x40 for requests with data from the host).
+ * See doc/vendor-requests.md for the details.
+ */
+enum class usb_vendor_request : uint8_t
+{
+    /// Get parameter (`wValue`: parameter ID, 4 bytes response)
+    get_param = 0x01,
+    /// Set parameter (`wValue`: parameter ID, 4 bytes data)
+    set_param = 0x02,
+    /// Get performance counters (`wValue` bit 0: reset counters after reading, up to 64 bytes response)
+    get_counters = 0x03,
+    /// Get main loop statistics (`wValue` bit 0: reset statistics after reading, up to 112 bytes response)
+    get_loop_stats = 0x04,
+    /// Get baud rate alias (`wValue`: table index, 8 bytes response: requested and actual baud rate)
+    get_baud_alias = 0x05,
+    /// Set baud rate alias (`wValue`: table index, 8 bytes data: requested and actual baud rate)
+    set_baud_alias = 0x06,
+    /// Run microbenchmark (up to 44 bytes response: benchmark results)
+    run_bench = 0x07,
+    /// Get USB frame time (up to 28 bytes response: frame number and timestamp of last SOF)
+    get_frame_time = 0x08,
+    /// Get event trace (`wValue`: sequence number of first record, up to 124 bytes response: header and records)
+    get_trace = 0x09,
+    /// Get line coding (7 bytes response: line coding in CDC PSTN format)
+    get_line_coding = 0x0a,
+    /// Set line coding (7 bytes data: line coding in CDC PSTN format)
+    set_line_coding = 0x0b,
+};
+
+/**
+ * @brief Parameters that can be read and modified with vendor-specific control requests.
+ * 
+ * All parameters are reset to their default value when the USB device is configured.
+ */
+enum class usb_serial_param : uint16_t
+{
+    /// Maximum time data is held back for transmission via USB (in ms, 0 to 1000, default 3; see `holdback_time_us`)
+    holdback_time = 1,
+    /// Number of bytes held back for transmission via USB (0 to 64, default 16)
+    holdback_len = 2,
+    /// RX buffer high-water mark (in bytes, 0 for automatic)
+    rx_high_water_mark = 3,
+    /// Free space in the TX buffer below which USB data out is paused (in bytes, 128 to 1023, default 128, minimum and default 256 with the vendor-specific interface, 0 for deferred acknowledgement)
+    nak_threshold = 4,
+    /// Maximum chunk size for transmission via UART (in bytes, 0 for automatic)
+    tx_max_chunk_size = 5,
+    /// Deviation of achieved baud rate from target baud rate (in ppm, signed, read-only)
+    baudrate_error = 6,
+    /// Delimiter byte ending a frame, flushing received data immediately (0 to 255, 256 to disable, default 256)
+    flush_delimiter = 7,
+    /// Framed RX mode: each IN packet starts with a `usb_serial_rx_header` (0 or 1, default 0)
+    framed_rx = 8,
+    /// Time from the start of the microsecond timer until the USB device was first configured (in µs, 0 if not yet, read-only)
+    boot_configured_time = 9,
+    /// Time from the start of the microsecond timer until the first data byte passed the bridge (in µs, 0 if not yet, read-only)
+    boot_first_byte_time = 10,
+    /// Upload mode: baud rate used for the upload, with maximum-size TX DMA transfers (0 to end upload mode, default 0)
+    upload_baudrate = 11,
+    /// CRC check of received frames: 0 to disable or combination of `USB_SERIAL_CRC_...` flags (default 0)
+    rx_frame_crc = 12,
+    /// Maximum time data is held back for transmission via USB (in µs, 0 to 1000000, default 3000; same setting as `holdback_time`)
+    holdback_time_us = 13,
+    /// Interval of the telemetry notifications on COMM_IN_1 (in ms, 0 to disable or 10 to 60000, default 0; requires `TELEMETRY_ENABLE`)
+    telemetry_interval = 14,
+};
+
+/// Value of `usb_serial_param::flush_delimiter` disabling the delimiter-aware flush
+constexpr uint32_t USB_SERIAL_NO_DELIMITER = 0x100;
+
+/// Flag of `usb_serial_param::rx_frame_crc`: check the trailing CRC of each frame (CRC-32, polynomial 0x04C11DB7)
+constexpr uint32_t USB_SERIAL_CRC_ENABLE = 0x01;
+/// Flag of `usb_serial_param::rx_frame_crc`: bytes processed LSB first, CRC appended little-endian (MSB first, big-endian otherwise)
+constexpr uint32_t USB_SERIAL_CRC_REFLECTED = 0x02;
+/// Flag of `usb_serial_param::rx_frame_crc`: initial value 0xffffffff (0 otherwise)
+constexpr uint32_t USB_SERIAL_CRC_INIT_ONES = 0x04;
+/// Flag of `usb_serial_param::rx_frame_crc`: CRC inverted before it is appended
+constexpr uint32_t USB_SERIAL_CRC_XOR_OUT = 0x08;
+/// Value of `usb_serial_param::rx_frame_crc` for CRC-32 (Ethernet, zlib)
+constexpr uint32_t USB_SERIAL_CRC_32 = 0x0f;
+/// Value of `usb_serial_param::rx_frame_crc` for CRC-32/MPEG-2
+constexpr uint32_t USB_SERIAL_CRC_32_MPEG2 = 0x05;
+
+/// Notification code of the telemetry notification (vendor-specific, see `usb_serial_telemetry`)
+constexpr uint8_t USB_SERIAL_NOTIF_TELEMETRY = 0xf0;
+
+/**
+ * @brief Telemetry record (data of the telemetry notification).
+ * 
+ * The notification header has `bNotification` set to `USB_SERIAL_NOTIF_TELEMETRY`
+ * and `wValue` set to a sequence number (incremented with each record). All values
+ * cover the time since the previous record (or since the interval was set).
+ */
+struct usb_serial_telemetry
+{
+    /// Number of bytes received via USB (host to device)
+    uint32_t usb_out_bytes;
+    /// Number of bytes transmitted via USB (device to host)
+    uint32_t usb_in_bytes;
+    /// Peak fill level of the UART TX buffer (in bytes)
+    uint16_t tx_buf_peak;
+    /// Peak fill level of the UART RX buffer (in bytes)
+    uint16_t rx_buf_peak;
+    /// Time the OUT endpoint has been paused (in ms, incl. a pause still in progress, saturated at 65535)
+    uint16_t out_paused_time;
+    /// Number of RX buffer overruns
+    uint16_t rx_overruns;
+} __attribute__((packed));
+
+/// First byte of a `usb_serial_rx_header`
+constexpr uint8_t USB_SERIAL_RX_HEADER_MAGIC = 0xa5;
+
+/**
+ * @brief Header of IN packets in framed RX mode.
+ * 
+ * The header is followed by the payload. As the host reads the data as a stream,
+ * the header is self-delimiting.
+ */
+struct usb_serial_rx_header
+{
+    /// Magic byte (`USB_SERIAL_RX_HEADER_MAGIC`)
+    uint8_t magic;
+    /// Payload length (in bytes)
+    uint8_t len;
+    /// Position of the first payload byte in the received data stream (low 16 bits)
+    uint16_t offset;
+    /// Time the first payload byte arrived in the RX buffer (see `clock_ticks()`)
+    uint32_t arrival_ticks;
+    /// Time the packet was submitted (see `clock_ticks()`)
+    uint32_t submit_ticks;
+    /// Number of the USB frame in which the packet was submitted (11 bits, from the last SOF)
+    uint16_t submit_frame;
+} __attribute__((packed));
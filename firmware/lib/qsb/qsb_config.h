@@ -55,10 +55,51 @@
 //
 // QSB_WIN_WCID_ENABLE: If defined, enables support for Microsoft WCID descriptors.
 //     The WCID descriptors declare that Windows should use the WinUSB drivers. This is good for device
-//     with a single interface with number 0. 
+//     with a single interface with number 0 or for a composite device with a single vendor-specific interface
+//     (see QSB_WIN_WCID_INTERFACE). 
 //
 // QSB_WIN_WCID_VENDOR_CODE: If WCID descriptors is enabled, this macro can be defined to set the
 //     vendor code used in the WCID control request. The default value is 0xF0. 
+//
+// QSB_WIN_WCID_INTERFACE: If WCID descriptors is enabled, this macro can be defined to set the
+//     number of the interface declared as WinUSB compatible (for composite devices). The default is 0.
+//
+// QSB_ISR_MODE_ENABLE: If defined, USB events are handled in the USB interrupt handler. The interrupt
+//     handler must call `qsb_dev_isr()`. It clears the interrupt flags, updates the endpoint states and
+//     queues the events. `qsb_dev_poll()` still needs to be called from the main loop. It processes the
+//     queued events and calls the callback functions. Only supported for the USB full-speed device
+//     interface with double buffering (QSB_FSDEV_DBL_BUF).
+//
+// QSB_ISR_EVENT_QUEUE_LEN: Length of the event queue for interrupt mode. It must be a power of 2 (at most 128).
+//     By default, it is 16.
+//
+// QSB_USB_IRQ: USB interrupt number (used by interrupt mode). The default is set for STM32F0 and STM32F1.
+//
+// QSB_RAMFUNC_ENABLE: If defined, the functions on the data path (`qsb_dev_poll()` and the PMA copy
+//     functions) are placed in the `.ramtext` section. The startup code copies them to SRAM, where they
+//     are executed without flash wait states. This costs RAM.
+//
+// QSB_DMA_COPY_ENABLE: If defined, packets submitted for transmission on double buffered endpoints are
+//     copied to the packet memory by a memory-to-memory DMA transfer instead of the CPU. The submitting
+//     function returns immediately and the packet is handed over to the USB peripheral once the copy
+//     has completed (checked by `qsb_dev_poll()`). The data must remain unchanged until then (see
+//     `qsb_dev_ep_transmit_pending()`). Only supported for the USB full-speed device interface with
+//     double buffering (QSB_FSDEV_DBL_BUF).
+//
+// QSB_DMA_COPY_CHANNEL: DMA1 channel used for copying packets (if QSB_DMA_COPY_ENABLE is defined).
+//     By default, it is 1.
+//
+// QSB_STATIC_EP_DISPATCH_ENABLE: If defined, packets received on OUT endpoints other than the control
+//     endpoint are not passed to the callback functions registered with `qsb_dev_ep_setup()`. Instead,
+//     `qsb_dev_poll()` directly calls `qsb_static_ep_out()`, which must be implemented by the application.
+//     It receives the packet's buffer offset and reads the packet with `qsb_dev_ep_read_packet_at()`.
+//     This saves the indirect call and the checks of `qsb_dev_ep_read_packet()`. Only supported for the
+//     USB full-speed device interface with double buffering (QSB_FSDEV_DBL_BUF).
+//
+// QSB_SIM_ENABLE: If defined, the library is built against a simulated register model on the host
+//     instead of the USB peripheral. Writes to the endpoint registers and to USB_ISTR are passed to
+//     `qsb_sim_ep_write()` and `qsb_sim_istr_write()` (provided by the model) as these registers
+//     have bits with toggle and clear-only behavior. Not supported with QSB_ISR_MODE_ENABLE.
 
 #if !defined(QSB_ARCH)
 #if defined(STM32F0)
@@ -144,3 +185,67 @@
 #ifndef QSB_WIN_WCID_VENDOR_CODE
 #define QSB_WIN_WCID_VENDOR_CODE 0xf0
 #endif
+
+#ifndef QSB_WIN_WCID_INTERFACE
+#define QSB_WIN_WCID_INTERFACE 0
+#endif
+
+#ifdef QSB_ISR_MODE_ENABLE
+#define QSB_ISR_MODE 1
+#else
+#define QSB_ISR_MODE 0
+#endif
+
+#ifndef QSB_ISR_EVENT_QUEUE_LEN
+#define QSB_ISR_EVENT_QUEUE_LEN 16
+#endif
+
+#if QSB_ISR_MODE == 1 && !defined(QSB_USB_IRQ)
+#if defined(STM32F0)
+#define QSB_USB_IRQ NVIC_USB_IRQ
+#elif defined(STM32F1)
+#define QSB_USB_IRQ NVIC_USB_LP_CAN_RX0_IRQ
+#else
+#error "Please define QSB_USB_IRQ"
+#endif
+#endif
+
+#ifdef QSB_RAMFUNC_ENABLE
+#define QSB_RAMFUNC __attribute__((section(".ramtext"), noinline))
+#else
+#define QSB_RAMFUNC
+#endif
+
+#ifdef QSB_DMA_COPY_ENABLE
+#define QSB_DMA_COPY 1
+#else
+#define QSB_DMA_COPY 0
+#endif
+
+#ifdef QSB_STATIC_EP_DISPATCH_ENABLE
+#define QSB_STATIC_EP_DISPATCH 1
+#else
+#define QSB_STATIC_EP_DISPATCH 0
+#endif
+
+#ifdef QSB_SIM_ENABLE
+#define QSB_SIM 1
+#else
+#define QSB_SIM 0
+#endif
+
+#if QSB_SIM == 1 && QSB_ISR_MODE == 1
+#error "QSB_ISR_MODE_ENABLE is not supported with QSB_SIM_ENABLE"
+#endif
+
+#if QSB_DMA_COPY == 1 && !defined(QSB_DMA_COPY_CHANNEL)
+#define QSB_DMA_COPY_CHANNEL 1
+#endif
+
+#if QSB_DMA_COPY == 1 && !defined(QSB_DMA_COPY_RCC)
+#if defined(STM32F0)
+#define QSB_DMA_COPY_RCC RCC_DMA
+#else
+#define QSB_DMA_COPY_RCC RCC_DMA1
+#endif
+#endif
@@ -25,6 +25,8 @@ qsb_device* qsb_dev_init(qsb_port port, const qsb_device_desc* device_desc,
     device->config = config_descs;
     device->strings = strings;
     device->num_strings = num_strings;
+    device->prebuilt_config_descs = NULL;
+    device->prebuilt_string_descs = NULL;
     device->ctrl_buf = control_buffer;
     device->ctrl_buf_len = control_buffer_size;
 
@@ -40,6 +42,13 @@ qsb_device* qsb_dev_init(qsb_port port, const qsb_device_desc* device_desc,
     return device;
 }
 
+void qsb_dev_init_prebuilt_descs(
+    qsb_device* device, const uint8_t* const* config_descs, const uint8_t* const* string_descs)
+{
+    device->prebuilt_config_descs = config_descs;
+    device->prebuilt_string_descs = string_descs;
+}
+
 void qsb_dev_register_reset_callback(qsb_device* device, void (*callback)(void))
 {
     device->user_callback_reset = callback;
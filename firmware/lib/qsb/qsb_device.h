@@ -92,6 +92,29 @@ qsb_device* qsb_dev_init(qsb_port port, const qsb_device_desc* device_desc,
     const qsb_config_desc* config_descs, const char* const* strings, int num_strings, uint8_t* control_buffer,
     uint16_t control_buffer_size);
 
+/**
+ * @brief Registers prebuilt configuration and string descriptors.
+ * 
+ * By default, the configuration descriptor is assembled from the descriptor data
+ * structures and the string descriptors are converted to UTF-16 in the control
+ * buffer for each *GetDescriptor* request. Prebuilt descriptors are sent as is,
+ * directly from flash memory. `qsb_dev_init()` must still be called with the
+ * configuration data structures as they are used for *SetConfiguration* and
+ * *SetInterface* requests. But the interface and endpoint descriptors no
+ * longer need to be provided.
+ * 
+ * `string_descs` has the same indexes as the `strings` array passed to
+ * `qsb_dev_init()`. Entries can be `NULL` for strings only known at runtime
+ * (e.g. serial number). They are built from `strings` in the control buffer.
+ * 
+ * @param device USB device
+ * @param config_descs array of complete configuration descriptors (incl. interface, endpoint and
+ * functional descriptors), or `NULL` to build them at runtime
+ * @param string_descs array of string descriptors (in UTF-16), or `NULL` to build them at runtime
+ */
+void qsb_dev_init_prebuilt_descs(
+    qsb_device* device, const uint8_t* const* config_descs, const uint8_t* const* string_descs);
+
 #if QSB_BOS == 1
 
 /**
@@ -307,6 +330,22 @@ void qsb_dev_register_set_altsetting_callback(qsb_device* device, qsb_dev_set_al
  */
 void qsb_dev_poll(qsb_device* device);
 
+#if QSB_ISR_MODE == 1
+/**
+ * @brief Handles the USB interrupt.
+ *
+ * This function must be called from the USB interrupt handler if interrupt mode is enabled
+ * (`QSB_ISR_MODE_ENABLE`). It clears the interrupt flags, updates the endpoint states and
+ * queues the events for `qsb_dev_poll()`, which calls the callback functions from the main loop.
+ *
+ * If the event queue is full, the USB interrupt is disabled until `qsb_dev_poll()` has
+ * processed the queued events.
+ *
+ * @param device USB device
+ */
+void qsb_dev_isr(qsb_device* device);
+#endif
+
 /**
  * @brief Disconnects the device.
  * 
@@ -325,6 +364,11 @@ void qsb_dev_disconnect(qsb_device* device, bool disconnected);
  * Valid values for `wMaxPacketSize` are 8, 16, 32 or 64 (bytes) for full-speed
  * endpoints.
  * 
+ * The buffers are allocated from packet memory in the order of the calls. The
+ * allocation is reset on a bus reset and on SET_CONFIGURATION (before the
+ * "Set_Config" callbacks are called). So the callback must set up all endpoints
+ * of the configuration, and repeated configuration does not use up packet memory.
+ * 
  * @param device USB device
  * @param addr endpoint address including direction (e.g. 0x01 or 0x81)
  * @param type endpoint type (`QSB_ENDPOINT_ATTR_*`); it should match `bmAttributes` in the endpoint descriptor
@@ -341,6 +385,9 @@ void qsb_dev_ep_setup(
  * If 0 is returned, no packet can be submitted for transmission, not even
  * a zero length packet.
  * 
+ * For double buffered endpoints, the result includes the free space of both
+ * buffers, i.e. up to two packets can be submitted with a single call.
+ * 
  * @param device USB device
  * @param addr endpoint address incl. direction bit (of an IN endpoint)
  * @return maximum length of data (in bytes)
@@ -351,7 +398,7 @@ uint16_t qsb_dev_ep_transmit_avail(qsb_device* device, uint8_t addr);
  * @brief Submits a data packet for transmission.
  * 
  * The specified data buffer can immediately be reused as the data is copied
- * by the function.
+ * by the function (unless DMA copying is enabled, see `qsb_dev_ep_transmit_pending()`).
  * 
  * Once the data has been transmitted, the endpoint callback function is called.
  * 
@@ -363,6 +410,55 @@ uint16_t qsb_dev_ep_transmit_avail(qsb_device* device, uint8_t addr);
  */
 int qsb_dev_ep_transmit_packet(qsb_device* device, uint8_t addr, const uint8_t* buf, int len);
 
+/**
+ * @brief Submits a data packet assembled from two chunks for transmission.
+ * 
+ * The packet consists of the first chunk followed by the second chunk. It is
+ * directly assembled in the packet memory so data from a circular buffer
+ * can be transmitted without an intermediate copy. If the combined length
+ * exceeds the available space (see `qsb_dev_ep_transmit_avail()`), the data
+ * is truncated.
+ * 
+ * For double buffered endpoints, data longer than the maximum packet size
+ * is split into two packets (if both buffers are free). The endpoint callback
+ * will be called for each packet.
+ * 
+ * Each byte is masked with `mask` while it is copied (e.g. 0x7f to clear the high bit).
+ * Use 0xff to transmit the data unchanged.
+ * 
+ * The specified data buffers can immediately be reused as the data is copied
+ * by the function (unless DMA copying is enabled, see `qsb_dev_ep_transmit_pending()`).
+ * 
+ * Once the data has been transmitted, the endpoint callback function is called.
+ * 
+ * @param device USB device
+ * @param addr endpoint address incl. direction bit (of an IN endpoint)
+ * @param buf1 pointer to first data chunk
+ * @param len1 length of first data chunk
+ * @param buf2 pointer to second data chunk
+ * @param len2 length of second data chunk
+ * @param mask bit mask applied to each byte
+ * @return -1 if failed, number of bytes submitted if successful
+ */
+int qsb_dev_ep_transmit_chunks(qsb_device* device, uint8_t addr, const uint8_t* buf1, int len1,
+    const uint8_t* buf2, int len2, uint8_t mask);
+
+/**
+ * @brief Indicates if submitted data is still being copied to the packet memory.
+ * 
+ * If DMA copying is enabled (`QSB_DMA_COPY_ENABLE`), a packet submitted with
+ * `qsb_dev_ep_transmit_packet()` or `qsb_dev_ep_transmit_chunks()` can be copied
+ * to the packet memory asynchronously. The data buffer must not be modified or
+ * reused until this function returns `false`.
+ * 
+ * If DMA copying is disabled, the function always returns `false`.
+ * 
+ * @param device USB device
+ * @param addr endpoint address incl. direction bit (of an IN endpoint)
+ * @return `true` if the copy is pending, `false` otherwise
+ */
+bool qsb_dev_ep_transmit_pending(qsb_device* device, uint8_t addr);
+
 /**
  * @brief Retrieves a received data packet.
  * 
@@ -379,6 +475,58 @@ int qsb_dev_ep_transmit_packet(qsb_device* device, uint8_t addr, const uint8_t*
  */
 uint16_t qsb_dev_ep_read_packet(qsb_device* device, uint8_t addr, uint8_t* buf, uint16_t len);
 
+#if QSB_STATIC_EP_DISPATCH == 1
+
+/**
+ * @brief Handles a packet received on an OUT endpoint (static dispatch).
+ * 
+ * Must be implemented by the application if `QSB_STATIC_EP_DISPATCH_ENABLE` is defined.
+ * It is called by `qsb_dev_poll()` for all OUT endpoints except the control endpoint,
+ * instead of the callback function registered with `qsb_dev_ep_setup()`. Within this
+ * function, the packet can be deferred with `qsb_dev_ep_defer_packet()`.
+ * 
+ * @param device USB device
+ * @param addr endpoint address (of an OUT endpoint)
+ * @param offset buffer offset of the packet (for `qsb_dev_ep_read_packet_at()`)
+ * @param len packet length (in bytes)
+ */
+void qsb_static_ep_out(qsb_device* device, uint8_t addr, uint8_t offset, uint16_t len);
+
+/**
+ * @brief Retrieves a received data packet (static dispatch).
+ * 
+ * This function may only be called from within `qsb_static_ep_out()`. Unlike
+ * `qsb_dev_ep_read_packet()`, it does not check that the endpoint is active.
+ * 
+ * @param addr endpoint address (of an OUT endpoint)
+ * @param offset buffer offset as passed to `qsb_static_ep_out()`
+ * @param buf buffer that will receive data
+ * @param len size of buffer
+ * @return Number of bytes written to buffer
+ */
+uint16_t qsb_dev_ep_read_packet_at(uint8_t addr, uint8_t offset, uint8_t* buf, uint16_t len);
+
+#endif
+
+/**
+ * @brief Defers a received data packet.
+ * 
+ * This function may only be called from within the endpoint callback function of an OUT endpoint,
+ * instead of `qsb_dev_ep_read_packet()`. The packet remains in packet memory and its buffer is not
+ * released. Packets arriving in the meantime are held in packet memory as well, and once all
+ * buffers of the endpoint are occupied, the endpoint answers with NAK. No further callbacks for
+ * this endpoint are received until `qsb_dev_ep_unpause()` is called. It then calls the callback
+ * function again for the deferred packets.
+ * 
+ * Compared to pausing the endpoint in advance, no space has to be reserved for packets arriving
+ * after the pause. Only supported for the USB full-speed device interface with double
+ * buffering (`QSB_FSDEV_DBL_BUF`).
+ * 
+ * @param device USB device
+ * @param addr endpoint address (of an OUT endpoint)
+ */
+void qsb_dev_ep_defer_packet(qsb_device* device, uint8_t addr);
+
 /**
  * @brief Pauses the endpoint.
  * 
@@ -407,7 +555,12 @@ void qsb_dev_ep_pause(qsb_device* device, uint8_t addr);
  * 
  * Clears the paused state so the endpoint continues to receive data.
  * 
+ * If packets have been deferred, the callback function is called for them (from within this function,
+ * which must therefore not be called from the endpoint callback). If the callback defers a
+ * packet again, the remaining packets stay deferred.
+ * 
  * @sa qsb_dev_ep_pause
+ * @sa qsb_dev_ep_defer_packet
  * 
  * @param device USB device
  * @param addr endpoint address (of an OUT endpoint)
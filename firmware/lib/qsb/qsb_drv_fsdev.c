@@ -15,6 +15,16 @@
 
 #if QSB_ARCH == QSB_ARCH_FSDEV && !defined(QSB_FSDEV_DBL_BUF)
 
+#if QSB_ISR_MODE == 1
+#error "QSB_ISR_MODE_ENABLE requires QSB_FSDEV_DBL_BUF"
+#endif
+#if QSB_DMA_COPY == 1
+#error "QSB_DMA_COPY_ENABLE requires QSB_FSDEV_DBL_BUF"
+#endif
+#if QSB_STATIC_EP_DISPATCH == 1
+#error "QSB_STATIC_EP_DISPATCH_ENABLE requires QSB_FSDEV_DBL_BUF"
+#endif
+
 #include "qsb_fsdev.h"
 #include "qsb_drv_fsdev_btable.h"
 #include "qsb_fsdev_ep.h"
@@ -39,7 +49,7 @@ qsb_device* create_port_fs(void)
     rcc_periph_clock_enable(RCC_USB);
     USB_CNTR = 0;
     USB_BTABLE = 0;
-    USB_ISTR = 0;
+    USB_ISTR_WRITE(0);
 
     // Enable RESET, SUSPEND, RESUME and CTR interrupts.
     USB_CNTR = USB_CNTR_RESETM | USB_CNTR_CTRM | USB_CNTR_SUSPM | USB_CNTR_WKUPM;
@@ -180,7 +190,18 @@ uint16_t qsb_dev_ep_transmit_avail(__attribute__((unused)) qsb_device* dev, uint
     return (ep_val & USB_EP_STAT_TX) == USB_EP_STAT_TX_VALID ? 0 : 64;
 }
 
-int qsb_dev_ep_transmit_packet(__attribute__((unused)) qsb_device* dev, uint8_t addr, const uint8_t* buf, int len)
+bool qsb_dev_ep_transmit_pending(__attribute__((unused)) qsb_device* dev, __attribute__((unused)) uint8_t addr)
+{
+    return false; // data is always copied immediately
+}
+
+int qsb_dev_ep_transmit_packet(qsb_device* dev, uint8_t addr, const uint8_t* buf, int len)
+{
+    return qsb_dev_ep_transmit_chunks(dev, addr, buf, len, NULL, 0, 0xff);
+}
+
+int qsb_dev_ep_transmit_chunks(__attribute__((unused)) qsb_device* dev, uint8_t addr, const uint8_t* buf1, int len1,
+    const uint8_t* buf2, int len2, uint8_t mask)
 {
     uint8_t ep = qsb_endpoint_num(addr);
     uint32_t ep_val = USB_EP(ep);
@@ -189,10 +210,10 @@ int qsb_dev_ep_transmit_packet(__attribute__((unused)) qsb_device* dev, uint8_t
     if ((ep_val & USB_EP_STAT_TX) == USB_EP_STAT_TX_VALID)
         return -1; // endpoint is transmitting
 
-    qsb_fsdev_copy_to_pma(ep, qsb_offset_tx, buf, len);
+    qsb_fsdev_copy_chunks_to_pma(ep, qsb_offset_tx, buf1, len1, buf2, len2, mask);
     qsb_ep_stat_tx_set(ep, USB_EP_STAT_TX_VALID);
 
-    return len;
+    return len1 + len2;
 }
 
 uint16_t qsb_dev_ep_read_packet(__attribute__((unused)) qsb_device* dev, uint8_t addr, uint8_t* buf, uint16_t len)
@@ -217,12 +238,12 @@ static inline void ep_callback(qsb_device* dev, uint8_t addr, uint8_t type, qsb_
     dev->active_ep_callback = 0xff;
 }
 
-void qsb_dev_poll(qsb_device* dev)
+QSB_RAMFUNC void qsb_dev_poll(qsb_device* dev)
 {
     uint32_t istr = USB_ISTR;
 
     if (istr & USB_ISTR_RESET) {
-        USB_ISTR = ~USB_ISTR_RESET;
+        USB_ISTR_WRITE(~USB_ISTR_RESET);
         dev->pm_top = PM_TOP_INIT;
         qsb_internal_dev_reset(dev);
         return;
@@ -252,19 +273,19 @@ void qsb_dev_poll(qsb_device* dev)
     }
 
     if (istr & USB_ISTR_SUSP) {
-        USB_ISTR = ~USB_ISTR_SUSP;
+        USB_ISTR_WRITE(~USB_ISTR_SUSP);
         if (dev->user_callback_suspend)
             dev->user_callback_suspend();
     }
 
     if (istr & USB_ISTR_WKUP) {
-        USB_ISTR = ~USB_ISTR_WKUP;
+        USB_ISTR_WRITE(~USB_ISTR_WKUP);
         if (dev->user_callback_resume)
             dev->user_callback_resume();
     }
 
     if (istr & USB_ISTR_SOF) {
-        USB_ISTR = ~USB_ISTR_SOF;
+        USB_ISTR_WRITE(~USB_ISTR_SOF);
         if (dev->user_callback_sof)
             dev->user_callback_sof();
     }
@@ -280,10 +301,11 @@ void qsb_dev_poll(qsb_device* dev)
 #if QSB_FSDEV_SUBTYPE >= 3
 void qsb_dev_disconnect(__attribute__((unused)) qsb_device* dev, bool disconnected)
 {
+    // the device is disconnected by disabling the D+ pull-up
     if (disconnected) {
-        USB_BCDR |= USB_BCDR_DPPU;
-    } else {
         USB_BCDR &= ~USB_BCDR_DPPU;
+    } else {
+        USB_BCDR |= USB_BCDR_DPPU;
     }
 }
 #endif
@@ -60,6 +60,23 @@ uint32_t qsb_fsdev_get_len(uint8_t ep, qsb_buf_desc_offset offset);
  */
 void qsb_fsdev_copy_to_pma(uint8_t ep, qsb_buf_desc_offset offset, const uint8_t* buf, uint32_t len);
 
+/**
+ * Copy two data chunks to USB packet memory, forming a single packet.
+ *
+ * The second chunk is appended to the first one. Each byte is masked with
+ * `mask` while it is copied (use 0xff to copy the data unchanged).
+ *
+ * @param ep Endpoint address without direction bit (target)
+ * @param offset Offset within buffer descriptor table (0 or 1)
+ * @param buf1 pointer to first data chunk (source)
+ * @param len1 length of first data chunk
+ * @param buf2 pointer to second data chunk (source)
+ * @param len2 length of second data chunk
+ * @param mask bit mask applied to each byte
+ */
+void qsb_fsdev_copy_chunks_to_pma(uint8_t ep, qsb_buf_desc_offset offset, const uint8_t* buf1, uint32_t len1,
+    const uint8_t* buf2, uint32_t len2, uint8_t mask);
+
 /**
  * Copy USB packet memory into a data buffer.
  *
@@ -71,3 +88,19 @@ void qsb_fsdev_copy_to_pma(uint8_t ep, qsb_buf_desc_offset offset, const uint8_t
  */
 
 uint32_t qsb_fsdev_copy_from_pma(uint8_t* buf, uint32_t len, uint8_t ep, qsb_buf_desc_offset offset);
+
+/**
+ * Prepare a TX buffer for packet data written by DMA.
+ *
+ * Sets the packet length and copies the last byte if the length is odd.
+ * The remaining data (`len / 2` half words) must be copied by DMA. For BTABLE type 2,
+ * each half word occupies a half word in packet memory. For BTABLE type 4, each
+ * half word occupies the lower half of a 32-bit word.
+ *
+ * @param ep Endpoint address without direction bit (target)
+ * @param offset Offset within buffer descriptor table (0 or 1)
+ * @param buf pointer to data buffer (source)
+ * @param len length of data
+ * @return address of buffer in packet memory (as seen by the CPU and the DMA controller)
+ */
+volatile void* qsb_fsdev_prepare_dma_tx(uint8_t ep, qsb_buf_desc_offset offset, const uint8_t* buf, uint32_t len);
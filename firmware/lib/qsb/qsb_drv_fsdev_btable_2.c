@@ -83,39 +83,179 @@ uint32_t qsb_fsdev_get_len(uint8_t ep, qsb_buf_desc_offset offset)
     return desc->count & 0x3ff;
 }
 
-void qsb_fsdev_copy_to_pma(uint8_t ep, qsb_buf_desc_offset offset, const uint8_t* buf, uint32_t len)
+// Copies word-aligned data to PMA (length must be a multiple of 4).
+// Each word is loaded once and stored as two half words. The main loop is unrolled 8 times (8 half words).
+static inline __attribute__((always_inline)) void copy_words_to_pma(
+    volatile uint16_t* tgt, const uint32_t* src, uint32_t len)
+{
+    for (; len >= 16; len -= 16, src += 4, tgt += 8) {
+        uint32_t w0 = src[0];
+        uint32_t w1 = src[1];
+        uint32_t w2 = src[2];
+        uint32_t w3 = src[3];
+        tgt[0] = w0;
+        tgt[1] = w0 >> 16;
+        tgt[2] = w1;
+        tgt[3] = w1 >> 16;
+        tgt[4] = w2;
+        tgt[5] = w2 >> 16;
+        tgt[6] = w3;
+        tgt[7] = w3 >> 16;
+    }
+
+    for (; len >= 4; len -= 4, src++, tgt += 2) {
+        uint32_t w = *src;
+        tgt[0] = w;
+        tgt[1] = w >> 16;
+    }
+}
+
+// Copies PMA data to a word-aligned buffer (length must be a multiple of 4).
+// Two half words are loaded and stored as a single word. The main loop is unrolled 8 times (8 half words).
+static inline __attribute__((always_inline)) void copy_words_from_pma(
+    uint32_t* tgt, const volatile uint16_t* src, uint32_t len)
+{
+    for (; len >= 16; len -= 16, src += 8, tgt += 4) {
+        tgt[0] = src[0] | (src[1] << 16);
+        tgt[1] = src[2] | (src[3] << 16);
+        tgt[2] = src[4] | (src[5] << 16);
+        tgt[3] = src[6] | (src[7] << 16);
+    }
+
+    for (; len >= 4; len -= 4, src += 2, tgt++)
+        *tgt = src[0] | (src[1] << 16);
+}
+
+// Copies data to PMA, using the fastest method for the alignment of the source buffer
+static inline __attribute__((always_inline)) volatile uint16_t* copy_bytes_to_pma(
+    volatile uint16_t* tgt, const uint8_t* buf, uint32_t len)
+{
+    if ((((uintptr_t)buf) & 0x03) == 0) {
+        // word aligned
+        uint32_t n = len & ~0x03;
+        copy_words_to_pma(tgt, (const uint32_t*)buf, n);
+        tgt += n >> 1;
+        buf += n;
+        len -= n;
+
+    } else if ((((uintptr_t)buf) & 0x01) == 0) {
+        // half word aligned
+        const uint16_t* src = (const uint16_t*)buf;
+        for (; len >= 2; len -= 2)
+            *tgt++ = *src++;
+        buf = (const uint8_t*)src;
+    }
+
+    // remaining bytes (or all bytes if the buffer is not half word aligned)
+    for (; len >= 2; len -= 2, buf += 2)
+        *tgt++ = (buf[1] << 8) | buf[0];
+
+    if (len != 0)
+        *tgt++ = buf[0];
+
+    return tgt;
+}
+
+QSB_RAMFUNC void qsb_fsdev_copy_to_pma(uint8_t ep, qsb_buf_desc_offset offset, const uint8_t* buf, uint32_t len)
 {
     buf_desc* desc = get_buf_desc(ep, offset);
     desc->count = len;
 
     volatile uint16_t* tgt = get_pma_addr(desc);
 
-    for (unsigned i = 0; i + 1 < len; i += 2)
-        *tgt++ = (buf[i + 1] << 8) | buf[i];
+    if (len == 64 && (((uintptr_t)buf) & 0x03) == 0) {
+        // common case: full packet from word aligned buffer (specialized for constant length)
+        copy_words_to_pma(tgt, (const uint32_t*)buf, 64);
+        return;
+    }
+
+    copy_bytes_to_pma(tgt, buf, len);
+}
 
-    if ((len & 1) != 0)
-        *tgt = buf[len - 1];
+QSB_RAMFUNC void qsb_fsdev_copy_chunks_to_pma(uint8_t ep, qsb_buf_desc_offset offset, const uint8_t* buf1, uint32_t len1,
+    const uint8_t* buf2, uint32_t len2, uint8_t mask)
+{
+    buf_desc* desc = get_buf_desc(ep, offset);
+    desc->count = len1 + len2;
+
+    volatile uint16_t* tgt = get_pma_addr(desc);
+
+    if (mask == 0xff && (len1 & 0x01) == 0) {
+        // unmasked and no half word spanning both chunks
+        tgt = copy_bytes_to_pma(tgt, buf1, len1);
+        copy_bytes_to_pma(tgt, buf2, len2);
+        return;
+    }
+
+    uint16_t mask16 = (mask << 8) | mask;
+
+    for (; len1 >= 2; len1 -= 2, buf1 += 2)
+        *tgt++ = ((buf1[1] << 8) | buf1[0]) & mask16;
+
+    if (len1 != 0) {
+        if (len2 == 0) {
+            *tgt = buf1[0] & mask;
+            return;
+        }
+
+        // half word spanning both chunks
+        *tgt++ = ((buf2[0] << 8) | buf1[0]) & mask16;
+        buf2++;
+        len2--;
+    }
+
+    for (; len2 >= 2; len2 -= 2, buf2 += 2)
+        *tgt++ = ((buf2[1] << 8) | buf2[0]) & mask16;
+
+    if (len2 != 0)
+        *tgt = buf2[0] & mask;
 }
 
-uint32_t qsb_fsdev_copy_from_pma(uint8_t* buf, uint32_t len, uint8_t ep, qsb_buf_desc_offset offset)
+QSB_RAMFUNC uint32_t qsb_fsdev_copy_from_pma(uint8_t* buf, uint32_t len, uint8_t ep, qsb_buf_desc_offset offset)
 {
     buf_desc* desc = get_buf_desc(ep, offset);
     len = imin(len, desc->count & 0x3ff);
     const volatile uint16_t* src = get_pma_addr(desc);
 
-    if (((uintptr_t)buf) & 0x01) {
-        // target buffer is not half word aligned -> copy byte by byte
-        for (unsigned i = 0; i < len >> 1; i++) {
-            uint16_t hw = *src++;
-            *buf++ = hw;
-            *buf++ = hw >> 8;
+    if (len == 64 && (((uintptr_t)buf) & 0x03) == 0) {
+        // common case: full packet into word aligned buffer (specialized for constant length)
+        copy_words_from_pma((uint32_t*)buf, src, 64);
+        return len;
+    }
+
+    uint32_t n = len & ~0x01;
+
+    if ((((uintptr_t)buf) & 0x03) == 0) {
+        // target buffer is word aligned -> copy word by word, then the remaining half word
+        uint32_t nw = n & ~0x03;
+        copy_words_from_pma((uint32_t*)buf, src, nw);
+        src += nw >> 1;
+        buf += nw;
+        if (n != nw) {
+            *(uint16_t*)buf = *src++;
+            buf += 2;
         }
-    } else {
+
+    } else if ((((uintptr_t)buf) & 0x01) == 0) {
         // target buffer is half word aligned -> copy half word by half word
         uint16_t* tgt = (uint16_t*)buf;
-        for (unsigned i = 0; i < len >> 1; i++)
+        for (unsigned i = 0; i < n >> 1; i++)
             *tgt++ = *src++;
         buf = (uint8_t*)tgt;
+
+    } else if (n != 0) {
+        // target buffer is not half word aligned -> store the first byte separately
+        // and combine two PMA half words into each aligned target half word
+        uint32_t hw = *src++;
+        *buf++ = hw;
+        uint16_t* tgt = (uint16_t*)buf;
+        for (unsigned i = 1; i < n >> 1; i++) {
+            uint32_t next = *src++;
+            *tgt++ = (hw >> 8) | (next << 8);
+            hw = next;
+        }
+        buf = (uint8_t*)tgt;
+        *buf++ = hw >> 8;
     }
 
     if ((len & 1) != 0)
@@ -124,4 +264,16 @@ uint32_t qsb_fsdev_copy_from_pma(uint8_t* buf, uint32_t len, uint8_t ep, qsb_buf
     return len;
 }
 
+volatile void* qsb_fsdev_prepare_dma_tx(uint8_t ep, qsb_buf_desc_offset offset, const uint8_t* buf, uint32_t len)
+{
+    buf_desc* desc = get_buf_desc(ep, offset);
+    desc->count = len;
+
+    volatile uint16_t* tgt = get_pma_addr(desc);
+    if ((len & 1) != 0)
+        tgt[len >> 1] = buf[len - 1];
+
+    return tgt;
+}
+
 #endif
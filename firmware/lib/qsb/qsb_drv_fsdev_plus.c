@@ -23,6 +23,12 @@
 #include <libopencm3/cm3/common.h>
 #include <libopencm3/stm32/rcc.h>
 #include <stdlib.h>
+#if QSB_ISR_MODE == 1
+#include <libopencm3/cm3/nvic.h>
+#endif
+#if QSB_DMA_COPY == 1
+#include <libopencm3/stm32/dma.h>
+#endif
 
 // Initial program memory top making space for the buffer descriptors (BTABLE). 
 static const uint32_t PM_TOP_INIT = QSB_NUM_ENDPOINTS * 8;
@@ -65,13 +71,122 @@ typedef enum ep_state_rx_e {
     dbl_buf_paused_1
 } ep_state_rx_e;
 
+#if QSB_ISR_MODE == 1
+
+/// Event types (in addition to `qsb_internal_dev_transaction`)
+enum {
+    event_reset = 3,
+    event_suspend = 4,
+    event_resume = 5,
+    event_sof = 6
+};
+
+// indices into the event queue are 8-bit counters
+_Static_assert((QSB_ISR_EVENT_QUEUE_LEN & (QSB_ISR_EVENT_QUEUE_LEN - 1)) == 0 && QSB_ISR_EVENT_QUEUE_LEN <= 128,
+    "QSB_ISR_EVENT_QUEUE_LEN must be a power of 2 and at most 128");
+
+// Prevents the USB interrupt handler from modifying the endpoint states
+// (returns if the interrupt was enabled before)
+static inline bool lock_ep_state(void)
+{
+    bool was_enabled = nvic_get_irq_enabled(QSB_USB_IRQ) != 0;
+    nvic_disable_irq(QSB_USB_IRQ);
+    __asm__ volatile("dsb\n\tisb" ::: "memory");
+    return was_enabled;
+}
+
+// Restores the interrupt state saved by lock_ep_state()
+static inline void unlock_ep_state(bool was_enabled)
+{
+    if (was_enabled)
+        nvic_enable_irq(QSB_USB_IRQ);
+}
+
+#else
+
+static inline bool lock_ep_state(void)
+{
+    return false;
+}
+
+static inline void unlock_ep_state(__attribute__((unused)) bool was_enabled)
+{
+}
+
+#endif
+
+#if QSB_DMA_COPY == 1
+
+static const uint8_t NO_DMA_COPY = 0xff;
+
+// Minimum packet length copied with DMA (shorter packets are copied faster by the CPU)
+static const int DMA_COPY_MIN_LEN = 16;
+
+// Indicates if a packet can be copied with DMA (single chunk, unmasked, half word aligned)
+static inline bool can_copy_with_dma(qsb_device* dev, const uint8_t* buf, int len, uint8_t mask)
+{
+    return dev->dma_copy_ep == NO_DMA_COPY && mask == 0xff && len >= DMA_COPY_MIN_LEN
+        && ((uintptr_t)buf & 1) == 0;
+}
+
+// Starts copying a packet into the free half of a double buffered endpoint with DMA
+static void start_dma_copy(qsb_device* dev, uint8_t ep, const uint8_t* buf, int len)
+{
+    uint8_t offset = (USB_EP(ep) & USB_EP_SW_BUF_TX) == 0 ? qsb_offset_db0 : qsb_offset_db1;
+    volatile void* pma = qsb_fsdev_prepare_dma_tx(ep, offset, buf, len);
+    dev->dma_copy_ep = ep;
+
+    // memory-to-memory transfer of half words; for BTABLE type 4, each half word
+    // is zero-extended into a 32-bit word
+    const uint32_t ch = QSB_DMA_COPY_CHANNEL;
+    dma_channel_reset(DMA1, ch);
+    dma_set_peripheral_address(DMA1, ch, (uint32_t)pma);
+    dma_set_memory_address(DMA1, ch, (uint32_t)buf);
+    dma_set_number_of_data(DMA1, ch, len >> 1);
+    dma_set_read_from_memory(DMA1, ch);
+    dma_enable_mem2mem_mode(DMA1, ch);
+    dma_enable_memory_increment_mode(DMA1, ch);
+    dma_enable_peripheral_increment_mode(DMA1, ch);
+    dma_set_memory_size(DMA1, ch, DMA_CCR_MSIZE_16BIT);
+#if QSB_FSDEV_BTABLE_TYPE == 2
+    dma_set_peripheral_size(DMA1, ch, DMA_CCR_PSIZE_16BIT);
+#else
+    dma_set_peripheral_size(DMA1, ch, DMA_CCR_PSIZE_32BIT);
+#endif
+    dma_set_priority(DMA1, ch, DMA_CCR_PL_LOW);
+    dma_enable_channel(DMA1, ch);
+}
+
+// Hands over the packet to the peripheral if the DMA copy has completed
+static void check_dma_copy(qsb_device* dev)
+{
+    uint8_t ep = dev->dma_copy_ep;
+    if (ep == NO_DMA_COPY || !dma_get_interrupt_flag(DMA1, QSB_DMA_COPY_CHANNEL, DMA_TCIF))
+        return;
+
+    dma_clear_interrupt_flags(DMA1, QSB_DMA_COPY_CHANNEL, DMA_TCIF);
+    dma_disable_channel(DMA1, QSB_DMA_COPY_CHANNEL);
+    dev->dma_copy_ep = NO_DMA_COPY;
+
+    bool irq_enabled = lock_ep_state();
+    dev->ep_state_tx[ep] += 1;
+    qsb_ep_sw_buf_tx_toggle(ep);
+    unlock_ep_state(irq_enabled);
+}
+
+#endif
+
 // Initialize the USB device controller hardware of the STM32
 qsb_device* create_port_fs(void)
 {
     rcc_periph_clock_enable(RCC_USB);
+#if QSB_DMA_COPY == 1
+    rcc_periph_clock_enable(QSB_DMA_COPY_RCC);
+    device_fsdev.dma_copy_ep = NO_DMA_COPY;
+#endif
     USB_CNTR = 0;
     USB_BTABLE = 0;
-    USB_ISTR = 0;
+    USB_ISTR_WRITE(0);
 
     // Enable RESET, SUSPEND, RESUME and CTR interrupts.
     USB_CNTR = USB_CNTR_RESETM | USB_CNTR_CTRM | USB_CNTR_SUSPM | USB_CNTR_WKUPM;
@@ -148,7 +263,14 @@ void qsb_internal_ep_reset(qsb_device* dev)
         dev->ep_state_rx[i] = 0;
         dev->ep_state_tx[i] = 0;
         dev->ep_outstanig_rx_acks[i] = 0;
+        dev->ep_deferred_rx[i] = 0;
+    }
+#if QSB_DMA_COPY == 1
+    if (dev->dma_copy_ep != NO_DMA_COPY) {
+        dma_disable_channel(DMA1, QSB_DMA_COPY_CHANNEL);
+        dev->dma_copy_ep = NO_DMA_COPY;
     }
+#endif
     dev->pm_top = PM_TOP_INIT + 2 * dev->desc->bMaxPacketSize0;
 }
 
@@ -199,6 +321,7 @@ void qsb_dev_ep_pause(qsb_device* dev, uint8_t addr)
 
     // Since IN bit is not set, ep equals addr
     uint8_t ep = addr;
+    bool irq_enabled = lock_ep_state();
     switch (dev->ep_state_rx[ep]) {
     case sgl_buf_ready:
         dev->ep_state_rx[ep] = sgl_buf_paused;
@@ -216,6 +339,42 @@ void qsb_dev_ep_pause(qsb_device* dev, uint8_t addr)
         //USB_EP(ep) = reg;
         break;
     }
+    unlock_ep_state(irq_enabled);
+}
+
+static inline void ep_callback(qsb_device* dev, uint8_t ep, uint8_t type, uint8_t offset);
+static inline void release_rx_buf(qsb_device* dev, uint8_t ep);
+
+void qsb_dev_ep_defer_packet(qsb_device* dev, uint8_t addr)
+{
+    if (dev->active_ep_callback != addr || qsb_endpoint_is_tx(addr))
+        return; // call is only valid from within user callback of this OUT endpoint
+
+    // Since IN bit is not set, ep equals addr
+    dev->ep_deferred_rx[addr] = 1;
+    dev->ep_deferred_offset[addr] = dev->active_ep_offset;
+}
+
+// Calls the endpoint callback for the deferred packets (until it defers one again)
+static void redeliver_deferred_packets(qsb_device* dev, uint8_t ep)
+{
+    while (dev->ep_deferred_rx[ep] != 0) {
+        uint8_t num_pkts = dev->ep_deferred_rx[ep];
+        uint8_t offset = dev->ep_deferred_offset[ep];
+        dev->ep_deferred_rx[ep] = 0;
+        ep_callback(dev, ep, QSB_TRANSACTION_OUT, offset);
+        if (dev->ep_deferred_rx[ep] != 0) {
+            // deferred again
+            dev->ep_deferred_rx[ep] = num_pkts;
+            return;
+        }
+
+        bool irq_enabled = lock_ep_state();
+        release_rx_buf(dev, ep);
+        unlock_ep_state(irq_enabled);
+        dev->ep_deferred_rx[ep] = num_pkts - 1;
+        dev->ep_deferred_offset[ep] = offset ^ 1;
+    }
 }
 
 void qsb_dev_ep_unpause(qsb_device* dev, uint8_t addr)
@@ -226,6 +385,10 @@ void qsb_dev_ep_unpause(qsb_device* dev, uint8_t addr)
 
     // Since IN bit is not set, ep equals addr
     uint8_t ep = addr;
+    if (dev->ep_deferred_rx[ep] != 0)
+        redeliver_deferred_packets(dev, ep);
+
+    bool irq_enabled = lock_ep_state();
     switch (dev->ep_state_rx[ep]) {
     case sgl_buf_paused:
         dev->ep_state_rx[ep] = sgl_buf_ready;
@@ -242,15 +405,22 @@ void qsb_dev_ep_unpause(qsb_device* dev, uint8_t addr)
         }
         break;
     }
+    unlock_ep_state(irq_enabled);
 }
 
 uint16_t qsb_dev_ep_transmit_avail(qsb_device* dev, uint8_t addr)
 {
     uint8_t ep = qsb_endpoint_num(addr);
+#if QSB_DMA_COPY == 1
+    check_dma_copy(dev);
+    if (dev->dma_copy_ep == ep)
+        return 0;
+#endif
     ep_state_tx_e dbl_buf_state = dev->ep_state_tx[ep];
 
     switch (dbl_buf_state) {
     case dbl_buf_en_0_pkts:
+        return 2 * 64;
     case sgl_buf_0_pkts:
     case dbl_buf_en_1_pkt:
         return 64;
@@ -259,25 +429,76 @@ uint16_t qsb_dev_ep_transmit_avail(qsb_device* dev, uint8_t addr)
     }
 }
 
-int qsb_dev_ep_transmit_packet(qsb_device* dev, uint8_t addr, const uint8_t* buf, int len)
+bool qsb_dev_ep_transmit_pending(qsb_device* dev, uint8_t addr)
+{
+#if QSB_DMA_COPY == 1
+    check_dma_copy(dev);
+    return dev->dma_copy_ep == qsb_endpoint_num(addr);
+#else
+    (void)dev;
+    (void)addr;
+    return false;
+#endif
+}
+
+QSB_RAMFUNC int qsb_dev_ep_transmit_packet(qsb_device* dev, uint8_t addr, const uint8_t* buf, int len)
+{
+    return qsb_dev_ep_transmit_chunks(dev, addr, buf, len, NULL, 0, 0xff);
+}
+
+// Copies a packet into the free half of a double buffered endpoint and hands it over to the peripheral
+static void submit_dbl_buf_packet(qsb_device* dev, uint8_t ep, const uint8_t* buf1, int len1,
+    const uint8_t* buf2, int len2, uint8_t mask)
+{
+    uint8_t offset = (USB_EP(ep) & USB_EP_SW_BUF_TX) == 0 ? qsb_offset_db0 : qsb_offset_db1;
+    qsb_fsdev_copy_chunks_to_pma(ep, offset, buf1, len1, buf2, len2, mask);
+    bool irq_enabled = lock_ep_state();
+    dev->ep_state_tx[ep] += 1;
+    qsb_ep_sw_buf_tx_toggle(ep);
+    unlock_ep_state(irq_enabled);
+}
+
+QSB_RAMFUNC int qsb_dev_ep_transmit_chunks(qsb_device* dev, uint8_t addr, const uint8_t* buf1, int len1,
+    const uint8_t* buf2, int len2, uint8_t mask)
 {
     uint8_t ep = qsb_endpoint_num(addr);
+#if QSB_DMA_COPY == 1
+    check_dma_copy(dev);
+    if (dev->dma_copy_ep == ep)
+        return -1; // previous packet is still being copied
+#endif
     ep_state_tx_e state = dev->ep_state_tx[ep];
 
     if (state == sgl_buf_0_pkts) {
         // submit a single packet in single buffering mode
-        len = imin(len, 64);
-        qsb_fsdev_copy_to_pma(ep, qsb_offset_tx, buf, len);
+        len1 = imin(len1, 64);
+        len2 = imin(len2, 64 - len1);
+        qsb_fsdev_copy_chunks_to_pma(ep, qsb_offset_tx, buf1, len1, buf2, len2, mask);
         dev->ep_state_tx[ep] = sgl_buf_1_pkt;
         qsb_ep_stat_tx_set(ep, USB_EP_STAT_TX_VALID);
 
     } else if (state == dbl_buf_en_0_pkts || state == dbl_buf_en_1_pkt) {
         // submit one or two packets in double buffering mode
-        uint8_t offset = (USB_EP(ep) & USB_EP_SW_BUF_TX) == 0 ? qsb_offset_db0 : qsb_offset_db1;
-        len = imin(len, 64);
-        qsb_fsdev_copy_to_pma(ep, offset, buf, len);
-        dev->ep_state_tx[ep] = state + 1;
-        qsb_ep_sw_buf_tx_toggle(ep);
+        int max_len = state == dbl_buf_en_0_pkts ? 2 * 64 : 64;
+        len1 = imin(len1, max_len);
+        len2 = imin(len2, max_len - len1);
+
+        // first packet
+        int pkt_len1 = imin(len1, 64);
+        int pkt_len2 = imin(len2, 64 - pkt_len1);
+#if QSB_DMA_COPY == 1
+        // a packet from a single chunk is copied by DMA; it is submitted once the copy has completed
+        if ((pkt_len1 == 0 || pkt_len2 == 0)
+                && can_copy_with_dma(dev, pkt_len1 != 0 ? buf1 : buf2, pkt_len1 + pkt_len2, mask)) {
+            start_dma_copy(dev, ep, pkt_len1 != 0 ? buf1 : buf2, pkt_len1 + pkt_len2);
+            return pkt_len1 + pkt_len2;
+        }
+#endif
+        submit_dbl_buf_packet(dev, ep, buf1, pkt_len1, buf2, pkt_len2, mask);
+
+        // second packet (if the data does not fit into the first one)
+        if (len1 + len2 > 64)
+            submit_dbl_buf_packet(dev, ep, buf1 + pkt_len1, len1 - pkt_len1, buf2 + pkt_len2, len2 - pkt_len2, mask);
 
     } else {
         // busy with a single packet in single buffering
@@ -285,41 +506,258 @@ int qsb_dev_ep_transmit_packet(qsb_device* dev, uint8_t addr, const uint8_t* buf
         return -1;
     }
 
-    return len;
+    return len1 + len2;
 }
 
-uint16_t qsb_dev_ep_read_packet(qsb_device* dev, uint8_t addr, uint8_t* buf, uint16_t len)
+QSB_RAMFUNC uint16_t qsb_dev_ep_read_packet(qsb_device* dev, uint8_t addr, uint8_t* buf, uint16_t len)
 {
     if (dev->active_ep_callback != addr)
         return 0; // call is only valid from within user callback of this endpoint
 
     // Since IN bit is not set, ep equals addr
     uint8_t ep = addr;
-    uint32_t ep_reg = USB_EP(ep);
-    uint8_t offset = qsb_offset_rx;
-    if ((ep_reg & USB_EP_KIND_DBL_BUF) != 0)
-            offset = dev->ep_state_rx[ep] & 1;
+    return qsb_fsdev_copy_from_pma(buf, len, ep, dev->active_ep_offset);
+}
 
-    return qsb_fsdev_copy_from_pma(buf, len, ep, offset);
+#if QSB_STATIC_EP_DISPATCH == 1
+QSB_RAMFUNC uint16_t qsb_dev_ep_read_packet_at(uint8_t addr, uint8_t offset, uint8_t* buf, uint16_t len)
+{
+    return qsb_fsdev_copy_from_pma(buf, len, addr, offset);
 }
+#endif
 
 static inline void ep_callback(qsb_device* dev, uint8_t ep, uint8_t type, uint8_t offset)
 {
+#if QSB_STATIC_EP_DISPATCH == 1
+    // the type is known at the call sites, so this reduces to the check of the endpoint number
+    if (type == QSB_TRANSACTION_OUT && ep != 0) {
+        // active endpoint is still set for qsb_dev_ep_defer_packet() and qsb_dev_ep_unpause()
+        dev->active_ep_callback = ep;
+        dev->active_ep_offset = offset;
+        qsb_static_ep_out(dev, ep, offset, qsb_fsdev_get_len(ep, offset));
+        dev->active_ep_callback = 0xff;
+        return;
+    }
+#endif
+
     if (dev->ep_callbacks[ep][type] == NULL)
         return;
 
     uint8_t addr = type == QSB_TRANSACTION_IN ? qsb_endpoint_addr_in(ep) : qsb_endpoint_addr_out(ep);
     dev->active_ep_callback = addr;
+    dev->active_ep_offset = offset;
     dev->ep_callbacks[ep][type](dev, addr, qsb_fsdev_get_len(ep, offset));
     dev->active_ep_callback = 0xff;
 }
 
-void qsb_dev_poll(qsb_device* dev)
+// Releases the buffer of a received packet for the next packet (unless the endpoint is paused)
+static inline void release_rx_buf(qsb_device* dev, uint8_t ep)
+{
+    ep_state_rx_e rx_state = dev->ep_state_rx[ep];
+    if (rx_state == sgl_buf_ready) {
+        qsb_ep_stat_rx_set(ep, USB_EP_STAT_RX_VALID);
+    } else if (rx_state == dbl_buf_ready_0 || rx_state == dbl_buf_ready_1) {
+        qsb_ep_sw_buf_rx_toggle(ep);
+    } else if (rx_state == dbl_buf_paused_0 || rx_state == dbl_buf_paused_1) {
+        dev->ep_outstanig_rx_acks[ep] += 1;
+    }
+}
+
+// Calls the endpoint callback for a received packet and releases its buffer,
+// unless the packet is deferred or an earlier packet is still deferred
+static inline void deliver_rx_packet(qsb_device* dev, uint8_t ep, uint8_t offset)
+{
+    if (dev->ep_deferred_rx[ep] != 0) {
+        // hold the packet in packet memory behind the deferred one
+        dev->ep_deferred_rx[ep] += 1;
+        return;
+    }
+
+    ep_callback(dev, ep, QSB_TRANSACTION_OUT, offset);
+    if (dev->ep_deferred_rx[ep] == 0)
+        release_rx_buf(dev, ep);
+}
+
+// Gets the buffer offset of a received packet (before the RX state is advanced)
+static inline uint8_t rx_buf_offset(qsb_device* dev, uint8_t ep, uint32_t ep_reg)
+{
+    if ((ep_reg & USB_EP_KIND_DBL_BUF) != 0)
+        return dev->ep_state_rx[ep] & 1;
+    return qsb_offset_rx;
+}
+
+// Gets the buffer offset of a transmitted packet
+static inline uint8_t tx_buf_offset(uint32_t ep_reg)
+{
+    if ((ep_reg & USB_EP_KIND_DBL_BUF) != 0 && (ep_reg & USB_EP_SW_BUF_TX) == 0)
+        return qsb_offset_db1;
+    return qsb_offset_tx;
+}
+
+// Updates the TX state after a packet has been transmitted
+static inline void tx_completed(qsb_device* dev, uint8_t ep)
+{
+    if (dev->ep_state_tx[ep] != sgl_buf_0_pkts && dev->ep_state_tx[ep] != dbl_buf_en_0_pkts)
+        dev->ep_state_tx[ep]--;
+}
+
+// enable SOF interupt only if callback has been registered
+static inline void update_sof_interrupt(qsb_device* dev)
 {
+    if (dev->user_callback_sof) {
+        USB_CNTR |= USB_CNTR_SOFM;
+    } else {
+        USB_CNTR &= ~USB_CNTR_SOFM;
+    }
+}
+
+#if QSB_ISR_MODE == 1
+
+// Adds an event to the event queue (called from interrupt handler only)
+static inline void push_event(qsb_device* dev, uint8_t type, uint8_t ep, uint8_t offset)
+{
+    uint8_t head = dev->event_queue_head;
+    struct qsb_internal_event* event = &dev->event_queue[head & (QSB_ISR_EVENT_QUEUE_LEN - 1)];
+    event->type = type;
+    event->ep = ep;
+    event->offset = offset;
+    dev->event_queue_head = head + 1;
+}
+
+QSB_RAMFUNC void qsb_dev_isr(qsb_device* dev)
+{
+    while (true) {
+        // Stop if the queue cannot take further events. The interrupt is
+        // re-enabled by qsb_dev_poll() once the queue has been processed.
+        if ((uint8_t)(dev->event_queue_head - dev->event_queue_tail) >= QSB_ISR_EVENT_QUEUE_LEN) {
+            nvic_disable_irq(QSB_USB_IRQ);
+            return;
+        }
+
+        uint32_t istr = USB_ISTR;
+
+        if (istr & USB_ISTR_RESET) {
+            USB_ISTR_WRITE(~USB_ISTR_RESET);
+            push_event(dev, event_reset, 0, 0);
+            continue;
+        }
+
+        // correct transfer
+        if ((istr & USB_ISTR_CTR) != 0) {
+            uint8_t ep = istr & USB_ISTR_EP_ID;
+            uint32_t ep_reg = USB_EP(ep);
+
+            // correct RX transfer (only one event per pass as the queue might become full)
+            if ((ep_reg & USB_EP_CTR_RX) != 0) {
+                if ((ep_reg & USB_EP_SETUP) != 0) {
+                    // SETUP transfer
+                    qsb_ep_ctr_rx_clear(0);
+                    push_event(dev, QSB_TRANSACTION_SETUP, 0, qsb_offset_rx);
+
+                } else {
+                    // Regular OUT transfer: the buffer is released after the callback
+                    qsb_ep_ctr_rx_clear(ep);
+                    push_event(dev, QSB_TRANSACTION_OUT, ep, rx_buf_offset(dev, ep, ep_reg));
+                    if ((ep_reg & USB_EP_KIND_DBL_BUF) != 0)
+                        dev->ep_state_rx[ep] ^= 1;
+                }
+
+            // correct TX transfer
+            } else if ((ep_reg & USB_EP_CTR_TX) != 0) {
+                qsb_ep_ctr_tx_clear(ep);
+                tx_completed(dev, ep);
+                push_event(dev, QSB_TRANSACTION_IN, ep, tx_buf_offset(ep_reg));
+            }
+            continue;
+        }
+
+        if (istr & USB_ISTR_SUSP) {
+            USB_ISTR_WRITE(~USB_ISTR_SUSP);
+            push_event(dev, event_suspend, 0, 0);
+            continue;
+        }
+
+        if (istr & USB_ISTR_WKUP) {
+            USB_ISTR_WRITE(~USB_ISTR_WKUP);
+            push_event(dev, event_resume, 0, 0);
+            continue;
+        }
+
+        if (istr & USB_ISTR_SOF) {
+            USB_ISTR_WRITE(~USB_ISTR_SOF);
+            push_event(dev, event_sof, 0, 0);
+            continue;
+        }
+
+        return;
+    }
+}
+
+QSB_RAMFUNC void qsb_dev_poll(qsb_device* dev)
+{
+#if QSB_DMA_COPY == 1
+    check_dma_copy(dev);
+#endif
+
+    while (dev->event_queue_tail != dev->event_queue_head) {
+        uint8_t tail = dev->event_queue_tail;
+        struct qsb_internal_event event = dev->event_queue[tail & (QSB_ISR_EVENT_QUEUE_LEN - 1)];
+        dev->event_queue_tail = tail + 1;
+
+        switch (event.type) {
+        case QSB_TRANSACTION_SETUP:
+            ep_callback(dev, 0, QSB_TRANSACTION_SETUP, event.offset);
+            qsb_ep_stat_rx_set(0, USB_EP_STAT_RX_VALID);
+            break;
+
+        case QSB_TRANSACTION_OUT:
+            deliver_rx_packet(dev, event.ep, event.offset);
+            break;
+
+        case QSB_TRANSACTION_IN:
+            ep_callback(dev, event.ep, QSB_TRANSACTION_IN, event.offset);
+            break;
+
+        case event_reset:
+            dev->pm_top = PM_TOP_INIT;
+            qsb_internal_dev_reset(dev);
+            break;
+
+        case event_suspend:
+            if (dev->user_callback_suspend)
+                dev->user_callback_suspend();
+            break;
+
+        case event_resume:
+            if (dev->user_callback_resume)
+                dev->user_callback_resume();
+            break;
+
+        case event_sof:
+            if (dev->user_callback_sof)
+                dev->user_callback_sof();
+            break;
+        }
+    }
+
+    update_sof_interrupt(dev);
+
+    // (re-)enable the interrupt (disabled initially or if the queue was full)
+    nvic_enable_irq(QSB_USB_IRQ);
+}
+
+#else
+
+QSB_RAMFUNC void qsb_dev_poll(qsb_device* dev)
+{
+#if QSB_DMA_COPY == 1
+    check_dma_copy(dev);
+#endif
+
     uint32_t istr = USB_ISTR;
 
     if (istr & USB_ISTR_RESET) {
-        USB_ISTR = ~USB_ISTR_RESET;
+        USB_ISTR_WRITE(~USB_ISTR_RESET);
         dev->pm_top = PM_TOP_INIT;
         qsb_internal_dev_reset(dev);
         return;
@@ -342,74 +780,53 @@ void qsb_dev_poll(qsb_device* dev)
             // Regular OUT transfer
             } else {
                 qsb_ep_ctr_rx_clear(ep);
-                uint8_t offset = qsb_offset_rx;
+                deliver_rx_packet(dev, ep, rx_buf_offset(dev, ep, ep_reg));
                 if ((ep_reg & USB_EP_KIND_DBL_BUF) != 0)
-                    offset = dev->ep_state_rx[ep] & 1;
-
-                ep_callback(dev, ep, QSB_TRANSACTION_OUT, offset);
-
-                ep_state_rx_e rx_state = dev->ep_state_rx[ep];
-                if (rx_state == sgl_buf_ready) {
-                    qsb_ep_stat_rx_set(ep, USB_EP_STAT_RX_VALID);
-                } else if (rx_state >= dbl_buf_ready_0 && rx_state <= dbl_buf_paused_1) {
-                    if (rx_state <= dbl_buf_ready_1)
-                        qsb_ep_sw_buf_rx_toggle(ep);
-                    else
-                        dev->ep_outstanig_rx_acks[ep] += 1;
                     dev->ep_state_rx[ep] ^= 1;
-                }
             }
         }        
 
         // correct TX transfer
         if ((ep_reg & USB_EP_CTR_TX) != 0) {
             qsb_ep_ctr_tx_clear(ep);
-
-            if (dev->ep_state_tx[ep] != sgl_buf_0_pkts && dev->ep_state_tx[ep] != dbl_buf_en_0_pkts)
-                dev->ep_state_tx[ep]--;
-
-            uint8_t offset = qsb_offset_tx;
-            if ((ep_reg & USB_EP_KIND_DBL_BUF) != 0 && (ep_reg & USB_EP_SW_BUF_TX) == 0)
-                offset = qsb_offset_db1;
-            ep_callback(dev, ep, QSB_TRANSACTION_IN, offset);
+            tx_completed(dev, ep);
+            ep_callback(dev, ep, QSB_TRANSACTION_IN, tx_buf_offset(ep_reg));
         }
 
         istr = USB_ISTR;
     }
 
     if (istr & USB_ISTR_SUSP) {
-        USB_ISTR = ~USB_ISTR_SUSP;
+        USB_ISTR_WRITE(~USB_ISTR_SUSP);
         if (dev->user_callback_suspend)
             dev->user_callback_suspend();
     }
 
     if (istr & USB_ISTR_WKUP) {
-        USB_ISTR = ~USB_ISTR_WKUP;
+        USB_ISTR_WRITE(~USB_ISTR_WKUP);
         if (dev->user_callback_resume)
             dev->user_callback_resume();
     }
 
     if (istr & USB_ISTR_SOF) {
-        USB_ISTR = ~USB_ISTR_SOF;
+        USB_ISTR_WRITE(~USB_ISTR_SOF);
         if (dev->user_callback_sof)
             dev->user_callback_sof();
     }
 
-    // enable SOF interupt only if callback has been registered
-    if (dev->user_callback_sof) {
-        USB_CNTR |= USB_CNTR_SOFM;
-    } else {
-        USB_CNTR &= ~USB_CNTR_SOFM;
-    }
+    update_sof_interrupt(dev);
 }
 
+#endif
+
 #if QSB_FSDEV_SUBTYPE >= 3
 void qsb_dev_disconnect(__attribute__((unused)) qsb_device* dev, bool disconnected)
 {
+    // the device is disconnected by disabling the D+ pull-up
     if (disconnected) {
-        USB_BCDR |= USB_BCDR_DPPU;
-    } else {
         USB_BCDR &= ~USB_BCDR_DPPU;
+    } else {
+        USB_BCDR |= USB_BCDR_DPPU;
     }
 }
 #endif
@@ -13,7 +13,9 @@
 
 #pragma once
 
+#include "qsb_config.h"
 #include <libopencm3/stm32/memorymap.h>
+#include <stdint.h>
 
 // --- USB general registers -----------------------------------------------
 
@@ -31,6 +33,24 @@
 // USB endpoint registers
 #define USB_EP(EP) MMIO32(USB_DEV_FS_BASE + 4 * (EP))
 
+// Writes to the endpoint registers and to USB_ISTR (registers with toggle and clear-only bits).
+// With QSB_SIM_ENABLE, they are passed to the simulated register model instead.
+#if QSB_SIM == 1
+#ifdef __cplusplus
+extern "C" {
+#endif
+void qsb_sim_ep_write(uint8_t ep, uint32_t val);
+void qsb_sim_istr_write(uint32_t val);
+#ifdef __cplusplus
+}
+#endif
+#define USB_EP_WRITE(EP, VAL) qsb_sim_ep_write((EP), (VAL))
+#define USB_ISTR_WRITE(VAL) qsb_sim_istr_write(VAL)
+#else
+#define USB_EP_WRITE(EP, VAL) (USB_EP(EP) = (VAL))
+#define USB_ISTR_WRITE(VAL) (USB_ISTR = (VAL))
+#endif
+
 // --- USB control register masks / bits -----------------------------------
 
 // Interrupt mask bits, set to 1 to enable interrupt generation
@@ -47,7 +47,7 @@ static inline void qsb_ep_toggle_bits(uint8_t ep, uint32_t val, uint32_t mask)
     // set bits to be toggled
     reg ^= val;
     // write resulting value
-    USB_EP(ep) = reg;
+    USB_EP_WRITE(ep, reg);
 }
 
 /**
@@ -66,7 +66,7 @@ static inline void qsb_ep_set_all_rw_bits(uint8_t ep, uint32_t val)
     // set bits to be updated
     reg |= val;
     // write resulting value
-    USB_EP(ep) = reg;
+    USB_EP_WRITE(ep, reg);
 }
 
 /// Set endpoint RX status to specified value
@@ -109,24 +109,24 @@ static inline void qsb_ep_sw_buf_tx_clear(uint8_t ep)
 static inline void qsb_ep_sw_buf_rx_toggle(uint8_t ep)
 {
     // This function is only used in double buffering mode so KIND_DBL_BUF and TYPE_BULK is assumed.
-    USB_EP(ep) = USB_EP_KIND_DBL_BUF | USB_EP_TYPE_BULK | ep | USB_EP_W0_BITS_MSK | USB_EP_SW_BUF_RX;
+    USB_EP_WRITE(ep, USB_EP_KIND_DBL_BUF | USB_EP_TYPE_BULK | ep | USB_EP_W0_BITS_MSK | USB_EP_SW_BUF_RX);
 }
 
 /// Toggle the SW_BUF_TX bit
 static inline void qsb_ep_sw_buf_tx_toggle(uint8_t ep)
 {
     // This function is only used in double buffering mode so KIND_DBL_BUF and TYPE_BULK is assumed.
-    USB_EP(ep) = USB_EP_KIND_DBL_BUF | USB_EP_TYPE_BULK | ep | USB_EP_W0_BITS_MSK | USB_EP_SW_BUF_TX;
+    USB_EP_WRITE(ep, USB_EP_KIND_DBL_BUF | USB_EP_TYPE_BULK | ep | USB_EP_W0_BITS_MSK | USB_EP_SW_BUF_TX);
 }
 
 /// Clear the CTR_RX bit
 static inline void qsb_ep_ctr_rx_clear(uint8_t ep)
 {
-    USB_EP(ep) = (USB_EP(ep) & USB_EP_RW_BITS_MSK) | USB_EP_CTR_TX;
+    USB_EP_WRITE(ep, (USB_EP(ep) & USB_EP_RW_BITS_MSK) | USB_EP_CTR_TX);
 }
 
 /// Clear the CTR_TX bit
 static inline void qsb_ep_ctr_tx_clear(uint8_t ep)
 {
-    USB_EP(ep) = (USB_EP(ep) & USB_EP_RW_BITS_MSK) | USB_EP_CTR_RX;
+    USB_EP_WRITE(ep, (USB_EP(ep) & USB_EP_RW_BITS_MSK) | USB_EP_CTR_RX);
 }
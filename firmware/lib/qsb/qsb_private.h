@@ -26,6 +26,13 @@
 #define QSB_MAX_CONTROL_CALLBACKS 4
 #define QSB_MAX_SET_CONFIG_CALLBACKS 4
 
+#if QSB_ISR_MODE == 1
+// Data modified by both the interrupt handler and the main loop
+#define QSB_ISR_SHARED volatile
+#else
+#define QSB_ISR_SHARED
+#endif
+
 /**
  * Return the minimum of the given arguments.
  *
@@ -49,6 +56,10 @@ struct qsb_internal_device {
     const qsb_config_desc* config;
     const char* const* strings;
     int num_strings;
+    /// Prebuilt configuration descriptors (NULL if they are built at runtime)
+    const uint8_t* const* prebuilt_config_descs;
+    /// Prebuilt string descriptors (NULL if they are built at runtime)
+    const uint8_t* const* prebuilt_string_descs;
 
     /// Internal buffer used for control transfers
     uint8_t* ctrl_buf;
@@ -60,6 +71,8 @@ struct qsb_internal_device {
 
     /// Endpoint address (incl. direction bit) whose callback is currently called
     uint8_t active_ep_callback;
+    /// Buffer offset of the endpoint whose callback is currently called
+    uint8_t active_ep_offset;
 
     // User callback functions for various USB events
     void (*user_callback_reset)(void);
@@ -108,11 +121,33 @@ struct qsb_internal_device {
     // private implementation data for USB full-speed device peripheral
 
     uint16_t pm_top; // Top of allocated endpoint buffer memory
-    uint8_t ep_state_rx[QSB_NUM_ENDPOINTS];
-    uint8_t ep_state_tx[QSB_NUM_ENDPOINTS];
+    QSB_ISR_SHARED uint8_t ep_state_rx[QSB_NUM_ENDPOINTS];
+    QSB_ISR_SHARED uint8_t ep_state_tx[QSB_NUM_ENDPOINTS];
 
 #if defined(QSB_FSDEV_DBL_BUF)
     uint8_t ep_outstanig_rx_acks[QSB_NUM_ENDPOINTS];
+    /// Number of received packets held in packet memory (see `qsb_dev_ep_defer_packet()`)
+    uint8_t ep_deferred_rx[QSB_NUM_ENDPOINTS];
+    /// Buffer offset of the oldest deferred packet
+    uint8_t ep_deferred_offset[QSB_NUM_ENDPOINTS];
+
+#if QSB_DMA_COPY == 1
+    /// Endpoint whose packet is being copied to PMA by DMA (0xff if none)
+    uint8_t dma_copy_ep;
+#endif
+#endif
+
+#if QSB_ISR_MODE == 1
+    // Event queue from interrupt handler (single producer) to main loop (single consumer)
+    struct qsb_internal_event {
+        uint8_t type;
+        uint8_t ep;
+        uint8_t offset;
+    } event_queue[QSB_ISR_EVENT_QUEUE_LEN];
+    /// Free-running insert position (only modified by interrupt handler)
+    volatile uint8_t event_queue_head;
+    /// Free-running remove position (only modified by main loop)
+    volatile uint8_t event_queue_tail;
 #endif
 
 #elif QSB_ARCH == QSB_ARCH_DWC
@@ -208,6 +208,13 @@ static qsb_request_return_code get_string_descriptor(
         if (req->wIndex != QSB_LANGID_ENGLISH_US)
             return QSB_REQ_NOTSUPP; // request for language ID other than English-US
 
+        if (dev->prebuilt_string_descs && dev->prebuilt_string_descs[array_idx]) {
+            // send prebuilt descriptor directly from flash
+            *buf = (uint8_t*)dev->prebuilt_string_descs[array_idx];
+            *len = imin(*len, (*buf)[0]);
+            return QSB_REQ_HANDLED;
+        }
+
         fill_string_desc(dev->strings[array_idx], desc, len);
     }
 
@@ -238,6 +245,16 @@ static qsb_request_return_code get_descriptor(qsb_device* dev, qsb_setup_data* r
         return QSB_REQ_HANDLED;
 
     case QSB_DT_CONFIGURATION:
+        if (descr_idx >= dev->desc->bNumConfigurations)
+            return QSB_REQ_NOTSUPP;
+
+        if (dev->prebuilt_config_descs) {
+            // send prebuilt descriptor directly from flash
+            *buf = (uint8_t*)dev->prebuilt_config_descs[descr_idx];
+            *len = imin(*len, (*buf)[2] | ((*buf)[3] << 8));
+            return QSB_REQ_HANDLED;
+        }
+
         *len = imin(*len, build_config_descriptor(dev, descr_idx, *buf));
         return QSB_REQ_HANDLED;
 
@@ -37,7 +37,7 @@ static const uint8_t wcid_feature_desc[] = {
     0x04, 0x00,                                     // compatibility descriptor index 0x0004
     0x01,                                           // number of sections
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,       // reserved (7 bytes)
-    0x00,                                           // interface number 0
+    QSB_WIN_WCID_INTERFACE,                         // interface number
     0x01,                                           // reserved
     0x57, 0x49, 0x4E, 0x55, 0x53, 0x42, 0x00, 0x00, // Compatible ID "WINUSB\0\0"
     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // Subcompatible ID (unused)
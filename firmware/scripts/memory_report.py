@@ -0,0 +1,107 @@
+#
+# USB Serial
+#
+# Copyright (c) 2020 Manuel Bleichenbacher
+# Licensed under MIT License
+# https://opensource.org/licenses/MIT
+#
+# PlatformIO extra script: prints a RAM usage report after linking
+# and suggests UART buffer sizes using the remaining RAM.
+#
+# The split between RX and TX buffer can be configured in platformio.ini:
+#
+#   custom_uart_rx_share = 67   ; percentage of buffer RAM used for RX buffer
+#
+
+import os
+import subprocess
+
+Import("env")
+
+# default UART buffer size of the board profiles (see include/boards)
+DEFAULT_BUF_LEN = {
+    "BOARD_STM32F042": 1024,
+    "BOARD_STM32F070": 1024,
+    "BOARD_STM32F103": 4096,
+}
+TX_BUF_SLACK = 64
+
+
+def read_symbols(elf_path):
+    nm = env.subst("$CC").replace("gcc", "nm")
+    proc_env = os.environ.copy()
+    proc_env.update(env["ENV"])
+    output = subprocess.check_output([nm, "-S", elf_path], env=proc_env, universal_newlines=True)
+    symbols = {}
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) == 4:
+            symbols[fields[3]] = (int(fields[0], 16), int(fields[1], 16), fields[2])
+        elif len(fields) == 3:
+            symbols[fields[2]] = (int(fields[0], 16), 0, fields[1])
+    return symbols
+
+
+def build_flag_value(name, default):
+    for define in env.get("CPPDEFINES", []):
+        if isinstance(define, (list, tuple)) and define[0] == name:
+            return int(str(define[1]), 0)
+    return default
+
+
+def has_build_flag(name):
+    return any(define == name or (isinstance(define, (list, tuple)) and define[0] == name)
+        for define in env.get("CPPDEFINES", []))
+
+
+def floor_pow2(n):
+    p = 1
+    while p * 2 <= n:
+        p *= 2
+    return p
+
+
+def memory_report(source, target, env):
+    symbols = read_symbols(str(target[0]))
+    if "end" not in symbols or "_stack" not in symbols:
+        print("Memory report: linker symbols not found")
+        return
+
+    ram_start = 0x20000000
+    ram_end = symbols["_stack"][0]
+    static_end = symbols["end"][0]
+    stack_reserve = symbols["_stack_reserve"][0] if "_stack_reserve" in symbols else 0
+    num_ports = 2 if has_build_flag("DUAL_CDC_ENABLE") else 1
+    board_len = next((n for board, n in DEFAULT_BUF_LEN.items() if has_build_flag(board)), 1024)
+    default_len = board_len // num_ports
+    rx_len = build_flag_value("UART_RX_BUF_LEN", default_len)
+    tx_len = build_flag_value("UART_TX_BUF_LEN", default_len)
+
+    print("Memory report (%s):" % env.subst("$PIOENV"))
+    print("  RAM:                %6d bytes" % (ram_end - ram_start))
+    print("  Static data:        %6d bytes" % (static_end - ram_start))
+    print("    UART RX buffer:   %6d bytes%s" % (rx_len, " (per port)" if num_ports > 1 else ""))
+    print("    UART TX buffer:   %6d bytes%s" % (tx_len + TX_BUF_SLACK, " (per port)" if num_ports > 1 else ""))
+    if "usbd_control_buffer" in symbols:
+        print("    USB control buf:  %6d bytes" % symbols["usbd_control_buffer"][1])
+    ramfunc_size = sum(size for addr, size, kind in symbols.values() if kind in "tT" and addr >= ram_start)
+    if ramfunc_size > 0:
+        print("    RAM functions:    %6d bytes" % ramfunc_size)
+    print("  Stack and heap:     %6d bytes (%d reserved for stack)" % (ram_end - static_end, stack_reserve))
+
+    # suggest buffer sizes (powers of 2) using the RAM not reserved for the stack
+    # (the same sizes for each serial port)
+    unused = ram_end - static_end - stack_reserve
+    buf_ram = rx_len + tx_len + unused // num_ports
+    rx_share = int(env.GetProjectOption("custom_uart_rx_share", "50"))
+    sugg_rx = floor_pow2(max(buf_ram * rx_share // 100, 64))
+    sugg_tx = floor_pow2(max(buf_ram - sugg_rx - TX_BUF_SLACK, 64))
+    if sugg_rx + sugg_tx > buf_ram - TX_BUF_SLACK:
+        sugg_rx = floor_pow2(max(buf_ram - TX_BUF_SLACK - sugg_tx, 64))
+    if (sugg_rx, sugg_tx) != (rx_len, tx_len):
+        print("  Unused RAM:         %6d bytes" % unused)
+        print("  Suggested build flags (RX share %d%%): -D UART_RX_BUF_LEN=%d -D UART_TX_BUF_LEN=%d"
+            % (rx_share, sugg_rx, sugg_tx))
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", memory_report)
@@ -0,0 +1,13 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: replaces <libopencm3/cm3/cortex.h>
+ */
+
+#pragma once
+
+#include <sim_libopencm3.h>
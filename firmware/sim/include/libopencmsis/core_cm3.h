@@ -0,0 +1,19 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: replaces <libopencmsis/core_cm3.h>
+ */
+
+#pragma once
+
+#include <sim_libopencm3.h>
+
+static inline void __NOP(void) {}
+static inline void __DSB(void) {}
+static inline void __ISB(void) {}
+static inline void __DMB(void) {}
+static inline void __WFI(void) {}
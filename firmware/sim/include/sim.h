@@ -0,0 +1,236 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation of the data path on the host (offline benchmarks and regression tests)
+ *
+ * The unmodified firmware (UART, USB serial, USB CDC and the QSB library) runs
+ * against a register model of the STM32F042: USART2 with DMA channels 4/5,
+ * the USB full-speed device peripheral with its packet memory, and the NVIC.
+ * Time only advances between main loop iterations (by the configurable loop
+ * cost) and in delay(). Pending DMA interrupts are executed as soon as time
+ * advances, i.e. the firmware is never interrupted in the middle of a function.
+ *
+ * The USB side is driven by a simulated host (enumeration, bulk IN/OUT and
+ * interrupt transactions within 1 ms frames), the UART side by a simulated
+ * peer (line rate transmission, optional RTS flow control and echo).
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include "usb_vendor.h"
+
+/// Configuration of a simulation run
+struct sim_config
+{
+    /// Duration of a main loop iteration (in ns)
+    uint32_t loop_cost_ns = 3000;
+    /// Time until the host retries a NAKed bulk or control transaction (in ns)
+    uint32_t nak_retry_ns = 10000;
+    /// Line coding set when the host opens the port
+    uint32_t baudrate = 115200;
+    /// Number of data bits (CDC line coding)
+    uint8_t databits = 8;
+    /// Stop bits (CDC line coding: 0 = 1, 1 = 1.5, 2 = 2)
+    uint8_t stopbits = 0;
+    /// Parity (CDC line coding: 0 = none, 1 = odd, 2 = even)
+    uint8_t parity = 0;
+};
+
+/// Bytes with the time they have been transmitted or received
+struct sim_byte_log
+{
+    std::vector<uint8_t> data;
+    /// Time stamp of each byte (in ns)
+    std::vector<uint64_t> time;
+
+    void clear()
+    {
+        data.clear();
+        time.clear();
+    }
+};
+
+/// IN packet or notification received by the host
+struct sim_packet
+{
+    /// Time stamp (in ns)
+    uint64_t time;
+    /// Packet length (bulk IN packets) or serial state (notifications)
+    uint16_t value;
+};
+
+// --- Simulation control ----------------------------------------------------
+
+/**
+ * @brief Resets the simulated device and runs the firmware until the host has opened the port.
+ *
+ * The firmware is initialized as after power-on. The host enumerates the device,
+ * sets the line coding and asserts DTR/RTS. Aborts if the port cannot be opened.
+ *
+ * @param config simulation configuration
+ */
+void sim_reset(const sim_config &config);
+
+/**
+ * @brief Runs the firmware main loop for the specified time.
+ * @param ms duration (in ms)
+ */
+void sim_run(uint32_t ms);
+
+/**
+ * @brief Runs the firmware main loop until the condition is met.
+ * @param condition condition, checked after each main loop iteration
+ * @param timeout_ms maximum duration (in ms)
+ * @return `true` if the condition has been met, `false` on timeout
+ */
+bool sim_run_until(const std::function<bool()> &condition, uint32_t timeout_ms);
+
+/**
+ * @brief Gets the simulated time.
+ * @return time since the last reset (in ns)
+ */
+uint64_t sim_time();
+
+// --- Host (USB side) -------------------------------------------------------
+
+/**
+ * @brief Executes a control transfer (runs the firmware until it has completed).
+ * @param bmRequestType request type
+ * @param bRequest request
+ * @param wValue value
+ * @param wIndex index
+ * @param data data to send (OUT) or buffer for the received data (IN)
+ * @param wLength length of data stage
+ * @param actual_len receives the number of received bytes (IN, may be `nullptr`)
+ * @return `true` if the transfer has succeeded, `false` if it has been stalled or has timed out
+ */
+bool sim_host_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+    void *data, uint16_t wLength, uint16_t *actual_len = nullptr);
+
+/**
+ * @brief Sets the line coding (CDC SET_LINE_CODING request).
+ * @return `true` if the request has succeeded
+ */
+bool sim_host_set_line_coding(uint32_t baudrate, uint8_t databits, uint8_t stopbits, uint8_t parity);
+
+/**
+ * @brief Sets a vendor-specific serial port parameter.
+ * @return `true` if the request has succeeded
+ */
+bool sim_host_set_param(usb_serial_param param, uint32_t value);
+
+/**
+ * @brief Gets a vendor-specific serial port parameter.
+ * @return `true` if the request has succeeded
+ */
+bool sim_host_get_param(usb_serial_param param, uint32_t *value);
+
+/**
+ * @brief Sets DTR and RTS (CDC SET_CONTROL_LINE_STATE request).
+ * @return `true` if the request has succeeded
+ */
+bool sim_host_set_control_lines(bool dtr, bool rts);
+
+/**
+ * @brief Queues data for transmission on the bulk OUT endpoint.
+ */
+void sim_host_write(const uint8_t *data, size_t len);
+
+/// Gets the number of bytes queued but not yet accepted by the device
+size_t sim_host_write_pending();
+
+/**
+ * @brief Starts or stops reading from the bulk IN endpoint (no IN tokens while stopped).
+ */
+void sim_host_set_reading(bool reading);
+
+/// Bytes sent to the device (time stamp: OUT transaction, when the device sees the packet)
+const sim_byte_log &sim_host_sent();
+
+/// Bytes received from the device (time stamp: end of the IN transaction)
+const sim_byte_log &sim_host_received();
+
+/// Bulk IN packets received (incl. zero-length packets)
+const std::vector<sim_packet> &sim_host_in_packets();
+
+/// SERIAL_STATE notifications received
+const std::vector<sim_packet> &sim_host_serial_states();
+
+/// Telemetry notification received from the device (see `TELEMETRY_ENABLE`)
+struct sim_telemetry
+{
+    /// Time stamp (in ns)
+    uint64_t time;
+    /// Sequence number (`wValue`)
+    uint16_t seq;
+    /// Telemetry record
+    usb_serial_telemetry record;
+};
+
+/// Telemetry notifications received
+const std::vector<sim_telemetry> &sim_host_telemetry();
+
+/// Clears the logs of the host
+void sim_host_clear();
+
+// --- Peer (UART side) ------------------------------------------------------
+
+/**
+ * @brief Queues data for transmission to the device at line rate.
+ * @param data data
+ * @param len data length
+ * @param gap_ns idle time between bytes (in ns)
+ */
+void sim_peer_send(const uint8_t *data, size_t len, uint32_t gap_ns = 0);
+
+/// Gets the number of bytes queued but not yet transmitted
+size_t sim_peer_send_pending();
+
+/**
+ * @brief Configures if the peer honors the RTS signal of the device.
+ * @param honor_rts `true` to stop sending while RTS is deasserted
+ * @param overshoot number of bytes still sent after RTS has been deasserted
+ */
+void sim_peer_set_flow_control(bool honor_rts, int overshoot);
+
+/**
+ * @brief Sets the peer's RTS signal (CTS input of the device).
+ * @param asserted `true` if the peer is ready to receive
+ */
+void sim_peer_set_rts(bool asserted);
+
+/// Sends all received bytes back to the device (loopback)
+void sim_peer_set_echo(bool echo);
+
+/**
+ * @brief Marks the next bytes sent by the peer as erroneous.
+ * @param flags `USART_ISR_PE` and/or `USART_ISR_FE`
+ * @param count number of bytes
+ */
+void sim_peer_inject_errors(uint32_t flags, int count);
+
+/// Bytes transmitted by the peer (time stamp: end of stop bit)
+const sim_byte_log &sim_peer_sent();
+
+/// Bytes received by the peer (time stamp: end of stop bit)
+const sim_byte_log &sim_peer_received();
+
+/// Clears the logs of the peer
+void sim_peer_clear();
+
+/// Indicates if the device asserts RTS (ready to receive)
+bool sim_device_rts_asserted();
+
+/// Indicates if the device holds the target MCU in reset (NRST pin low, see `TARGET_CTRL_ENABLE`)
+bool sim_target_in_reset();
+
+/// Indicates if the device asserts BOOT0 of the target MCU (see `TARGET_CTRL_ENABLE`)
+bool sim_target_boot0_asserted();
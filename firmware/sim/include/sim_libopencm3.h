@@ -0,0 +1,411 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: subset of the libopencm3 API used by the firmware (STM32F0)
+ *
+ * The firmware is compiled unchanged against these declarations. Registers
+ * are backed by the simulated register model (see sim_registers.cpp) and the
+ * library functions are implemented by the simulated peripherals.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(STM32F0)
+#error "The simulation only models the STM32F0 family (define STM32F0)"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// --- Register access ------------------------------------------------------
+
+/// Returns the storage of the simulated register at the specified address (aborts if unmapped)
+volatile uint32_t *sim_mmio32(uintptr_t addr);
+
+#define MMIO8(addr) (*(volatile uint8_t *)sim_mmio32((uintptr_t)(addr)))
+#define MMIO16(addr) (*(volatile uint16_t *)sim_mmio32((uintptr_t)(addr)))
+#define MMIO32(addr) (*sim_mmio32((uintptr_t)(addr)))
+
+#define BIT0 (1 << 0)
+
+// --- Memory map -----------------------------------------------------------
+
+#define PERIPH_BASE 0x40000000U
+#define IOPORT_BASE 0x48000000U
+#define PPBI_BASE 0xE0000000U
+#define SCS_BASE (PPBI_BASE + 0xE000)
+
+#define TIM2_BASE (PERIPH_BASE + 0x0000)
+#define TIM3_BASE (PERIPH_BASE + 0x0400)
+#define USART2_BASE (PERIPH_BASE + 0x4400)
+#define USART3_BASE (PERIPH_BASE + 0x4800)
+#define USART4_BASE (PERIPH_BASE + 0x4C00)
+#define USB_DEV_FS_BASE (PERIPH_BASE + 0x5C00)
+#define CRS_BASE (PERIPH_BASE + 0x6C00)
+#define SYSCFG_COMP_BASE (PERIPH_BASE + 0x10000)
+#define USART1_BASE (PERIPH_BASE + 0x13800)
+#define USART5_BASE (PERIPH_BASE + 0x15000)
+#define USART6_BASE (PERIPH_BASE + 0x11400)
+#define DMA1_BASE (PERIPH_BASE + 0x20000)
+#define DMA2_BASE (PERIPH_BASE + 0x20400)
+#define RCC_BASE (PERIPH_BASE + 0x21000)
+#define FLASH_MEM_INTERFACE_BASE (PERIPH_BASE + 0x22000)
+#define CRC_BASE (PERIPH_BASE + 0x23000)
+#define GPIO_PORT_A_BASE (IOPORT_BASE + 0x0000)
+#define GPIO_PORT_B_BASE (IOPORT_BASE + 0x0400)
+#define GPIO_PORT_C_BASE (IOPORT_BASE + 0x0800)
+#define GPIO_PORT_F_BASE (IOPORT_BASE + 0x1400)
+#define DESIG_UNIQUE_ID_BASE 0x1FFFF7AC
+
+/// Simulated USB packet memory (1024 bytes, accessed through half words by the CPU)
+extern uint8_t sim_pma[1024];
+#define USB_PMA_BASE ((uintptr_t)sim_pma)
+
+// --- NVIC / cortex ---------------------------------------------------------
+
+#define NVIC_DMA1_CHANNEL1_IRQ 9
+#define NVIC_DMA1_CHANNEL2_3_DMA2_CHANNEL1_2_IRQ 10
+#define NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ 11
+#define NVIC_USART1_IRQ 27
+#define NVIC_USART2_IRQ 28
+#define NVIC_USB_IRQ 31
+#define NVIC_IRQ_COUNT 32
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_disable_irq(uint8_t irqn);
+uint8_t nvic_get_irq_enabled(uint8_t irqn);
+void nvic_set_priority(uint8_t irqn, uint8_t priority);
+
+void dma1_channel1_isr(void);
+void dma1_channel2_3_dma2_channel1_2_isr(void);
+void dma1_channel4_7_dma2_channel3_5_isr(void);
+void usb_isr(void);
+
+void cm_enable_interrupts(void);
+void cm_disable_interrupts(void);
+bool cm_is_masked_interrupts(void);
+bool cm_mask_interrupts(bool mask);
+
+// --- SysTick ---------------------------------------------------------------
+
+#define STK_CSR MMIO32(SCS_BASE + 0x10)
+#define STK_RVR MMIO32(SCS_BASE + 0x14)
+#define STK_CVR MMIO32(SCS_BASE + 0x18)
+
+#define STK_CSR_CLKSOURCE_AHB_DIV8 (0 << 2)
+#define STK_CSR_CLKSOURCE_AHB (1 << 2)
+
+void systick_set_clocksource(uint8_t clocksource);
+void systick_set_reload(uint32_t value);
+void systick_interrupt_enable(void);
+void systick_counter_enable(void);
+uint32_t systick_get_value(void);
+
+// --- RCC / flash / CRS / SYSCFG -------------------------------------------
+
+#define RCC_CR MMIO32(RCC_BASE + 0x00)
+#define RCC_CR_HSEBYP (1 << 18)
+
+enum rcc_osc {
+    RCC_HSI14, RCC_HSI, RCC_HSE, RCC_PLL, RCC_LSI, RCC_LSE, RCC_HSI48
+};
+
+enum rcc_periph_clken {
+    RCC_DMA, RCC_DMA1, RCC_CRC, RCC_GPIOA, RCC_GPIOB, RCC_GPIOC, RCC_GPIOF,
+    RCC_SYSCFG_COMP, RCC_USART1, RCC_USART2, RCC_USART3, RCC_USB, RCC_CRS,
+    RCC_TIM2, RCC_TIM3
+};
+
+enum rcc_periph_rst {
+    RST_USART1, RST_USART2, RST_USB, RST_CRC, RST_DMA
+};
+
+extern uint32_t rcc_ahb_frequency;
+extern uint32_t rcc_apb1_frequency;
+extern uint32_t rcc_apb2_frequency;
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+void rcc_periph_reset_pulse(enum rcc_periph_rst rst);
+void rcc_set_usbclk_source(enum rcc_osc clk);
+void rcc_clock_setup_in_hsi48_out_48mhz(void);
+
+#define FLASH_ACR_LATENCY_000_024MHZ 0
+#define FLASH_ACR_LATENCY_024_048MHZ 1
+
+void flash_prefetch_enable(void);
+void flash_set_ws(uint32_t ws);
+
+void crs_autotrim_usb_enable(void);
+
+#define SYSCFG_CFGR1 MMIO32(SYSCFG_COMP_BASE + 0x00)
+#define SYSCFG_CFGR1_PA11_PA12_RMP (1 << 4)
+
+// --- GPIO ------------------------------------------------------------------
+
+#define GPIOA GPIO_PORT_A_BASE
+#define GPIOB GPIO_PORT_B_BASE
+#define GPIOC GPIO_PORT_C_BASE
+#define GPIOF GPIO_PORT_F_BASE
+
+#define GPIO0 (1 << 0)
+#define GPIO1 (1 << 1)
+#define GPIO2 (1 << 2)
+#define GPIO3 (1 << 3)
+#define GPIO4 (1 << 4)
+#define GPIO5 (1 << 5)
+#define GPIO6 (1 << 6)
+#define GPIO7 (1 << 7)
+#define GPIO8 (1 << 8)
+#define GPIO9 (1 << 9)
+#define GPIO10 (1 << 10)
+#define GPIO11 (1 << 11)
+#define GPIO12 (1 << 12)
+#define GPIO13 (1 << 13)
+#define GPIO14 (1 << 14)
+#define GPIO15 (1 << 15)
+
+#define GPIO_MODER(port) MMIO32((port) + 0x00)
+#define GPIO_IDR(port) MMIO32((port) + 0x10)
+#define GPIO_ODR(port) MMIO32((port) + 0x14)
+
+#define GPIO_MODE_INPUT 0x00
+#define GPIO_MODE_OUTPUT 0x01
+#define GPIO_MODE_AF 0x02
+#define GPIO_MODE_ANALOG 0x03
+
+#define GPIO_PUPD_NONE 0x00
+#define GPIO_PUPD_PULLUP 0x01
+#define GPIO_PUPD_PULLDOWN 0x02
+
+#define GPIO_OTYPE_PP 0x00
+#define GPIO_OTYPE_OD 0x01
+
+#define GPIO_OSPEED_LOW 0x00
+#define GPIO_OSPEED_MED 0x01
+#define GPIO_OSPEED_HIGH 0x03
+
+#define GPIO_AF0 0x00
+#define GPIO_AF1 0x01
+#define GPIO_AF2 0x02
+
+void gpio_set(uint32_t gpioport, uint16_t gpios);
+void gpio_clear(uint32_t gpioport, uint16_t gpios);
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios);
+void gpio_toggle(uint32_t gpioport, uint16_t gpios);
+void gpio_mode_setup(uint32_t gpioport, uint8_t mode, uint8_t pull_up_down, uint16_t gpios);
+void gpio_set_output_options(uint32_t gpioport, uint8_t otype, uint8_t speed, uint16_t gpios);
+void gpio_set_af(uint32_t gpioport, uint8_t alt_func_num, uint16_t gpios);
+
+// --- USART (STM32F0 register layout) --------------------------------------
+
+#define USART1 USART1_BASE
+#define USART2 USART2_BASE
+#define USART3 USART3_BASE
+#define USART4 USART4_BASE
+#define USART5 USART5_BASE
+#define USART6 USART6_BASE
+
+#define USART_CR1(usart_base) MMIO32((usart_base) + 0x00)
+#define USART_CR2(usart_base) MMIO32((usart_base) + 0x04)
+#define USART_CR3(usart_base) MMIO32((usart_base) + 0x08)
+#define USART_BRR(usart_base) MMIO32((usart_base) + 0x0c)
+#define USART_ISR(usart_base) MMIO32((usart_base) + 0x1c)
+#define USART_ICR(usart_base) MMIO32((usart_base) + 0x20)
+#define USART_RDR(usart_base) MMIO32((usart_base) + 0x24)
+#define USART_TDR(usart_base) MMIO32((usart_base) + 0x28)
+
+#define USART_CR1_UE (1 << 0)
+#define USART_CR1_RE (1 << 2)
+#define USART_CR1_TE (1 << 3)
+#define USART_CR1_IDLEIE (1 << 4)
+#define USART_CR1_RXNEIE (1 << 5)
+#define USART_CR1_TCIE (1 << 6)
+#define USART_CR1_TXEIE (1 << 7)
+#define USART_CR1_PS (1 << 9)
+#define USART_CR1_PCE (1 << 10)
+#define USART_CR1_M0 (1 << 12)
+#define USART_CR1_M USART_CR1_M0
+#define USART_CR1_OVER8 (1 << 15)
+
+#define USART_CR2_STOPBITS_SHIFT 12
+#define USART_CR2_STOPBITS_MASK (3 << USART_CR2_STOPBITS_SHIFT)
+
+#define USART_CR3_EIE (1 << 0)
+#define USART_CR3_DMAR (1 << 6)
+#define USART_CR3_DMAT (1 << 7)
+#define USART_CR3_RTSE (1 << 8)
+#define USART_CR3_CTSE (1 << 9)
+#define USART_CR3_OVRDIS (1 << 12)
+
+#define USART_ISR_PE (1 << 0)
+#define USART_ISR_FE (1 << 1)
+#define USART_ISR_NF (1 << 2)
+#define USART_ISR_ORE (1 << 3)
+#define USART_ISR_IDLE (1 << 4)
+#define USART_ISR_RXNE (1 << 5)
+#define USART_ISR_TC (1 << 6)
+#define USART_ISR_TXE (1 << 7)
+
+#define USART_ICR_PECF (1 << 0)
+#define USART_ICR_FECF (1 << 1)
+#define USART_ICR_NCF (1 << 2)
+#define USART_ICR_ORECF (1 << 3)
+#define USART_ICR_IDLECF (1 << 4)
+#define USART_ICR_TCCF (1 << 6)
+
+#define USART_STOPBITS_1 (0 << USART_CR2_STOPBITS_SHIFT)
+#define USART_STOPBITS_0_5 (1 << USART_CR2_STOPBITS_SHIFT)
+#define USART_STOPBITS_2 (2 << USART_CR2_STOPBITS_SHIFT)
+#define USART_STOPBITS_1_5 (3 << USART_CR2_STOPBITS_SHIFT)
+
+#define USART_PARITY_NONE 0
+#define USART_PARITY_EVEN USART_CR1_PCE
+#define USART_PARITY_ODD (USART_CR1_PS | USART_CR1_PCE)
+#define USART_PARITY_MASK (USART_CR1_PS | USART_CR1_PCE)
+
+#define USART_MODE_RX USART_CR1_RE
+#define USART_MODE_TX USART_CR1_TE
+#define USART_MODE_TX_RX (USART_CR1_RE | USART_CR1_TE)
+#define USART_MODE_MASK (USART_CR1_RE | USART_CR1_TE)
+
+#define USART_FLOWCONTROL_NONE 0
+#define USART_FLOWCONTROL_RTS USART_CR3_RTSE
+#define USART_FLOWCONTROL_CTS USART_CR3_CTSE
+#define USART_FLOWCONTROL_RTS_CTS (USART_CR3_RTSE | USART_CR3_CTSE)
+#define USART_FLOWCONTROL_MASK (USART_CR3_RTSE | USART_CR3_CTSE)
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud);
+void usart_set_databits(uint32_t usart, uint32_t bits);
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits);
+void usart_set_parity(uint32_t usart, uint32_t parity);
+void usart_set_mode(uint32_t usart, uint32_t mode);
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol);
+void usart_enable(uint32_t usart);
+void usart_disable(uint32_t usart);
+void usart_enable_rx_dma(uint32_t usart);
+void usart_disable_rx_dma(uint32_t usart);
+void usart_enable_tx_dma(uint32_t usart);
+void usart_disable_tx_dma(uint32_t usart);
+
+// --- DMA (STM32F0 register layout) ----------------------------------------
+
+#define DMA1 DMA1_BASE
+#define DMA2 DMA2_BASE
+
+#define DMA_CHANNEL1 1
+#define DMA_CHANNEL2 2
+#define DMA_CHANNEL3 3
+#define DMA_CHANNEL4 4
+#define DMA_CHANNEL5 5
+#define DMA_CHANNEL6 6
+#define DMA_CHANNEL7 7
+
+#define DMA_ISR(dma_base) MMIO32((dma_base) + 0x00)
+#define DMA_IFCR(dma_base) MMIO32((dma_base) + 0x04)
+#define DMA_CCR(dma_base, channel) MMIO32((dma_base) + 0x08 + 0x14 * ((channel) - 1))
+#define DMA_CNDTR(dma_base, channel) MMIO32((dma_base) + 0x0c + 0x14 * ((channel) - 1))
+#define DMA_CPAR(dma_base, channel) MMIO32((dma_base) + 0x10 + 0x14 * ((channel) - 1))
+#define DMA_CMAR(dma_base, channel) MMIO32((dma_base) + 0x14 + 0x14 * ((channel) - 1))
+
+#define DMA_GIF (1 << 0)
+#define DMA_TCIF (1 << 1)
+#define DMA_HTIF (1 << 2)
+#define DMA_TEIF (1 << 3)
+#define DMA_IFLAGS (DMA_TEIF | DMA_HTIF | DMA_TCIF | DMA_GIF)
+#define DMA_FLAG_OFFSET(channel) (4 * ((channel) - 1))
+
+#define DMA_CCR_EN (1 << 0)
+#define DMA_CCR_TCIE (1 << 1)
+#define DMA_CCR_HTIE (1 << 2)
+#define DMA_CCR_TEIE (1 << 3)
+#define DMA_CCR_DIR (1 << 4)
+#define DMA_CCR_CIRC (1 << 5)
+#define DMA_CCR_PINC (1 << 6)
+#define DMA_CCR_MINC (1 << 7)
+#define DMA_CCR_PSIZE_8BIT (0 << 8)
+#define DMA_CCR_PSIZE_16BIT (1 << 8)
+#define DMA_CCR_PSIZE_32BIT (2 << 8)
+#define DMA_CCR_PSIZE_MASK (3 << 8)
+#define DMA_CCR_MSIZE_8BIT (0 << 10)
+#define DMA_CCR_MSIZE_16BIT (1 << 10)
+#define DMA_CCR_MSIZE_32BIT (2 << 10)
+#define DMA_CCR_MSIZE_MASK (3 << 10)
+#define DMA_CCR_PL_LOW (0 << 12)
+#define DMA_CCR_PL_MEDIUM (1 << 12)
+#define DMA_CCR_PL_HIGH (2 << 12)
+#define DMA_CCR_PL_VERY_HIGH (3 << 12)
+#define DMA_CCR_PL_MASK (3 << 12)
+#define DMA_CCR_MEM2MEM (1 << 14)
+
+void dma_channel_reset(uint32_t dma, uint8_t channel);
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts);
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts);
+void dma_enable_mem2mem_mode(uint32_t dma, uint8_t channel);
+void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio);
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size);
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size);
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel);
+void dma_enable_peripheral_increment_mode(uint32_t dma, uint8_t channel);
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel);
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel);
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel);
+void dma_enable_transfer_error_interrupt(uint32_t dma, uint8_t channel);
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel);
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel);
+void dma_enable_channel(uint32_t dma, uint8_t channel);
+void dma_disable_channel(uint32_t dma, uint8_t channel);
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address);
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address);
+uint16_t dma_get_number_of_data(uint32_t dma, uint8_t channel);
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number);
+
+// --- CRC (STM32F0 register layout) ----------------------------------------
+
+#define CRC_CR MMIO32(CRC_BASE + 0x08)
+#define CRC_INIT MMIO32(CRC_BASE + 0x10)
+
+#define CRC_CR_RESET (1 << 0)
+#define CRC_CR_REV_OUT (1 << 7)
+#define CRC_CR_REV_IN_SHIFT 5
+#define CRC_CR_REV_IN_MASK 0x3
+#define CRC_CR_REV_IN_NONE 0x0
+#define CRC_CR_REV_IN_BYTE 0x1
+#define CRC_CR_REV_IN_HALF 0x2
+#define CRC_CR_REV_IN_WORD 0x3
+
+void crc_reset(void);
+void crc_set_reverse_input(uint32_t reverse_in);
+void crc_reverse_output_enable(void);
+void crc_reverse_output_disable(void);
+void crc_set_initial(uint32_t crcinit);
+
+/// Writes 8 or 32 bits to the CRC data register (processed by the CRC model)
+void sim_crc_write(uint32_t data, int bits);
+/// Reads the CRC data register
+uint32_t sim_crc_read(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+// The CRC data register processes each write, so it is accessed through a proxy
+template <int Bits>
+struct sim_crc_data_register
+{
+    void operator=(uint32_t data) const { sim_crc_write(data, Bits); }
+    operator uint32_t() const { return sim_crc_read(); }
+};
+
+#define CRC_DR (sim_crc_data_register<32>())
+#define CRC_DR8 (sim_crc_data_register<8>())
+#endif
@@ -0,0 +1,430 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: time base, NVIC, clocks, GPIO and firmware life cycle
+ *
+ * Replaces common.cpp: millis(), clock_ticks() and micros() are derived from the
+ * simulated time and delay() advances it (executing interrupt handlers).
+ */
+
+#include "sim_internal.h"
+#include "boot_timing.h"
+#include "common.h"
+#include "hardware.h"
+#include "perf_counters.h"
+#include "target_ctrl.h"
+#include "uart.h"
+#include "usb_cdc.h"
+#include "usb_serial.h"
+#include "qsb_device.h"
+#include <algorithm>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint64_t sim_now;
+sim_config sim_cfg;
+
+uint32_t rcc_ahb_frequency;
+uint32_t rcc_apb1_frequency;
+uint32_t rcc_apb2_frequency;
+
+// Maximum number of consecutive executions of an interrupt handler
+static const int MAX_ISR_REENTRIES = 1000;
+
+// Serial number reported by the simulated device
+static const char SIM_SERIAL_NUM[] = "SIM000000001";
+
+static uint32_t nvic_enabled;
+static bool interrupts_masked;
+
+void sim_fatal(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "simulation error at %.3f ms: ", sim_now / (double)SIM_PS_PER_MS);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+    abort();
+}
+
+// Number of system clock cycles since reset
+static uint64_t clock_cycles()
+{
+    return (uint64_t)((unsigned __int128)sim_now * rcc_ahb_frequency / (SIM_PS_PER_MS * 1000));
+}
+
+// Updates the SysTick counter (counts down from STK_RVR once per ms)
+static void update_systick()
+{
+    uint32_t ticks_per_ms = STK_RVR + 1;
+    STK_CVR = STK_RVR - (uint32_t)(clock_cycles() % ticks_per_ms);
+}
+
+// Processes all events due and the resulting interrupts
+static void process_events()
+{
+    sim_registers_apply_writes();
+    sim_uart_update();
+    sim_usb_update();
+    sim_nvic_run_pending();
+    // the interrupt handlers might have started new transfers
+    sim_uart_update();
+}
+
+void sim_advance(uint64_t duration)
+{
+    uint64_t target = sim_now + duration;
+    while (true) {
+        process_events();
+
+        uint64_t next = std::min(sim_uart_next_event(), sim_usb_next_event());
+        if (next <= sim_now)
+            next = sim_now + 1;
+        if (next > target)
+            break;
+        sim_now = next;
+    }
+    sim_now = target;
+    update_systick();
+}
+
+// --- NVIC / cortex -----------------------------------------------------------------
+
+extern "C" {
+
+__attribute__((weak)) void dma1_channel1_isr(void)
+{
+}
+
+__attribute__((weak)) void dma1_channel2_3_dma2_channel1_2_isr(void)
+{
+}
+
+__attribute__((weak)) void dma1_channel4_7_dma2_channel3_5_isr(void)
+{
+}
+
+__attribute__((weak)) void usb_isr(void)
+{
+}
+
+}
+
+static void run_isr(int irq)
+{
+    switch (irq) {
+    case NVIC_DMA1_CHANNEL1_IRQ:
+        dma1_channel1_isr();
+        break;
+    case NVIC_DMA1_CHANNEL2_3_DMA2_CHANNEL1_2_IRQ:
+        dma1_channel2_3_dma2_channel1_2_isr();
+        break;
+    case NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ:
+        dma1_channel4_7_dma2_channel3_5_isr();
+        break;
+    default:
+        sim_fatal("interrupt %d not simulated", irq);
+    }
+}
+
+void sim_nvic_run_pending()
+{
+    if (interrupts_masked)
+        return;
+
+    for (int i = 0; i < MAX_ISR_REENTRIES; i++) {
+        uint32_t pending = sim_dma_pending_irqs() & nvic_enabled;
+        if (pending == 0)
+            return;
+        run_isr(__builtin_ctz(pending));
+    }
+    sim_fatal("interrupt handler does not clear the interrupt flags");
+}
+
+void nvic_enable_irq(uint8_t irqn)
+{
+    nvic_enabled |= 1u << irqn;
+}
+
+void nvic_disable_irq(uint8_t irqn)
+{
+    nvic_enabled &= ~(1u << irqn);
+}
+
+uint8_t nvic_get_irq_enabled(uint8_t irqn)
+{
+    return (nvic_enabled >> irqn) & 1;
+}
+
+void nvic_set_priority(uint8_t, uint8_t)
+{
+}
+
+void cm_enable_interrupts(void)
+{
+    interrupts_masked = false;
+}
+
+void cm_disable_interrupts(void)
+{
+    interrupts_masked = true;
+}
+
+bool cm_is_masked_interrupts(void)
+{
+    return interrupts_masked;
+}
+
+bool cm_mask_interrupts(bool mask)
+{
+    bool old = interrupts_masked;
+    interrupts_masked = mask;
+    return old;
+}
+
+// --- SysTick -----------------------------------------------------------------------
+
+void systick_set_clocksource(uint8_t clocksource)
+{
+    STK_CSR = (STK_CSR & ~STK_CSR_CLKSOURCE_AHB) | clocksource;
+}
+
+void systick_set_reload(uint32_t value)
+{
+    STK_RVR = value & 0xffffff;
+}
+
+void systick_interrupt_enable(void)
+{
+    STK_CSR |= 1 << 1;
+}
+
+void systick_counter_enable(void)
+{
+    STK_CSR |= 1 << 0;
+}
+
+uint32_t systick_get_value(void)
+{
+    return STK_CVR;
+}
+
+// --- RCC / flash / CRS -------------------------------------------------------------
+
+void rcc_periph_clock_enable(enum rcc_periph_clken)
+{
+}
+
+void rcc_periph_reset_pulse(enum rcc_periph_rst rst)
+{
+    if (rst == RST_USB)
+        sim_usb_periph_reset();
+}
+
+void rcc_set_usbclk_source(enum rcc_osc)
+{
+}
+
+void rcc_clock_setup_in_hsi48_out_48mhz(void)
+{
+    rcc_ahb_frequency = 48000000;
+    rcc_apb1_frequency = 48000000;
+    rcc_apb2_frequency = 48000000;
+}
+
+void flash_prefetch_enable(void)
+{
+}
+
+void flash_set_ws(uint32_t)
+{
+}
+
+void crs_autotrim_usb_enable(void)
+{
+}
+
+// --- GPIO --------------------------------------------------------------------------
+
+// Outputs are read back through the input data register
+static void set_odr(uint32_t gpioport, uint32_t odr)
+{
+    GPIO_ODR(gpioport) = odr;
+    GPIO_IDR(gpioport) = odr;
+}
+
+void gpio_set(uint32_t gpioport, uint16_t gpios)
+{
+    set_odr(gpioport, GPIO_ODR(gpioport) | gpios);
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios)
+{
+    set_odr(gpioport, GPIO_ODR(gpioport) & ~gpios);
+}
+
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios)
+{
+    return GPIO_IDR(gpioport) & gpios;
+}
+
+void gpio_toggle(uint32_t gpioport, uint16_t gpios)
+{
+    set_odr(gpioport, GPIO_ODR(gpioport) ^ gpios);
+}
+
+void gpio_mode_setup(uint32_t gpioport, uint8_t mode, uint8_t, uint16_t gpios)
+{
+    uint32_t moder = GPIO_MODER(gpioport);
+    for (int i = 0; i < 16; i++) {
+        if ((gpios & (1 << i)) != 0)
+            moder = (moder & ~(3u << (2 * i))) | ((uint32_t)mode << (2 * i));
+    }
+    GPIO_MODER(gpioport) = moder;
+}
+
+void gpio_set_output_options(uint32_t, uint8_t, uint8_t, uint16_t)
+{
+}
+
+void gpio_set_af(uint32_t, uint8_t, uint16_t)
+{
+}
+
+bool sim_target_in_reset()
+{
+    return (GPIO_ODR(TARGET_CTRL_PORT) & TARGET_NRST_GPIO) == 0;
+}
+
+bool sim_target_boot0_asserted()
+{
+    return (GPIO_ODR(TARGET_CTRL_PORT) & TARGET_BOOT0_GPIO) != 0;
+}
+
+// --- common.h ----------------------------------------------------------------------
+
+void common_init()
+{
+    rcc_clock_setup_in_hsi48_out_48mhz();
+    systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+    systick_set_reload(rcc_ahb_frequency / 1000 - 1);
+    systick_interrupt_enable();
+    systick_counter_enable();
+    update_systick();
+}
+
+uint32_t millis()
+{
+    return (uint32_t)(sim_now / SIM_PS_PER_MS);
+}
+
+void delay(uint32_t ms)
+{
+    sim_advance(ms * SIM_PS_PER_MS);
+}
+
+bool has_expired(uint32_t timeout)
+{
+    return (int32_t)timeout - (int32_t)millis() <= 0;
+}
+
+uint32_t clock_ticks()
+{
+    return (uint32_t)clock_cycles();
+}
+
+uint32_t clock_ticks(uint32_t *ms, uint32_t *systick)
+{
+    update_systick();
+    *ms = millis();
+    *systick = STK_CVR;
+    return clock_ticks();
+}
+
+uint32_t micros()
+{
+    return (uint32_t)(sim_now / SIM_PS_PER_US);
+}
+
+// --- firmware life cycle -----------------------------------------------------------
+
+// One iteration of the firmware main loop (see main.cpp)
+static void run_loop_iteration()
+{
+    usb_cdc_poll();
+    usb_serial.poll();
+#if TARGET_CTRL == 1
+    target_ctrl.poll();
+#endif
+    sim_advance((uint64_t)sim_cfg.loop_cost_ns * SIM_PS_PER_NS);
+}
+
+void sim_reset(const sim_config &config)
+{
+    sim_cfg = config;
+    sim_now = 0;
+    nvic_enabled = 0;
+    interrupts_masked = false;
+    rcc_ahb_frequency = rcc_apb1_frequency = rcc_apb2_frequency = 8000000;
+
+    sim_registers_reset();
+    sim_dma_reset();
+    sim_uart_reset();
+    sim_crc_reset();
+    sim_usb_reset();
+    sim_usb_periph_reset();
+
+    // firmware state as after power-on
+    uart = uart_impl<uart_1_hw>();
+    usb_serial = usb_serial_impl<usb_serial_1_port>();
+    perf_counters = perf_counters_impl();
+    boot_timing = boot_timing_impl();
+#if TARGET_CTRL == 1
+    target_ctrl = target_ctrl_impl();
+#endif
+    usb_device = nullptr;
+
+    // initialization as in main()
+    common_init();
+    rcc_periph_clock_enable(RCC_GPIOA);
+    rcc_periph_clock_enable(RCC_GPIOB);
+#if TARGET_CTRL == 1
+    target_ctrl.init();
+#endif
+    usb_cdc_init();
+    strcpy(qsb_serial_num, SIM_SERIAL_NUM);
+    usb_serial.init();
+
+    if (!sim_run_until(sim_host_port_open, 2000))
+        sim_fatal("host has not opened the port");
+}
+
+void sim_run(uint32_t ms)
+{
+    uint64_t end = sim_now + ms * SIM_PS_PER_MS;
+    while (sim_now < end)
+        run_loop_iteration();
+}
+
+bool sim_run_until(const std::function<bool()> &condition, uint32_t timeout_ms)
+{
+    uint64_t end = sim_now + timeout_ms * SIM_PS_PER_MS;
+    while (!condition()) {
+        if (sim_now >= end)
+            return false;
+        run_loop_iteration();
+    }
+    return true;
+}
+
+uint64_t sim_time()
+{
+    return sim_now / SIM_PS_PER_NS;
+}
@@ -0,0 +1,98 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: CRC calculation unit (fixed polynomial 0x04C11DB7, 32 bits)
+ *
+ * Models the input and output bit reversal, the initial value and 8-bit and
+ * 32-bit writes to the data register. The reset bit in CRC_CR is applied on
+ * the next access to the data register.
+ */
+
+#include "sim_internal.h"
+#include <algorithm>
+
+static const uint32_t CRC_POLY = 0x04C11DB7;
+
+static uint32_t crc_value;
+
+static uint32_t reverse_bits(uint32_t value, int bits)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < bits; i++)
+        result |= ((value >> i) & 1) << (bits - 1 - i);
+    return result;
+}
+
+static void apply_reset()
+{
+    if ((CRC_CR & CRC_CR_RESET) == 0)
+        return;
+    CRC_CR = CRC_CR & ~CRC_CR_RESET;
+    crc_value = CRC_INIT;
+}
+
+// Reverses the bits of the written data in units of 8, 16 or 32 bits (REV_IN)
+static uint32_t reverse_input(uint32_t data, int bits)
+{
+    uint32_t rev_in = (CRC_CR >> CRC_CR_REV_IN_SHIFT) & CRC_CR_REV_IN_MASK;
+    if (rev_in == CRC_CR_REV_IN_NONE)
+        return data;
+    int unit = std::min(rev_in == CRC_CR_REV_IN_BYTE ? 8 : rev_in == CRC_CR_REV_IN_HALF ? 16 : 32, bits);
+    uint32_t result = 0;
+    for (int shift = 0; shift < bits; shift += unit)
+        result |= reverse_bits(data >> shift, unit) << shift;
+    return result;
+}
+
+void sim_crc_write(uint32_t data, int bits)
+{
+    apply_reset();
+    data = reverse_input(data, bits);
+
+    // most significant bit first
+    for (int i = bits - 1; i >= 0; i--) {
+        uint32_t bit = ((data >> i) ^ (crc_value >> 31)) & 1;
+        crc_value = (crc_value << 1) ^ (bit != 0 ? CRC_POLY : 0);
+    }
+}
+
+uint32_t sim_crc_read()
+{
+    apply_reset();
+    return (CRC_CR & CRC_CR_REV_OUT) != 0 ? reverse_bits(crc_value, 32) : crc_value;
+}
+
+void crc_reset()
+{
+    CRC_CR = CRC_CR | CRC_CR_RESET;
+}
+
+void crc_set_reverse_input(uint32_t reverse_in)
+{
+    CRC_CR = (CRC_CR & ~(CRC_CR_REV_IN_MASK << CRC_CR_REV_IN_SHIFT)) | (reverse_in << CRC_CR_REV_IN_SHIFT);
+}
+
+void crc_reverse_output_enable()
+{
+    CRC_CR = CRC_CR | CRC_CR_REV_OUT;
+}
+
+void crc_reverse_output_disable()
+{
+    CRC_CR = CRC_CR & ~CRC_CR_REV_OUT;
+}
+
+void crc_set_initial(uint32_t crcinit)
+{
+    CRC_INIT = crcinit;
+}
+
+void sim_crc_reset()
+{
+    crc_value = 0;
+    CRC_INIT = 0xffffffff;
+}
@@ -0,0 +1,310 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: DMA controller (DMA1, 7 channels)
+ *
+ * Peripheral transfers are triggered by the peripheral models (one item per
+ * request). CNDTR counts down with each transfer; the half transfer and
+ * transfer complete flags are set at half and zero count. Circular channels
+ * reload the count and addresses. Memory-to-memory transfers complete
+ * immediately when the channel is enabled.
+ */
+
+#include "sim_internal.h"
+#include <string.h>
+
+namespace {
+
+constexpr int NUM_CHANNELS = 7;
+
+/// Internal channel state (latched when the channel is enabled)
+struct dma_channel_state
+{
+    uint32_t reload;
+    uint32_t mem_addr;
+    uint32_t periph_addr;
+};
+
+dma_channel_state channels[NUM_CHANNELS + 1];
+
+// IRQ number of DMA1 channels on the STM32F0
+const uint8_t channel_irqs[NUM_CHANNELS + 1] = {
+    0,
+    NVIC_DMA1_CHANNEL1_IRQ,
+    NVIC_DMA1_CHANNEL2_3_DMA2_CHANNEL1_2_IRQ,
+    NVIC_DMA1_CHANNEL2_3_DMA2_CHANNEL1_2_IRQ,
+    NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ,
+    NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ,
+    NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ,
+    NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ,
+};
+
+void check_dma(uint32_t dma, uint8_t channel)
+{
+    if (dma != DMA1 || channel < 1 || channel > NUM_CHANNELS)
+        sim_fatal("DMA %08x channel %d not simulated", (unsigned)dma, channel);
+}
+
+void set_flags(int channel, uint32_t flags)
+{
+    DMA_ISR(DMA1) |= (flags | DMA_GIF) << DMA_FLAG_OFFSET(channel);
+}
+
+uint32_t item_size(uint32_t ccr, bool memory)
+{
+    uint32_t size = memory ? (ccr & DMA_CCR_MSIZE_MASK) >> 10 : (ccr & DMA_CCR_PSIZE_MASK) >> 8;
+    return 1 << size;
+}
+
+// Advances the channel after a transfer (addresses, count, flags, circular reload)
+void complete_item(int channel)
+{
+    uint32_t ccr = DMA_CCR(DMA1, channel);
+    dma_channel_state &state = channels[channel];
+    if ((ccr & DMA_CCR_MINC) != 0)
+        state.mem_addr += item_size(ccr, true);
+    if ((ccr & DMA_CCR_PINC) != 0)
+        state.periph_addr += item_size(ccr, false);
+
+    uint32_t count = DMA_CNDTR(DMA1, channel) - 1;
+    DMA_CNDTR(DMA1, channel) = count;
+    if (count == state.reload - state.reload / 2)
+        set_flags(channel, DMA_HTIF);
+    if (count == 0) {
+        set_flags(channel, DMA_TCIF);
+        if ((ccr & DMA_CCR_CIRC) != 0) {
+            DMA_CNDTR(DMA1, channel) = state.reload;
+            state.mem_addr = DMA_CMAR(DMA1, channel);
+            state.periph_addr = DMA_CPAR(DMA1, channel);
+        }
+    }
+}
+
+bool is_active(int channel)
+{
+    return (DMA_CCR(DMA1, channel) & DMA_CCR_EN) != 0 && DMA_CNDTR(DMA1, channel) != 0;
+}
+
+void copy_item(void *dst, const void *src, uint32_t dst_size, uint32_t src_size)
+{
+    // zero-extends or truncates (little endian)
+    uint32_t value = 0;
+    memcpy(&value, src, src_size);
+    memcpy(dst, &value, dst_size);
+}
+
+void run_mem2mem(int channel)
+{
+    uint32_t ccr = DMA_CCR(DMA1, channel);
+    uint32_t msize = item_size(ccr, true);
+    uint32_t psize = item_size(ccr, false);
+    bool from_memory = (ccr & DMA_CCR_DIR) != 0;
+    dma_channel_state &state = channels[channel];
+    while (is_active(channel)) {
+        void *mem = sim_host_pointer(state.mem_addr);
+        void *periph = sim_host_pointer(state.periph_addr);
+        if (from_memory)
+            copy_item(periph, mem, psize, msize);
+        else
+            copy_item(mem, periph, msize, psize);
+        complete_item(channel);
+        if ((ccr & DMA_CCR_CIRC) != 0)
+            break;
+    }
+}
+
+} // namespace
+
+void sim_dma_reset()
+{
+    memset(channels, 0, sizeof(channels));
+}
+
+int sim_dma_find_channel(volatile uint32_t *periph_reg, bool read_from_memory)
+{
+    // the DMA controller only keeps the lower 32 bits of the register address
+    uint32_t addr = (uint32_t)(uintptr_t)periph_reg;
+    for (int ch = 1; ch <= NUM_CHANNELS; ch++) {
+        uint32_t ccr = DMA_CCR(DMA1, ch);
+        if ((ccr & DMA_CCR_EN) == 0 || (ccr & DMA_CCR_MEM2MEM) != 0)
+            continue;
+        if (((ccr & DMA_CCR_DIR) != 0) != read_from_memory)
+            continue;
+        if (DMA_CPAR(DMA1, ch) == addr)
+            return ch;
+    }
+    return 0;
+}
+
+bool sim_dma_read_memory(int channel, uint8_t *data)
+{
+    if (!is_active(channel))
+        return false;
+    *data = *(uint8_t *)sim_host_pointer(channels[channel].mem_addr);
+    complete_item(channel);
+    return true;
+}
+
+bool sim_dma_write_memory(int channel, uint8_t data)
+{
+    if (!is_active(channel))
+        return false;
+    *(uint8_t *)sim_host_pointer(channels[channel].mem_addr) = data;
+    complete_item(channel);
+    return true;
+}
+
+uint32_t sim_dma_pending_irqs()
+{
+    uint32_t isr = DMA_ISR(DMA1);
+    uint32_t irqs = 0;
+    for (int ch = 1; ch <= NUM_CHANNELS; ch++) {
+        uint32_t ccr = DMA_CCR(DMA1, ch);
+        uint32_t flags = (isr >> DMA_FLAG_OFFSET(ch)) & DMA_IFLAGS;
+        uint32_t enabled = ((ccr & DMA_CCR_TCIE) != 0 ? DMA_TCIF : 0)
+            | ((ccr & DMA_CCR_HTIE) != 0 ? DMA_HTIF : 0)
+            | ((ccr & DMA_CCR_TEIE) != 0 ? DMA_TEIF : 0);
+        if ((flags & enabled) != 0)
+            irqs |= 1 << channel_irqs[ch];
+    }
+    return irqs;
+}
+
+// --- libopencm3 DMA functions ------------------------------------------------
+
+void dma_channel_reset(uint32_t dma, uint8_t channel)
+{
+    check_dma(dma, channel);
+    DMA_CCR(dma, channel) = 0;
+    DMA_CNDTR(dma, channel) = 0;
+    DMA_CPAR(dma, channel) = 0;
+    DMA_CMAR(dma, channel) = 0;
+    DMA_ISR(dma) &= ~(DMA_IFLAGS << DMA_FLAG_OFFSET(channel));
+}
+
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts)
+{
+    check_dma(dma, channel);
+    uint32_t isr = DMA_ISR(dma) & ~(interrupts << DMA_FLAG_OFFSET(channel));
+    // the global flag is the logical OR of the other flags
+    if (((isr >> DMA_FLAG_OFFSET(channel)) & (DMA_TCIF | DMA_HTIF | DMA_TEIF)) == 0)
+        isr &= ~(DMA_GIF << DMA_FLAG_OFFSET(channel));
+    DMA_ISR(dma) = isr;
+}
+
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts)
+{
+    check_dma(dma, channel);
+    return (DMA_ISR(dma) & (interrupts << DMA_FLAG_OFFSET(channel))) != 0;
+}
+
+void dma_enable_mem2mem_mode(uint32_t dma, uint8_t channel)
+{
+    DMA_CCR(dma, channel) |= DMA_CCR_MEM2MEM;
+    DMA_CCR(dma, channel) &= ~DMA_CCR_CIRC;
+}
+
+void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio)
+{
+    DMA_CCR(dma, channel) = (DMA_CCR(dma, channel) & ~DMA_CCR_PL_MASK) | prio;
+}
+
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size)
+{
+    DMA_CCR(dma, channel) = (DMA_CCR(dma, channel) & ~DMA_CCR_MSIZE_MASK) | mem_size;
+}
+
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size)
+{
+    DMA_CCR(dma, channel) = (DMA_CCR(dma, channel) & ~DMA_CCR_PSIZE_MASK) | peripheral_size;
+}
+
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel)
+{
+    DMA_CCR(dma, channel) |= DMA_CCR_MINC;
+}
+
+void dma_enable_peripheral_increment_mode(uint32_t dma, uint8_t channel)
+{
+    DMA_CCR(dma, channel) |= DMA_CCR_PINC;
+}
+
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel)
+{
+    DMA_CCR(dma, channel) |= DMA_CCR_CIRC;
+    DMA_CCR(dma, channel) &= ~DMA_CCR_MEM2MEM;
+}
+
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel)
+{
+    DMA_CCR(dma, channel) &= ~DMA_CCR_DIR;
+}
+
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel)
+{
+    DMA_CCR(dma, channel) |= DMA_CCR_DIR;
+}
+
+void dma_enable_transfer_error_interrupt(uint32_t dma, uint8_t channel)
+{
+    DMA_CCR(dma, channel) |= DMA_CCR_TEIE;
+}
+
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel)
+{
+    DMA_CCR(dma, channel) |= DMA_CCR_HTIE;
+}
+
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel)
+{
+    DMA_CCR(dma, channel) |= DMA_CCR_TCIE;
+}
+
+void dma_enable_channel(uint32_t dma, uint8_t channel)
+{
+    check_dma(dma, channel);
+    if ((DMA_CCR(dma, channel) & DMA_CCR_EN) != 0)
+        return;
+
+    dma_channel_state &state = channels[channel];
+    state.reload = DMA_CNDTR(dma, channel);
+    state.mem_addr = DMA_CMAR(dma, channel);
+    state.periph_addr = DMA_CPAR(dma, channel);
+    DMA_CCR(dma, channel) |= DMA_CCR_EN;
+
+    if ((DMA_CCR(dma, channel) & DMA_CCR_MEM2MEM) != 0)
+        run_mem2mem(channel);
+}
+
+void dma_disable_channel(uint32_t dma, uint8_t channel)
+{
+    check_dma(dma, channel);
+    DMA_CCR(dma, channel) &= ~DMA_CCR_EN;
+}
+
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address)
+{
+    if ((DMA_CCR(dma, channel) & DMA_CCR_EN) == 0)
+        DMA_CPAR(dma, channel) = address;
+}
+
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address)
+{
+    if ((DMA_CCR(dma, channel) & DMA_CCR_EN) == 0)
+        DMA_CMAR(dma, channel) = address;
+}
+
+uint16_t dma_get_number_of_data(uint32_t dma, uint8_t channel)
+{
+    return (uint16_t)DMA_CNDTR(dma, channel);
+}
+
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number)
+{
+    if ((DMA_CCR(dma, channel) & DMA_CCR_EN) == 0)
+        DMA_CNDTR(dma, channel) = number;
+}
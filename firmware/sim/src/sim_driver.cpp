@@ -0,0 +1,315 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: scripted traffic driver
+ *
+ * Runs a traffic script against the simulated device and reports throughput,
+ * latency and data integrity for each direction. Without a script file, the
+ * built-in benchmark script is run.
+ *
+ * Script commands (one per line, `#` starts a comment):
+ *
+ *   reset [baud=n] [loop_ns=n] [nak_retry_ns=n]   reset device, host opens port
+ *   line_coding <baud> [databits] [stopbits] [parity]
+ *   param <id> <value>                          vendor SET_PARAM request
+ *   host_write <bytes>                          host sends test data (bulk OUT)
+ *   host_reading <0|1>                          host issues IN tokens or not
+ *   peer_send <bytes> [gap_ns]                  peer sends test data (UART), then idles
+ *   peer_flow <honor_rts 0|1> [overshoot]       peer flow control behavior
+ *   peer_echo <0|1>                             peer echoes received data
+ *   run <ms>                                    run for the specified time
+ *   drain <ms>                                  run until all data has been delivered (or timeout)
+ *   report [label]                              print statistics since the last report
+ *
+ * Test data is a deterministic byte sequence (continued across commands),
+ * so data loss and reordering are detected.
+ */
+
+#ifndef PIO_UNIT_TESTING
+
+#include "sim.h"
+#include "perf_counters.h"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char BUILTIN_SCRIPT[] =
+    "# throughput in both directions\n"
+    "reset baud=1000000\n"
+    "host_write 100000\n"
+    "peer_send 100000\n"
+    "drain 5000\n"
+    "report duplex-1M\n"
+    "line_coding 6000000\n"
+    "host_write 100000\n"
+    "peer_send 100000\n"
+    "drain 5000\n"
+    "report duplex-6M\n"
+    "# latency of sporadic small messages\n"
+    "reset baud=1000000\n"
+    "peer_send 8 2000000\n"
+    "peer_send 8 2000000\n"
+    "peer_send 8 2000000\n"
+    "peer_send 8 2000000\n"
+    "drain 1000\n"
+    "report sporadic-1M\n"
+    "# RX flow control with a slow host\n"
+    "reset baud=2000000\n"
+    "peer_flow 1 2\n"
+    "host_reading 0\n"
+    "peer_send 20000\n"
+    "run 50\n"
+    "host_reading 1\n"
+    "drain 1000\n"
+    "report rx-flow-control\n";
+
+/// Generator of the deterministic test data for one direction
+struct test_stream
+{
+    uint32_t state = 1;
+
+    uint8_t next()
+    {
+        // xorshift32
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (uint8_t)state;
+    }
+
+    std::vector<uint8_t> generate(size_t len)
+    {
+        std::vector<uint8_t> data(len);
+        for (size_t i = 0; i < len; i++)
+            data[i] = next();
+        return data;
+    }
+};
+
+/// Statistics of one direction (source and sink log)
+struct direction_stats
+{
+    size_t bytes;
+    size_t errors;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    uint64_t latency_min_ns;
+    uint64_t latency_avg_ns;
+    uint64_t latency_max_ns;
+};
+
+test_stream host_stream;
+test_stream peer_stream;
+size_t host_reported;
+size_t peer_reported;
+int line_number;
+
+[[noreturn]] void script_error(const char *message)
+{
+    fprintf(stderr, "line %d: %s\n", line_number, message);
+    exit(1);
+}
+
+uint32_t parse_number(const std::string &text)
+{
+    char *end;
+    unsigned long value = strtoul(text.c_str(), &end, 0);
+    if (text.empty() || *end != 0)
+        script_error("invalid number");
+    return (uint32_t)value;
+}
+
+// Compares the received bytes (from `start`) with the sent bytes and computes the latency of each byte
+direction_stats analyze(const sim_byte_log &sent, const sim_byte_log &received, size_t start)
+{
+    direction_stats stats = {};
+    size_t end = std::min(sent.data.size(), received.data.size());
+    if (start >= end)
+        return stats;
+
+    uint64_t latency_sum = 0;
+    stats.latency_min_ns = UINT64_MAX;
+    for (size_t i = start; i < end; i++) {
+        if (sent.data[i] != received.data[i])
+            stats.errors++;
+        uint64_t latency = received.time[i] - sent.time[i];
+        latency_sum += latency;
+        stats.latency_min_ns = std::min(stats.latency_min_ns, latency);
+        stats.latency_max_ns = std::max(stats.latency_max_ns, latency);
+    }
+
+    stats.bytes = end - start;
+    stats.first_ns = sent.time[start];
+    stats.last_ns = received.time[end - 1];
+    stats.latency_avg_ns = latency_sum / stats.bytes;
+    return stats;
+}
+
+void print_stats(const char *label, const char *direction, const direction_stats &stats, size_t missing)
+{
+    double duration_s = (stats.last_ns - stats.first_ns) / 1e9;
+    double throughput = duration_s > 0 ? stats.bytes / duration_s / 1000 : 0;
+    printf("%-20s %-8s %8zu bytes %9.1f KB/s  latency min %7.1f avg %7.1f max %7.1f us  errors %zu  missing %zu\n",
+        label, direction, stats.bytes, throughput, stats.latency_min_ns / 1e3, stats.latency_avg_ns / 1e3,
+        stats.latency_max_ns / 1e3, stats.errors, missing);
+}
+
+void report(const char *label)
+{
+    const sim_byte_log &host_sent = sim_host_sent();
+    const sim_byte_log &peer_received = sim_peer_received();
+    const sim_byte_log &peer_sent = sim_peer_sent();
+    const sim_byte_log &host_received = sim_host_received();
+
+    direction_stats out = analyze(host_sent, peer_received, host_reported);
+    direction_stats in = analyze(peer_sent, host_received, peer_reported);
+    size_t out_missing = host_sent.data.size() + sim_host_write_pending() - host_reported - out.bytes;
+    size_t in_missing = peer_sent.data.size() + sim_peer_send_pending() - peer_reported - in.bytes;
+    print_stats(label, "host>uart", out, out_missing);
+    print_stats(label, "uart>host", in, in_missing);
+
+    size_t zlps = 0;
+    for (const sim_packet &packet : sim_host_in_packets())
+        zlps += packet.value == 0 ? 1 : 0;
+    printf("%-20s since reset: in_packets %zu zlps %zu out_pauses %u overruns %u notifications %zu\n", label,
+        sim_host_in_packets().size(), zlps, (unsigned)perf_counters.out_pauses, (unsigned)perf_counters.rx_overruns,
+        sim_host_serial_states().size());
+
+    host_reported += out.bytes;
+    peer_reported += in.bytes;
+}
+
+bool is_drained()
+{
+    return sim_host_write_pending() == 0 && sim_peer_send_pending() == 0
+        && sim_peer_received().data.size() >= sim_host_sent().data.size()
+        && sim_host_received().data.size() >= sim_peer_sent().data.size();
+}
+
+void reset(const std::vector<std::string> &args)
+{
+    sim_config config;
+    for (size_t i = 1; i < args.size(); i++) {
+        size_t eq = args[i].find('=');
+        if (eq == std::string::npos)
+            script_error("expected name=value");
+        std::string name = args[i].substr(0, eq);
+        uint32_t value = parse_number(args[i].substr(eq + 1));
+        if (name == "baud")
+            config.baudrate = value;
+        else if (name == "loop_ns")
+            config.loop_cost_ns = value;
+        else if (name == "nak_retry_ns")
+            config.nak_retry_ns = value;
+        else
+            script_error("unknown reset option");
+    }
+
+    sim_reset(config);
+    perf_counters.reset();
+    host_stream = test_stream();
+    peer_stream = test_stream();
+    host_reported = 0;
+    peer_reported = 0;
+}
+
+void execute(const std::vector<std::string> &args)
+{
+    const std::string &cmd = args[0];
+    auto arg = [&args](size_t index, uint32_t default_value) {
+        if (index < args.size())
+            return parse_number(args[index]);
+        if (default_value == UINT32_MAX)
+            script_error("missing argument");
+        return default_value;
+    };
+
+    if (cmd == "reset") {
+        reset(args);
+    } else if (cmd == "line_coding") {
+        if (!sim_host_set_line_coding(arg(1, UINT32_MAX), arg(2, 8), arg(3, 0), arg(4, 0)))
+            script_error("SET_LINE_CODING failed");
+    } else if (cmd == "param") {
+        if (!sim_host_set_param((usb_serial_param)arg(1, UINT32_MAX), arg(2, UINT32_MAX)))
+            script_error("SET_PARAM failed");
+    } else if (cmd == "host_write") {
+        std::vector<uint8_t> data = host_stream.generate(arg(1, UINT32_MAX));
+        sim_host_write(data.data(), data.size());
+    } else if (cmd == "host_reading") {
+        sim_host_set_reading(arg(1, UINT32_MAX) != 0);
+    } else if (cmd == "peer_send") {
+        std::vector<uint8_t> data = peer_stream.generate(arg(1, UINT32_MAX));
+        if (!data.empty()) {
+            sim_peer_send(data.data(), data.size() - 1);
+            sim_peer_send(&data.back(), 1, arg(2, 0));
+        }
+    } else if (cmd == "peer_flow") {
+        sim_peer_set_flow_control(arg(1, UINT32_MAX) != 0, arg(2, 0));
+    } else if (cmd == "peer_echo") {
+        sim_peer_set_echo(arg(1, UINT32_MAX) != 0);
+    } else if (cmd == "run") {
+        sim_run(arg(1, UINT32_MAX));
+    } else if (cmd == "drain") {
+        if (!sim_run_until(is_drained, arg(1, UINT32_MAX)))
+            printf("drain: timeout\n");
+    } else if (cmd == "report") {
+        report(args.size() > 1 ? args[1].c_str() : "report");
+    } else {
+        script_error("unknown command");
+    }
+}
+
+void run_script(FILE *file)
+{
+    char line[256];
+    line_number = 0;
+    bool is_reset = false;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment != nullptr)
+            *comment = 0;
+
+        std::vector<std::string> args;
+        for (char *token = strtok(line, " \t\r\n"); token != nullptr; token = strtok(nullptr, " \t\r\n"))
+            args.push_back(token);
+        if (args.empty())
+            continue;
+
+        if (!is_reset && args[0] != "reset")
+            script_error("script must start with 'reset'");
+        is_reset = true;
+        execute(args);
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    FILE *file;
+    if (argc > 1) {
+        file = fopen(argv[1], "r");
+        if (file == nullptr) {
+            perror(argv[1]);
+            return 1;
+        }
+    } else {
+        file = fmemopen((void *)BUILTIN_SCRIPT, sizeof(BUILTIN_SCRIPT) - 1, "r");
+    }
+
+    run_script(file);
+    fclose(file);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: interfaces between the simulated peripherals
+ */
+
+#pragma once
+
+#include "sim.h"
+#include <sim_libopencm3.h>
+#include <stdint.h>
+
+/// Time value meaning "no event scheduled"
+constexpr uint64_t SIM_NEVER = UINT64_MAX;
+
+constexpr uint64_t SIM_PS_PER_NS = 1000;
+constexpr uint64_t SIM_PS_PER_US = 1000000;
+constexpr uint64_t SIM_PS_PER_MS = 1000000000;
+
+/// Current simulated time (in ps)
+extern uint64_t sim_now;
+
+/// Active configuration
+extern sim_config sim_cfg;
+
+/**
+ * @brief Advances the simulated time, processing all peripheral events and pending interrupts.
+ * @param duration time to advance (in ps)
+ */
+void sim_advance(uint64_t duration);
+
+/// Aborts the simulation with an error message
+[[noreturn]] void sim_fatal(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// --- Register model (sim_registers.cpp) --------------------------------------
+
+/// Resets all registers to their reset values
+void sim_registers_reset();
+
+/// Applies pending writes to write-only registers with side effects (USART_ICR)
+void sim_registers_apply_writes();
+
+/// Converts a 32-bit address written to a DMA register to a host pointer
+void *sim_host_pointer(uint32_t address);
+
+// --- NVIC (sim_core.cpp) -----------------------------------------------------
+
+/// Executes pending interrupt handlers (DMA interrupts)
+void sim_nvic_run_pending();
+
+// --- DMA (sim_dma.cpp) -------------------------------------------------------
+
+void sim_dma_reset();
+
+/**
+ * @brief Finds the enabled DMA1 channel serving the peripheral register.
+ * @param periph_reg peripheral register
+ * @param read_from_memory `true` for memory to peripheral transfers
+ * @return channel number, or 0 if no channel is enabled
+ */
+int sim_dma_find_channel(volatile uint32_t *periph_reg, bool read_from_memory);
+
+/// Transfers a byte from memory to the peripheral register (returns `false` if the channel is done)
+bool sim_dma_read_memory(int channel, uint8_t *data);
+
+/// Transfers a byte from the peripheral register to memory (returns `false` if the channel is done)
+bool sim_dma_write_memory(int channel, uint8_t data);
+
+/// Gets the mask of IRQ numbers with a pending DMA interrupt
+uint32_t sim_dma_pending_irqs();
+
+// --- USART and peer (sim_uart.cpp) -------------------------------------------
+
+void sim_uart_reset();
+
+/// Processes the USART and peer events due (at `sim_now`)
+void sim_uart_update();
+
+/// Gets the time of the next USART or peer event
+uint64_t sim_uart_next_event();
+
+// --- CRC unit (sim_crc.cpp) ---------------------------------------------------
+
+void sim_crc_reset();
+
+// --- USB peripheral and host (sim_usb.cpp) -----------------------------------
+
+void sim_usb_reset();
+
+/// Resets the USB peripheral registers (RCC reset)
+void sim_usb_periph_reset();
+
+/// Processes the USB host events due (at `sim_now`)
+void sim_usb_update();
+
+/// Gets the time of the next USB host event
+uint64_t sim_usb_next_event();
+
+/// Indicates if the host has opened the port (enumeration and port setup complete)
+bool sim_host_port_open();
@@ -0,0 +1,99 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: register storage
+ *
+ * Peripheral registers are plain memory. Registers with side effects are
+ * handled by the peripheral models: they either update the registers
+ * eagerly (status registers), are written through library functions
+ * implemented by the models (DMA, USART configuration) or through the
+ * QSB write hooks (USB endpoint registers and USB_ISTR).
+ */
+
+#include "sim_internal.h"
+#include <string.h>
+
+// Peripherals on APB and AHB1 (0x4000 0000 to 0x4002 4000)
+static uint32_t periph_regs[0x24000 / 4];
+// GPIO ports on AHB2 (0x4800 0000 to 0x4800 1800)
+static uint32_t gpio_regs[0x1800 / 4];
+// System control space (SysTick, NVIC)
+static uint32_t scs_regs[0x1000 / 4];
+
+uint8_t sim_pma[1024] __attribute__((aligned(4)));
+
+// USART_ICR is write-only: writes go to a separate slot and are applied
+// before the next register access (or when time advances).
+static const uintptr_t icr_addrs[] = { USART1 + 0x20, USART2 + 0x20 };
+static const uintptr_t isr_addrs[] = { USART1 + 0x1c, USART2 + 0x1c };
+static uint32_t icr_slots[2];
+static bool has_icr_write;
+
+void sim_registers_apply_writes()
+{
+    if (!has_icr_write)
+        return;
+    has_icr_write = false;
+
+    for (int i = 0; i < 2; i++) {
+        uint32_t icr = icr_slots[i];
+        if (icr == 0)
+            continue;
+        icr_slots[i] = 0;
+        uint32_t cleared = icr & (USART_ICR_PECF | USART_ICR_FECF | USART_ICR_NCF
+            | USART_ICR_ORECF | USART_ICR_IDLECF | USART_ICR_TCCF);
+        periph_regs[(isr_addrs[i] - PERIPH_BASE) / 4] &= ~cleared;
+    }
+}
+
+volatile uint32_t *sim_mmio32(uintptr_t addr)
+{
+    sim_registers_apply_writes();
+
+    for (int i = 0; i < 2; i++) {
+        if (addr == icr_addrs[i]) {
+            has_icr_write = true;
+            return &icr_slots[i];
+        }
+    }
+
+    uint32_t *reg;
+    if (addr >= PERIPH_BASE && addr < PERIPH_BASE + sizeof(periph_regs))
+        reg = &periph_regs[(addr - PERIPH_BASE) / 4];
+    else if (addr >= IOPORT_BASE && addr < IOPORT_BASE + sizeof(gpio_regs))
+        reg = &gpio_regs[(addr - IOPORT_BASE) / 4];
+    else if (addr >= SCS_BASE && addr < SCS_BASE + sizeof(scs_regs))
+        reg = &scs_regs[(addr - SCS_BASE) / 4];
+    else
+        sim_fatal("access to unmapped register 0x%08lx", (unsigned long)addr);
+
+    // byte and half word accesses (MMIO8/MMIO16) within the register
+    return (volatile uint32_t *)((uint8_t *)reg + (addr & 3));
+}
+
+void sim_registers_reset()
+{
+    memset(periph_regs, 0, sizeof(periph_regs));
+    memset(gpio_regs, 0, sizeof(gpio_regs));
+    memset(scs_regs, 0, sizeof(scs_regs));
+    memset(icr_slots, 0, sizeof(icr_slots));
+    memset(sim_pma, 0, sizeof(sim_pma));
+    has_icr_write = false;
+
+    // transmit data register empty, transmission complete
+    for (uintptr_t isr : isr_addrs)
+        periph_regs[(isr - PERIPH_BASE) / 4] = USART_ISR_TXE | USART_ISR_TC;
+}
+
+void *sim_host_pointer(uint32_t address)
+{
+    // The firmware passes memory addresses to the DMA controller as 32-bit values.
+    // Static data of the firmware and the simulation share the upper half of their
+    // 64-bit addresses (the executable's data segment does not cross a 4 GB boundary).
+    uintptr_t base = (uintptr_t)periph_regs & ~(uintptr_t)UINT32_MAX;
+    return (void *)(base | address);
+}
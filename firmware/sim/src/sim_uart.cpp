@@ -0,0 +1,392 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: USART (STM32F0 register layout) and the peer on the other end of the line
+ *
+ * Only the USART of the first serial port is modelled. The transmitter has a
+ * data register (TDR) and a shift register; the DMA channel refills TDR as soon
+ * as it is empty. The receiver has a single data register (RDR); a byte arriving
+ * while RXNE is still set causes an overrun. Frame timing is derived from the
+ * BRR, CR1 and CR2 registers (bit rate, data bits, parity, stop bits).
+ *
+ * The peer transmits at the line rate configured on the device and optionally
+ * honors the device's RTS signal (with a configurable overshoot, like a real
+ * UART with a transmit FIFO) and echoes the received bytes.
+ */
+
+#include "sim_internal.h"
+#include "hardware.h"
+#include <algorithm>
+#include <deque>
+
+namespace {
+
+struct peer_byte
+{
+    uint8_t data;
+    /// idle time after the byte (in ps)
+    uint64_t gap;
+};
+
+// --- device transmitter
+bool shifter_busy;
+uint8_t shifter_data;
+uint64_t shifter_end;
+bool tc_pending;
+uint8_t tdr_data;
+
+// --- device receiver
+uint64_t idle_at;
+
+// --- peer
+std::deque<peer_byte> peer_queue;
+bool peer_busy;
+uint8_t peer_data;
+uint64_t peer_end;
+uint64_t peer_next_start;
+bool peer_honor_rts;
+int peer_overshoot;
+int peer_overshoot_left;
+bool peer_rts;
+bool peer_echo;
+uint32_t peer_error_flags;
+int peer_error_count;
+uint32_t peer_byte_errors;
+sim_byte_log peer_sent_log;
+sim_byte_log peer_received_log;
+
+uint32_t usart_clock(uint32_t usart)
+{
+    return usart == USART1 || usart == USART6 ? rcc_apb2_frequency : rcc_apb1_frequency;
+}
+
+// Duration of a frame with the current configuration (in ps), 0 if not configured
+uint64_t frame_duration()
+{
+    uint32_t cr1 = USART_CR1(USART);
+    uint32_t brr = USART_BRR(USART);
+    uint32_t clock = usart_clock(USART);
+    if (brr == 0 || clock == 0)
+        return 0;
+
+    // USARTDIV in units of half the bit time (BRR[2:0] is USARTDIV[3:1] with oversampling by 8)
+    uint64_t div2 = (cr1 & USART_CR1_OVER8) != 0 ? (brr & 0xfff0) | ((brr & 7) << 1) : 2 * brr;
+    // frame length in half bits: start bit, data bits (incl. parity), stop bits
+    static const uint8_t stop_half_bits[] = { 2, 1, 4, 3 };
+    uint32_t stop = (USART_CR2(USART) & USART_CR2_STOPBITS_MASK) >> USART_CR2_STOPBITS_SHIFT;
+    uint64_t half_bits = 2 * (1 + ((cr1 & USART_CR1_M0) != 0 ? 9 : 8)) + stop_half_bits[stop];
+
+    return half_bits * div2 * 1000000000000ULL / (4ULL * clock);
+}
+
+bool is_enabled(uint32_t mode)
+{
+    uint32_t cr1 = USART_CR1(USART);
+    return (cr1 & USART_CR1_UE) != 0 && (cr1 & mode) != 0;
+}
+
+void set_isr(uint32_t set, uint32_t clear)
+{
+    USART_ISR(USART) = (USART_ISR(USART) & ~clear) | set;
+}
+
+void log_byte(sim_byte_log &log, uint8_t data, uint64_t time)
+{
+    log.data.push_back(data);
+    log.time.push_back(time / SIM_PS_PER_NS);
+}
+
+// Moves the next byte from memory to TDR (if TDR is empty and the DMA request is enabled)
+void fill_tdr()
+{
+    if (!is_enabled(USART_CR1_TE) || (USART_CR3(USART) & USART_CR3_DMAT) == 0
+            || (USART_ISR(USART) & USART_ISR_TXE) == 0)
+        return;
+
+    int channel = sim_dma_find_channel(&USART_TDR(USART), true);
+    if (channel == 0 || !sim_dma_read_memory(channel, &tdr_data))
+        return;
+    set_isr(0, USART_ISR_TXE | USART_ISR_TC);
+}
+
+void start_shifter()
+{
+    if (shifter_busy || (USART_ISR(USART) & USART_ISR_TXE) != 0 || !is_enabled(USART_CR1_TE))
+        return;
+    if ((USART_CR3(USART) & USART_CR3_CTSE) != 0 && !peer_rts)
+        return;
+
+    uint64_t duration = frame_duration();
+    if (duration == 0)
+        return;
+
+    shifter_busy = true;
+    shifter_data = tdr_data;
+    shifter_end = sim_now + duration;
+    set_isr(USART_ISR_TXE, 0);
+}
+
+void update_transmitter()
+{
+    if (shifter_busy && sim_now >= shifter_end) {
+        shifter_busy = false;
+        tc_pending = true;
+        log_byte(peer_received_log, shifter_data, shifter_end);
+        if (peer_echo)
+            peer_queue.push_back({ shifter_data, 0 });
+    }
+
+    fill_tdr();
+    start_shifter();
+    fill_tdr();
+
+    if (tc_pending && !shifter_busy) {
+        tc_pending = false;
+        if ((USART_ISR(USART) & USART_ISR_TXE) != 0)
+            set_isr(USART_ISR_TC, 0);
+    }
+}
+
+void receive_byte(uint8_t data, uint32_t errors)
+{
+    if (!is_enabled(USART_CR1_RE))
+        return;
+
+    set_isr(errors, 0);
+    if ((USART_ISR(USART) & USART_ISR_RXNE) != 0) {
+        // byte is lost
+        if ((USART_CR3(USART) & USART_CR3_OVRDIS) == 0)
+            set_isr(USART_ISR_ORE, 0);
+        return;
+    }
+
+    USART_RDR(USART) = data;
+    set_isr(USART_ISR_RXNE, 0);
+
+    if ((USART_CR3(USART) & USART_CR3_DMAR) != 0) {
+        int channel = sim_dma_find_channel(&USART_RDR(USART), false);
+        if (channel != 0 && sim_dma_write_memory(channel, data))
+            set_isr(0, USART_ISR_RXNE);
+    }
+}
+
+bool is_peer_blocked()
+{
+    if (!peer_honor_rts || sim_device_rts_asserted())
+        return false;
+    return peer_overshoot_left <= 0;
+}
+
+void update_peer()
+{
+    if (peer_busy && sim_now >= peer_end) {
+        peer_busy = false;
+        receive_byte(peer_data, peer_byte_errors);
+        log_byte(peer_sent_log, peer_data, peer_end);
+        idle_at = peer_end + frame_duration();
+    }
+
+    if (idle_at != SIM_NEVER && sim_now >= idle_at) {
+        idle_at = SIM_NEVER;
+        if (is_enabled(USART_CR1_RE))
+            set_isr(USART_ISR_IDLE, 0);
+    }
+
+    if (sim_device_rts_asserted())
+        peer_overshoot_left = peer_overshoot;
+
+    if (peer_busy || peer_queue.empty() || sim_now < peer_next_start || is_peer_blocked())
+        return;
+
+    uint64_t duration = frame_duration();
+    if (duration == 0)
+        return;
+
+    if (!sim_device_rts_asserted())
+        peer_overshoot_left--;
+
+    peer_byte byte = peer_queue.front();
+    peer_queue.pop_front();
+    peer_busy = true;
+    peer_data = byte.data;
+    peer_end = sim_now + duration;
+    peer_next_start = peer_end + byte.gap;
+    idle_at = SIM_NEVER;
+
+    peer_byte_errors = 0;
+    if (peer_error_count > 0) {
+        peer_error_count--;
+        peer_byte_errors = peer_error_flags;
+    }
+}
+
+} // namespace
+
+void sim_uart_reset()
+{
+    shifter_busy = false;
+    tc_pending = false;
+    idle_at = SIM_NEVER;
+    peer_queue.clear();
+    peer_busy = false;
+    peer_next_start = 0;
+    peer_honor_rts = true;
+    peer_overshoot = 0;
+    peer_overshoot_left = 0;
+    peer_rts = true;
+    peer_echo = false;
+    peer_error_count = 0;
+    peer_sent_log.clear();
+    peer_received_log.clear();
+}
+
+void sim_uart_update()
+{
+    update_transmitter();
+    update_peer();
+}
+
+uint64_t sim_uart_next_event()
+{
+    uint64_t next = SIM_NEVER;
+    if (shifter_busy)
+        next = std::min(next, shifter_end);
+    if (peer_busy)
+        next = std::min(next, peer_end);
+    if (idle_at != SIM_NEVER)
+        next = std::min(next, idle_at);
+    // a blocked peer is re-evaluated whenever time advances
+    if (!peer_busy && !peer_queue.empty() && peer_next_start > sim_now && !is_peer_blocked())
+        next = std::min(next, peer_next_start);
+    return next;
+}
+
+bool sim_device_rts_asserted()
+{
+    if ((USART_CR3(USART) & USART_CR3_RTSE) != 0)
+        return (USART_ISR(USART) & USART_ISR_RXNE) == 0;
+    return (GPIO_ODR(USART_RTS_PORT) & USART_RTS_GPIO) == 0;
+}
+
+// --- Peer API ----------------------------------------------------------------
+
+void sim_peer_send(const uint8_t *data, size_t len, uint32_t gap_ns)
+{
+    for (size_t i = 0; i < len; i++)
+        peer_queue.push_back({ data[i], gap_ns * SIM_PS_PER_NS });
+}
+
+size_t sim_peer_send_pending()
+{
+    return peer_queue.size() + (peer_busy ? 1 : 0);
+}
+
+void sim_peer_set_flow_control(bool honor_rts, int overshoot)
+{
+    peer_honor_rts = honor_rts;
+    peer_overshoot = overshoot;
+    peer_overshoot_left = overshoot;
+}
+
+void sim_peer_set_rts(bool asserted)
+{
+    peer_rts = asserted;
+}
+
+void sim_peer_set_echo(bool echo)
+{
+    peer_echo = echo;
+}
+
+void sim_peer_inject_errors(uint32_t flags, int count)
+{
+    peer_error_flags = flags & (USART_ISR_PE | USART_ISR_FE);
+    peer_error_count = count;
+}
+
+const sim_byte_log &sim_peer_sent()
+{
+    return peer_sent_log;
+}
+
+const sim_byte_log &sim_peer_received()
+{
+    return peer_received_log;
+}
+
+void sim_peer_clear()
+{
+    peer_sent_log.clear();
+    peer_received_log.clear();
+}
+
+// --- libopencm3 USART functions ------------------------------------------------
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud)
+{
+    uint32_t clock = usart_clock(usart);
+    USART_BRR(usart) = (clock + baud / 2) / baud;
+}
+
+void usart_set_databits(uint32_t usart, uint32_t bits)
+{
+    // as libopencm3: anything but 8 selects 9 bits
+    if (bits == 8)
+        USART_CR1(usart) &= ~USART_CR1_M0;
+    else
+        USART_CR1(usart) |= USART_CR1_M0;
+}
+
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits)
+{
+    USART_CR2(usart) = (USART_CR2(usart) & ~USART_CR2_STOPBITS_MASK) | stopbits;
+}
+
+void usart_set_parity(uint32_t usart, uint32_t parity)
+{
+    USART_CR1(usart) = (USART_CR1(usart) & ~USART_PARITY_MASK) | parity;
+}
+
+void usart_set_mode(uint32_t usart, uint32_t mode)
+{
+    USART_CR1(usart) = (USART_CR1(usart) & ~USART_MODE_MASK) | mode;
+}
+
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol)
+{
+    USART_CR3(usart) = (USART_CR3(usart) & ~USART_FLOWCONTROL_MASK) | flowcontrol;
+}
+
+void usart_enable(uint32_t usart)
+{
+    USART_CR1(usart) |= USART_CR1_UE;
+}
+
+void usart_disable(uint32_t usart)
+{
+    USART_CR1(usart) &= ~USART_CR1_UE;
+}
+
+void usart_enable_rx_dma(uint32_t usart)
+{
+    USART_CR3(usart) |= USART_CR3_DMAR;
+}
+
+void usart_disable_rx_dma(uint32_t usart)
+{
+    USART_CR3(usart) &= ~USART_CR3_DMAR;
+}
+
+void usart_enable_tx_dma(uint32_t usart)
+{
+    USART_CR3(usart) |= USART_CR3_DMAT;
+}
+
+void usart_disable_tx_dma(uint32_t usart)
+{
+    USART_CR3(usart) &= ~USART_CR3_DMAT;
+}
@@ -0,0 +1,854 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Simulation: USB full-speed device peripheral and USB host
+ *
+ * The device side models the endpoint registers (toggle and clear-only bits,
+ * double buffering with the SW_BUF bits), USB_ISTR and the buffer descriptor
+ * table in packet memory. Transactions are executed atomically: the host
+ * calls into the device model, which updates the registers and packet memory
+ * as the peripheral would at the end of the transaction.
+ *
+ * The host attaches once the device enables the D+ pull-up, resets the bus,
+ * enumerates the device and opens the port (SET_LINE_CODING and
+ * SET_CONTROL_LINE_STATE). It then issues SOF packets every 1 ms and
+ * schedules control, interrupt and bulk transactions within each frame.
+ */
+
+#include "sim_internal.h"
+#include "qsb_cdc.h"
+#include "qsb_fsdev.h"
+#include "qsb_private.h"
+#include "usb_conf.h"
+#include <algorithm>
+#include <deque>
+#include <string.h>
+
+namespace {
+
+constexpr int NUM_EP_REGS = 8;
+
+// Bits of the endpoint register toggled by writing 1
+constexpr uint32_t EP_TOGGLE_BITS = USB_EP_DTOG_RX | USB_EP_STAT_RX | USB_EP_DTOG_TX | USB_EP_STAT_TX;
+
+// Duration of the transaction overhead and of a byte on the bus (in ps, incl. bit stuffing)
+constexpr uint64_t TRANSACTION_OVERHEAD_BYTES = 16;
+constexpr uint64_t BYTE_TIME = 693 * SIM_PS_PER_NS;
+
+// Duration of a NAKed transaction (in ps)
+constexpr uint64_t NAK_TIME = 4 * SIM_PS_PER_US;
+
+// Number of unanswered control transactions before a transfer fails
+constexpr int MAX_NO_RESPONSE = 3;
+
+enum class handshake { ack, nak, stall, none };
+
+// --- device side ---------------------------------------------------------------
+
+/// Hidden state of double buffered endpoints: the STAT bits read as set by the
+/// software but the peripheral NAKs if the buffer is owned by the software.
+struct ep_buffer_state
+{
+    bool rx_masked;
+    bool tx_masked;
+};
+
+ep_buffer_state ep_states[NUM_EP_REGS];
+
+uint16_t pma_read16(uint32_t offset)
+{
+    uint16_t value;
+    memcpy(&value, sim_pma + offset, 2);
+    return value;
+}
+
+void pma_write16(uint32_t offset, uint16_t value)
+{
+    memcpy(sim_pma + offset, &value, 2);
+}
+
+// Offset of the buffer descriptor entry (BTABLE at 0, 2 half words per entry)
+uint32_t buf_desc(int ep, int offset)
+{
+    return USB_BTABLE + ep * 8 + offset * 4;
+}
+
+bool is_dbl_buf(uint32_t reg)
+{
+    return (reg & USB_EP_KIND_DBL_BUF) != 0 && (reg & USB_EP_TYPE) == USB_EP_TYPE_BULK;
+}
+
+// Updates the masking after the DTOG (peripheral) or SW_BUF (software) bit has changed
+void update_mask(bool *masked, uint32_t old_reg, uint32_t reg, uint32_t dtog_bit, uint32_t sw_buf_bit)
+{
+    bool dtog = (reg & dtog_bit) != 0;
+    bool sw_buf = (reg & sw_buf_bit) != 0;
+    if (((old_reg ^ reg) & dtog_bit) != 0 && dtog == sw_buf)
+        *masked = true; // the peripheral has moved to the buffer owned by the software
+    else if (dtog != sw_buf)
+        *masked = false; // the software has released the buffer
+}
+
+void update_masks(int ep, uint32_t old_reg, uint32_t reg)
+{
+    ep_buffer_state &state = ep_states[ep];
+    if (((old_reg ^ reg) & USB_EP_RW_BITS_MSK) != 0) {
+        state.rx_masked = true;
+        state.tx_masked = true;
+    }
+    update_mask(&state.rx_masked, old_reg, reg, USB_EP_DTOG_RX, USB_EP_SW_BUF_RX);
+    update_mask(&state.tx_masked, old_reg, reg, USB_EP_DTOG_TX, USB_EP_SW_BUF_TX);
+}
+
+// Updates CTR, DIR and EP_ID in USB_ISTR from the endpoint registers
+void update_istr()
+{
+    uint32_t istr = USB_ISTR & ~(USB_ISTR_CTR | USB_ISTR_DIR | USB_ISTR_EP_ID);
+    for (int ep = 0; ep < NUM_EP_REGS; ep++) {
+        uint32_t reg = USB_EP(ep);
+        if ((reg & (USB_EP_CTR_RX | USB_EP_CTR_TX)) != 0) {
+            istr |= USB_ISTR_CTR | ep;
+            if ((reg & USB_EP_CTR_RX) != 0)
+                istr |= USB_ISTR_DIR;
+            break;
+        }
+    }
+    USB_ISTR = istr;
+}
+
+
+bool device_responds(uint8_t address)
+{
+    if ((USB_CNTR & (USB_CNTR_PWDN | USB_CNTR_FRES)) != 0)
+        return false;
+    uint32_t daddr = USB_DADDR;
+    return (daddr & USB_DADDR_EF) != 0 && (daddr & USB_DADDR_ADDR) == address;
+}
+
+// Finds the endpoint register with the specified endpoint address (-1 if none)
+int find_ep_reg(uint8_t ep_num)
+{
+    for (int ep = 0; ep < NUM_EP_REGS; ep++) {
+        if ((USB_EP(ep) & USB_EP_ADDR) == ep_num)
+            return ep;
+    }
+    return -1;
+}
+
+// Writes a received packet to the RX buffer
+void write_rx_buf(int ep, int offset, const uint8_t *data, int len)
+{
+    uint32_t desc = buf_desc(ep, offset);
+    uint16_t addr = pma_read16(desc);
+    uint16_t count = pma_read16(desc + 2);
+    int num_blocks = (count >> 10) & 0x1f;
+    int capacity = (count & 0x8000) != 0 ? (num_blocks + 1) * 32 : num_blocks * 2;
+    if (len > capacity || addr + len > (int)sizeof(sim_pma))
+        sim_fatal("USB packet of %d bytes exceeds RX buffer of endpoint %d (%d bytes)", len, ep, capacity);
+
+    memcpy(sim_pma + addr, data, len);
+    pma_write16(desc + 2, (count & 0xfc00) | len);
+}
+
+// Reads a packet to be transmitted from the TX buffer
+int read_tx_buf(int ep, int offset, uint8_t *data)
+{
+    uint32_t desc = buf_desc(ep, offset);
+    uint16_t addr = pma_read16(desc);
+    int len = pma_read16(desc + 2) & 0x3ff;
+    if (len > 64 || addr + len > (int)sizeof(sim_pma))
+        sim_fatal("invalid USB packet of %d bytes in TX buffer of endpoint %d", len, ep);
+
+    memcpy(data, sim_pma + addr, len);
+    return len;
+}
+
+handshake device_setup(uint8_t address, const uint8_t *setup)
+{
+    if (!device_responds(address))
+        return handshake::none;
+    int ep = find_ep_reg(0);
+    if (ep < 0)
+        return handshake::none;
+    uint32_t reg = USB_EP(ep);
+    if ((reg & USB_EP_TYPE) != USB_EP_TYPE_CONTROL || (reg & USB_EP_STAT_RX) == USB_EP_STAT_RX_DISABLED)
+        return handshake::none;
+
+    // SETUP packets are always acknowledged
+    write_rx_buf(ep, qsb_offset_rx, setup, 8);
+    reg = (reg & ~(USB_EP_STAT_RX | USB_EP_STAT_TX)) | USB_EP_STAT_RX_NAK | USB_EP_STAT_TX_NAK;
+    USB_EP(ep) = reg | USB_EP_CTR_RX | USB_EP_SETUP;
+    update_istr();
+    return handshake::ack;
+}
+
+handshake device_out(uint8_t address, uint8_t ep_num, const uint8_t *data, int len)
+{
+    if (!device_responds(address))
+        return handshake::none;
+    int ep = find_ep_reg(ep_num);
+    if (ep < 0)
+        return handshake::none;
+
+    uint32_t reg = USB_EP(ep);
+    uint32_t stat = reg & USB_EP_STAT_RX;
+    if (stat == USB_EP_STAT_RX_DISABLED)
+        return handshake::none;
+    if (stat == USB_EP_STAT_RX_STALL)
+        return handshake::stall;
+    if (stat == USB_EP_STAT_RX_NAK)
+        return handshake::nak;
+
+    bool dbl_buf = is_dbl_buf(reg);
+    if (dbl_buf && ep_states[ep].rx_masked)
+        return handshake::nak;
+
+    int offset = dbl_buf ? ((reg & USB_EP_DTOG_RX) != 0 ? qsb_offset_db1 : qsb_offset_db0) : qsb_offset_rx;
+    write_rx_buf(ep, offset, data, len);
+
+    uint32_t new_reg = ((reg ^ USB_EP_DTOG_RX) | USB_EP_CTR_RX) & ~USB_EP_SETUP;
+    if (!dbl_buf)
+        new_reg = (new_reg & ~USB_EP_STAT_RX) | USB_EP_STAT_RX_NAK;
+    USB_EP(ep) = new_reg;
+    if (dbl_buf)
+        update_mask(&ep_states[ep].rx_masked, reg, new_reg, USB_EP_DTOG_RX, USB_EP_SW_BUF_RX);
+    update_istr();
+    return handshake::ack;
+}
+
+handshake device_in(uint8_t address, uint8_t ep_num, uint8_t *data, int *len)
+{
+    if (!device_responds(address))
+        return handshake::none;
+    int ep = find_ep_reg(ep_num);
+    if (ep < 0)
+        return handshake::none;
+
+    uint32_t reg = USB_EP(ep);
+    uint32_t stat = reg & USB_EP_STAT_TX;
+    if (stat == USB_EP_STAT_TX_DISABLED)
+        return handshake::none;
+    if (stat == USB_EP_STAT_TX_STALL)
+        return handshake::stall;
+    if (stat == USB_EP_STAT_TX_NAK)
+        return handshake::nak;
+
+    bool dbl_buf = is_dbl_buf(reg);
+    if (dbl_buf && ep_states[ep].tx_masked)
+        return handshake::nak;
+
+    int offset = dbl_buf ? ((reg & USB_EP_DTOG_TX) != 0 ? qsb_offset_db1 : qsb_offset_db0) : qsb_offset_tx;
+    *len = read_tx_buf(ep, offset, data);
+
+    uint32_t new_reg = (reg ^ USB_EP_DTOG_TX) | USB_EP_CTR_TX;
+    if (!dbl_buf)
+        new_reg = (new_reg & ~USB_EP_STAT_TX) | USB_EP_STAT_TX_NAK;
+    USB_EP(ep) = new_reg;
+    if (dbl_buf)
+        update_mask(&ep_states[ep].tx_masked, reg, new_reg, USB_EP_DTOG_TX, USB_EP_SW_BUF_TX);
+    update_istr();
+    return handshake::ack;
+}
+
+void reset_ep_states()
+{
+    for (ep_buffer_state &state : ep_states)
+        state = { true, true };
+}
+
+// --- host side -----------------------------------------------------------------
+
+enum class bus_state { detached, attaching, resetting, enumerating, ready };
+
+enum class control_stage { setup, data_in, data_out, status_in, status_out };
+
+struct control_transfer
+{
+    bool active;
+    bool succeeded;
+    control_stage stage;
+    uint8_t setup[8];
+    uint16_t length;
+    std::vector<uint8_t> data;
+    size_t pos;
+    uint64_t retry_at;
+    int no_response_count;
+};
+
+bus_state state;
+uint64_t bus_timer;
+uint64_t next_sof;
+uint64_t bus_free;
+uint32_t frame_number;
+uint8_t device_address;
+uint8_t pending_address;
+bool port_open;
+
+control_transfer control;
+int enum_step;
+uint64_t enum_next_at;
+uint16_t config_length;
+
+bool interrupt_due;
+bool reading;
+uint64_t out_retry_at;
+uint64_t in_retry_at;
+bool prefer_in;
+std::deque<uint8_t> out_queue;
+
+sim_byte_log sent_log;
+sim_byte_log received_log;
+std::vector<sim_packet> in_packets;
+std::vector<sim_packet> serial_states;
+std::vector<sim_telemetry> telemetry;
+
+uint64_t transaction_time(int len)
+{
+    return (len + TRANSACTION_OVERHEAD_BYTES) * BYTE_TIME;
+}
+
+void start_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+    const void *data, uint16_t wLength)
+{
+    control.active = true;
+    control.succeeded = false;
+    control.stage = control_stage::setup;
+    uint8_t setup[8] = { bmRequestType, bRequest, (uint8_t)wValue, (uint8_t)(wValue >> 8),
+        (uint8_t)wIndex, (uint8_t)(wIndex >> 8), (uint8_t)wLength, (uint8_t)(wLength >> 8) };
+    memcpy(control.setup, setup, 8);
+    control.length = wLength;
+    control.data.clear();
+    if ((bmRequestType & 0x80) == 0) {
+        control.data.assign(wLength, 0);
+        if (data != nullptr)
+            memcpy(control.data.data(), data, wLength);
+    }
+    control.pos = 0;
+    control.retry_at = 0;
+    control.no_response_count = 0;
+}
+
+void finish_control(bool succeeded)
+{
+    control.active = false;
+    control.succeeded = succeeded;
+}
+
+void reset_host_device_state()
+{
+    device_address = 0;
+    pending_address = 0;
+    port_open = false;
+    control.active = false;
+    enum_step = 0;
+    enum_next_at = 0;
+    interrupt_due = false;
+    out_retry_at = 0;
+    in_retry_at = 0;
+}
+
+void bus_reset()
+{
+    for (int ep = 0; ep < NUM_EP_REGS; ep++)
+        USB_EP(ep) = 0;
+    USB_DADDR = 0;
+    USB_ISTR = (USB_ISTR | USB_ISTR_RESET) & ~(USB_ISTR_CTR | USB_ISTR_DIR | USB_ISTR_EP_ID);
+    reset_ep_states();
+    reset_host_device_state();
+}
+
+// Starts the next step of the enumeration and port setup
+void enumerate()
+{
+    if (control.active || sim_now < enum_next_at)
+        return;
+
+    if (enum_step > 0 && !control.succeeded)
+        sim_fatal("USB enumeration failed at step %d", enum_step);
+
+    if (pending_address != 0) {
+        // the new address is used 2 ms after the status stage (USB 2.0, 9.2.6.3)
+        device_address = pending_address;
+        pending_address = 0;
+    }
+
+    switch (enum_step++) {
+    case 0:
+        start_control(0x80, QSB_REQ_GET_DESCRIPTOR, QSB_DT_DEVICE << 8, 0, nullptr, 64);
+        break;
+    case 1:
+        start_control(0x00, QSB_REQ_SET_ADDRESS, 1, 0, nullptr, 0);
+        pending_address = 1;
+        break;
+    case 2:
+        start_control(0x80, QSB_REQ_GET_DESCRIPTOR, QSB_DT_DEVICE << 8, 0, nullptr, 18);
+        break;
+    case 3:
+        start_control(0x80, QSB_REQ_GET_DESCRIPTOR, QSB_DT_CONFIGURATION << 8, 0, nullptr, 9);
+        break;
+    case 4:
+        config_length = control.data.size() >= 4 ? control.data[2] | (control.data[3] << 8) : 9;
+        start_control(0x80, QSB_REQ_GET_DESCRIPTOR, QSB_DT_CONFIGURATION << 8, 0, nullptr, config_length);
+        break;
+    case 5:
+        start_control(0x00, QSB_REQ_SET_CONFIGURATION, 1, 0, nullptr, 0);
+        break;
+    case 6: {
+        uint32_t baud = sim_cfg.baudrate;
+        uint8_t coding[7] = { (uint8_t)baud, (uint8_t)(baud >> 8), (uint8_t)(baud >> 16), (uint8_t)(baud >> 24),
+            sim_cfg.stopbits, sim_cfg.parity, sim_cfg.databits };
+        start_control(0x21, QSB_PSTN_REQ_SET_LINE_CODING, 0, INTF_COMM_1, coding, sizeof(coding));
+        break;
+    }
+    case 7:
+        start_control(0x21, QSB_PSTN_REQ_SET_CONTROL_LINE_STATE, 3, INTF_COMM_1, nullptr, 0);
+        break;
+    default:
+        state = bus_state::ready;
+        port_open = true;
+        break;
+    }
+}
+
+void handle_control_failure(handshake result)
+{
+    if (result == handshake::nak) {
+        control.retry_at = sim_now + sim_cfg.nak_retry_ns * SIM_PS_PER_NS;
+    } else if (result == handshake::none && ++control.no_response_count < MAX_NO_RESPONSE) {
+        control.retry_at = sim_now + sim_cfg.nak_retry_ns * SIM_PS_PER_NS;
+    } else {
+        finish_control(false);
+    }
+}
+
+// Executes the next transaction of the control transfer (returns the bus time used)
+uint64_t control_transaction()
+{
+    uint8_t buf[64];
+    int len = 0;
+    handshake result;
+
+    switch (control.stage) {
+    case control_stage::setup:
+        result = device_setup(device_address, control.setup);
+        if (result == handshake::ack) {
+            control.no_response_count = 0;
+            if (control.length == 0)
+                control.stage = control_stage::status_in;
+            else if ((control.setup[0] & 0x80) != 0)
+                control.stage = control_stage::data_in;
+            else
+                control.stage = control_stage::data_out;
+        } else {
+            handle_control_failure(result);
+        }
+        return transaction_time(8);
+
+    case control_stage::data_in:
+        result = device_in(device_address, 0, buf, &len);
+        if (result != handshake::ack) {
+            handle_control_failure(result);
+            return NAK_TIME;
+        }
+        len = std::min(len, (int)(control.length - control.data.size()));
+        control.data.insert(control.data.end(), buf, buf + len);
+        if (len < USB_EP0_PACKET_SIZE || control.data.size() >= control.length)
+            control.stage = control_stage::status_out;
+        return transaction_time(len);
+
+    case control_stage::data_out:
+        len = std::min((int)(control.length - control.pos), USB_EP0_PACKET_SIZE);
+        result = device_out(device_address, 0, control.data.data() + control.pos, len);
+        if (result != handshake::ack) {
+            handle_control_failure(result);
+            return NAK_TIME;
+        }
+        control.pos += len;
+        if (control.pos >= control.length)
+            control.stage = control_stage::status_in;
+        return transaction_time(len);
+
+    case control_stage::status_in:
+        result = device_in(device_address, 0, buf, &len);
+        if (result != handshake::ack) {
+            handle_control_failure(result);
+            return NAK_TIME;
+        }
+        finish_control(true);
+        if (pending_address != 0)
+            enum_next_at = sim_now + 2 * SIM_PS_PER_MS;
+        return transaction_time(0);
+
+    case control_stage::status_out:
+        result = device_out(device_address, 0, nullptr, 0);
+        if (result != handshake::ack) {
+            handle_control_failure(result);
+            return NAK_TIME;
+        }
+        finish_control(true);
+        return transaction_time(0);
+    }
+    return 0;
+}
+
+uint64_t interrupt_transaction()
+{
+    uint8_t buf[64];
+    int len = 0;
+    interrupt_due = false;
+    if (device_in(device_address, COMM_IN_1 & 0x7f, buf, &len) != handshake::ack)
+        return NAK_TIME;
+
+    uint64_t duration = transaction_time(len);
+    // SERIAL_STATE notification: header (8 bytes) and state (2 bytes)
+    if (len >= 10 && buf[1] == QSB_PSTN_NOTIF_SERIAL_STATE)
+        serial_states.push_back({ (sim_now + duration) / SIM_PS_PER_NS, (uint16_t)(buf[8] | (buf[9] << 8)) });
+    // telemetry notification: header (8 bytes) and record
+    if (len >= 8 + (int)sizeof(usb_serial_telemetry) && buf[1] == USB_SERIAL_NOTIF_TELEMETRY) {
+        sim_telemetry notif = { (sim_now + duration) / SIM_PS_PER_NS, (uint16_t)(buf[2] | (buf[3] << 8)), {} };
+        memcpy(&notif.record, buf + 8, sizeof(notif.record));
+        telemetry.push_back(notif);
+    }
+    return duration;
+}
+
+uint64_t bulk_out_transaction()
+{
+    uint8_t buf[64];
+    int len = std::min((int)out_queue.size(), 64);
+    std::copy(out_queue.begin(), out_queue.begin() + len, buf);
+    handshake result = device_out(device_address, DATA_OUT_1, buf, len);
+    if (result != handshake::ack) {
+        out_retry_at = sim_now + sim_cfg.nak_retry_ns * SIM_PS_PER_NS;
+        return NAK_TIME;
+    }
+
+    // the transaction is executed atomically: the device sees the data from now on
+    for (int i = 0; i < len; i++) {
+        sent_log.data.push_back(buf[i]);
+        sent_log.time.push_back(sim_now / SIM_PS_PER_NS);
+    }
+    out_queue.erase(out_queue.begin(), out_queue.begin() + len);
+    return transaction_time(len);
+}
+
+uint64_t bulk_in_transaction()
+{
+    uint8_t buf[64];
+    int len = 0;
+    handshake result = device_in(device_address, DATA_IN_1 & 0x7f, buf, &len);
+    if (result != handshake::ack) {
+        in_retry_at = sim_now + sim_cfg.nak_retry_ns * SIM_PS_PER_NS;
+        return NAK_TIME;
+    }
+
+    uint64_t duration = transaction_time(len);
+    uint64_t end = (sim_now + duration) / SIM_PS_PER_NS;
+    in_packets.push_back({ end, (uint16_t)len });
+    for (int i = 0; i < len; i++) {
+        received_log.data.push_back(buf[i]);
+        received_log.time.push_back(end);
+    }
+    return duration;
+}
+
+bool is_control_ready()
+{
+    return control.active && sim_now >= control.retry_at;
+}
+
+bool is_bulk_out_ready()
+{
+    return port_open && !out_queue.empty() && sim_now >= out_retry_at;
+}
+
+bool is_bulk_in_ready()
+{
+    return port_open && reading && sim_now >= in_retry_at;
+}
+
+// Executes the next transaction due (returns `false` if there is none)
+bool run_transaction()
+{
+    bool out_ready = is_bulk_out_ready();
+    bool in_ready = is_bulk_in_ready();
+    uint64_t (*transaction)() = nullptr;
+    int max_len = 64;
+
+    if (is_control_ready()) {
+        transaction = control_transaction;
+    } else if (interrupt_due) {
+        transaction = interrupt_transaction;
+        max_len = USB_COMM_PACKET_SIZE;
+    } else if (out_ready && (!in_ready || !prefer_in)) {
+        transaction = bulk_out_transaction;
+        prefer_in = true;
+    } else if (in_ready) {
+        transaction = bulk_in_transaction;
+        prefer_in = false;
+    } else {
+        return false;
+    }
+
+    // transactions must complete before the next SOF
+    if (sim_now + transaction_time(max_len) > next_sof) {
+        bus_free = next_sof;
+        return false;
+    }
+
+    bus_free = sim_now + transaction();
+    return true;
+}
+
+void start_of_frame()
+{
+    next_sof += SIM_PS_PER_MS;
+    frame_number = (frame_number + 1) & USB_FNR_FN;
+    USB_FNR = (USB_FNR & ~USB_FNR_FN) | frame_number;
+    USB_ISTR = USB_ISTR | USB_ISTR_SOF;
+    if (port_open && frame_number % USB_COMM_INTERVAL == 0)
+        interrupt_due = true;
+}
+
+void update_bus_state()
+{
+    bool pull_up = (USB_BCDR & USB_BCDR_DPPU) != 0;
+    if (state != bus_state::detached && !pull_up) {
+        state = bus_state::detached;
+        reset_host_device_state();
+        return;
+    }
+
+    switch (state) {
+    case bus_state::detached:
+        if (pull_up) {
+            state = bus_state::attaching;
+            bus_timer = sim_now + 10 * SIM_PS_PER_MS;
+        }
+        break;
+    case bus_state::attaching:
+        if (sim_now >= bus_timer) {
+            bus_reset();
+            state = bus_state::resetting;
+            bus_timer = sim_now + 10 * SIM_PS_PER_MS;
+        }
+        break;
+    case bus_state::resetting:
+        if (sim_now >= bus_timer) {
+            state = bus_state::enumerating;
+            next_sof = sim_now;
+            bus_free = sim_now;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+} // namespace
+
+// --- register write hooks ------------------------------------------------------
+
+extern "C" void qsb_sim_ep_write(uint8_t ep, uint32_t val)
+{
+    if (ep >= NUM_EP_REGS)
+        sim_fatal("write to invalid USB endpoint register %d", ep);
+
+    uint32_t old_reg = USB_EP(ep);
+    uint32_t reg = (val & USB_EP_RW_BITS_MSK)
+        | ((old_reg ^ val) & EP_TOGGLE_BITS)
+        | (old_reg & val & USB_EP_W0_BITS_MSK)
+        | (old_reg & USB_EP_SETUP);
+    USB_EP(ep) = reg;
+    update_masks(ep, old_reg, reg);
+    update_istr();
+}
+
+extern "C" void qsb_sim_istr_write(uint32_t val)
+{
+    // all bits but CTR, DIR and EP_ID are cleared by writing 0
+    USB_ISTR = USB_ISTR & val & ~(USB_ISTR_CTR | USB_ISTR_DIR | USB_ISTR_EP_ID);
+    update_istr();
+}
+
+// --- interface to the simulation core ------------------------------------------
+
+void sim_usb_reset()
+{
+    reset_ep_states();
+    state = bus_state::detached;
+    frame_number = 0;
+    reset_host_device_state();
+    control.succeeded = false;
+    reading = true;
+    prefer_in = false;
+    out_queue.clear();
+    sim_host_clear();
+}
+
+void sim_usb_periph_reset()
+{
+    for (int ep = 0; ep < NUM_EP_REGS; ep++)
+        USB_EP(ep) = 0;
+    USB_CNTR = USB_CNTR_FRES | USB_CNTR_PWDN;
+    USB_ISTR = 0;
+    USB_FNR = 0;
+    USB_DADDR = 0;
+    USB_BTABLE = 0;
+    USB_LPMCSR = 0;
+    USB_BCDR = 0;
+    reset_ep_states();
+}
+
+void sim_usb_update()
+{
+    update_bus_state();
+    if (state != bus_state::enumerating && state != bus_state::ready)
+        return;
+
+    if (sim_now >= next_sof)
+        start_of_frame();
+    if (state == bus_state::enumerating)
+        enumerate();
+    if (sim_now >= bus_free)
+        run_transaction();
+}
+
+uint64_t sim_usb_next_event()
+{
+    switch (state) {
+    case bus_state::detached:
+        return SIM_NEVER;
+    case bus_state::attaching:
+    case bus_state::resetting:
+        return bus_timer;
+    default:
+        break;
+    }
+
+    uint64_t next = next_sof;
+    if (state == bus_state::enumerating && !control.active)
+        next = std::min(next, enum_next_at);
+
+    // earliest time a transaction can be started
+    uint64_t ready = SIM_NEVER;
+    if (control.active)
+        ready = std::min(ready, control.retry_at);
+    if (interrupt_due)
+        ready = sim_now;
+    if (port_open && !out_queue.empty())
+        ready = std::min(ready, out_retry_at);
+    if (port_open && reading)
+        ready = std::min(ready, in_retry_at);
+    if (ready != SIM_NEVER)
+        next = std::min(next, std::max(ready, bus_free));
+
+    return next;
+}
+
+bool sim_host_port_open()
+{
+    return port_open;
+}
+
+// --- host API --------------------------------------------------------------------
+
+bool sim_host_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+    void *data, uint16_t wLength, uint16_t *actual_len)
+{
+    if (state != bus_state::ready || control.active)
+        return false;
+
+    start_control(bmRequestType, bRequest, wValue, wIndex, data, wLength);
+    if (!sim_run_until([] { return !control.active; }, 1000))
+        control.active = false;
+
+    if ((bmRequestType & 0x80) != 0 && control.succeeded && data != nullptr)
+        memcpy(data, control.data.data(), control.data.size());
+    if (actual_len != nullptr)
+        *actual_len = control.succeeded ? (uint16_t)control.data.size() : 0;
+    return control.succeeded;
+}
+
+bool sim_host_set_line_coding(uint32_t baudrate, uint8_t databits, uint8_t stopbits, uint8_t parity)
+{
+    uint8_t coding[7] = { (uint8_t)baudrate, (uint8_t)(baudrate >> 8), (uint8_t)(baudrate >> 16),
+        (uint8_t)(baudrate >> 24), stopbits, parity, databits };
+    return sim_host_control(0x21, QSB_PSTN_REQ_SET_LINE_CODING, 0, INTF_COMM_1, coding, sizeof(coding));
+}
+
+bool sim_host_set_param(usb_serial_param param, uint32_t value)
+{
+    uint8_t data[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+    return sim_host_control(0x40, (uint8_t)usb_vendor_request::set_param, (uint16_t)param, 0, data, sizeof(data));
+}
+
+bool sim_host_get_param(usb_serial_param param, uint32_t *value)
+{
+    uint8_t data[4];
+    uint16_t len = 0;
+    if (!sim_host_control(0xc0, (uint8_t)usb_vendor_request::get_param, (uint16_t)param, 0, data, sizeof(data), &len)
+        || len != sizeof(data))
+        return false;
+    *value = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+    return true;
+}
+
+bool sim_host_set_control_lines(bool dtr, bool rts)
+{
+    uint16_t state = (dtr ? 1 : 0) | (rts ? 2 : 0);
+    return sim_host_control(0x21, QSB_PSTN_REQ_SET_CONTROL_LINE_STATE, state, INTF_COMM_1, nullptr, 0);
+}
+
+void sim_host_write(const uint8_t *data, size_t len)
+{
+    out_queue.insert(out_queue.end(), data, data + len);
+}
+
+size_t sim_host_write_pending()
+{
+    return out_queue.size();
+}
+
+void sim_host_set_reading(bool enabled)
+{
+    reading = enabled;
+}
+
+const sim_byte_log &sim_host_sent()
+{
+    return sent_log;
+}
+
+const sim_byte_log &sim_host_received()
+{
+    return received_log;
+}
+
+const std::vector<sim_packet> &sim_host_in_packets()
+{
+    return in_packets;
+}
+
+const std::vector<sim_packet> &sim_host_serial_states()
+{
+    return serial_states;
+}
+
+const std::vector<sim_telemetry> &sim_host_telemetry()
+{
+    return telemetry;
+}
+
+void sim_host_clear()
+{
+    sent_log.clear();
+    received_log.clear();
+    in_packets.clear();
+    serial_states.clear();
+    telemetry.clear();
+}
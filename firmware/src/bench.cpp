@@ -0,0 +1,454 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Microbenchmark of hot path functions (instrumentation build option)
+ */
+
+#include "bench.h"
+
+#if BENCH == 1
+
+#include "common.h"
+#include "usb_conf.h"
+#if BENCH_SUITE == 1
+#include "uart.h"
+#include "usb_cdc.h"
+#include "usb_serial.h"
+#endif
+#include <libopencm3/stm32/memorymap.h>
+#include <libopencm3/stm32/rcc.h>
+#include <string.h>
+
+extern "C" {
+#include "qsb_drv_fsdev_btable.h"
+}
+
+// Endpoint whose BTABLE entry is used for the benchmark (not used by the firmware)
+static constexpr uint8_t BENCH_EP = 7;
+// Packet size
+static constexpr uint32_t BENCH_LEN = 64;
+// PMA address of benchmark buffer (last 64 bytes of PMA)
+static constexpr uint16_t BENCH_PMA_ADDR = USB_PMA_SIZE - BENCH_LEN;
+static_assert(usb_pma_plan::total <= BENCH_PMA_ADDR, "benchmark buffer overlaps endpoint buffers");
+// Number of runs (the fastest one is reported)
+static constexpr int NUM_RUNS = 8;
+#if BENCH_SUITE == 1
+// Number of runs of the benchmark suite (the fastest and slowest one are reported)
+static constexpr int NUM_SUITE_RUNS = 16;
+#endif
+
+bench_impl bench;
+
+static uint8_t packet_buf[BENCH_LEN + 4] __attribute__((aligned(4)));
+
+// Reference loops (byte-wise half word assembly, as used before the optimized PMA copy kernels)
+
+#if QSB_FSDEV_BTABLE_TYPE == 2
+
+typedef volatile uint16_t pma_word;
+static pma_word* const bench_pma = (pma_word*)(USB_PMA_BASE + BENCH_PMA_ADDR);
+
+__attribute__((noinline)) static void ref_copy_to_pma(pma_word* tgt, const uint8_t* buf, uint32_t len)
+{
+    for (unsigned i = 0; i + 1 < len; i += 2)
+        *tgt++ = (buf[i + 1] << 8) | buf[i];
+
+    if ((len & 1) != 0)
+        *tgt = buf[len - 1];
+}
+
+__attribute__((noinline)) static void ref_copy_from_pma(uint8_t* buf, const pma_word* src, uint32_t len)
+{
+    if (((uintptr_t)buf) & 0x01) {
+        for (unsigned i = 0; i < len >> 1; i++) {
+            uint16_t hw = *src++;
+            *buf++ = hw;
+            *buf++ = hw >> 8;
+        }
+    } else {
+        uint16_t* tgt = (uint16_t*)buf;
+        for (unsigned i = 0; i < len >> 1; i++)
+            *tgt++ = *src++;
+        buf = (uint8_t*)tgt;
+    }
+
+    if ((len & 1) != 0)
+        *buf = *src;
+}
+
+#else
+
+typedef volatile uint32_t pma_word;
+static pma_word* const bench_pma = (pma_word*)(USB_PMA_BASE + BENCH_PMA_ADDR * 2);
+
+__attribute__((noinline)) static void ref_copy_to_pma(pma_word* tgt, const uint8_t* buf, uint32_t len)
+{
+    const uint16_t* src = (const uint16_t*)buf;
+
+    for (; len >= 2; len -= 2)
+        *tgt++ = *src++;
+
+    if (len > 0)
+        *tgt = *(uint8_t*)src;
+}
+
+__attribute__((noinline)) static void ref_copy_from_pma(uint8_t* buf, const pma_word* src, uint32_t len)
+{
+    uint16_t* tgt = (uint16_t*)buf;
+
+    for (unsigned i = 0; i < len >> 1; i++)
+        *tgt++ = *src++;
+
+    if ((len & 1) != 0)
+        *(uint8_t*)tgt = *src;
+}
+
+#endif
+
+// Measures the duration of the specified function (best of several runs)
+template <typename F>
+static uint32_t measure(F func)
+{
+    uint32_t best = UINT32_MAX;
+    for (int i = 0; i < NUM_RUNS; i++) {
+        uint32_t start = clock_ticks();
+        func();
+        uint32_t duration = clock_ticks() - start;
+        if (duration < best)
+            best = duration;
+    }
+    return best;
+}
+
+void bench_impl::run()
+{
+    uint16_t pm_top = BENCH_PMA_ADDR;
+    qsb_fsdev_setup_buf_tx(BENCH_EP, qsb_offset_tx, BENCH_LEN, &pm_top);
+
+    for (uint32_t i = 0; i < sizeof(packet_buf); i++)
+        packet_buf[i] = i;
+
+    uint32_t overhead = measure([] {});
+
+    results.clock_freq = rcc_ahb_frequency;
+    results.flags = 0;
+#if defined(RAMFUNC_ENABLE)
+    results.flags |= BENCH_FLAG_RAMFUNC;
+#endif
+#if defined(QSB_RAMFUNC_ENABLE)
+    results.flags |= BENCH_FLAG_QSB_RAMFUNC;
+#endif
+
+    results.copy_to_pma = measure([] {
+        qsb_fsdev_copy_to_pma(BENCH_EP, qsb_offset_tx, packet_buf, BENCH_LEN);
+    }) - overhead;
+
+    results.copy_to_pma_unaligned = measure([] {
+        qsb_fsdev_copy_to_pma(BENCH_EP, qsb_offset_tx, packet_buf + 1, BENCH_LEN);
+    }) - overhead;
+
+    results.copy_chunks_to_pma = measure([] {
+        qsb_fsdev_copy_chunks_to_pma(BENCH_EP, qsb_offset_tx, packet_buf, BENCH_LEN / 2,
+            packet_buf + BENCH_LEN / 2, BENCH_LEN / 2, 0xff);
+    }) - overhead;
+
+    // the buffer descriptor count is still set from the copy to PMA
+    results.copy_from_pma = measure([] {
+        qsb_fsdev_copy_from_pma(packet_buf, BENCH_LEN, BENCH_EP, qsb_offset_tx);
+    }) - overhead;
+
+    results.copy_from_pma_unaligned = measure([] {
+        qsb_fsdev_copy_from_pma(packet_buf + 1, BENCH_LEN, BENCH_EP, qsb_offset_tx);
+    }) - overhead;
+
+    results.ref_copy_to_pma = measure([] {
+        ref_copy_to_pma(bench_pma, packet_buf, BENCH_LEN);
+    }) - overhead;
+
+    results.ref_copy_to_pma_unaligned = measure([] {
+        ref_copy_to_pma(bench_pma, packet_buf + 1, BENCH_LEN);
+    }) - overhead;
+
+    results.ref_copy_from_pma = measure([] {
+        ref_copy_from_pma(packet_buf, bench_pma, BENCH_LEN);
+    }) - overhead;
+
+    results.ref_copy_from_pma_unaligned = measure([] {
+        ref_copy_from_pma(packet_buf + 1, bench_pma, BENCH_LEN);
+    }) - overhead;
+}
+
+
+#if BENCH_SUITE == 1
+
+// UART buffer management: ring_buffer (as used by uart_impl) against the
+// head/tail index loops used before (reference). Both operate on a small
+// buffer of their own so no data is transmitted; the buffer contents are not
+// touched except for the slack area.
+
+static constexpr uint32_t BENCH_RING_LEN = 128;
+
+static ring_buffer<BENCH_RING_LEN, UART_TX_BUF_SLACK> bench_tx_ring;
+static ring_buffer<BENCH_RING_LEN, 0, uint32_t> bench_rx_ring;
+static uint32_t bench_rx_write_count;
+// Outputs of the kernels (kept so the computation is not optimized away)
+static uint32_t bench_tx_fill;
+static const uint8_t *bench_rx_chunk1;
+static const uint8_t *bench_rx_chunk2;
+
+// Reserves and commits a packet, then transmits it in chunks (ring_buffer)
+__attribute__((noinline)) static void tx_ring_buffer(uint32_t len)
+{
+    if (len > UART_TX_BUF_SLACK || bench_tx_ring.avail() < len)
+        return;
+    bench_tx_ring.commit(len);
+    bench_tx_fill = bench_tx_ring.size();
+
+    while (!bench_tx_ring.empty()) {
+        uint32_t size = std::min((uint32_t)bench_tx_ring.read_span(), (uint32_t)BENCH_LEN);
+        bench_tx_ring.consume(size);
+    }
+}
+
+// Reads the received data in two chunks and consumes it (ring_buffer)
+__attribute__((noinline)) static void rx_ring_buffer(uint32_t len)
+{
+    bench_rx_write_count += len;
+    bench_rx_ring.set_head(bench_rx_write_count);
+
+    uint32_t len1;
+    uint32_t len2;
+    uint32_t avail = bench_rx_ring.peek_chunks(&bench_rx_chunk1, &len1, &bench_rx_chunk2, &len2);
+    if (avail > BENCH_RING_LEN)
+        return;
+    bench_rx_ring.consume(len1 + len2);
+}
+
+// (the reference kernels use the storage of the ring buffers above)
+static int ref_tx_head;
+static int ref_tx_tail;
+static uint32_t ref_rx_write_count;
+static uint32_t ref_rx_read_count;
+
+static size_t ref_tx_data_avail()
+{
+    int head = ref_tx_head;
+    int tail = ref_tx_tail;
+    if (head >= tail)
+        return BENCH_RING_LEN - (head - tail) - 1;
+    else
+        return tail - head - 1;
+}
+
+// Same as tx_ring_buffer() with the previous head/tail loops of reserve_tx(),
+// commit_tx(), start_transmission() and on_tx_complete()
+__attribute__((noinline)) static void ref_tx_head_tail(uint32_t len)
+{
+    if (len > UART_TX_BUF_SLACK || ref_tx_data_avail() < len)
+        return;
+
+    int buf_head = ref_tx_head;
+    buf_head += len;
+    if (buf_head >= (int)BENCH_RING_LEN) {
+        buf_head -= BENCH_RING_LEN;
+        // move data in slack area to start of buffer
+        if (buf_head > 0)
+            memcpy(bench_tx_ring.data(), bench_tx_ring.data() + BENCH_RING_LEN, buf_head);
+    }
+    ref_tx_head = buf_head;
+    bench_tx_fill = BENCH_RING_LEN - 1 - ref_tx_data_avail();
+
+    while (ref_tx_head != ref_tx_tail) {
+        int start_pos = ref_tx_tail;
+        int end_pos = ref_tx_head;
+        if (end_pos <= start_pos)
+            end_pos = BENCH_RING_LEN;
+        int size = std::min(end_pos - start_pos, (int)BENCH_LEN);
+
+        int buf_tail = ref_tx_tail + size;
+        if (buf_tail >= (int)BENCH_RING_LEN)
+            buf_tail = 0;
+        ref_tx_tail = buf_tail;
+    }
+}
+
+// Same as rx_ring_buffer() with the previous index loops of peek_rx_chunks() and consume_rx()
+__attribute__((noinline)) static void ref_rx_head_tail(uint32_t len)
+{
+    ref_rx_write_count += len;
+
+    size_t avail = ref_rx_write_count - ref_rx_read_count;
+    if (avail > BENCH_RING_LEN)
+        return;
+
+    int buf_tail = ref_rx_read_count & (BENCH_RING_LEN - 1);
+    bench_rx_chunk1 = bench_rx_ring.data() + buf_tail;
+    bench_rx_chunk2 = bench_rx_ring.data();
+
+    // chunk between tail and end of buffer, chunk between start of buffer and head
+    size_t len1 = std::min(avail, (size_t)(BENCH_RING_LEN - buf_tail));
+    size_t len2 = avail - len1;
+
+    ref_rx_read_count += len1 + len2;
+}
+
+// Measures the fastest and slowest run of the specified function
+template <typename F>
+static void measure_range(F func, uint32_t overhead, uint32_t *min_cycles, uint32_t *max_cycles)
+{
+    uint32_t best = UINT32_MAX;
+    uint32_t worst = 0;
+    for (int i = 0; i < NUM_SUITE_RUNS; i++) {
+        uint32_t start = clock_ticks();
+        func();
+        uint32_t duration = clock_ticks() - start;
+        best = std::min(best, duration);
+        worst = std::max(worst, duration);
+    }
+    *min_cycles = best > overhead ? best - overhead : 0;
+    *max_cycles = worst > overhead ? worst - overhead : 0;
+}
+
+void bench_impl::run_suite()
+{
+    // the PMA copy kernels and the flags are measured by the basic benchmark
+    run();
+
+    uint16_t pm_top = BENCH_PMA_ADDR;
+    qsb_fsdev_setup_buf_tx(BENCH_EP, qsb_offset_tx, BENCH_LEN, &pm_top);
+    uint32_t overhead = measure([] {});
+    num_suite_results = 0;
+
+    auto add = [this, overhead](const char *name, uint16_t bytes, auto func) {
+        bench_suite_result &result = suite_results[num_suite_results++];
+        result.name = name;
+        result.bytes = bytes;
+        measure_range(func, overhead, &result.min_cycles, &result.max_cycles);
+    };
+
+    add("copy_to_pma", BENCH_LEN, [] {
+        qsb_fsdev_copy_to_pma(BENCH_EP, qsb_offset_tx, packet_buf, BENCH_LEN);
+    });
+    add("copy_to_pma_unaligned", BENCH_LEN, [] {
+        qsb_fsdev_copy_to_pma(BENCH_EP, qsb_offset_tx, packet_buf + 1, BENCH_LEN);
+    });
+    add("copy_chunks_to_pma", BENCH_LEN, [] {
+        qsb_fsdev_copy_chunks_to_pma(BENCH_EP, qsb_offset_tx, packet_buf, BENCH_LEN / 2,
+            packet_buf + BENCH_LEN / 2, BENCH_LEN / 2, 0xff);
+    });
+    add("copy_from_pma", BENCH_LEN, [] {
+        qsb_fsdev_copy_from_pma(packet_buf, BENCH_LEN, BENCH_EP, qsb_offset_tx);
+    });
+    add("copy_from_pma_unaligned", BENCH_LEN, [] {
+        qsb_fsdev_copy_from_pma(packet_buf + 1, BENCH_LEN, BENCH_EP, qsb_offset_tx);
+    });
+    add("clear_high_bits", BENCH_LEN, [] {
+        uart_impl<uart_1_hw>::clear_high_bits(packet_buf, BENCH_LEN);
+    });
+    add("uart_peek_rx", 0, [] {
+        const uint8_t *chunk1;
+        const uint8_t *chunk2;
+        size_t len1;
+        size_t len2;
+        uart.peek_rx_chunks(&chunk1, &len1, &chunk2, &len2);
+    });
+    // transmits the packet via UART (NUM_SUITE_RUNS * 64 bytes in total)
+    add("uart_commit_tx", BENCH_LEN, [] {
+        uint8_t *buf = uart.reserve_tx(BENCH_LEN);
+        if (buf != nullptr) {
+            memcpy(buf, packet_buf, BENCH_LEN);
+            uart.commit_tx(BENCH_LEN);
+        }
+    });
+    // packets of 48 bytes so the buffer position wraps in the middle of a packet
+    add("tx_ring_buffer", 48, [] { tx_ring_buffer(48); });
+    add("ref_tx_head_tail", 48, [] { ref_tx_head_tail(48); });
+    add("rx_ring_buffer", 48, [] { rx_ring_buffer(48); });
+    add("ref_rx_head_tail", 48, [] { ref_rx_head_tail(48); });
+    add("usb_serial_poll", 0, [] { usb_serial.poll(); });
+    add("usb_cdc_poll", 0, [] { usb_cdc_poll(); });
+}
+
+// Formats an unsigned decimal number, returns the number of characters
+static int format_uint(char *buf, uint32_t value)
+{
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    for (int i = 0; i < n; i++)
+        buf[i] = digits[n - 1 - i];
+    return n;
+}
+
+static int format_str(char *buf, const char *str)
+{
+    int n = strlen(str);
+    memcpy(buf, str, n);
+    return n;
+}
+
+// Formats a line of the report (index 0: header, 1 to n: kernel results, n + 1: end)
+int bench_impl::format_report_line(int index, char *line)
+{
+    int n = 0;
+    if (index == 0) {
+        n += format_str(line + n, "BENCH 1 clock=");
+        n += format_uint(line + n, results.clock_freq);
+        n += format_str(line + n, " flags=");
+        n += format_uint(line + n, results.flags);
+        n += format_str(line + n, " runs=");
+        n += format_uint(line + n, NUM_SUITE_RUNS);
+    } else if (index <= num_suite_results) {
+        const bench_suite_result &result = suite_results[index - 1];
+        n += format_str(line + n, result.name);
+        line[n++] = ' ';
+        n += format_uint(line + n, result.bytes);
+        line[n++] = ' ';
+        n += format_uint(line + n, result.min_cycles);
+        line[n++] = ' ';
+        n += format_uint(line + n, result.max_cycles);
+    } else {
+        n += format_str(line + n, "END");
+    }
+    line[n++] = '\r';
+    line[n++] = '\n';
+    return n;
+}
+
+bool bench_impl::poll_suite()
+{
+    if (is_suite_requested) {
+        is_suite_requested = false;
+        if (!usb_cdc_is_connected())
+            return false;
+        run_suite();
+        report_line = 0;
+    }
+
+    if (report_line < 0)
+        return false;
+
+    // each line is sent in a packet of its own (always shorter than 64 bytes, no ZLP needed)
+    // (the previous line might still be copied by DMA)
+    if (qsb_dev_ep_transmit_avail(usb_device, DATA_IN_1) == 0 || qsb_dev_ep_transmit_pending(usb_device, DATA_IN_1))
+        return true;
+    int len = format_report_line(report_line, report_packet);
+    if (qsb_dev_ep_transmit_packet(usb_device, DATA_IN_1, (const uint8_t *)report_packet, len) < 0)
+        return true;
+
+    report_line++;
+    if (report_line > num_suite_results + 1)
+        report_line = -1;
+    return true;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,13 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Boot timing (time to USB configuration and to the first data byte)
+ */
+
+#include "boot_timing.h"
+
+boot_timing_impl boot_timing;
@@ -0,0 +1,36 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Clock synchronization with the USB frames (build option)
+ */
+
+#include "clock_sync.h"
+
+#if CLOCK_SYNC == 1
+
+#include "common.h"
+#include "qsb_fsdev.h"
+#include <libopencm3/stm32/rcc.h>
+
+clock_sync_impl clock_sync;
+
+void clock_sync_impl::on_sof()
+{
+    uint32_t fnr = USB_FNR;
+    data.sof_ticks = clock_ticks(&data.millis, &data.systick);
+    data.frame_number = fnr & USB_FNR_FN;
+    data.sof_count++;
+}
+
+const clock_sync_data &clock_sync_impl::frame_time()
+{
+    data.request_ticks = clock_ticks();
+    data.clock_freq = rcc_ahb_frequency;
+    return data;
+}
+
+#endif
@@ -9,10 +9,22 @@
  */
 
 #include "common.h"
+#include "event_loop.h"
+#include "hardware.h"
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
 
 static volatile uint32_t millis_count;
+static uint32_t ticks_per_ms;
+// upper 16 bits of the microsecond time (incremented at each timer overflow)
+static volatile uint32_t micros_high;
+#if EVENT_LOOP == 1
+static uint32_t wake_time;
+#endif
 
 uint32_t millis()
 {
@@ -31,6 +43,75 @@ bool has_expired(uint32_t timeout)
     return (int32_t)timeout - (int32_t)millis_count <= 0;
 }
 
+uint32_t clock_ticks()
+{
+	uint32_t ms;
+	uint32_t cvr;
+	return clock_ticks(&ms, &cvr);
+}
+
+uint32_t clock_ticks(uint32_t *ms, uint32_t *systick)
+{
+	uint32_t pending;
+
+	// retry if the system tick interrupt has occurred or become pending in-between
+	do {
+		*ms = millis_count;
+		pending = SCB_ICSR & SCB_ICSR_PENDSTSET;
+		*systick = STK_CVR;
+	} while (*ms != millis_count || pending != (SCB_ICSR & SCB_ICSR_PENDSTSET));
+
+	// counter has wrapped but interrupt not yet handled (masked or called from a higher priority interrupt)
+	if (pending != 0)
+		*ms += 1;
+
+	// SysTick counts down from ticks_per_ms - 1
+	return *ms * ticks_per_ms + (ticks_per_ms - 1 - *systick);
+}
+
+uint32_t micros()
+{
+	uint32_t high;
+	uint32_t count;
+	uint32_t status;
+
+	// retry if the timer interrupt has occurred in-between
+	do {
+		high = micros_high;
+		count = TIM_CNT(MICROS_TIMER);
+		status = TIM_SR(MICROS_TIMER);
+	} while (high != micros_high);
+
+	// overflow not yet handled (interrupt pending or masked)
+	if ((status & TIM_SR_UIF) != 0 && count < 0x8000)
+		high += 0x10000;
+
+	return high + count;
+}
+
+#if EVENT_LOOP == 1
+
+void wake_at(uint32_t time)
+{
+	if ((int32_t)(time - micros()) >= 1000)
+		return; // system tick comes first
+	if ((TIM_DIER(MICROS_TIMER) & TIM_DIER_CC1IE) != 0 && (int32_t)(wake_time - time) <= 0)
+		return; // earlier wake-up pending
+
+	wake_time = time;
+	timer_set_oc_value(MICROS_TIMER, TIM_OC1, (uint16_t)time);
+	timer_clear_flag(MICROS_TIMER, TIM_SR_CC1IF);
+	timer_enable_irq(MICROS_TIMER, TIM_DIER_CC1IE);
+
+	// the compare match only occurs if the time has not passed yet
+	if ((int32_t)(time - micros()) <= 0)
+		event_loop.signal(wake_timer);
+}
+
+#endif
+
+#if BOARD_CLOCK == BOARD_CLOCK_HSE_BYPASS_16MHZ
+
 void rcc_clock_setup_in_hsebyp_16mhz_out_48mhz(void)
 {
 	RCC_CR |= RCC_CR_HSEBYP;
@@ -58,25 +139,65 @@ void rcc_clock_setup_in_hsebyp_16mhz_out_48mhz(void)
 	rcc_ahb_frequency = 48000000;
 }
 
+#endif
+
 void common_init()
 {
 	// Initialize SysTick
 
+#if BOARD_CLOCK == BOARD_CLOCK_HSI48
+	rcc_clock_setup_in_hsi48_out_48mhz();
+#elif BOARD_CLOCK == BOARD_CLOCK_HSE_BYPASS_16MHZ
 	rcc_clock_setup_in_hsebyp_16mhz_out_48mhz();
-	// rcc_clock_setup_in_hsi_out_48mhz();
+#elif BOARD_CLOCK == BOARD_CLOCK_HSE_8MHZ_72MHZ
+	// also sets the USB prescaler to 1.5 (48 MHz)
+	rcc_clock_setup_in_hse_8mhz_out_72mhz();
+#endif
 
 	// Interrupt every 1ms
+	ticks_per_ms = rcc_ahb_frequency / 1000;
 	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
-	systick_set_reload(rcc_ahb_frequency / 1000 - 1);
+	systick_set_reload(ticks_per_ms - 1);
 
 	// Enable and start
 	systick_interrupt_enable();
 	systick_counter_enable();
+
+	// Microsecond timer (the timer clock is the system clock: APB prescaler 1,
+	// or 2 with the timer clock doubled)
+	rcc_periph_clock_enable(MICROS_TIMER_RCC);
+	timer_set_prescaler(MICROS_TIMER, rcc_ahb_frequency / 1000000 - 1);
+	timer_set_period(MICROS_TIMER, 0xffff);
+	timer_generate_event(MICROS_TIMER, TIM_EGR_UG); // load prescaler
+	timer_clear_flag(MICROS_TIMER, TIM_SR_UIF);
+	timer_enable_irq(MICROS_TIMER, TIM_DIER_UIE);
+	nvic_set_priority(MICROS_TIMER_IRQ, 1 << 6);
+	nvic_enable_irq(MICROS_TIMER_IRQ);
+	timer_enable_counter(MICROS_TIMER);
 }
 
 // System tick timer interrupt handler
 extern "C" void sys_tick_handler()
 {
 	millis_count++;
+#if EVENT_LOOP == 1
+	event_loop.signal(wake_systick);
+#endif
+}
+
+// Microsecond timer interrupt handler (overflow every 65.536 ms)
+extern "C" void MICROS_TIMER_ISR()
+{
+	if (timer_get_flag(MICROS_TIMER, TIM_SR_UIF)) {
+		timer_clear_flag(MICROS_TIMER, TIM_SR_UIF);
+		micros_high += 0x10000;
+	}
+
+#if EVENT_LOOP == 1
+	if ((TIM_DIER(MICROS_TIMER) & TIM_DIER_CC1IE) != 0 && timer_get_flag(MICROS_TIMER, TIM_SR_CC1IF)) {
+		timer_disable_irq(MICROS_TIMER, TIM_DIER_CC1IE);
+		event_loop.signal(wake_timer);
+	}
+#endif
 }
 
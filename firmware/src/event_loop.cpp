@@ -0,0 +1,47 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Event-driven main loop (build option)
+ */
+
+#include "event_loop.h"
+
+#if EVENT_LOOP == 1
+
+#include "common.h"
+#include <libopencm3/cm3/cortex.h>
+
+event_loop_impl event_loop;
+
+void event_loop_impl::signal(uint32_t sources)
+{
+    // the interrupt handlers have different priorities and might preempt each other
+    bool masked = cm_mask_interrupts(true);
+    pending_sources = pending_sources | sources;
+    cm_mask_interrupts(masked);
+}
+
+uint32_t event_loop_impl::wait()
+{
+    cm_disable_interrupts();
+    while (pending_sources == 0) {
+        // WFI also wakes up if the interrupt is masked (PRIMASK). So an interrupt
+        // occurring between the check and WFI is not missed. Its handler runs as
+        // soon as interrupts are enabled again.
+        __WFI();
+        cm_enable_interrupts();
+        __ISB();
+        cm_disable_interrupts();
+    }
+
+    uint32_t sources = pending_sources;
+    pending_sources = 0;
+    cm_enable_interrupts();
+    return sources;
+}
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * CRC check of received frames with the CRC unit (build option)
+ */
+
+#include "frame_crc.h"
+
+#if FRAME_CRC == 1
+
+#include "common.h"
+#include "perf_counters.h"
+#include "usb_vendor.h"
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/rcc.h>
+#include <string.h>
+
+#ifndef CRC_DR8
+// 8-bit access to the data register (processes a single byte)
+#define CRC_DR8 MMIO8(CRC_BASE + 0x00)
+#endif
+
+// Length of the CRC trailer (in bytes)
+constexpr uint32_t CRC_TRAILER_LEN = 4;
+
+frame_crc_impl frame_crc;
+
+void frame_crc_impl::configure(uint32_t flags)
+{
+    rcc_periph_clock_enable(RCC_CRC);
+
+    // With byte-wise input reversal, each byte is processed LSB first.
+    // Words are byte-swapped when written (see feed()).
+    bool is_reflected = (flags & USB_SERIAL_CRC_REFLECTED) != 0;
+    crc_set_reverse_input(is_reflected ? CRC_CR_REV_IN_BYTE : CRC_CR_REV_IN_NONE);
+    if (is_reflected)
+        crc_reverse_output_enable();
+    else
+        crc_reverse_output_disable();
+    uint32_t init = (flags & USB_SERIAL_CRC_INIT_ONES) != 0 ? 0xffffffff : 0;
+    crc_set_initial(init);
+
+    // The residue does not depend on the frame data. So it is the CRC register
+    // value after the trailer of an empty frame (initial value, final XOR applied).
+    uint32_t empty_crc = init ^ ((flags & USB_SERIAL_CRC_XOR_OUT) != 0 ? 0xffffffff : 0);
+    uint8_t trailer[CRC_TRAILER_LEN];
+    for (uint32_t i = 0; i < CRC_TRAILER_LEN; i++) {
+        int shift = is_reflected ? 8 * i : 24 - 8 * i;
+        trailer[i] = (uint8_t)(empty_crc >> shift);
+    }
+    crc_reset();
+    feed(trailer, sizeof(trailer));
+    residue = CRC_DR;
+
+    start_frame();
+}
+
+RAMFUNC int frame_crc_impl::process(const uint8_t *data, size_t len, uint8_t delimiter)
+{
+    int errors = 0;
+    while (len > 0) {
+        const uint8_t *end = (const uint8_t *)memchr(data, delimiter, len);
+        size_t n = end != nullptr ? end - data : len;
+        if (!is_resyncing) {
+            feed(data, n);
+            frame_len += n;
+        }
+        if (end == nullptr)
+            break;
+
+        // end of frame (empty frames between consecutive delimiters are ignored)
+        if (!is_resyncing && frame_len != 0) {
+            perf_counters.rx_crc_frames++;
+            if (frame_len < CRC_TRAILER_LEN || CRC_DR != residue) {
+                perf_counters.rx_crc_errors++;
+                errors++;
+            }
+        }
+        start_frame();
+        data = end + 1;
+        len -= n + 1;
+    }
+    return errors;
+}
+
+// Writes the data to the CRC unit
+RAMFUNC void frame_crc_impl::feed(const uint8_t *data, size_t len)
+{
+    // single bytes up to a word boundary
+    for (; len > 0 && ((uintptr_t)data & 3) != 0; len--)
+        CRC_DR8 = *data++;
+
+    // words (the unit processes the most significant byte first)
+    const uint32_t *words = (const uint32_t *)data;
+    for (size_t i = len / 4; i > 0; i--)
+        CRC_DR = __builtin_bswap32(*words++);
+
+    // remaining bytes
+    data = (const uint8_t *)words;
+    for (len &= 3; len > 0; len--)
+        CRC_DR8 = *data++;
+}
+
+void frame_crc_impl::start_frame()
+{
+    crc_reset();
+    frame_len = 0;
+    is_resyncing = false;
+}
+
+#endif
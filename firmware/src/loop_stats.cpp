@@ -0,0 +1,52 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Main loop statistics (instrumentation build option)
+ */
+
+#include "loop_stats.h"
+
+#if LOOP_STATS == 1
+
+#include "common.h"
+#include <libopencm3/stm32/rcc.h>
+#include <string.h>
+
+loop_stats_impl loop_stats;
+
+void loop_stats_impl::on_loop_start()
+{
+    uint32_t timestamp = clock_ticks();
+
+    if (!is_first_iteration) {
+        uint32_t period = timestamp - last_timestamp;
+        int bucket = period == 0 ? 0 : 32 - __builtin_clz(period);
+        if (bucket >= LOOP_STATS_NUM_BUCKETS)
+            bucket = LOOP_STATS_NUM_BUCKETS - 1;
+        data.histogram[bucket]++;
+        if (period > data.max_period)
+            data.max_period = period;
+        data.iterations++;
+        if (!has_done_work)
+            data.idle_iterations++;
+    }
+
+    is_first_iteration = false;
+    last_timestamp = timestamp;
+    has_done_work = false;
+}
+
+void loop_stats_impl::reset()
+{
+    memset(&data, 0, sizeof(data));
+    data.clock_freq = rcc_ahb_frequency;
+
+    // the period of the current iteration is distorted by the reset
+    is_first_iteration = true;
+}
+
+#endif
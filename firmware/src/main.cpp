@@ -8,8 +8,13 @@
  * Main program
  */
 
+#include "bench.h"
 #include "common.h"
+#include "event_loop.h"
 #include "hardware.h"
+#include "loop_stats.h"
+#include "target_ctrl.h"
+#include "usb_cdc.h"
 #include "usb_conf.h"
 #include "usb_serial.h"
 #include <libopencm3/stm32/gpio.h>
@@ -22,22 +27,72 @@ static void gpio_setup()
 	rcc_periph_clock_enable(RCC_GPIOA);
 	rcc_periph_clock_enable(RCC_GPIOB);
 
-	gpio_mode_setup(GPIOA, GPIO_MODE_INPUT, GPIO_PUPD_PULLDOWN, GPIO0 | GPIO1 | GPIO4 | GPIO5 | GPIO6 | GPIO7 | GPIO13 | GPIO14);
-	gpio_mode_setup(GPIOB, GPIO_MODE_INPUT, GPIO_PUPD_PULLDOWN, GPIO1);
+	// unused pins (see board profile)
+#if TARGET_CTRL == 1
+	// a pull-down on the target's reset pin could hold it in reset
+	static_assert(TARGET_CTRL_PORT == GPIOA, "target control pins expected on GPIOA");
+	constexpr uint16_t unused_gpioa = BOARD_UNUSED_GPIOA & ~(TARGET_NRST_GPIO | TARGET_BOOT0_GPIO);
+#else
+	constexpr uint16_t unused_gpioa = BOARD_UNUSED_GPIOA;
+#endif
+#if defined(STM32F1)
+	gpio_clear(GPIOA, unused_gpioa);
+	gpio_clear(GPIOB, BOARD_UNUSED_GPIOB);
+	gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, unused_gpioa);
+	gpio_set_mode(GPIOB, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, BOARD_UNUSED_GPIOB);
+#else
+	gpio_mode_setup(GPIOA, GPIO_MODE_INPUT, GPIO_PUPD_PULLDOWN, unused_gpioa);
+	gpio_mode_setup(GPIOB, GPIO_MODE_INPUT, GPIO_PUPD_PULLDOWN, BOARD_UNUSED_GPIOB);
+#endif
 }
 
 int main()
 {
 	common_init();
 	gpio_setup();
+#if TARGET_CTRL == 1
+	target_ctrl.init();
+#endif
+	usb_cdc_init(); // starts the disconnect period, overlapping the remaining initialization
 	qsb_serial_num_init();
 	usb_serial.init();
+#if DUAL_CDC == 1
+	usb_serial_2.init();
+#endif
 
 	bool connected = false;
 
+#if LOOP_STATS == 1
+	loop_stats.reset();
+#endif
+
 	while (1)
 	{
-		usb_serial.poll();
+#if EVENT_LOOP == 1
+		// sleeps until an interrupt has set a wake flag
+		uint32_t wake = event_loop.wait();
+#else
+		constexpr uint32_t wake = wake_all;
+#endif
+#if LOOP_STATS == 1
+		loop_stats.on_loop_start();
+#endif
+		if ((wake & (wake_usb | wake_systick)) != 0)
+			usb_cdc_poll();
+#if BENCH_SUITE == 1
+		if ((wake & (wake_usb | wake_systick)) != 0 && bench.poll_suite())
+			continue; // benchmark suite report being sent
+#endif
+		if ((wake & (wake_usb | wake_systick | wake_timer | wake_uart_port(0))) != 0)
+			usb_serial.poll();
+#if DUAL_CDC == 1
+		if ((wake & (wake_usb | wake_systick | wake_timer | wake_uart_port(1))) != 0)
+			usb_serial_2.poll();
+#endif
+#if TARGET_CTRL == 1
+		if ((wake & wake_systick) != 0)
+			target_ctrl.poll();
+#endif
 	}
 
 	return 0;
@@ -0,0 +1,19 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Performance counters of the data path
+ */
+
+#include "perf_counters.h"
+#include <string.h>
+
+perf_counters_impl perf_counters;
+
+void perf_counters_impl::reset()
+{
+    memset(this, 0, sizeof(*this));
+}
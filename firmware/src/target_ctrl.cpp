@@ -0,0 +1,81 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Reset and boot mode control of the target MCU (build option)
+ */
+
+#include "target_ctrl.h"
+
+#if TARGET_CTRL == 1
+
+#include "common.h"
+#include "hardware.h"
+#include <libopencm3/stm32/gpio.h>
+
+target_ctrl_impl target_ctrl;
+
+void target_ctrl_impl::init()
+{
+    // NRST is open-drain (the target has a pull-up), BOOT0 push-pull
+    gpio_set(TARGET_CTRL_PORT, TARGET_NRST_GPIO);
+    gpio_clear(TARGET_CTRL_PORT, TARGET_BOOT0_GPIO);
+#if defined(STM32F1)
+    gpio_set_mode(TARGET_CTRL_PORT, GPIO_MODE_OUTPUT_2_MHZ, GPIO_CNF_OUTPUT_OPENDRAIN, TARGET_NRST_GPIO);
+    gpio_set_mode(TARGET_CTRL_PORT, GPIO_MODE_OUTPUT_2_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, TARGET_BOOT0_GPIO);
+#else
+    gpio_mode_setup(TARGET_CTRL_PORT, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, TARGET_NRST_GPIO | TARGET_BOOT0_GPIO);
+    gpio_set_output_options(TARGET_CTRL_PORT, GPIO_OTYPE_OD, GPIO_OSPEED_LOW, TARGET_NRST_GPIO);
+    gpio_set_output_options(TARGET_CTRL_PORT, GPIO_OTYPE_PP, GPIO_OSPEED_LOW, TARGET_BOOT0_GPIO);
+#endif
+
+    is_reset_asserted = false;
+    is_boot0_asserted = false;
+    is_boot0_release_pending = false;
+}
+
+void target_ctrl_impl::set_control_lines(bool dtr, bool rts)
+{
+    bool reset = rts && !dtr;
+    bool boot0 = dtr && !rts;
+
+    if (reset) {
+        gpio_clear(TARGET_CTRL_PORT, TARGET_NRST_GPIO);
+    } else if (is_reset_asserted) {
+        // BOOT0 must be valid before the reset is released and is held while the target samples it
+        set_boot0(boot0);
+        boot0_hold_until = millis() + TARGET_BOOT0_HOLD_TIME;
+        gpio_set(TARGET_CTRL_PORT, TARGET_NRST_GPIO);
+    }
+    is_reset_asserted = reset;
+
+    if (boot0) {
+        set_boot0(true);
+    } else if (is_boot0_asserted) {
+        is_boot0_release_pending = true;
+        release_boot0();
+    }
+}
+
+void target_ctrl_impl::set_boot0(bool asserted)
+{
+    if (asserted)
+        gpio_set(TARGET_CTRL_PORT, TARGET_BOOT0_GPIO);
+    else
+        gpio_clear(TARGET_CTRL_PORT, TARGET_BOOT0_GPIO);
+    is_boot0_asserted = asserted;
+    is_boot0_release_pending = false;
+}
+
+void target_ctrl_impl::release_boot0()
+{
+    // BOOT0 is irrelevant while the target is in reset
+    if (!is_reset_asserted && !has_expired(boot0_hold_until))
+        return; // target might not have sampled it yet
+    set_boot0(false);
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * USB Serial
+ * 
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ * 
+ * Event trace (instrumentation build option)
+ */
+
+#include "trace.h"
+
+#if TRACE == 1
+
+#include "common.h"
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/stm32/rcc.h>
+#include <string.h>
+
+trace_impl trace_ring;
+
+RAMFUNC void trace_impl::add(uint8_t event, uint32_t arg)
+{
+    // write the record with interrupts masked (interrupt handlers add records, too,
+    // and read() must not see a record that has been reserved but not yet written)
+    bool masked = cm_mask_interrupts(true);
+    trace_record *record = &records[write_count & (TRACE_LEN - 1)];
+    record->timestamp = clock_ticks();
+    record->event_arg = event | (arg << 8);
+    write_count++;
+    cm_mask_interrupts(masked);
+}
+
+uint16_t trace_impl::read(uint16_t first, uint8_t *buf, uint16_t len)
+{
+    if (len < sizeof(trace_header))
+        return 0;
+
+    trace_header header;
+    header.write_count = write_count;
+    header.clock_freq = rcc_ahb_frequency;
+
+    // extend the sequence number to 32 bits and limit it to the available records
+    uint32_t seq = header.write_count - (uint16_t)(header.write_count - first);
+    if ((int32_t)(header.write_count - seq) > TRACE_LEN)
+        seq = header.write_count > TRACE_LEN ? header.write_count - TRACE_LEN : 0;
+    header.first = seq;
+
+    memcpy(buf, &header, sizeof(header));
+    uint16_t n = sizeof(header);
+    while (seq != header.write_count && n + sizeof(trace_record) <= len) {
+        memcpy(buf + n, &records[seq & (TRACE_LEN - 1)], sizeof(trace_record));
+        n += sizeof(trace_record);
+        seq++;
+    }
+
+    return n;
+}
+
+#endif
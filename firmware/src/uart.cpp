@@ -10,232 +10,570 @@
 
 #include "common.h"
 #include "hardware.h"
+#include "perf_counters.h"
+#include "trace.h"
 #include "uart.h"
 #include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/usart.h>
+#include <libopencm3/cm3/nvic.h>
 #include <string.h>
 
-uart_impl uart;
+#if defined(STM32F1)
+// The STM32F1 USART has a status register (instead of interrupt and status register)
+// and a single data register (instead of separate RX and TX data registers)
+#define USART_ISR USART_SR
+#define USART_ISR_PE USART_SR_PE
+#define USART_ISR_FE USART_SR_FE
+#define USART_ISR_IDLE USART_SR_IDLE
+#define USART_TDR USART_DR
+#define USART_RDR USART_DR
+#endif
+
+uart_impl<uart_1_hw> uart;
+#if DUAL_CDC == 1
+uart_impl<uart_2_hw> uart_2;
+#endif
+
+// Window for measuring the RX drain rate (in ms, power of 2)
+#define RX_DRAIN_WINDOW 16
+
+// Window for measuring the TX fill rate (in ms, power of 2)
+#define TX_FILL_WINDOW 16
+
+// Range of the adaptive TX chunk size (in bytes)
+#define TX_MIN_CHUNK_SIZE 16
+#define TX_MAX_CHUNK_SIZE 256
+
+// Default baud rate aliases (legacy baud rates mapped to exact fractions of the 48 MHz clock),
+// used as Linux does not easily allow baud rates over 4M (aliases exceeding the maximum
+// baud rate of the board are skipped)
+static const uart_baud_alias default_baud_aliases[] = {
+    { 75, 6000000 },    // 48 MHz / 8
+    { 110, 4800000 },   // 48 MHz / 10
+    { 134, 4000000 },   // 48 MHz / 12
+    { 150, 3000000 },   // 48 MHz / 16
+};
 
-void uart_impl::init()
+template <class HW>
+void uart_impl<HW>::init()
 {
     // Enable USART interface clock
-    rcc_periph_clock_enable(USART_RCC);
+    rcc_periph_clock_enable(HW::usart_rcc);
 
     // Enable TX, RX pin clock
-    rcc_periph_clock_enable(RCC_GPIOA);
+    rcc_periph_clock_enable(HW::port_rcc);
+
+    reset_baud_aliases();
 
     // Configure RX/TXpins
-    gpio_set(USART_PORT, USART_TX_GPIO);
-    gpio_mode_setup(USART_PORT, GPIO_MODE_AF, GPIO_PUPD_PULLUP, USART_TX_GPIO | USART_RX_GPIO);
-    gpio_set_af(USART_PORT, GPIO_AF1, USART_TX_GPIO | USART_RX_GPIO);
+    gpio_set(HW::port, HW::tx_gpio);
+#if defined(STM32F1)
+    gpio_set(HW::port, HW::rx_gpio); // pull-up
+    gpio_set_mode(HW::port, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, HW::tx_gpio);
+    gpio_set_mode(HW::port, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, HW::rx_gpio);
+#else
+    gpio_mode_setup(HW::port, GPIO_MODE_AF, GPIO_PUPD_PULLUP, HW::tx_gpio | HW::rx_gpio);
+    gpio_set_af(HW::port, HW::gpio_af, HW::tx_gpio | HW::rx_gpio);
+#endif
+
+    // Configure RTS pin (controlled by software, initially asserted)
+    gpio_clear(HW::rts_port, HW::rts_gpio);
+#if defined(STM32F1)
+    gpio_set_mode(HW::rts_port, GPIO_MODE_OUTPUT_2_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, HW::rts_gpio);
+#else
+    gpio_mode_setup(HW::rts_port, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, HW::rts_gpio);
+#endif
+    is_rts_deasserted = false;
 }
 
-void uart_impl::enable()
+template <class HW>
+void uart_impl<HW>::enable()
 {
+    nvic_disable_irq(HW::dma_tx_irq);
+    nvic_disable_irq(HW::dma_rx_irq);
+#if EVENT_LOOP == 1
+    nvic_disable_irq(HW::usart_irq);
+#endif
+
     is_transmitting = false;
-    tx_buf_head = tx_buf_tail = 0;
+    tx_buf.clear();
     tx_size = 0;
-    rx_buf_tail = 0;
+    rx_dma_count = 0;
+    rx_buf.clear();
+#if defined(STM32F1)
+    error_flag_rx_count = 0;
+    idle_flag_rx_count = 0;
+#endif
+#if RX_TIMESTAMPS == 1
+    memset(rx_arrivals, 0, sizeof(rx_arrivals));
+    rx_arrival_index = 0;
+#endif
+    rx_drain_rate = 0;
+    rx_drain_window_start = millis();
+    rx_drain_window_count = 0;
+    tx_chunk_scale = UINT16_MAX;
+    tx_fill_window_start = millis();
+    tx_fill_window_count = 0;
+    gpio_clear(HW::rts_port, HW::rts_gpio);
+    is_rts_deasserted = false;
 
     // configure TX DMA
     rcc_periph_clock_enable(USART_DMA_RCC);
-    dma_channel_reset(USART_DMA, USART_DMA_TX_CHAN);
-    dma_set_peripheral_address(USART_DMA, USART_DMA_TX_CHAN, (uint32_t)&USART_TX_DATA_REG);
-    dma_set_read_from_memory(USART_DMA, USART_DMA_TX_CHAN);
-    dma_enable_memory_increment_mode(USART_DMA, USART_DMA_TX_CHAN);
-    dma_set_memory_size(USART_DMA, USART_DMA_TX_CHAN, DMA_CCR_MSIZE_8BIT);
-    dma_set_peripheral_size(USART_DMA, USART_DMA_TX_CHAN, DMA_CCR_MSIZE_8BIT);
-    dma_set_priority(USART_DMA, USART_DMA_TX_CHAN, DMA_CCR_PL_MEDIUM);
-    dma_enable_transfer_complete_interrupt(USART_DMA, USART_DMA_TX_CHAN);
+    dma_channel_reset(HW::dma, HW::dma_tx_chan);
+    dma_set_peripheral_address(HW::dma, HW::dma_tx_chan, (uint32_t)(uintptr_t)&USART_TDR(HW::usart));
+    dma_set_read_from_memory(HW::dma, HW::dma_tx_chan);
+    dma_enable_memory_increment_mode(HW::dma, HW::dma_tx_chan);
+    dma_set_memory_size(HW::dma, HW::dma_tx_chan, DMA_CCR_MSIZE_8BIT);
+    dma_set_peripheral_size(HW::dma, HW::dma_tx_chan, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(HW::dma, HW::dma_tx_chan, DMA_CCR_PL_MEDIUM);
+    dma_enable_transfer_complete_interrupt(HW::dma, HW::dma_tx_chan);
+    dma_enable_transfer_error_interrupt(HW::dma, HW::dma_tx_chan);
 
     // configure RX DMA (as circular buffer)
-    dma_channel_reset(USART_DMA, USART_DMA_RX_CHAN);
-    dma_set_peripheral_address(USART_DMA, USART_DMA_RX_CHAN, (uint32_t)&USART_RX_DATA_REG);
-    dma_set_read_from_peripheral(USART_DMA, USART_DMA_RX_CHAN);
-    dma_enable_memory_increment_mode(USART_DMA, USART_DMA_RX_CHAN);
-    dma_enable_circular_mode(USART_DMA, USART_DMA_RX_CHAN);
-    dma_set_memory_size(USART_DMA, USART_DMA_RX_CHAN, DMA_CCR_MSIZE_8BIT);
-    dma_set_peripheral_size(USART_DMA, USART_DMA_RX_CHAN, DMA_CCR_MSIZE_8BIT);
-    dma_set_priority(USART_DMA, USART_DMA_RX_CHAN, DMA_CCR_PL_MEDIUM);
-    dma_set_memory_address(USART_DMA, USART_DMA_RX_CHAN, (uint32_t)rx_buf);
-    dma_set_number_of_data(USART_DMA, USART_DMA_RX_CHAN, UART_RX_BUF_LEN);
-
-    dma_enable_channel(USART_DMA, USART_DMA_RX_CHAN);
+    dma_channel_reset(HW::dma, HW::dma_rx_chan);
+    dma_set_peripheral_address(HW::dma, HW::dma_rx_chan, (uint32_t)(uintptr_t)&USART_RDR(HW::usart));
+    dma_set_read_from_peripheral(HW::dma, HW::dma_rx_chan);
+    dma_enable_memory_increment_mode(HW::dma, HW::dma_rx_chan);
+    dma_enable_circular_mode(HW::dma, HW::dma_rx_chan);
+    dma_set_memory_size(HW::dma, HW::dma_rx_chan, DMA_CCR_MSIZE_8BIT);
+    dma_set_peripheral_size(HW::dma, HW::dma_rx_chan, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(HW::dma, HW::dma_rx_chan, DMA_CCR_PL_MEDIUM);
+    dma_set_memory_address(HW::dma, HW::dma_rx_chan, (uint32_t)(uintptr_t)rx_buf.data());
+    dma_set_number_of_data(HW::dma, HW::dma_rx_chan, rx_buf_len);
+    dma_enable_half_transfer_interrupt(HW::dma, HW::dma_rx_chan);
+    dma_enable_transfer_complete_interrupt(HW::dma, HW::dma_rx_chan);
+
+    dma_enable_channel(HW::dma, HW::dma_rx_chan);
 
     // configure baud rate etc.
     set_coding(9600, 8, uart_stopbits::_1_0, uart_parity::none);
-    usart_set_mode(USART, USART_MODE_TX_RX);
-    usart_set_flow_control(USART, USART_FLOWCONTROL_CTS);
-
-    usart_enable_rx_dma(USART);
-    usart_enable_tx_dma(USART);
-    usart_enable(USART);
+    usart_set_mode(HW::usart, USART_MODE_TX_RX);
+    usart_set_flow_control(HW::usart, HW::flow_control);
+
+    usart_enable_rx_dma(HW::usart);
+    usart_enable_tx_dma(HW::usart);
+    usart_enable(HW::usart);
+
+    // The next TX chunk is started from the DMA interrupt handler.
+    // It needs the highest priority for gapless transmission.
+    nvic_set_priority(HW::dma_tx_irq, 0);
+    nvic_set_priority(HW::dma_rx_irq, 0);
+    nvic_enable_irq(HW::dma_tx_irq);
+    nvic_enable_irq(HW::dma_rx_irq);
+
+#if EVENT_LOOP == 1
+    // The idle line interrupt wakes up the main loop at the end of a burst
+    USART_CR1(HW::usart) |= USART_CR1_IDLEIE;
+    arm_rx_start_wake();
+    nvic_set_priority(HW::usart_irq, 1 << 6);
+    nvic_enable_irq(HW::usart_irq);
+#endif
 
     is_enabled = true;
 }
 
-void uart_impl::poll()
+template <class HW>
+RAMFUNC void uart_impl<HW>::poll()
 {
     if (!is_enabled)
         return;
 
-    // TX side
-    poll_tx_complete();
-    start_transmission();
-
     // RX side
     check_rx_overrun();
+    check_rx_errors();
+    measure_rx_drain_rate();
+    update_rts();
+#if EVENT_LOOP == 1
+    arm_rx_start_wake();
+#endif
+
+    // TX side
+    measure_tx_fill_rate();
 }
 
-void uart_impl::transmit(const uint8_t *data, size_t len)
+template <class HW>
+uint8_t *uart_impl<HW>::reserve_tx(size_t len)
 {
-    int buf_tail = tx_buf_tail;
-    int buf_head = tx_buf_head;
-
-    size_t avail_chunk_size;
-    if (buf_head < buf_tail)
-        avail_chunk_size = buf_tail - buf_head - 1;
-    else if (buf_tail != 0)
-        avail_chunk_size = UART_TX_BUF_LEN - buf_head;
-    else
-        avail_chunk_size = UART_TX_BUF_LEN - 1 - buf_head;
+    if (len > UART_TX_BUF_SLACK || tx_buf.avail() < len)
+        return nullptr;
 
-    if (avail_chunk_size == 0)
-        return; // buffer full - discard data
+    return tx_buf.write_ptr();
+}
 
-    // Copy data to transmit buffer
-    size_t size = std::min(len, avail_chunk_size);
-    memcpy(tx_buf + buf_head, data, size);
+template <class HW>
+RAMFUNC void uart_impl<HW>::commit_tx(size_t len)
+{
     if (_databits == 7)
-        clear_high_bits(tx_buf + buf_head, size);
-    buf_head += size;
-    if (buf_head >= UART_TX_BUF_LEN)
-        buf_head = 0;
-    tx_buf_head = buf_head;
+        clear_high_bits(tx_buf.write_ptr(), len);
+
+    // data in slack area is moved to start of buffer
+    tx_buf.commit(len);
+
+    size_t fill = tx_buf.size();
+    if (fill > perf_counters.tx_buf_peak)
+        perf_counters.tx_buf_peak = fill;
+#if TELEMETRY == 1
+    if (fill > tx_buf_report_peak)
+        tx_buf_report_peak = fill;
+#endif
 
     // start transmission
     start_transmission();
-
-    // Use second transmit in case of remaining data
-    // (usually because of wrap around at the end of the buffer)
-    if (size < len)
-        transmit(data + size, len - size);
 }
 
-void uart_impl::start_transmission()
+template <class HW>
+void uart_impl<HW>::start_transmission()
 {
-    if (is_transmitting || tx_buf_head == tx_buf_tail)
+    if (is_transmitting || tx_buf.empty())
         return; // UART busy or queue empty
 
-    // Determine TX chunk size
-    int start_pos = tx_buf_tail;
-    int end_pos = tx_buf_head;
-    if (end_pos <= start_pos)
-        end_pos = UART_TX_BUF_LEN;
-    tx_size = end_pos - start_pos;
+    // Determine TX chunk size (contiguous data up to end of buffer)
+    tx_size = tx_buf.read_span();
+    if (tx_max_chunk_size_setting == 0)
+        tx_max_chunk_size = adaptive_tx_chunk_size();
     if (tx_size > tx_max_chunk_size)
         tx_size = tx_max_chunk_size; // limit size to free up space soon
     is_transmitting = true;
 
     // set transmit chunk
-    dma_set_memory_address(USART_DMA, USART_DMA_TX_CHAN, (uint32_t)(tx_buf + start_pos));
-    dma_set_number_of_data(USART_DMA, USART_DMA_TX_CHAN, tx_size);
+    dma_set_memory_address(HW::dma, HW::dma_tx_chan, (uint32_t)(uintptr_t)tx_buf.read_ptr());
+    dma_set_number_of_data(HW::dma, HW::dma_tx_chan, tx_size);
 
     // start transmission
-    dma_enable_channel(USART_DMA, USART_DMA_TX_CHAN);
+    dma_enable_channel(HW::dma, HW::dma_tx_chan);
+    trace(trace_event::tx_dma_start, tx_size, HW::port_index);
 }
 
-void uart_impl::poll_tx_complete()
+template <class HW>
+void uart_impl<HW>::on_tx_complete()
 {
-    if (!dma_get_interrupt_flag(USART_DMA, USART_DMA_TX_CHAN, DMA_TCIF | DMA_TEIF))
-        return;
+    dma_clear_interrupt_flags(HW::dma, HW::dma_tx_chan, DMA_TCIF | DMA_TEIF);
+
+    // Disable DMA
+    dma_disable_channel(HW::dma, HW::dma_tx_chan);
 
-    dma_clear_interrupt_flags(USART_DMA, USART_DMA_TX_CHAN, DMA_TCIF | DMA_TEIF);
+    trace(trace_event::tx_dma_done, tx_size, HW::port_index);
 
     // Update TX buffer
-    int buf_tail = tx_buf_tail + tx_size;
-    if (buf_tail >= UART_TX_BUF_LEN)
-        buf_tail = 0;
-    tx_buf_tail = buf_tail;
+    tx_buf.consume(tx_size);
     tx_size = 0;
     is_transmitting = false;
 
-    // Disable DMA    
-    dma_disable_channel(USART_DMA, USART_DMA_TX_CHAN);
+    // Continue with next chunk while the UART is still
+    // busy with the last bytes of the previous chunk
+    start_transmission();
 }
 
-size_t uart_impl::copy_rx_data(uint8_t *data, size_t len)
+template <class HW>
+void uart_impl<HW>::on_rx_half_complete()
 {
-    int buf_head = UART_RX_BUF_LEN - dma_get_number_of_data(USART_DMA, USART_DMA_RX_CHAN);
-    if (buf_head == UART_RX_BUF_LEN)
-        buf_head = 0;
-    if (buf_head == rx_buf_tail)
-        return 0; // no new data
+    // count each half separately in case both have completed
+    if (dma_get_interrupt_flag(HW::dma, HW::dma_rx_chan, DMA_HTIF)) {
+        dma_clear_interrupt_flags(HW::dma, HW::dma_rx_chan, DMA_HTIF);
+        rx_dma_count += rx_buf_len / 2;
+    }
+    if (dma_get_interrupt_flag(HW::dma, HW::dma_rx_chan, DMA_TCIF)) {
+        dma_clear_interrupt_flags(HW::dma, HW::dma_rx_chan, DMA_TCIF);
+        rx_dma_count += rx_buf_len / 2;
+    }
+}
 
-    int n1 = 0;
-    int n2 = 0;
+template <class HW>
+void uart_impl<HW>::on_dma_interrupt()
+{
+    if (dma_get_interrupt_flag(HW::dma, HW::dma_tx_chan, DMA_TCIF | DMA_TEIF))
+        on_tx_complete();
+    if (dma_get_interrupt_flag(HW::dma, HW::dma_rx_chan, DMA_HTIF | DMA_TCIF))
+        on_rx_half_complete();
+#if EVENT_LOOP == 1
+    event_loop.signal(wake_uart_port(HW::port_index));
+#endif
+}
 
-    if (rx_buf_tail > buf_head)
-    {
-        last_rx_size = UART_RX_BUF_LEN - rx_buf_tail + buf_head;
-        // chunk between tail and end of buffer
-        n1 = std::min((int)len, UART_RX_BUF_LEN - rx_buf_tail);
-        memcpy(data, rx_buf + rx_buf_tail, n1);
-        if (_databits == 7)
-            clear_high_bits(data, n1);
-        rx_buf_tail += n1;
-        if (rx_buf_tail >= UART_RX_BUF_LEN)
-            rx_buf_tail = 0;
-        data += n1;
-        len -= n1;
-        last_rx_size -= n1;
+#if EVENT_LOOP == 1
+
+template <class HW>
+void uart_impl<HW>::on_usart_interrupt()
+{
+    // Both interrupts are one-shot: RXNE is re-armed once the receive
+    // buffer is empty again, IDLE by has_rx_burst_ended() once the flag
+    // has been cleared. The RXNE flag itself might already have been
+    // cleared by the DMA controller.
+    uint32_t disable = USART_CR1_RXNEIE;
+    if ((USART_ISR(HW::usart) & USART_ISR_IDLE) != 0)
+        disable |= USART_CR1_IDLEIE;
+    USART_CR1(HW::usart) &= ~disable;
+
+    event_loop.signal(wake_uart_rx_port(HW::port_index));
+}
+
+template <class HW>
+RAMFUNC void uart_impl<HW>::arm_rx_start_wake()
+{
+    // Only the first byte of a burst needs to wake up the main loop
+    // (as it is transmitted without holdback); the following bytes are
+    // covered by the DMA, idle line and system tick interrupts.
+    if ((USART_CR1(HW::usart) & USART_CR1_RXNEIE) == 0 && rx_data_len() == 0)
+        USART_CR1(HW::usart) |= USART_CR1_RXNEIE;
+}
+
+#endif
+
+// DMA interrupt handler (TX and RX channel)
+extern "C" void USART_DMA_ISR()
+{
+    uart.on_dma_interrupt();
+}
+
+#if defined(USART_DMA_RX_ISR)
+
+// DMA interrupt handler (RX channel, if it has its own interrupt)
+extern "C" void USART_DMA_RX_ISR()
+{
+    uart.on_dma_interrupt();
+}
+
+#endif
+
+#if EVENT_LOOP == 1
+
+// USART interrupt handler (event-driven main loop only)
+extern "C" void USART_IRQ_HANDLER()
+{
+    uart.on_usart_interrupt();
+}
+
+#endif
+
+#if DUAL_CDC == 1
+
+// DMA interrupt handler of second serial port (TX and RX channel)
+extern "C" void USART_2_DMA_ISR()
+{
+    uart_2.on_dma_interrupt();
+}
+
+#if defined(USART_2_DMA_RX_ISR)
+
+// DMA interrupt handler of second serial port (RX channel, if it has its own interrupt)
+extern "C" void USART_2_DMA_RX_ISR()
+{
+    uart_2.on_dma_interrupt();
+}
+
+#endif
+
+#if EVENT_LOOP == 1
+
+// USART interrupt handler of second serial port (event-driven main loop only)
+extern "C" void USART_2_IRQ_HANDLER()
+{
+    uart_2.on_usart_interrupt();
+}
+
+#endif
+
+#endif
+
+template <class HW>
+RAMFUNC uint32_t uart_impl<HW>::rx_write_count()
+{
+    uint32_t dma_count;
+    uint32_t buf_head;
+
+    // retry if the DMA interrupt has occurred in-between
+    do {
+        dma_count = rx_dma_count;
+        buf_head = rx_buf_len - dma_get_number_of_data(HW::dma, HW::dma_rx_chan);
+    } while (dma_count != rx_dma_count);
+
+    // bytes written since the last interrupt (also correct if an interrupt is pending)
+    return dma_count + ((buf_head - dma_count) & (rx_buf_len - 1));
+}
+
+template <class HW>
+RAMFUNC void uart_impl<HW>::update_rx_head()
+{
+    uint32_t head = rx_write_count();
+#if RX_TIMESTAMPS == 1
+    uint32_t prev_head = rx_buf.head_count();
+    if (head != prev_head) {
+        rx_arrival_index = (rx_arrival_index + 1) % UART_RX_ARRIVAL_LOG_LEN;
+        rx_arrivals[rx_arrival_index] = { prev_head, clock_ticks() };
     }
+#endif
+    rx_buf.set_head(head);
+}
 
-    if (len == 0)
-        return n1;
+#if RX_TIMESTAMPS == 1
+template <class HW>
+RAMFUNC uint32_t uart_impl<HW>::rx_arrival_time(uint32_t count)
+{
+    // search from the newest entry for the entry covering the byte
+    int index = rx_arrival_index;
+    for (int i = 0; i < UART_RX_ARRIVAL_LOG_LEN - 1; i++) {
+        if ((int32_t)(count - rx_arrivals[index].count) >= 0)
+            break;
+        index = (index + UART_RX_ARRIVAL_LOG_LEN - 1) % UART_RX_ARRIVAL_LOG_LEN;
+    }
+    return rx_arrivals[index].ticks;
+}
+#endif
 
-    if (rx_buf_tail < buf_head)
-    {
-        last_rx_size = buf_head - rx_buf_tail;
-        // chunk between tail and head (no wrap around)
-        n2 = std::min((int)len, buf_head - rx_buf_tail);
-        memcpy(data, rx_buf + rx_buf_tail, n2);
-        if (_databits == 7)
-            clear_high_bits(data, n2);
-        rx_buf_tail += n2;
-        last_rx_size -= n2;
+template <class HW>
+RAMFUNC size_t uart_impl<HW>::peek_rx_chunks(const uint8_t **chunk1, size_t *len1, const uint8_t **chunk2, size_t *len2)
+{
+    update_rx_head();
+
+    uint32_t l1;
+    uint32_t l2;
+    size_t len = rx_buf.peek_chunks(chunk1, &l1, chunk2, &l2);
+    if (len > rx_buf_len) {
+        // overrun: wait for it to be cleared by check_rx_overrun()
+        l1 = l2 = len = 0;
     }
+    *len1 = l1;
+    *len2 = l2;
+
+    if (len > perf_counters.rx_buf_peak)
+        perf_counters.rx_buf_peak = len;
+#if TELEMETRY == 1
+    if (len > rx_buf_report_peak)
+        rx_buf_report_peak = len;
+#endif
+    return len;
+}
 
-    return n1 + n2;
+template <class HW>
+void uart_impl<HW>::consume_rx(size_t len)
+{
+    rx_buf.consume(len);
+#if EVENT_LOOP == 1
+    arm_rx_start_wake();
+#endif
+}
+
+template <class HW>
+size_t uart_impl<HW>::rx_data_len()
+{
+    update_rx_head();
+    return std::min(rx_buf.size(), (uint32_t)rx_buf_len);
+}
+
+template <class HW>
+void uart_impl<HW>::check_rx_overrun()
+{
+    update_rx_head();
+    uint32_t len = rx_buf.size();
+    if (len <= rx_buf_len)
+        return;
+
+    // overrun detected: the oldest data has been overwritten.
+    // Keep the newest half of the buffer as it will not be
+    // overwritten before it has been transmitted.
+    uint32_t lost = len - rx_buf_len / 2;
+    rx_buf.consume(lost);
+    perf_counters.rx_lost_bytes += lost;
+    perf_counters.rx_overruns++;
+    rx_overrun_occurred = true;
+    trace(trace_event::rx_overrun, lost, HW::port_index);
 }
 
-size_t uart_impl::rx_data_len()
+template <class HW>
+void uart_impl<HW>::measure_rx_drain_rate()
 {
-    int buf_head = UART_RX_BUF_LEN - dma_get_number_of_data(USART_DMA, USART_DMA_RX_CHAN);
-    if (buf_head == UART_RX_BUF_LEN)
-        buf_head = 0;
-    if (buf_head >= rx_buf_tail)
-        return buf_head - rx_buf_tail;
+    if (!has_expired(rx_drain_window_start + RX_DRAIN_WINDOW))
+        return;
+
+    uint32_t read_count = rx_buf.tail_count();
+    int rate = (read_count - rx_drain_window_count) / RX_DRAIN_WINDOW;
+    rx_drain_window_start = millis();
+    rx_drain_window_count = read_count;
+
+    if (rate != rx_drain_rate) {
+        rx_drain_rate = rate;
+        update_rx_high_water_mark();
+    }
+}
+
+template <class HW>
+void uart_impl<HW>::measure_tx_fill_rate()
+{
+    if (!has_expired(tx_fill_window_start + TX_FILL_WINDOW))
+        return;
+
+    uint16_t write_count = tx_buf.head_count();
+    uint32_t fill_rate = (uint16_t)(write_count - tx_fill_window_count) / TX_FILL_WINDOW;
+    tx_fill_window_start = millis();
+    tx_fill_window_count = write_count;
 
-    return UART_RX_BUF_LEN - rx_buf_tail + buf_head;
+    // line rate: 10 bits per byte
+    uint32_t line_rate = _baudrate / 10000;
+    if (line_rate == 0)
+        line_rate = 1;
+    tx_chunk_scale = fill_rate == 0 ? UINT16_MAX : std::min((line_rate << 8) / fill_rate, (uint32_t)UINT16_MAX);
 }
 
-void uart_impl::check_rx_overrun()
+template <class HW>
+int uart_impl<HW>::adaptive_tx_chunk_size()
 {
-    size_t len = rx_data_len();
-    if (len < last_rx_size) {
-        // overrun detected
-        // clear error condition by discarding data
-        rx_buf_tail = UART_RX_BUF_LEN - dma_get_number_of_data(USART_DMA, USART_DMA_RX_CHAN);
-        last_rx_size = 0;
-        rx_overrun_occurred = true;
+    // The chunk should complete (and free up its space) before the data arriving
+    // in the meantime has used up the headroom above the pause threshold:
+    // chunk / line rate <= headroom / fill rate. Larger chunks save DMA restarts.
+    int headroom = (int)tx_buf.avail() - tx_pause_threshold;
+    if (headroom <= 0)
+        return TX_MIN_CHUNK_SIZE;
+
+    uint32_t size = ((uint32_t)headroom * tx_chunk_scale) >> 8;
+    return std::min(std::max(size, (uint32_t)TX_MIN_CHUNK_SIZE), (uint32_t)TX_MAX_CHUNK_SIZE);
+}
+
+template <class HW>
+void uart_impl<HW>::update_rts()
+{
+    int len = rx_data_len();
+    if (!is_rts_deasserted && len >= rx_high_water_mark) {
+        // ask sender to pause
+        gpio_set(HW::rts_port, HW::rts_gpio);
+        is_rts_deasserted = true;
+    } else if (is_rts_deasserted && len < rx_low_water_mark) {
+        // ask sender to resume
+        gpio_clear(HW::rts_port, HW::rts_gpio);
+        is_rts_deasserted = false;
     }
 }
 
-bool uart_impl::has_rx_overrun_occurred()
+template <class HW>
+void uart_impl<HW>::check_rx_errors()
+{
+#if defined(STM32F1)
+    // read before the flags (data arriving in-between is checked again)
+    uint32_t count = rx_write_count();
+#endif
+    uint32_t isr = USART_ISR(HW::usart);
+    if ((isr & (USART_ISR_PE | USART_ISR_FE)) == 0)
+        return;
+
+#if defined(STM32F1)
+    // still set from the error already counted (no data received since)
+    if (count == error_flag_rx_count)
+        return;
+    error_flag_rx_count = count;
+#endif
+
+    if ((isr & USART_ISR_PE) != 0)
+        perf_counters.parity_errors++;
+    if ((isr & USART_ISR_FE) != 0)
+        perf_counters.framing_errors++;
+#if !defined(STM32F1)
+    USART_ICR(HW::usart) = USART_ICR_PECF | USART_ICR_FECF;
+#endif
+}
+
+template <class HW>
+bool uart_impl<HW>::has_rx_overrun_occurred()
 {
     if (rx_overrun_occurred)
     {
@@ -246,13 +584,42 @@ bool uart_impl::has_rx_overrun_occurred()
     return false;
 }
 
-size_t uart_impl::tx_data_avail() {
-    int head = tx_buf_head;
-    int tail = tx_buf_tail;
-    if (head >= tail)
-        return UART_TX_BUF_LEN - (head - tail) - 1;
-    else
-        return tail - head - 1;    
+template <class HW>
+bool uart_impl<HW>::has_rx_burst_ended()
+{
+#if defined(STM32F1)
+    // read before the flag (data arriving in-between is checked again)
+    uint32_t count = rx_write_count();
+    uint32_t isr = USART_ISR(HW::usart);
+
+    // still set from the end of the last burst (no data received since)
+    if (count == idle_flag_rx_count)
+        return false;
+#if EVENT_LOOP == 1
+    // the flag has been cleared by the DMA controller (or is set for the end of the new burst)
+    if ((USART_CR1(HW::usart) & USART_CR1_IDLEIE) == 0)
+        USART_CR1(HW::usart) |= USART_CR1_IDLEIE;
+#endif
+    if ((isr & USART_ISR_IDLE) == 0)
+        return false;
+
+    idle_flag_rx_count = count;
+#else
+    uint32_t isr = USART_ISR(HW::usart);
+    if ((isr & USART_ISR_IDLE) == 0)
+        return false;
+
+    USART_ICR(HW::usart) = USART_ICR_IDLECF;
+#if EVENT_LOOP == 1
+    USART_CR1(HW::usart) |= USART_CR1_IDLEIE;
+#endif
+#endif
+    return true;
+}
+
+template <class HW>
+size_t uart_impl<HW>::tx_data_avail() {
+    return tx_buf.avail();
 }
 
 static const uint32_t stopbits_enum_to_uint32[] = {
@@ -267,74 +634,191 @@ static const uint32_t parity_enum_to_uint32[] = {
     USART_PARITY_EVEN,
 };
 
-void uart_impl::set_coding(int baudrate, int databits, uart_stopbits stopbits, uart_parity parity)
+template <class HW>
+void uart_impl<HW>::set_coding(int baudrate, int databits, uart_stopbits stopbits, uart_parity parity)
 {
     _databits = databits;
     _stopbits = stopbits;
     _parity = parity;
     int p = parity == uart_parity::none ? 0 : 1;
 
-    usart_disable(USART);
+    usart_disable(HW::usart);
 
-    // Hack to work around Linux not easily allowing baud rates over 4M.
-    if (baudrate == 75) {
-        baudrate = 6000000;
+    for (const uart_baud_alias &alias : baud_aliases) {
+        if (alias.requested != 0 && alias.requested == (uint32_t)baudrate) {
+            baudrate = alias.actual;
+            break;
+        }
     }
     set_baudrate(baudrate);
 
-    usart_set_databits(USART, _databits + p);
-    usart_set_stopbits(USART, stopbits_enum_to_uint32[(int)_stopbits]);
-    usart_set_parity(USART, parity_enum_to_uint32[(int)_parity]);
-    usart_enable(USART);
+    usart_set_databits(HW::usart, _databits + p);
+    usart_set_stopbits(HW::usart, stopbits_enum_to_uint32[(int)_stopbits]);
+    usart_set_parity(HW::usart, parity_enum_to_uint32[(int)_parity]);
+    usart_enable(HW::usart);
+
+    update_rx_high_water_mark();
+}
+
+template <class HW>
+void uart_impl<HW>::set_rx_high_water(int mark)
+{
+    rx_high_water_mark_setting = mark;
+    update_rx_high_water_mark();
+}
+
+template <class HW>
+void uart_impl<HW>::update_rx_high_water_mark()
+{
+    if (rx_high_water_mark_setting != 0) {
+        rx_high_water_mark = rx_high_water_mark_setting;
+    } else {
+        // Reserve room for the data the sender might still transmit after
+        // RTS has been deasserted: 0.5ms worth of data (10 bits per byte),
+        // at least 16 and at most half of the buffer
+#if EVENT_LOOP == 1
+        // (plus 1ms as the buffer level is checked at least every system tick)
+        int reserve = std::min(std::max(_baudrate / 20000 * 3, 16), (int)rx_buf_len / 2);
+#else
+        int reserve = std::min(std::max(_baudrate / 20000, 16), (int)rx_buf_len / 2);
+#endif
+        rx_high_water_mark = (int)rx_buf_len - reserve;
+    }
 
-    // High water mark is buffer size - 5ms worth of data
-    rx_high_water_mark = std::max(UART_RX_BUF_LEN - baudrate / 2000, 0);
+    // Hysteresis: about 1ms worth of data drained via USB so RTS does not
+    // toggle with each USB packet; at least 2 packets, at most half the high-water mark
+    int hysteresis = std::min(std::max(rx_drain_rate, 128), rx_high_water_mark / 2);
+    rx_low_water_mark = rx_high_water_mark - hysteresis;
 }
 
-void uart_impl::set_baudrate(int baud)
+template <class HW>
+void uart_impl<HW>::set_tx_chunk_size(int size)
 {
-    _baudrate = baud;
+    tx_max_chunk_size_setting = size;
+    update_tx_chunk_size();
+}
 
+template <class HW>
+uint32_t uart_impl<HW>::usart_clock()
+{
 	uint32_t clock = rcc_apb1_frequency;
-	if ((USART == USART1) || (USART == USART6)) {
+	if ((HW::usart == USART1) || (HW::usart == USART6)) {
 		clock = rcc_apb2_frequency;
 	}
+    return clock;
+}
+
+template <class HW>
+void uart_impl<HW>::set_baudrate(int baud)
+{
+    uint32_t clock = usart_clock();
 
-    uint32_t brr = (clock + baud / 2) / baud;
+    // USARTDIV is the bit time in 1/16 (oversampling by 16) or 1/8 (oversampling by 8)
+    // of the clock period. Oversampling by 8 is only used where oversampling by 16
+    // cannot reach the baud rate as it is less tolerant to clock deviations.
+    uint32_t usartdiv = (clock + baud / 2) / baud;
+    uint32_t brr;
 
-    if (brr > 0xffff) {
+    if (usartdiv > 0xffff) {
         // increase too low bitrate
-        brr = 0xffff;
-        _baudrate = (clock + 0x8fff) / 0xffff;
+        usartdiv = 0xffff;
     }
-    
-    if (brr >= 0x10) {
+
+#if USART_MIN_OVERSAMPLING == 16
+    // oversampling by 16 only
+    if (usartdiv < 0x10)
+        usartdiv = 0x10; // select fastest bitrate possible
+    brr = usartdiv;
+    _baudrate = (clock + usartdiv / 2) / usartdiv;
+#else
+    if (usartdiv >= 0x10) {
         // oversampling by 16
-        USART_CR1(USART) &= ~USART_CR1_OVER8;
+        USART_CR1(HW::usart) &= ~USART_CR1_OVER8;
+        brr = usartdiv;
+        _baudrate = (clock + usartdiv / 2) / usartdiv;
+
     } else {
-        // oversampling by 8
-        USART_CR1(USART) |= USART_CR1_OVER8;
-        if (brr >= 0x08) {
-            brr = 0x10 | (brr & 0x07);
-        } else {
-            // select fastest bitrate possible
-            brr = 0x10;
-            _baudrate = clock / 8;
-        }
+        // oversampling by 8: BRR[2:0] holds USARTDIV[3:1], so USARTDIV must be even
+        // (same step size as oversampling by 16, only the range is extended)
+        USART_CR1(HW::usart) |= USART_CR1_OVER8;
+        usartdiv = 2 * ((clock + baud / 2) / baud);
+        if (usartdiv < 0x10)
+            usartdiv = 0x10; // select fastest bitrate possible
+        brr = (usartdiv & 0xfff0) | ((usartdiv & 0x0f) >> 1);
+        _baudrate = (2 * clock + usartdiv / 2) / usartdiv;
+    }
+#endif
+
+    USART_BRR(HW::usart) = brr;
+
+    baudrate_error = (int)((int64_t)(_baudrate - baud) * 1000000 / baud);
+
+    update_tx_chunk_size();
+}
+
+template <class HW>
+bool uart_impl<HW>::get_baud_alias(int index, uart_baud_alias *alias)
+{
+    if (index < 0 || index >= UART_BAUD_ALIAS_TABLE_LEN)
+        return false;
+
+    *alias = baud_aliases[index];
+    return true;
+}
+
+template <class HW>
+bool uart_impl<HW>::set_baud_alias(int index, const uart_baud_alias *alias)
+{
+    if (index < 0 || index >= UART_BAUD_ALIAS_TABLE_LEN)
+        return false;
+
+    if (alias->requested == 0) {
+        baud_aliases[index] = { 0, 0 };
+        return true;
+    }
+
+    // the baud rate must be achievable (see set_baudrate())
+    uint32_t clock = usart_clock();
+    if (alias->actual < clock / 0xffff || alias->actual > clock / USART_MIN_OVERSAMPLING)
+        return false;
+
+    baud_aliases[index] = *alias;
+    return true;
+}
+
+template <class HW>
+void uart_impl<HW>::reset_baud_aliases()
+{
+    memset(baud_aliases, 0, sizeof(baud_aliases));
+    uint32_t max_baudrate = usart_clock() / USART_MIN_OVERSAMPLING;
+    int n = 0;
+    for (const uart_baud_alias &alias : default_baud_aliases) {
+        if (alias.actual <= max_baudrate)
+            baud_aliases[n++] = alias;
     }
+}
 
-    USART_BRR(USART) = brr;
+template <class HW>
+void uart_impl<HW>::update_tx_chunk_size()
+{
+    if (tx_max_chunk_size_setting != 0) {
+        tx_max_chunk_size = tx_max_chunk_size_setting;
+        return;
+    }
 
-    tx_max_chunk_size = _baudrate / 10000;
-    if (tx_max_chunk_size < 16)
-        tx_max_chunk_size = 16;
-    if (tx_max_chunk_size > 256)
-        tx_max_chunk_size = 256;
+    // adapted to the fill rate for each chunk (see adaptive_tx_chunk_size())
+    tx_max_chunk_size = TX_MAX_CHUNK_SIZE;
 }
 
 
-void uart_impl::clear_high_bits(uint8_t* buf, int buf_len)
+template <class HW>
+void uart_impl<HW>::clear_high_bits(uint8_t* buf, int buf_len)
 {
     for (int i = 0; i < buf_len; i++)
         buf[i] &= 0x7f;
 }
+
+template class uart_impl<uart_1_hw>;
+#if DUAL_CDC == 1
+template class uart_impl<uart_2_hw>;
+#endif
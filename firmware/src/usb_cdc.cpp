@@ -8,27 +8,47 @@
  * USB CDC Implementation
  */
 
+#include "bench.h"
+#include "boot_timing.h"
+#include "clock_sync.h"
 #include "common.h"
+#include "event_loop.h"
 #include "hardware.h"
+#include "loop_stats.h"
+#include "perf_counters.h"
+#include "trace.h"
+#include "uart.h"
 #include "usb_cdc.h"
 #include "usb_conf.h"
 #include "usb_serial.h"
+#if !defined(STM32F1)
 #include <libopencm3/stm32/crs.h>
 #include <libopencm3/stm32/syscfg.h>
+#endif
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/cm3/nvic.h>
 #include "qsb_device.h"
 #include <string.h>
 
+#ifndef USB_DISCONNECT_TIME
+/// Time D+ is held low after reset to trigger device reenumeration (in ms)
+#define USB_DISCONNECT_TIME 20
+#endif
+
 qsb_device *usb_device;
 
 static uint16_t configured;
 
-// Process ACM requests on control endpoint
-static enum qsb_request_return_code cdc_control_request(
-	__attribute__((unused)) qsb_device *dev,
-	qsb_setup_data *req, uint8_t **buf, uint16_t *len,
-	__attribute__((unused)) qsb_dev_control_completion_callback_fn *complete)
+// Time when the disconnect period ends (see millis())
+static uint32_t attach_time;
+
+// Indicates if the disconnect period has ended and the device is visible to the host
+static bool is_attached;
+
+// Process ACM requests for a serial port
+template <class Serial>
+static enum qsb_request_return_code cdc_port_request(Serial &serial, qsb_setup_data *req, uint8_t **buf, uint16_t *len)
 {
 	switch (req->bRequest)
 	{
@@ -36,26 +56,199 @@ static enum qsb_request_return_code cdc_control_request(
 		if (*len < sizeof(qsb_pstn_line_coding))
 			return QSB_REQ_NOTSUPP;
 
-		if (req->wIndex != 0)
-			return QSB_REQ_NOTSUPP;
-
-		return usb_serial.set_line_coding((qsb_pstn_line_coding *)*buf) ? QSB_REQ_HANDLED : QSB_REQ_NOTSUPP;
+		return serial.set_line_coding((qsb_pstn_line_coding *)*buf) ? QSB_REQ_HANDLED : QSB_REQ_NOTSUPP;
 		
 
 	case QSB_PSTN_REQ_GET_LINE_CODING:
 		if (*len < sizeof(qsb_pstn_line_coding))
 			return QSB_REQ_NOTSUPP;
 
-		if (req->wIndex != 0)
+		serial.get_line_coding((qsb_pstn_line_coding *)*buf);
+		*len = sizeof(qsb_pstn_line_coding);
+		return QSB_REQ_HANDLED;
+
+	case QSB_PSTN_REQ_SET_CONTROL_LINE_STATE:
+		serial.set_control_line_state(req->wValue);
+		return QSB_REQ_HANDLED;
+	}
+	return QSB_REQ_NEXT_HANDLER;
+}
+
+// Process ACM requests on control endpoint (wIndex is the COMM interface of the serial port)
+static enum qsb_request_return_code cdc_control_request(
+	__attribute__((unused)) qsb_device *dev,
+	qsb_setup_data *req, uint8_t **buf, uint16_t *len,
+	__attribute__((unused)) qsb_dev_control_completion_callback_fn *complete)
+{
+#if USB_FUNCTIONS != USB_FUNC_VENDOR
+	if (req->wIndex == INTF_COMM_1)
+		return cdc_port_request(usb_serial, req, buf, len);
+#else
+	// no ACM interface
+	(void)req;
+	(void)buf;
+	(void)len;
+#endif
+#if DUAL_CDC == 1
+	if (req->wIndex == INTF_COMM_2)
+		return cdc_port_request(usb_serial_2, req, buf, len);
+#endif
+	return QSB_REQ_NOTSUPP;
+}
+
+// Process vendor-specific requests for a serial port
+template <class Serial, class Uart>
+static enum qsb_request_return_code vendor_port_request(Serial &serial, Uart &uart,
+	qsb_setup_data *req, uint8_t **buf, uint16_t *len)
+{
+	uint32_t value;
+	uart_baud_alias alias;
+
+	switch ((usb_vendor_request)req->bRequest)
+	{
+	case usb_vendor_request::get_param:
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_IN || *len < sizeof(value))
+			return QSB_REQ_NOTSUPP;
+
+		if (!serial.get_param((usb_serial_param)req->wValue, &value))
+			return QSB_REQ_NOTSUPP;
+
+		memcpy(*buf, &value, sizeof(value));
+		*len = sizeof(value);
+		return QSB_REQ_HANDLED;
+
+	case usb_vendor_request::set_param:
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_OUT || *len < sizeof(value))
+			return QSB_REQ_NOTSUPP;
+
+		memcpy(&value, *buf, sizeof(value));
+		return serial.set_param((usb_serial_param)req->wValue, value) ? QSB_REQ_HANDLED : QSB_REQ_NOTSUPP;
+
+	case usb_vendor_request::get_baud_alias:
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_IN || *len < sizeof(alias))
+			return QSB_REQ_NOTSUPP;
+
+		if (!uart.get_baud_alias(req->wValue, &alias))
+			return QSB_REQ_NOTSUPP;
+
+		memcpy(*buf, &alias, sizeof(alias));
+		*len = sizeof(alias);
+		return QSB_REQ_HANDLED;
+
+	case usb_vendor_request::set_baud_alias:
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_OUT || *len < sizeof(alias))
 			return QSB_REQ_NOTSUPP;
 
-		usb_serial.get_line_coding((qsb_pstn_line_coding *)*buf);
+		memcpy(&alias, *buf, sizeof(alias));
+		return uart.set_baud_alias(req->wValue, &alias) ? QSB_REQ_HANDLED : QSB_REQ_NOTSUPP;
+
+	// same as the CDC ACM requests (needed if the firmware is built without the CDC ACM function)
+	case usb_vendor_request::get_line_coding:
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_IN || *len < sizeof(qsb_pstn_line_coding))
+			return QSB_REQ_NOTSUPP;
+
+		serial.get_line_coding((qsb_pstn_line_coding *)*buf);
 		*len = sizeof(qsb_pstn_line_coding);
 		return QSB_REQ_HANDLED;
 
-	case QSB_PSTN_REQ_SET_CONTROL_LINE_STATE:
-		usb_serial.set_control_line_state(req->wValue);
+	case usb_vendor_request::set_line_coding:
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_OUT || *len < sizeof(qsb_pstn_line_coding))
+			return QSB_REQ_NOTSUPP;
+
+		return serial.set_line_coding((qsb_pstn_line_coding *)*buf) ? QSB_REQ_HANDLED : QSB_REQ_NOTSUPP;
+
+	default:
+		return QSB_REQ_NOTSUPP;
+	}
+}
+
+// Process vendor-specific requests on control endpoint
+static enum qsb_request_return_code vendor_control_request(
+	__attribute__((unused)) qsb_device *dev,
+	qsb_setup_data *req, uint8_t **buf, uint16_t *len,
+	__attribute__((unused)) qsb_dev_control_completion_callback_fn *complete)
+{
+	switch ((usb_vendor_request)req->bRequest)
+	{
+	case usb_vendor_request::get_param:
+	case usb_vendor_request::set_param:
+	case usb_vendor_request::get_baud_alias:
+	case usb_vendor_request::set_baud_alias:
+	case usb_vendor_request::get_line_coding:
+	case usb_vendor_request::set_line_coding:
+		// wIndex selects the serial port
+		if (req->wIndex == 0)
+			return vendor_port_request(usb_serial, uart, req, buf, len);
+#if DUAL_CDC == 1
+		if (req->wIndex == 1)
+			return vendor_port_request(usb_serial_2, uart_2, req, buf, len);
+#endif
+		return QSB_REQ_NOTSUPP;
+
+	case usb_vendor_request::get_counters:
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_IN)
+			return QSB_REQ_NOTSUPP;
+
+		*len = std::min(*len, (uint16_t)sizeof(perf_counters));
+		memcpy(*buf, &perf_counters, *len);
+		if ((req->wValue & 1) != 0) {
+			perf_counters.reset();
+			usb_serial.on_counters_reset();
+#if DUAL_CDC == 1
+			usb_serial_2.on_counters_reset();
+#endif
+		}
+		return QSB_REQ_HANDLED;
+
+	case usb_vendor_request::get_loop_stats:
+#if LOOP_STATS == 1
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_IN)
+			return QSB_REQ_NOTSUPP;
+
+		*len = std::min(*len, (uint16_t)sizeof(loop_stats.data));
+		memcpy(*buf, &loop_stats.data, *len);
+		if ((req->wValue & 1) != 0)
+			loop_stats.reset();
+		return QSB_REQ_HANDLED;
+#else
+		return QSB_REQ_NOTSUPP; // not included in this build
+#endif
+
+	case usb_vendor_request::run_bench:
+#if BENCH == 1
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_IN)
+			return QSB_REQ_NOTSUPP;
+
+		bench.run();
+		*len = std::min(*len, (uint16_t)sizeof(bench.results));
+		memcpy(*buf, &bench.results, *len);
+		return QSB_REQ_HANDLED;
+#else
+		return QSB_REQ_NOTSUPP; // not included in this build
+#endif
+
+	case usb_vendor_request::get_frame_time:
+#if CLOCK_SYNC == 1
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_IN)
+			return QSB_REQ_NOTSUPP;
+
+		*len = std::min(*len, (uint16_t)sizeof(clock_sync_data));
+		memcpy(*buf, &clock_sync.frame_time(), *len);
 		return QSB_REQ_HANDLED;
+#else
+		return QSB_REQ_NOTSUPP; // not included in this build
+#endif
+
+	case usb_vendor_request::get_trace:
+#if TRACE == 1
+		if ((req->bmRequestType & QSB_REQ_TYPE_DIRECTION_MASK) != QSB_REQ_TYPE_IN)
+			return QSB_REQ_NOTSUPP;
+
+		*len = trace_ring.read(req->wValue, *buf, std::min(*len, (uint16_t)USB_CONTROL_BUF_SIZE));
+		return *len != 0 ? QSB_REQ_HANDLED : QSB_REQ_NOTSUPP;
+#else
+		return QSB_REQ_NOTSUPP; // not included in this build
+#endif
 	}
 	return QSB_REQ_NEXT_HANDLER;
 }
@@ -68,18 +261,72 @@ bool usb_cdc_is_connected()
 static void cdc_set_config(qsb_device *dev, uint16_t wValue)
 {
 	configured = wValue;
+	trace(trace_event::configured, wValue);
+	boot_timing.on_configured();
 
 	qsb_dev_register_control_callback(dev,
 								   QSB_REQ_TYPE_CLASS     | QSB_REQ_TYPE_INTERFACE,
 								   QSB_REQ_TYPE_TYPE_MASK | QSB_REQ_TYPE_RECIPIENT_MASK,
 								   cdc_control_request);
 
-	// Serial interface
+	qsb_dev_register_control_callback(dev,
+								   QSB_REQ_TYPE_VENDOR    | QSB_REQ_TYPE_DEVICE,
+								   QSB_REQ_TYPE_TYPE_MASK | QSB_REQ_TYPE_RECIPIENT_MASK,
+								   vendor_control_request);
+
+	// Serial interfaces
 	usb_serial.on_usb_configured();
+#if DUAL_CDC == 1
+	usb_serial_2.on_usb_configured();
+#endif
 
 	// Send initial serial state.
 	// Allows the use of /dev/tty* devices on macOS and BSD systems
 	usb_serial.send_serial_state();
+#if DUAL_CDC == 1
+	usb_serial_2.send_serial_state();
+#endif
+}
+
+#if TRACE == 1
+// Called on USB bus reset
+static void cdc_reset()
+{
+	trace(trace_event::bus_reset);
+}
+#endif
+
+#if SOF_SCHED == 1 || CLOCK_SYNC == 1
+// Called at the start of each USB frame
+static void cdc_sof()
+{
+#if CLOCK_SYNC == 1
+	clock_sync.on_sof();
+#endif
+#if SOF_SCHED == 1
+	usb_serial.on_sof();
+#if DUAL_CDC == 1
+	usb_serial_2.on_sof();
+#endif
+#endif
+}
+#endif
+
+static void usb_cdc_attach()
+{
+	usb_device = usb_conf_init();
+
+	// Set callback for config calls
+	qsb_dev_register_set_config_callback(usb_device, cdc_set_config);
+
+#if TRACE == 1
+	qsb_dev_register_reset_callback(usb_device, cdc_reset);
+#endif
+
+#if SOF_SCHED == 1 || CLOCK_SYNC == 1
+	// SOF events schedule the IN packets and latch the frame time
+	qsb_dev_register_sof_callback(usb_device, cdc_sof);
+#endif
 }
 
 void usb_cdc_init()
@@ -87,29 +334,75 @@ void usb_cdc_init()
 	rcc_periph_clock_enable(RCC_USB);
 	rcc_periph_clock_enable(USB_PORT_RCC);
 
+#if BOARD_CLOCK == BOARD_CLOCK_HSI48
+	// HSI48 is trimmed using the USB SOF packets
 	crs_autotrim_usb_enable();
+	rcc_set_usbclk_source(RCC_HSI48);
+#elif !defined(STM32F1)
 	rcc_set_usbclk_source(RCC_PLL);
+#endif
 
+#if !defined(STM32F1)
 	// Remap pins PA11/PA12
 	rcc_periph_clock_enable(RCC_SYSCFG_COMP);
 	SYSCFG_CFGR1 |= SYSCFG_CFGR1_PA11_PA12_RMP;
+#endif
 
 	// reset USB peripheral
 	rcc_periph_reset_pulse(RST_USB);
 
-	// Pull USB D+ low for 80ms to trigger device reenumeration
+#if QSB_FSDEV_SUBTYPE >= 3
+	// The D+ pull-up is internal: the device is created right away but kept
+	// disconnected until the disconnect period has ended (see usb_cdc_poll()).
+	usb_cdc_attach();
+	qsb_dev_disconnect(usb_device, true);
+#else
+	// Pull USB D+ low to trigger device reenumeration. The device is only
+	// created (and the pull-up enabled) in usb_cdc_poll() when the disconnect
+	// period has ended so the remaining initialization overlaps with it.
+#if defined(STM32F1)
+	gpio_set_mode(USB_DP_PORT, GPIO_MODE_OUTPUT_2_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, USB_DP_PIN);
+#else
 	gpio_mode_setup(USB_DP_PORT, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, USB_DP_PIN);
+#endif
 	gpio_clear(USB_DP_PORT, USB_DP_PIN);
-	delay(80);
-
-	// create USB device
-	usb_device = usb_conf_init();
+#endif
+	is_attached = false;
+	attach_time = millis() + USB_DISCONNECT_TIME;
 
-	// Set callback for config calls
-	qsb_dev_register_set_config_callback(usb_device, cdc_set_config);
+#if QSB_ISR_MODE == 1
+	// USB interrupt (enabled by qsb_dev_poll()) must not delay the UART DMA interrupt
+	nvic_set_priority(QSB_USB_IRQ, 1 << 6);
+#endif
 }
 
+// Ends the disconnect period (creating the device or enabling the pull-up)
+// and polls the USB device
 void usb_cdc_poll()
 {
+	if (!is_attached) {
+		if (!has_expired(attach_time))
+			return; // disconnect period still running
+#if QSB_FSDEV_SUBTYPE >= 3
+		qsb_dev_disconnect(usb_device, false);
+#else
+		usb_cdc_attach();
+#endif
+		is_attached = true;
+	}
+
 	qsb_dev_poll(usb_device);
 }
+
+#if QSB_ISR_MODE == 1
+
+// USB interrupt handler
+extern "C" void USB_ISR()
+{
+	qsb_dev_isr(usb_device);
+#if EVENT_LOOP == 1
+	event_loop.signal(wake_usb);
+#endif
+}
+
+#endif
@@ -12,6 +12,7 @@
 #include "hardware.h"
 #include "usb_cdc.h"
 #include "usb_conf.h"
+#include "usb_desc.h"
 #include "qsb_device.h"
 #include "qsb_cdc.h"
 #include <string.h>
@@ -20,11 +21,6 @@
 #define USB_PID 0xA4F6
 #define USB_DEVICE_REL 0x0100
 
-#define INTF_COMM 0 //  COMM must be immediately before DATA because of Associated Interface Descriptor.
-#define INTF_DATA 1
-
-#define USB_CONTROL_BUF_SIZE 256
-
 static uint8_t usbd_control_buffer[USB_CONTROL_BUF_SIZE] __attribute__((aligned(4)));
 
 static const char * const usb_strings[] = {
@@ -34,6 +30,14 @@ static const char * const usb_strings[] = {
 	"Virtual Serial Port", //  Interface assocation
 	"Prunt Board 2 COMM 1",   //  Communication interface
 	"Prunt Board 2 DATA 1",   //  Data interface
+#if DUAL_CDC == 1
+	"Virtual Serial Port 2", //  Interface assocation of second serial port
+	"Prunt Board 2 COMM 2",   //  Communication interface of second serial port
+	"Prunt Board 2 DATA 2",   //  Data interface of second serial port
+#endif
+#if USB_FUNCTIONS != USB_FUNC_CDC
+	"Prunt Board 2 Vendor Interface", //  Vendor-specific interface
+#endif
 };
 
 enum usb_strings_index
@@ -44,136 +48,166 @@ enum usb_strings_index
 	USB_STRINGS_SERIAL_PORT_ID,
 	USB_STRINGS_COMM_1_ID,
 	USB_STRINGS_DATA_1_ID,
+#if DUAL_CDC == 1
+	USB_STRINGS_SERIAL_PORT_2_ID,
+	USB_STRINGS_COMM_2_ID,
+	USB_STRINGS_DATA_2_ID,
+#endif
+#if USB_FUNCTIONS != USB_FUNC_CDC
+	USB_STRINGS_VENDOR_ID,
+#endif
 };
 
-// Serial ACM interface
-static const qsb_endpoint_desc comm_ep_1_desc[] = {
-	{
-		.bLength = QSB_DT_ENDPOINT_SIZE,
-		.bDescriptorType = QSB_DT_ENDPOINT,
-		.bEndpointAddress = COMM_IN_1,
-		.bmAttributes = QSB_ENDPOINT_ATTR_INTERRUPT,
-		.wMaxPacketSize = 16,
-		.bInterval = 255,
-		.extra = nullptr,
-		.extralen = 0,
-	}};
-
-static const qsb_endpoint_desc data_ep_1_desc[] = {
+// Prebuilt string descriptors (in flash)
+static constexpr auto manufacturer_str_desc = usb_desc::string("Prunt 3D");
+static constexpr auto product_str_desc = usb_desc::string("Prunt Board 2");
+static constexpr auto serial_port_str_desc = usb_desc::string("Virtual Serial Port");
+static constexpr auto comm_1_str_desc = usb_desc::string("Prunt Board 2 COMM 1");
+static constexpr auto data_1_str_desc = usb_desc::string("Prunt Board 2 DATA 1");
+#if DUAL_CDC == 1
+static constexpr auto serial_port_2_str_desc = usb_desc::string("Virtual Serial Port 2");
+static constexpr auto comm_2_str_desc = usb_desc::string("Prunt Board 2 COMM 2");
+static constexpr auto data_2_str_desc = usb_desc::string("Prunt Board 2 DATA 2");
+#endif
+#if USB_FUNCTIONS != USB_FUNC_CDC
+static constexpr auto vendor_str_desc = usb_desc::string("Prunt Board 2 Vendor Interface");
+#endif
+
+static const uint8_t * const usb_string_descs[] = {
+	manufacturer_str_desc.data(),
+	product_str_desc.data(),
+	nullptr, // serial number is built at runtime
+	serial_port_str_desc.data(),
+	comm_1_str_desc.data(),
+	data_1_str_desc.data(),
+#if DUAL_CDC == 1
+	serial_port_2_str_desc.data(),
+	comm_2_str_desc.data(),
+	data_2_str_desc.data(),
+#endif
+#if USB_FUNCTIONS != USB_FUNC_CDC
+	vendor_str_desc.data(),
+#endif
+};
+
+static_assert(QSB_ARRAY_SIZE(usb_string_descs) == QSB_ARRAY_SIZE(usb_strings), "string descriptors out of sync");
+
+// Descriptors of a serial port (CDC ACM function with COMM and DATA interface)
+static constexpr auto serial_port_descs(uint8_t intf_comm, uint8_t intf_data, uint8_t comm_in,
+	uint8_t data_out, uint8_t data_in, uint8_t iface_assoc_str, uint8_t comm_str, uint8_t data_str)
+{
+	return usb_desc::concat(
+		// Interface association (mandatory for composite device with multiple interfaces)
+		usb_desc::iface_assoc(intf_comm, 2, QSB_CDC_INTF_CLASS_COMM, QSB_CDC_INTF_SUBCLASS_ACM,
+			QSB_CDC_INTF_PROTOCOL_AT, iface_assoc_str),
+
+		// Serial ACM interface
+		usb_desc::interface(intf_comm, 0, 1, QSB_CDC_INTF_CLASS_COMM, QSB_CDC_INTF_SUBCLASS_ACM,
+			QSB_CDC_INTF_PROTOCOL_AT, comm_str),
+		usb_desc::cdc_header(0x0110),
+		usb_desc::cdc_call_management(0, intf_data), // no call management
+		usb_desc::cdc_acm(QSB_ACM_CAP_LINE_CODING),
+		usb_desc::cdc_union(intf_comm, intf_data),
+		usb_desc::endpoint(comm_in, QSB_ENDPOINT_ATTR_INTERRUPT, USB_COMM_PACKET_SIZE, USB_COMM_INTERVAL),
+
+		// CDC data interface
+		usb_desc::interface(intf_data, 0, 2, QSB_CDC_INTF_CLASS_DATA, 0, 0, data_str),
+		usb_desc::endpoint(data_out, QSB_ENDPOINT_ATTR_BULK, CDCACM_PACKET_SIZE, 1),
+		usb_desc::endpoint(data_in, QSB_ENDPOINT_ATTR_BULK, CDCACM_PACKET_SIZE, 1)
+	);
+}
+
+#if USB_FUNCTIONS != USB_FUNC_CDC
+// Descriptors of the vendor-specific interface (bulk endpoint pair, bound to WinUSB via WCID descriptors)
+static constexpr auto vendor_intf_descs()
+{
+	return usb_desc::concat(
+		usb_desc::interface(INTF_VENDOR, 0, 2, 0xff, 0, 0, USB_STRINGS_VENDOR_ID),
+		usb_desc::endpoint(VENDOR_OUT, QSB_ENDPOINT_ATTR_BULK, CDCACM_PACKET_SIZE, 1),
+		usb_desc::endpoint(VENDOR_IN, QSB_ENDPOINT_ATTR_BULK, CDCACM_PACKET_SIZE, 1)
+	);
+}
+#endif
+
+// Number of interfaces
+#if USB_FUNCTIONS == USB_FUNC_VENDOR
+#define USB_NUM_INTERFACES 1
+#elif USB_FUNCTIONS == USB_FUNC_CDC_VENDOR
+#define USB_NUM_INTERFACES 3
+#elif DUAL_CDC == 1
+#define USB_NUM_INTERFACES 4
+#else
+#define USB_NUM_INTERFACES 2
+#endif
+
+// Complete configuration descriptor (in flash)
+static constexpr auto config_1_desc = usb_desc::configuration(
+	USB_NUM_INTERFACES, // number of interfaces
+	1, // configuration value
+	0, // no configuration string
+	QSB_CONFIG_ATTR_DEFAULT, // bus-powered
+	50, // 100 mA
+
+#if USB_FUNCTIONS == USB_FUNC_VENDOR
+	vendor_intf_descs()
+#else
+	serial_port_descs(INTF_COMM_1, INTF_DATA_1, COMM_IN_1, DATA_OUT_1, DATA_IN_1,
+		USB_STRINGS_SERIAL_PORT_ID, USB_STRINGS_COMM_1_ID, USB_STRINGS_DATA_1_ID)
+#endif
+#if USB_FUNCTIONS == USB_FUNC_CDC_VENDOR
+	,
+	vendor_intf_descs()
+#endif
+#if DUAL_CDC == 1
+	,
+	serial_port_descs(INTF_COMM_2, INTF_DATA_2, COMM_IN_2, DATA_OUT_2, DATA_IN_2,
+		USB_STRINGS_SERIAL_PORT_2_ID, USB_STRINGS_COMM_2_ID, USB_STRINGS_DATA_2_ID)
+#endif
+);
+
+static const uint8_t * const usb_config_descs[] = {
+	config_1_desc.data(),
+};
+
+// All interfaces (the descriptors are provided by the prebuilt configuration descriptor)
+static const qsb_interface usb_interfaces[] = {
 	{
-		.bLength = QSB_DT_ENDPOINT_SIZE,
-		.bDescriptorType = QSB_DT_ENDPOINT,
-		.bEndpointAddress = DATA_OUT_1,
-		.bmAttributes = QSB_ENDPOINT_ATTR_BULK,
-		.wMaxPacketSize = CDCACM_PACKET_SIZE,
-		.bInterval = 1,
-		.extra = nullptr,
-		.extralen = 0,
+		.cur_altsetting = nullptr,
+		.num_altsetting = 1,
+		.altsetting = nullptr,
+		.iface_assoc = nullptr,
 	},
+#if USB_NUM_INTERFACES >= 2
 	{
-		.bLength = QSB_DT_ENDPOINT_SIZE,
-		.bDescriptorType = QSB_DT_ENDPOINT,
-		.bEndpointAddress = DATA_IN_1,
-		.bmAttributes = QSB_ENDPOINT_ATTR_BULK,
-		.wMaxPacketSize = CDCACM_PACKET_SIZE,
-		.bInterval = 1,
-		.extra = nullptr,
-		.extralen = 0,
-	}};
-
-static const qsb_cdc_functional_descs cdc_func_desc = {
-	.header = {
-		.bFunctionLength = sizeof(qsb_cdc_header_desc),
-		.bDescriptorType = QSB_CDC_FUNC_DT_INTERFACE,
-		.bDescriptorSubtype = QSB_CDC_FUNC_SUBTYPE_HEADER,
-		.bcdCDC = 0x0110,
-	},
-	.call_mgmt = { // see chapter 5.3.1 in PSTN120
-		.bFunctionLength = sizeof(qsb_pstn_call_management_desc),
-		.bDescriptorType = QSB_CDC_FUNC_DT_INTERFACE,
-		.bDescriptorSubtype = QSB_CDC_FUNC_SUBTYPE_CALL_MANAGEMENT,
-		.bmCapabilities = 0, // no call management
-		.bDataInterface = INTF_DATA,
-	},
-	.acm = { // see chapter 5.3.2 in PSTN120
-		.bFunctionLength = sizeof(qsb_cdc_acm_desc),
-		.bDescriptorType = QSB_CDC_FUNC_DT_INTERFACE,
-		.bDescriptorSubtype = QSB_CDC_FUNC_SUBTYPE_ACM,
-		.bmCapabilities = QSB_ACM_CAP_LINE_CODING,
+		.cur_altsetting = nullptr,
+		.num_altsetting = 1,
+		.altsetting = nullptr,
+		.iface_assoc = nullptr,
 	},
-	.cdc_union = {
-		.bFunctionLength = sizeof(qsb_cdc_union_desc),
-		.bDescriptorType = QSB_CDC_FUNC_DT_INTERFACE,
-		.bDescriptorSubtype = QSB_CDC_FUNC_SUBTYPE_UNION,
-		.bControlInterface = INTF_COMM,
-		.bSubordinateInterface0 = INTF_DATA,
-	}};
-
-// CDC interfaces descriptors
-static const qsb_interface_desc comm_if_1_desc[] = {
-	{
-		.bLength = QSB_DT_INTERFACE_SIZE,
-		.bDescriptorType = QSB_DT_INTERFACE,
-		.bInterfaceNumber = INTF_COMM,
-		.bAlternateSetting = 0,
-        .bNumEndpoints = QSB_ARRAY_SIZE(comm_ep_1_desc),
-		.bInterfaceClass = QSB_CDC_INTF_CLASS_COMM,
-		.bInterfaceSubClass = QSB_CDC_INTF_SUBCLASS_ACM,
-		.bInterfaceProtocol = QSB_CDC_INTF_PROTOCOL_AT,
-		.iInterface = USB_STRINGS_COMM_1_ID,
-		.endpoint = comm_ep_1_desc,
-		.extra = &cdc_func_desc,
-		.extralen = sizeof(cdc_func_desc),
-	}};
-
-static const qsb_interface_desc data_if_1_desc[] = {
-	{
-		.bLength = QSB_DT_INTERFACE_SIZE,
-		.bDescriptorType = QSB_DT_INTERFACE,
-		.bInterfaceNumber = INTF_DATA,
-		.bAlternateSetting = 0,
-		.bNumEndpoints = QSB_ARRAY_SIZE(data_ep_1_desc),
-		.bInterfaceClass = QSB_CDC_INTF_CLASS_DATA,
-		.bInterfaceSubClass = 0,
-		.bInterfaceProtocol = 0,
-		.iInterface = USB_STRINGS_DATA_1_ID,
-		.endpoint = data_ep_1_desc,
-		.extra = nullptr,
-		.extralen = 0,
-	}};
-
-static const qsb_iface_assoc_desc assoc_1_desc = {
-	.bLength = QSB_DT_INTERFACE_ASSOCIATION_SIZE,
-	.bDescriptorType = QSB_DT_INTERFACE_ASSOCIATION,
-	.bFirstInterface = INTF_COMM,
-	.bInterfaceCount = 2,
-	.bFunctionClass = QSB_CDC_INTF_CLASS_COMM,
-	.bFunctionSubClass = QSB_CDC_INTF_SUBCLASS_ACM,
-	.bFunctionProtocol = QSB_CDC_INTF_PROTOCOL_AT,
-	.iFunction = USB_STRINGS_SERIAL_PORT_ID,
-};
-
-// All interfaces
-static const qsb_interface usb_interfaces[] = {
+#endif
+#if USB_NUM_INTERFACES >= 3
 	{
 		.cur_altsetting = nullptr,
-		.num_altsetting = QSB_ARRAY_SIZE(comm_if_1_desc),
-		.altsetting = comm_if_1_desc,  // Index of this array element must match with INTF_COMM
-		.iface_assoc = &assoc_1_desc,  // Mandatory for composite device with multiple interfaces
+		.num_altsetting = 1,
+		.altsetting = nullptr,
+		.iface_assoc = nullptr,
 	},
+#endif
+#if USB_NUM_INTERFACES >= 4
 	{
 		.cur_altsetting = nullptr,
-		.num_altsetting = QSB_ARRAY_SIZE(data_if_1_desc),
-		.altsetting = data_if_1_desc,  // Index of this array element must match with INTF_DATA
+		.num_altsetting = 1,
+		.altsetting = nullptr,
 		.iface_assoc = nullptr,
 	},
+#endif
 };
 
 static const qsb_config_desc config_desc[] = {
 	{
 		.bLength = QSB_DT_CONFIGURATION_SIZE,
 		.bDescriptorType = QSB_DT_CONFIGURATION,
-		.wTotalLength = 0,
+		.wTotalLength = config_1_desc.size(),
 		.bNumInterfaces = QSB_ARRAY_SIZE(usb_interfaces),
 		.bConfigurationValue = 1,
 		.iConfiguration = 0,
@@ -191,7 +225,7 @@ static const qsb_device_desc dev_desc = {
 	.bDeviceClass = QSB_DEV_CLASS_MISCELLANEOUS,
 	.bDeviceSubClass = QSB_DEV_SUBCLASS_MISC_COMMON,
 	.bDeviceProtocol = QSB_DEV_PROTOCOL_INTF_ASSOC_DESC,
-	.bMaxPacketSize0 = 16,
+	.bMaxPacketSize0 = USB_EP0_PACKET_SIZE,
 	.idVendor = USB_VID,
 	.idProduct = USB_PID,
 	.bcdDevice = USB_DEVICE_REL,
@@ -203,7 +237,9 @@ static const qsb_device_desc dev_desc = {
 
 qsb_device *usb_conf_init()
 {
-	return qsb_dev_init(qsb_port_fs, &dev_desc, config_desc,
+	qsb_device *dev = qsb_dev_init(qsb_port_fs, &dev_desc, config_desc,
 					 usb_strings, QSB_ARRAY_SIZE(usb_strings),
 					 usbd_control_buffer, sizeof(usbd_control_buffer));
+	qsb_dev_init_prebuilt_descs(dev, usb_config_descs, usb_string_descs);
+	return dev;
 }
@@ -8,160 +8,553 @@
  * USB serial implementation
  */
 
+#include "bench.h"
+#include "boot_timing.h"
 #include "common.h"
+#include "event_loop.h"
 #include "hardware.h"
+#include "loop_stats.h"
+#include "perf_counters.h"
+#include "target_ctrl.h"
+#include "trace.h"
 #include "uart.h"
 #include "usb_cdc.h"
 #include "usb_conf.h"
 #include "usb_serial.h"
 #include "qsb_cdc.h"
+#include "qsb_fsdev.h"
 #include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/rcc.h>
 
-#define TX_HOLDBACK_MAX_TIME 3  // max time to hold back data for transmission (in milliseconds)
-#define TX_HOLDBACK_MAX_LEN 16  // max number of bytes to hold back data for transmission
+#define TX_HOLDBACK_MAX_TIME 3000  // default max time to hold back data for transmission (in µs)
+#define TX_HOLDBACK_MAX_LEN 16  // default max number of bytes to hold back data for transmission
+#define UPLOAD_MAX_BAUDRATE_ERROR 10000 // max deviation of the achieved upload baud rate (in ppm)
 
-constexpr int RX_USB_BUF_SIZE = 2 * CDCACM_PACKET_SIZE;
-constexpr int TX_USB_BUF_SIZE = 2 * CDCACM_PACKET_SIZE;
+constexpr int RX_USB_BUF_SIZE = usb_pma_plan::data_out;
+constexpr int TX_USB_BUF_SIZE = usb_pma_plan::data_in;
 
+#if QSB_STATIC_EP_DISPATCH == 1
+// packets received on the OUT endpoints are passed to qsb_static_ep_out()
+static constexpr qsb_dev_ep_callback_fn usb_data_out_cb = nullptr;
+#else
 static void usb_data_out_cb(qsb_device *dev, uint8_t ep, uint32_t len);
+#endif
 static void usb_data_in_cb(qsb_device *dev, uint8_t ep, uint32_t len);
 static void usb_comm_in_cb(qsb_device *dev, uint8_t ep, uint32_t len);
 
-usb_serial_impl usb_serial;
+usb_serial_impl<usb_serial_1_port> usb_serial;
+#if DUAL_CDC == 1
+usb_serial_impl<usb_serial_2_port> usb_serial_2;
+#endif
 
-void usb_serial_impl::init()
+template <class Port>
+void usb_serial_impl<Port>::init()
 {
-    uart.init();
-    usb_cdc_init();
+    uart().init();
 }
 
 // Called when USB is connected
-void usb_serial_impl::on_usb_configured()
+template <class Port>
+void usb_serial_impl<Port>::on_usb_configured()
 {
+    if (upload_saved_baudrate != 0)
+        end_upload_mode();
+
     needs_zlp = false;
     is_tx_high_water = false;
     last_serial_state = 0;
-    tx_timestamp = millis() - 100;
+    is_rx_burst_ended = false;
     pending_interrupt = 0;
+    is_notif_in_flight = false;
+    rx_consume_pending = 0;
+    is_dtr_set = false;
+    data_in_ep = Port::has_vendor_intf ? Port::vendor_in : Port::data_in;
+
+    // reset parameters set by host
+    set_holdback_time_us(TX_HOLDBACK_MAX_TIME);
+    holdback_len = TX_HOLDBACK_MAX_LEN;
+    tx_timestamp = holdback_clock() - holdback_time;
+    flush_delimiter = USB_SERIAL_NO_DELIMITER;
+    rx_scanned_len = 0;
+    rx_flush_len = 0;
+    is_framed_rx = false;
+    rx_frame_crc = 0;
+    rx_crc_len = 0;
+    nak_threshold = min_nak_threshold;
+    deferred_out_len[0] = deferred_out_len[1] = 0;
+    uart().set_tx_pause_threshold(nak_threshold);
+    uart().set_rx_high_water(0);
+    uart().set_tx_chunk_size(0);
+    uart().reset_baud_aliases();
+#if TELEMETRY == 1
+    telemetry_interval = 0;
+    telemetry_seq = 0;
+#endif
 
     // register callbacks
-    qsb_dev_ep_setup(usb_device, DATA_OUT_1, QSB_ENDPOINT_ATTR_BULK, RX_USB_BUF_SIZE, usb_data_out_cb);
-    qsb_dev_ep_setup(usb_device, DATA_IN_1, QSB_ENDPOINT_ATTR_BULK, TX_USB_BUF_SIZE, usb_data_in_cb);
-    qsb_dev_ep_setup(usb_device, COMM_IN_1, QSB_ENDPOINT_ATTR_INTERRUPT, 16, usb_comm_in_cb);
+    qsb_dev_ep_setup(usb_device, Port::data_out, QSB_ENDPOINT_ATTR_BULK, RX_USB_BUF_SIZE, usb_data_out_cb);
+    qsb_dev_ep_setup(usb_device, Port::data_in, QSB_ENDPOINT_ATTR_BULK, TX_USB_BUF_SIZE, usb_data_in_cb);
+    if (Port::has_comm)
+        qsb_dev_ep_setup(usb_device, Port::comm_in, QSB_ENDPOINT_ATTR_INTERRUPT, usb_pma_plan::comm_in, usb_comm_in_cb);
+    if (Port::has_vendor_intf) {
+        qsb_dev_ep_setup(usb_device, Port::vendor_out, QSB_ENDPOINT_ATTR_BULK, RX_USB_BUF_SIZE, usb_data_out_cb);
+        qsb_dev_ep_setup(usb_device, Port::vendor_in, QSB_ENDPOINT_ATTR_BULK, TX_USB_BUF_SIZE, usb_data_in_cb);
+    }
 
-    uart.enable();
+    uart().enable();
 }
 
-void usb_serial_impl::on_usb_data_received(qsb_device *dev)
+template <class Port>
+RAMFUNC void usb_serial_impl<Port>::on_usb_data_received(qsb_device *dev, uint8_t ep, uint32_t len, uint8_t offset)
 {
-    uint8_t packet[CDCACM_PACKET_SIZE] __attribute__((aligned(4)));
+    uint8_t *buf;
+    if (nak_threshold == 0) {
+        // Deferred acknowledgement: reserve the exact packet size,
+        // or leave the packet in packet memory until it fits
+        buf = uart().reserve_tx(len);
+        if (buf == nullptr) {
+            qsb_dev_ep_defer_packet(dev, ep);
+            deferred_out_len[ep == Port::data_out ? 0 : 1] = len;
+            if (!is_tx_high_water) {
+                is_tx_high_water = true;
+                perf_counters.out_pauses++;
+                pause_timestamp = millis();
+                trace(trace_event::ep_pause, uart().tx_data_avail(), Port::port_index);
+            }
+            return;
+        }
+    } else {
+        // Reserve space for an entire packet in the UART transmit buffer
+        buf = uart().reserve_tx(CDCACM_PACKET_SIZE);
+        if (buf == nullptr)
+            return; // buffer full - discard data
+    }
 
-    // Retrieve USB data
-    uint16_t len = qsb_dev_ep_read_packet(dev, DATA_OUT_1, packet, CDCACM_PACKET_SIZE);
-    if (len == 0)
+    // Retrieve USB data (directly into transmit buffer)
+#if QSB_STATIC_EP_DISPATCH == 1
+    uint16_t n = qsb_dev_ep_read_packet_at(ep, offset, buf, CDCACM_PACKET_SIZE);
+#else
+    (void)offset;
+    uint16_t n = qsb_dev_ep_read_packet(dev, ep, buf, CDCACM_PACKET_SIZE);
+#endif
+    perf_counters.usb_out_packets++;
+    if (n == 0)
         return;
 
+    perf_counters.usb_out_bytes += n;
+
     // Start transmission via UART
-    uart.transmit(packet, len);
+    uart().commit_tx(n);
+    boot_timing.on_data();
+#if LOOP_STATS == 1
+    loop_stats.on_work_done();
+#endif
+
+    if (nak_threshold != 0)
+        update_nak(); // deferred packets are retried from poll()
+}
 
-    update_nak();
+#if QSB_STATIC_EP_DISPATCH == 1
+
+// Called by qsb_dev_poll() when data has arrived via USB (OUT endpoints known at compile time)
+RAMFUNC void qsb_static_ep_out(qsb_device *dev, uint8_t ep, uint8_t offset, uint16_t len)
+{
+#if DUAL_CDC == 1
+    if (ep == DATA_OUT_2) {
+        usb_serial_2.on_usb_data_received(dev, ep, len, offset);
+        return;
+    }
+#endif
+    usb_serial.on_usb_data_received(dev, ep, len, offset);
 }
 
+#else
+
 // Called when data has arrived via USB
-void usb_data_out_cb(qsb_device *dev, __attribute__((unused)) uint8_t ep, __attribute__((unused)) uint32_t len)
+void usb_data_out_cb(qsb_device *dev, uint8_t ep, uint32_t len)
 {
-    usb_serial.on_usb_data_received(dev);
+#if DUAL_CDC == 1
+    if (ep == DATA_OUT_2) {
+        usb_serial_2.on_usb_data_received(dev, ep, len, 0);
+        return;
+    }
+#endif
+    usb_serial.on_usb_data_received(dev, ep, len, 0);
 }
 
-bool usb_serial_impl::is_connected()
+#endif
+
+template <class Port>
+bool usb_serial_impl<Port>::is_connected()
 {
     return usb_cdc_is_connected();
 }
 
 // Check for data received via UART
-void usb_serial_impl::poll()
+template <class Port>
+RAMFUNC void usb_serial_impl<Port>::poll()
 {
-    usb_cdc_poll();
-    
-    uart.poll();
+    uart().poll();
 
     if (!usb_cdc_is_connected())
         return;
 
     update_nak();
 
-    // Check for RX buffer overrun
-    if (uart.has_rx_overrun_occurred()) {
+    // Remove data from the UART RX buffer once it has been copied to packet memory
+    if (rx_consume_pending != 0) {
+        if (qsb_dev_ep_transmit_pending(usb_device, data_in_ep)) {
+#if EVENT_LOOP == 1
+            event_loop.signal(wake_usb); // completion is checked by qsb_dev_poll()
+#endif
+            return; // DMA copy in progress
+        }
+        uart().consume_rx(std::min(rx_consume_pending, uart().rx_data_len()));
+        rx_consume_pending = 0;
+    }
+
+    if (Port::has_vendor_intf)
+        select_data_in();
+
+    // Check for RX buffer overrun (the notification does not hold up the data path)
+    if (uart().has_rx_overrun_occurred()) {
+        rx_scanned_len = rx_flush_len = 0; // data has been discarded
+#if FRAME_CRC == 1
+        if (rx_frame_crc != 0) {
+            rx_crc_len = 0;
+            frame_crc.resync();
+        }
+#endif
         on_interrupt_occurred(usb_serial_interrupt::data_overrun);
-        return;
     }
 
-    uint16_t state = serial_state();
-    if (state != last_serial_state)
-        notify_serial_state(state);
+    update_serial_state();
+#if TELEMETRY == 1
+    update_telemetry();
+#endif
 
     // In order to prevent the USB line from being flooded with packets
-    // to transmit a single byte, data is held back until a certain time
-    // has expired or a certain number of bytes has been accumulated.
+    // to transmit a single byte, data is held back until the RX line
+    // has become idle (end of burst), a certain time has expired or
+    // a certain number of bytes has been accumulated.
     // After a pause with no transmission, the next byte (or chunk of bytes)
     // is immediately transmitted.
-    size_t len = uart.rx_data_len();
-    if (!needs_zlp && len == 0)
-            return; // no data, no ZLP
-    if (!needs_zlp && len < TX_HOLDBACK_MAX_LEN && !has_expired(tx_timestamp + TX_HOLDBACK_MAX_TIME))
+    // If a delimiter is configured, complete frames are transmitted immediately
+    // (without the incomplete frame following them). An incomplete frame is
+    // held back until it fills a packet.
+    if (uart().has_rx_burst_ended())
+        is_rx_burst_ended = true;
+
+#if SOF_SCHED == 1
+    // Between frame starts, only full packets (and pending ZLPs) are submitted
+    bool is_frame_start = is_sof_pending;
+    is_sof_pending = false;
+    if (!is_frame_start && !needs_zlp && uart().rx_data_len() < CDCACM_PACKET_SIZE)
+        return;
+#endif
+
+    const uint8_t *chunk1;
+    const uint8_t *chunk2;
+    size_t len1;
+    size_t len2;
+    size_t len = uart().peek_rx_chunks(&chunk1, &len1, &chunk2, &len2);
+    if (!needs_zlp && len == 0) {
+        is_rx_burst_ended = false;
+        return; // no data, no ZLP
+    }
+    size_t hold_len = holdback_len;
+    if (flush_delimiter != USB_SERIAL_NO_DELIMITER) {
+#if FRAME_CRC == 1
+        if (rx_frame_crc != 0)
+            check_rx_crc(chunk1, len1, chunk2, len);
+#endif
+        scan_rx_delimiter(chunk1, len1, chunk2, len);
+        hold_len = CDCACM_PACKET_SIZE; // do not split an incomplete frame early
+    }
+    if (!needs_zlp && rx_flush_len == 0 && len < hold_len && !is_rx_burst_ended
+            && (int32_t)(tx_timestamp + holdback_time - holdback_clock()) > 0) {
+#if EVENT_LOOP == 1 && SOF_SCHED == 0
+        wake_at(tx_timestamp + holdback_time);
+#endif
         return; // wait for more data to arrive
+    }
 
-    uint16_t write_avail = qsb_dev_ep_transmit_avail(usb_device, DATA_IN_1);
+    uint16_t write_avail = qsb_dev_ep_transmit_avail(usb_device, data_in_ep);
     if (write_avail == 0)
         return; // DATA IN endpoint is busy
 
-    tx_timestamp = millis();
+    tx_timestamp = holdback_clock();
+
+    // Start transmission over USB (UART data is directly copied to packet memory).
+    // If both halves of the double buffered endpoint are free, up to two packets
+    // are submitted so the host can fetch them in a single frame.
+    size_t max_len = rx_flush_len != 0 ? std::min(rx_flush_len, (size_t)write_avail) : write_avail;
+#if SOF_SCHED == 1
+    if (!is_frame_start && len >= CDCACM_PACKET_SIZE)
+        max_len = std::min(len, (size_t)write_avail) & ~(size_t)(CDCACM_PACKET_SIZE - 1);
+#endif
+    len1 = std::min(len1, max_len);
+    len2 = std::min(len2, max_len - len1);
+    int n; // number of bytes taken from the RX buffer
+    int packet_len; // number of bytes submitted via USB
+#if RX_TIMESTAMPS == 1
+    if (is_framed_rx) {
+        n = transmit_framed(chunk1, len1, chunk2, len2);
+        packet_len = n > 0 ? n + sizeof(usb_serial_rx_header) : n;
+    } else
+#endif
+    {
+        n = qsb_dev_ep_transmit_chunks(usb_device, data_in_ep, chunk1, len1, chunk2, len2, uart().rx_data_mask());
+        packet_len = n;
+    }
+    if (n < 0)
+        return;
 
-    uint8_t packet[TX_USB_BUF_SIZE] __attribute__((aligned(4)));
+    rx_scanned_len = rx_scanned_len > (size_t)n ? rx_scanned_len - n : 0;
+    rx_crc_len = rx_crc_len > (size_t)n ? rx_crc_len - n : 0;
+    rx_flush_len = rx_flush_len > (size_t)n ? rx_flush_len - n : 0;
+
+    // With QSB_DMA_COPY, the data may still be read by the DMA controller
+    if (qsb_dev_ep_transmit_pending(usb_device, data_in_ep))
+        rx_consume_pending = n;
+    else
+        uart().consume_rx(n);
+#if LOOP_STATS == 1
+    loop_stats.on_work_done();
+#endif
+    perf_counters.usb_in_bytes += packet_len;
+    if (packet_len == 0) {
+        perf_counters.usb_in_packets++;
+        perf_counters.usb_in_zlps++;
+    } else {
+        perf_counters.usb_in_packets += packet_len > CDCACM_PACKET_SIZE ? 2 : 1;
+        boot_timing.on_data();
+    }
 
-    // Retrieve UART data
-    len = uart.copy_rx_data(packet, write_avail);
+    // A ZLP is needed if the last submitted packet was a full packet
+    needs_zlp = packet_len > 0 && packet_len % CDCACM_PACKET_SIZE == 0;
+    if ((size_t)n == len)
+        is_rx_burst_ended = false; // burst completely submitted
+}
 
-    needs_zlp = len > 0 && len % CDCACM_PACKET_SIZE == 0;
+// Scans the data received since the last call for the delimiter. Bytes are only scanned once;
+// the scan runs backwards so the last complete frame is found immediately.
+template <class Port>
+RAMFUNC void usb_serial_impl<Port>::scan_rx_delimiter(const uint8_t *chunk1, size_t len1, const uint8_t *chunk2, size_t len)
+{
+    if (rx_scanned_len > len)
+        rx_scanned_len = rx_flush_len = 0;
+
+    uint8_t mask = uart().rx_data_mask();
+    uint8_t delimiter = (uint8_t)flush_delimiter & mask;
+    for (size_t i = len; i > rx_scanned_len; i--) {
+        uint8_t b = i <= len1 ? chunk1[i - 1] : chunk2[i - 1 - len1];
+        if ((b & mask) == delimiter) {
+            rx_flush_len = i;
+            break;
+        }
+    }
+    rx_scanned_len = len;
+}
+
+#if FRAME_CRC == 1
+// Passes the data received since the last call to the CRC check of the frames.
+// Frames with an invalid CRC are reported with a SERIAL_STATE notification.
+template <class Port>
+RAMFUNC void usb_serial_impl<Port>::check_rx_crc(const uint8_t *chunk1, size_t len1, const uint8_t *chunk2, size_t len)
+{
+    if (rx_crc_len > len) {
+        rx_crc_len = 0;
+        frame_crc.resync();
+    }
+
+    uint8_t delimiter = (uint8_t)flush_delimiter;
+    int errors = 0;
+    size_t start = rx_crc_len;
+    if (start < len1) {
+        errors += frame_crc.process(chunk1 + start, len1 - start, delimiter);
+        start = len1;
+    }
+    if (start < len)
+        errors += frame_crc.process(chunk2 + (start - len1), len - start, delimiter);
+    rx_crc_len = len;
+
+    if (errors != 0)
+        on_interrupt_occurred(usb_serial_interrupt::crc_error);
+}
+#endif
+
+#if RX_TIMESTAMPS == 1
+// Submits a single packet consisting of a header with the arrival time of the
+// first byte and the payload (framed RX mode). Returns the payload length.
+template <class Port>
+RAMFUNC int usb_serial_impl<Port>::transmit_framed(const uint8_t *chunk1, size_t len1, const uint8_t *chunk2, size_t len2)
+{
+    if (len1 + len2 == 0)
+        return qsb_dev_ep_transmit_packet(usb_device, data_in_ep, nullptr, 0); // ZLP
+
+    constexpr size_t max_payload = CDCACM_PACKET_SIZE - sizeof(usb_serial_rx_header);
+    len1 = std::min(len1, max_payload);
+    len2 = std::min(len2, max_payload - len1);
+
+    uint32_t count = uart().rx_read_count();
+    usb_serial_rx_header *header = (usb_serial_rx_header *)framed_packet;
+    header->magic = USB_SERIAL_RX_HEADER_MAGIC;
+    header->len = len1 + len2;
+    header->offset = (uint16_t)count;
+    header->arrival_ticks = uart().rx_arrival_time(count);
+    header->submit_ticks = clock_ticks();
+    header->submit_frame = USB_FNR & USB_FNR_FN;
+
+    uint8_t mask = uart().rx_data_mask();
+    uint8_t *payload = framed_packet + sizeof(usb_serial_rx_header);
+    for (size_t i = 0; i < len1; i++)
+        payload[i] = chunk1[i] & mask;
+    for (size_t i = 0; i < len2; i++)
+        payload[len1 + i] = chunk2[i] & mask;
+
+    int packet_len = sizeof(usb_serial_rx_header) + len1 + len2;
+    if (qsb_dev_ep_transmit_packet(usb_device, data_in_ep, framed_packet, packet_len) < 0)
+        return -1;
+    return len1 + len2;
+}
+#endif
+
+// Gets the time base of the holdback timeout
+template <class Port>
+RAMFUNC uint32_t usb_serial_impl<Port>::holdback_clock()
+{
+#if SOF_SCHED == 1
+    return sof_count;
+#else
+    return micros();
+#endif
+}
+
+// Sets the holdback time (in µs, rounded up to USB frames with SOF_SCHED)
+template <class Port>
+void usb_serial_impl<Port>::set_holdback_time_us(uint32_t time)
+{
+#if SOF_SCHED == 1
+    holdback_time = (time + 999) / 1000;
+#else
+    holdback_time = time;
+#endif
+}
+
+// Gets the holdback time (in µs)
+template <class Port>
+uint32_t usb_serial_impl<Port>::holdback_time_us()
+{
+#if SOF_SCHED == 1
+    return holdback_time * 1000;
+#else
+    return holdback_time;
+#endif
+}
 
-    // Start transmission over USB
-    qsb_dev_ep_transmit_packet(usb_device, DATA_IN_1, packet, len);
+#if SOF_SCHED == 1
+// Called at the start of each USB frame
+template <class Port>
+void usb_serial_impl<Port>::on_sof()
+{
+    sof_count++;
+    is_sof_pending = true;
+}
+#endif
+
+// Selects the endpoint for data received via UART (CDC while the serial port is open).
+// The endpoint is only changed once the last packet has been completely submitted.
+template <class Port>
+void usb_serial_impl<Port>::select_data_in()
+{
+    uint8_t ep = is_dtr_set ? Port::data_in : Port::vendor_in;
+    if (ep != data_in_ep && !needs_zlp)
+        data_in_ep = ep;
 }
 
-// Updates the NAK status of DATA_OUT_1
-void usb_serial_impl::update_nak()
+// Updates the NAK status of the DATA OUT endpoint(s)
+template <class Port>
+void usb_serial_impl<Port>::update_nak()
 {
-    bool is_high_water = uart.tx_data_avail() < TX_USB_BUF_SIZE; // two more packages
+    if (nak_threshold == 0) {
+        retry_deferred_out();
+        return;
+    }
+
+    bool is_high_water = uart().tx_data_avail() < nak_threshold; // room for the packets arriving after the pause
     if (is_high_water && !is_tx_high_water) {
         is_tx_high_water = true;
-        qsb_dev_ep_pause(usb_device, DATA_OUT_1);
+        qsb_dev_ep_pause(usb_device, Port::data_out);
+        if (Port::has_vendor_intf)
+            qsb_dev_ep_pause(usb_device, Port::vendor_out);
+        perf_counters.out_pauses++;
+        pause_timestamp = millis();
+        trace(trace_event::ep_pause, uart().tx_data_avail(), Port::port_index);
     } else if (!is_high_water && is_tx_high_water) {
         is_tx_high_water = false;
-        qsb_dev_ep_unpause(usb_device, DATA_OUT_1);
+        qsb_dev_ep_unpause(usb_device, Port::data_out);
+        if (Port::has_vendor_intf)
+            qsb_dev_ep_unpause(usb_device, Port::vendor_out);
+        perf_counters.out_paused_time += millis() - pause_timestamp;
+        trace(trace_event::ep_unpause, uart().tx_data_avail(), Port::port_index);
+    }
+}
+
+// Delivers the deferred OUT packets again once they fit into the UART transmit buffer
+template <class Port>
+void usb_serial_impl<Port>::retry_deferred_out()
+{
+    if (!is_tx_high_water)
+        return;
+
+    size_t avail = uart().tx_data_avail();
+    for (int index = 0; index < 2; index++) {
+        if (deferred_out_len[index] == 0 || avail < deferred_out_len[index])
+            continue;
+
+        // the callback is called from within qsb_dev_ep_unpause() (and might defer the packet again)
+        deferred_out_len[index] = 0;
+        qsb_dev_ep_unpause(usb_device, index == 0 ? Port::data_out : Port::vendor_out);
+        avail = uart().tx_data_avail();
+    }
+
+    if (deferred_out_len[0] == 0 && deferred_out_len[1] == 0) {
+        is_tx_high_water = false;
+        perf_counters.out_paused_time += millis() - pause_timestamp;
+        trace(trace_event::ep_unpause, uart().tx_data_avail(), Port::port_index);
     }
 }
 
 // Called when transmission over USB has completed
-void usb_serial_impl::on_usb_data_transmitted()
+template <class Port>
+void usb_serial_impl<Port>::on_usb_data_transmitted()
 {
 }
 
 // Called when transmission over USB has completed
 void usb_data_in_cb(__attribute__((unused)) qsb_device *dev, __attribute__((unused)) uint8_t ep, __attribute__((unused)) uint32_t len)
 {
+#if DUAL_CDC == 1
+    if (ep == DATA_IN_2) {
+        usb_serial_2.on_usb_data_transmitted();
+        return;
+    }
+#endif
     usb_serial.on_usb_data_transmitted();
 }
 
-void usb_serial_impl::get_line_coding(qsb_pstn_line_coding *line_coding)
+template <class Port>
+void usb_serial_impl<Port>::get_line_coding(qsb_pstn_line_coding *line_coding)
 {
-    line_coding->dwDTERate = uart.baudrate();
-    line_coding->bDataBits = uart.databits();
-    line_coding->bCharFormat = (uint8_t)uart.stopbits();
-    line_coding->bParityType = (uint8_t)uart.parity();
+    line_coding->dwDTERate = uart().baudrate();
+    line_coding->bDataBits = uart().databits();
+    line_coding->bCharFormat = (uint8_t)uart().stopbits();
+    line_coding->bParityType = (uint8_t)uart().parity();
 }
 
-bool usb_serial_impl::set_line_coding(qsb_pstn_line_coding *line_coding)
+template <class Port>
+bool usb_serial_impl<Port>::set_line_coding(qsb_pstn_line_coding *line_coding)
 {
     if (line_coding->bCharFormat > 2)
         goto invalid_param;
@@ -177,7 +570,13 @@ bool usb_serial_impl::set_line_coding(qsb_pstn_line_coding *line_coding)
             goto invalid_param;
     }
 
-    uart.set_coding(
+    trace(trace_event::set_line_coding, line_coding->dwDTERate, Port::port_index);
+    if (upload_saved_baudrate != 0) {
+        // the host's line coding ends upload mode
+        upload_saved_baudrate = 0;
+        uart().set_tx_chunk_size(upload_saved_chunk_size);
+    }
+    uart().set_coding(
         line_coding->dwDTERate,
         line_coding->bDataBits,
         (uart_stopbits)line_coding->bCharFormat,
@@ -189,54 +588,374 @@ invalid_param:
     return false;
 }
 
-void usb_serial_impl::set_control_line_state(uint16_t state)
+template <class Port>
+bool usb_serial_impl<Port>::get_param(usb_serial_param param, uint32_t *value)
 {
-    (void)state;
+    switch (param) {
+    case usb_serial_param::holdback_time:
+        *value = holdback_time_us() / 1000;
+        return true;
+    case usb_serial_param::holdback_time_us:
+        *value = holdback_time_us();
+        return true;
+    case usb_serial_param::holdback_len:
+        *value = holdback_len;
+        return true;
+    case usb_serial_param::rx_high_water_mark:
+        *value = uart().rx_high_water();
+        return true;
+    case usb_serial_param::nak_threshold:
+        *value = nak_threshold;
+        return true;
+    case usb_serial_param::tx_max_chunk_size:
+        *value = uart().tx_chunk_size();
+        return true;
+    case usb_serial_param::baudrate_error:
+        *value = (uint32_t)uart().baudrate_error_ppm();
+        return true;
+    case usb_serial_param::flush_delimiter:
+        *value = flush_delimiter;
+        return true;
+    case usb_serial_param::framed_rx:
+        *value = is_framed_rx ? 1 : 0;
+        return true;
+    case usb_serial_param::boot_configured_time:
+        *value = boot_timing.configured_us();
+        return true;
+    case usb_serial_param::boot_first_byte_time:
+        *value = boot_timing.first_byte_us();
+        return true;
+    case usb_serial_param::upload_baudrate:
+        *value = upload_saved_baudrate != 0 ? uart().baudrate() : 0;
+        return true;
+    case usb_serial_param::rx_frame_crc:
+        *value = rx_frame_crc;
+        return true;
+    case usb_serial_param::telemetry_interval:
+#if TELEMETRY == 1
+        *value = telemetry_interval;
+#else
+        *value = 0;
+#endif
+        return true;
+    }
+    return false;
+}
+
+template <class Port>
+bool usb_serial_impl<Port>::set_param(usb_serial_param param, uint32_t value)
+{
+    switch (param) {
+    case usb_serial_param::holdback_time:
+        if (value > 1000)
+            return false;
+        set_holdback_time_us(value * 1000);
+        return true;
+    case usb_serial_param::holdback_time_us:
+        if (value > 1000000)
+            return false;
+        set_holdback_time_us(value);
+        return true;
+    case usb_serial_param::holdback_len:
+        if (value > CDCACM_PACKET_SIZE)
+            return false;
+        holdback_len = value;
+        return true;
+    case usb_serial_param::rx_high_water_mark:
+        if (value > uart().rx_buf_len)
+            return false;
+        uart().set_rx_high_water(value);
+        return true;
+    case usb_serial_param::nak_threshold:
+        // 0 selects deferred acknowledgement
+        if ((value != 0 && value < min_nak_threshold) || value >= uart().tx_buf_len)
+            return false;
+        // the flow control mode cannot be switched while the endpoint is held up
+        if ((value == 0) != (nak_threshold == 0) && is_tx_high_water)
+            return false;
+        nak_threshold = value;
+        uart().set_tx_pause_threshold(nak_threshold);
+        return true;
+    case usb_serial_param::tx_max_chunk_size:
+        if (value > uart().tx_buf_len)
+            return false;
+        uart().set_tx_chunk_size(value);
+        return true;
+    case usb_serial_param::baudrate_error:
+    case usb_serial_param::boot_configured_time:
+    case usb_serial_param::boot_first_byte_time:
+        return false; // read-only
+    case usb_serial_param::upload_baudrate:
+        if (value == 0) {
+            end_upload_mode();
+            return true;
+        }
+        return start_upload_mode(value);
+    case usb_serial_param::rx_frame_crc:
+#if FRAME_CRC == 1
+        // a single CRC unit, used by the first port
+        if (Port::port_index != 0 || value > USB_SERIAL_CRC_32 || (value != 0 && (value & USB_SERIAL_CRC_ENABLE) == 0))
+            return false;
+        rx_frame_crc = value;
+        rx_crc_len = 0;
+        if (value != 0) {
+            frame_crc.configure(value);
+            if (uart().rx_data_len() != 0)
+                frame_crc.resync(); // data received so far might start in the middle of a frame
+        }
+        return true;
+#else
+        return value == 0; // not included in this build
+#endif
+    case usb_serial_param::flush_delimiter:
+        if (value > USB_SERIAL_NO_DELIMITER)
+            return false;
+        flush_delimiter = value;
+        rx_scanned_len = rx_flush_len = 0;
+#if FRAME_CRC == 1
+        if (rx_frame_crc != 0) {
+            rx_crc_len = 0;
+            frame_crc.resync();
+        }
+#endif
+        return true;
+    case usb_serial_param::framed_rx:
+#if RX_TIMESTAMPS == 1
+        if (value > 1)
+            return false;
+        is_framed_rx = value != 0;
+        return true;
+#else
+        return value == 0; // not included in this build
+#endif
+    case usb_serial_param::telemetry_interval:
+#if TELEMETRY == 1
+        // the counters cover the entire device, the record is sent on COMM_IN_1
+        if (Port::port_index != 0 || !Port::has_comm || (value != 0 && (value < 10 || value > 60000)))
+            return false;
+        telemetry_interval = value;
+        restart_telemetry();
+        return true;
+#else
+        return value == 0; // not included in this build
+#endif
+    }
+    return false;
 }
 
-uint16_t usb_serial_impl::serial_state()
+template <class Port>
+void usb_serial_impl<Port>::set_control_line_state(uint16_t state)
+{
+#if BENCH_SUITE == 1
+    if (Port::port_index == 0 && (state & 1) != 0 && !is_dtr_set)
+        bench.request_suite();
+#endif
+    is_dtr_set = (state & 1) != 0;
+    trace(trace_event::set_control_line_state, state & 3, Port::port_index);
+#if TARGET_CTRL == 1
+    if (Port::port_index == 0)
+        target_ctrl.set_control_lines((state & 1) != 0, (state & 2) != 0);
+#endif
+}
+
+// Switches to the upload baud rate and transmits the TX buffer in maximum-size DMA transfers
+// (contiguous data up to the end of the buffer) instead of adaptive chunks
+template <class Port>
+bool usb_serial_impl<Port>::start_upload_mode(uint32_t baudrate)
+{
+    int prev_baudrate = uart().baudrate();
+    uart().set_coding(baudrate, uart().databits(), uart().stopbits(), uart().parity());
+
+    // reject baud rates the UART cannot generate accurately
+    int error = uart().baudrate_error_ppm();
+    if (error > UPLOAD_MAX_BAUDRATE_ERROR || error < -UPLOAD_MAX_BAUDRATE_ERROR) {
+        uart().set_coding(prev_baudrate, uart().databits(), uart().stopbits(), uart().parity());
+        return false;
+    }
+
+    if (upload_saved_baudrate == 0) {
+        upload_saved_baudrate = prev_baudrate;
+        upload_saved_chunk_size = uart().tx_chunk_size_setting();
+    }
+    uart().set_tx_chunk_size(uart().tx_buf_len);
+    trace(trace_event::set_line_coding, uart().baudrate(), Port::port_index);
+    return true;
+}
+
+// Restores the baud rate and TX chunk size used before upload mode
+template <class Port>
+void usb_serial_impl<Port>::end_upload_mode()
+{
+    if (upload_saved_baudrate == 0)
+        return;
+
+    uart().set_tx_chunk_size(upload_saved_chunk_size);
+    uart().set_coding(upload_saved_baudrate, uart().databits(), uart().stopbits(), uart().parity());
+    trace(trace_event::set_line_coding, upload_saved_baudrate, Port::port_index);
+    upload_saved_baudrate = 0;
+}
+
+template <class Port>
+uint16_t usb_serial_impl<Port>::serial_state()
 {
     uint16_t status = (uint16_t)pending_interrupt;
     return status;
 }
 
-void usb_serial_impl::send_serial_state()
+template <class Port>
+void usb_serial_impl<Port>::send_serial_state()
 {
-    notify_serial_state(serial_state());
+    if (!is_notif_in_flight)
+        notify_serial_state(serial_state());
 }
 
-void usb_serial_impl::notify_serial_state(uint16_t state)
+// Sends a SERIAL_STATE notification if the state has changed or interrupts are pending.
+// At most one notification is in flight; changes in the meantime are merged.
+template <class Port>
+RAMFUNC void usb_serial_impl<Port>::update_serial_state()
 {
+    if (is_notif_in_flight)
+        return;
+    uint16_t state = serial_state();
+    if (state != last_serial_state)
+        notify_serial_state(state);
+}
+
+template <class Port>
+void usb_serial_impl<Port>::notify_serial_state(uint16_t state)
+{
+    if (!Port::has_comm) {
+        // no COMM interface: nothing to notify
+        last_serial_state = state & 0x3;
+        pending_interrupt = 0;
+        return;
+    }
+
 	uint8_t buf[10];
 	qsb_cdc_notification *notif = (qsb_cdc_notification *)buf;
 	notif->bmRequestType = 0xA1;
 	notif->bNotification = QSB_PSTN_NOTIF_SERIAL_STATE;
 	notif->wValue = 0;
-	notif->wIndex = 0;
+	notif->wIndex = Port::comm_intf;
 	notif->wLength = 2;
 	buf[8] = state;
 	buf[9] = 0;
-	if (qsb_dev_ep_transmit_packet(usb_device, COMM_IN_1, buf, 10) == 10) {
+	if (qsb_dev_ep_transmit_packet(usb_device, Port::comm_in, buf, 10) == 10) {
         last_serial_state = state & 0x3;
         pending_interrupt = 0;
+        is_notif_in_flight = true;
+        perf_counters.serial_state_notifs++;
+#if LOOP_STATS == 1
+        loop_stats.on_work_done();
+#endif
+    }
+}
+
+#if TELEMETRY == 1
+static_assert(sizeof(qsb_cdc_notification) + sizeof(usb_serial_telemetry) <= USB_COMM_PACKET_SIZE,
+    "telemetry notification exceeds COMM endpoint packet size");
+
+// Sends a telemetry record once the interval has elapsed.
+// It shares the COMM endpoint with the SERIAL_STATE notifications, which take precedence.
+template <class Port>
+void usb_serial_impl<Port>::update_telemetry()
+{
+    if (telemetry_interval == 0 || is_notif_in_flight)
+        return;
+    uint32_t now = millis();
+    if (now - telemetry_timestamp < telemetry_interval)
+        return;
+
+    auto saturate = [](uint32_t value) { return (uint16_t)std::min(value, (uint32_t)0xffff); };
+
+    uint8_t buf[sizeof(qsb_cdc_notification) + sizeof(usb_serial_telemetry)];
+    qsb_cdc_notification *notif = (qsb_cdc_notification *)buf;
+    notif->bmRequestType = 0xA1;
+    notif->bNotification = USB_SERIAL_NOTIF_TELEMETRY;
+    notif->wValue = telemetry_seq;
+    notif->wIndex = Port::comm_intf;
+    notif->wLength = sizeof(usb_serial_telemetry);
+
+    size_t tx_peak, rx_peak;
+    uart().buf_peaks(&tx_peak, &rx_peak);
+    uint32_t paused_time = total_paused_time();
+    usb_serial_telemetry *record = (usb_serial_telemetry *)notif->data;
+    record->usb_out_bytes = perf_counters.usb_out_bytes - reported_out_bytes;
+    record->usb_in_bytes = perf_counters.usb_in_bytes - reported_in_bytes;
+    record->tx_buf_peak = saturate(tx_peak);
+    record->rx_buf_peak = saturate(rx_peak);
+    record->out_paused_time = saturate(paused_time - reported_paused_time);
+    record->rx_overruns = saturate(perf_counters.rx_overruns - reported_overruns);
+
+    if (qsb_dev_ep_transmit_packet(usb_device, Port::comm_in, buf, sizeof(buf)) == sizeof(buf)) {
+        restart_telemetry();
+        telemetry_timestamp = now;
+        telemetry_seq++;
+        is_notif_in_flight = true;
     }
 }
 
-void usb_serial_impl::on_interrupt_occurred(usb_serial_interrupt interrupt)
+// Starts a new telemetry interval (the next record covers the time from now)
+template <class Port>
+void usb_serial_impl<Port>::restart_telemetry()
+{
+    telemetry_timestamp = millis();
+    reported_out_bytes = perf_counters.usb_out_bytes;
+    reported_in_bytes = perf_counters.usb_in_bytes;
+    reported_paused_time = total_paused_time();
+    reported_overruns = perf_counters.rx_overruns;
+    uart().restart_buf_peaks();
+}
+
+// Total time the OUT endpoint has been paused, incl. a pause in progress (in ms)
+template <class Port>
+uint32_t usb_serial_impl<Port>::total_paused_time()
+{
+    uint32_t paused_time = perf_counters.out_paused_time;
+    if (is_tx_high_water)
+        paused_time += millis() - pause_timestamp;
+    return paused_time;
+}
+#endif
+
+template <class Port>
+void usb_serial_impl<Port>::on_interrupt_occurred(usb_serial_interrupt interrupt)
 {
     pending_interrupt |= (uint16_t)interrupt;
-    send_serial_state();
 }
 
-void usb_serial_impl::on_usb_ctrl_completed()
+template <class Port>
+void usb_serial_impl<Port>::on_usb_ctrl_completed()
 {
-    uint16_t state = serial_state();
-    if (state != last_serial_state)
-        notify_serial_state(state);
+    is_notif_in_flight = false;
+    update_serial_state();
+}
+
+template <class Port>
+void usb_serial_impl<Port>::on_counters_reset()
+{
+#if TELEMETRY == 1
+    // the counters restart from 0 (the paused time incl. a pause in progress)
+    reported_out_bytes = 0;
+    reported_in_bytes = 0;
+    reported_paused_time = total_paused_time();
+    reported_overruns = 0;
+#endif
 }
 
 // Called when control data has been received or transmitted via USB
 void usb_comm_in_cb(__attribute__((unused)) qsb_device *dev, __attribute__((unused)) uint8_t ep, __attribute__((unused)) uint32_t len)
 {
+#if DUAL_CDC == 1
+    if (ep == COMM_IN_2) {
+        usb_serial_2.on_usb_ctrl_completed();
+        return;
+    }
+#endif
     usb_serial.on_usb_ctrl_completed();
 }
+
+template class usb_serial_impl<usb_serial_1_port>;
+#if DUAL_CDC == 1
+template class usb_serial_impl<usb_serial_2_port>;
+#endif
@@ -0,0 +1,449 @@
+/*
+ * USB Serial
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Regression tests of the data path, run against the simulated device (pio test -e native)
+ */
+
+#include "sim.h"
+#include "boot_timing.h"
+#include "perf_counters.h"
+#include "uart.h"
+#include "usb_serial.h"
+#include <algorithm>
+#include <string.h>
+#include <unity.h>
+#include <vector>
+
+static std::vector<uint8_t> test_data(size_t len)
+{
+    std::vector<uint8_t> data(len);
+    for (size_t i = 0; i < len; i++)
+        data[i] = (uint8_t)(i * 7 + i / 251);
+    return data;
+}
+
+static bool is_overrun_notified()
+{
+    for (const sim_packet &notif : sim_host_serial_states()) {
+        if ((notif.value & (uint16_t)usb_serial_interrupt::data_overrun) != 0)
+            return true;
+    }
+    return false;
+}
+
+// CRC-32 computed bit by bit (reference for the CRC unit)
+static uint32_t reference_crc(const std::vector<uint8_t> &data, uint32_t flags)
+{
+    bool is_reflected = (flags & USB_SERIAL_CRC_REFLECTED) != 0;
+    uint32_t crc = (flags & USB_SERIAL_CRC_INIT_ONES) != 0 ? 0xffffffff : 0;
+    for (uint8_t b : data) {
+        for (int i = 0; i < 8; i++) {
+            uint32_t bit = is_reflected ? (b >> i) & 1 : (b >> (7 - i)) & 1;
+            crc = (crc << 1) ^ ((bit ^ (crc >> 31)) != 0 ? 0x04C11DB7 : 0);
+        }
+    }
+    if (is_reflected) {
+        uint32_t rev = 0;
+        for (int i = 0; i < 32; i++)
+            rev |= ((crc >> i) & 1) << (31 - i);
+        crc = rev;
+    }
+    return (flags & USB_SERIAL_CRC_XOR_OUT) != 0 ? ~crc : crc;
+}
+
+// Appends a frame with CRC trailer and delimiter (payload chosen so the trailer does not contain the delimiter)
+static void append_frame(std::vector<uint8_t> &stream, size_t len, uint8_t seed, uint32_t flags, uint8_t delimiter)
+{
+    std::vector<uint8_t> frame;
+    uint32_t crc;
+    for (;; seed++) {
+        frame.clear();
+        for (size_t i = 0; i < len; i++)
+            frame.push_back((uint8_t)(seed + i * 13) == delimiter ? 0x55 : (uint8_t)(seed + i * 13));
+        crc = reference_crc(frame, flags);
+        bool has_delimiter = false;
+        for (int i = 0; i < 4; i++)
+            has_delimiter |= (uint8_t)(crc >> (8 * i)) == delimiter;
+        if (!has_delimiter)
+            break;
+    }
+    for (int i = 0; i < 4; i++) {
+        int shift = (flags & USB_SERIAL_CRC_REFLECTED) != 0 ? 8 * i : 24 - 8 * i;
+        frame.push_back((uint8_t)(crc >> shift));
+    }
+    frame.push_back(delimiter);
+    stream.insert(stream.end(), frame.begin(), frame.end());
+}
+
+static bool is_crc_error_notified()
+{
+    for (const sim_packet &notif : sim_host_serial_states()) {
+        if ((notif.value & (uint16_t)usb_serial_interrupt::crc_error) != 0)
+            return true;
+    }
+    return false;
+}
+
+void setUp()
+{
+    sim_config config;
+    config.baudrate = 1000000;
+    sim_reset(config);
+}
+
+void tearDown()
+{
+}
+
+// Host sends more than fits into the TX buffer: the OUT endpoint is paused, no data is lost
+void test_out_flow_control()
+{
+    TEST_ASSERT_TRUE(sim_host_set_line_coding(115200, 8, 0, 0));
+    std::vector<uint8_t> data = test_data(4000);
+    sim_host_write(data.data(), data.size());
+
+    TEST_ASSERT_TRUE(sim_run_until([] { return sim_peer_received().data.size() >= 4000; }, 1000));
+    TEST_ASSERT_GREATER_THAN(0, perf_counters.out_pauses);
+    TEST_ASSERT_EQUAL_size_t(4000, sim_peer_received().data.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), sim_peer_received().data.data(), data.size());
+}
+
+// Deferred acknowledgement: packets not fitting into the TX buffer are left in packet memory and redelivered
+void test_out_deferred_ack()
+{
+    TEST_ASSERT_TRUE(sim_host_set_line_coding(115200, 8, 0, 0));
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::nak_threshold, 0));
+    // odd length: the last packet is short
+    std::vector<uint8_t> data = test_data(5003);
+    sim_host_write(data.data(), data.size());
+
+    TEST_ASSERT_TRUE(sim_run_until([] { return sim_peer_received().data.size() >= 5003; }, 1000));
+    TEST_ASSERT_GREATER_THAN(0, perf_counters.out_pauses);
+    TEST_ASSERT_EQUAL_size_t(0, sim_host_write_pending());
+    TEST_ASSERT_EQUAL_size_t(5003, sim_peer_received().data.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), sim_peer_received().data.data(), data.size());
+}
+
+// A transfer ending with a full packet is terminated with a zero-length packet
+void test_in_zlp_after_full_packet()
+{
+    // hold back data until the end of the burst
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::holdback_len, 64));
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::holdback_time, 1000));
+    std::vector<uint8_t> data = test_data(64);
+    sim_peer_send(data.data(), data.size());
+    sim_run(20);
+
+    const std::vector<sim_packet> &packets = sim_host_in_packets();
+    TEST_ASSERT_EQUAL_size_t(2, packets.size());
+    TEST_ASSERT_EQUAL_UINT16(64, packets[0].value);
+    TEST_ASSERT_EQUAL_UINT16(0, packets[1].value);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), sim_host_received().data.data(), data.size());
+}
+
+// A transfer ending with a short packet needs no zero-length packet
+void test_in_no_zlp_after_short_packet()
+{
+    std::vector<uint8_t> data = test_data(100);
+    sim_peer_send(data.data(), data.size());
+    sim_run(20);
+
+    for (const sim_packet &packet : sim_host_in_packets())
+        TEST_ASSERT_GREATER_THAN(0, packet.value);
+    TEST_ASSERT_EQUAL_size_t(100, sim_host_received().data.size());
+}
+
+// Host stops reading: RTS stops the peer before the RX buffer overflows
+void test_rx_flow_control()
+{
+    sim_peer_set_flow_control(true, 2);
+    sim_host_set_reading(false);
+    std::vector<uint8_t> data = test_data(5000);
+    sim_peer_send(data.data(), data.size());
+    sim_run(100);
+
+    TEST_ASSERT_FALSE(sim_device_rts_asserted());
+    TEST_ASSERT_GREATER_THAN(0, sim_peer_send_pending());
+    TEST_ASSERT_EQUAL_UINT32(0, perf_counters.rx_overruns);
+
+    sim_host_set_reading(true);
+    TEST_ASSERT_TRUE(sim_run_until([] { return sim_host_received().data.size() >= 5000; }, 1000));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), sim_host_received().data.data(), data.size());
+    TEST_ASSERT_FALSE(is_overrun_notified());
+}
+
+// Peer ignores RTS: the overrun is detected and notified, the remaining data is delivered
+void test_rx_overrun()
+{
+    sim_peer_set_flow_control(false, 0);
+    sim_host_set_reading(false);
+    std::vector<uint8_t> data = test_data(5000);
+    sim_peer_send(data.data(), data.size());
+    sim_run(100);
+
+    sim_host_set_reading(true);
+    sim_run(100);
+
+    TEST_ASSERT_GREATER_THAN(0, perf_counters.rx_overruns);
+    TEST_ASSERT_TRUE(is_overrun_notified());
+    TEST_ASSERT_LESS_THAN(5000, sim_host_received().data.size());
+}
+
+// Both directions at the maximum bit rate (6 Mbps): all data arrives unchanged
+void test_duplex_max_bit_rate()
+{
+    TEST_ASSERT_TRUE(sim_host_set_line_coding(6000000, 8, 0, 0));
+    std::vector<uint8_t> data = test_data(20000);
+    sim_host_write(data.data(), data.size());
+    sim_peer_send(data.data(), data.size());
+
+    TEST_ASSERT_TRUE(sim_run_until([] {
+        return sim_peer_received().data.size() >= 20000 && sim_host_received().data.size() >= 20000;
+    }, 1000));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), sim_peer_received().data.data(), data.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), sim_host_received().data.data(), data.size());
+    TEST_ASSERT_EQUAL_UINT32(0, perf_counters.rx_overruns);
+}
+
+// Oversampling by 8 only supports even USARTDIV values: the reported error matches the programmed divisor
+void test_over8_baudrate_error()
+{
+    // 48 MHz / 3.1 Mbps = 15.48, rounded to 15 (3.2 Mbps)
+    TEST_ASSERT_TRUE(sim_host_set_line_coding(3100000, 8, 0, 0));
+    uint32_t value;
+    TEST_ASSERT_TRUE(sim_host_get_param(usb_serial_param::baudrate_error, &value));
+    TEST_ASSERT_EQUAL_INT(32258, (int32_t)value);
+
+    std::vector<uint8_t> data = test_data(2000);
+    sim_host_write(data.data(), data.size());
+    sim_peer_send(data.data(), data.size());
+    sim_run(50);
+    TEST_ASSERT_EQUAL_size_t(data.size(), sim_peer_received().data.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), sim_peer_received().data.data(), data.size());
+    TEST_ASSERT_EQUAL_size_t(data.size(), sim_host_received().data.size());
+}
+
+// Line coding set with the vendor-specific request (for firmware without the CDC ACM function)
+void test_vendor_line_coding()
+{
+    uint8_t coding[7] = { 0x00, 0xc2, 0x01, 0x00, 0, 2, 7 }; // 115,200 bps, 7 data bits, even parity
+    TEST_ASSERT_TRUE(sim_host_control(0x40, (uint8_t)usb_vendor_request::set_line_coding, 0, 0, coding, sizeof(coding)));
+    TEST_ASSERT_EQUAL_UINT8(7, uart.databits());
+    TEST_ASSERT_EQUAL_INT((int)uart_parity::even, (int)uart.parity());
+
+    uint8_t result[7] = { 0 };
+    uint16_t len = 0;
+    TEST_ASSERT_TRUE(sim_host_control(0xc0, (uint8_t)usb_vendor_request::get_line_coding, 0, 0, result, sizeof(result), &len));
+    TEST_ASSERT_EQUAL_UINT16(sizeof(result), len);
+    TEST_ASSERT_EQUAL_UINT32(uart.baudrate(), result[0] | (result[1] << 8) | (result[2] << 16) | ((uint32_t)result[3] << 24));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(coding + 4, result + 4, 3);
+
+    // invalid data format and wrong direction are stalled
+    coding[6] = 5;
+    TEST_ASSERT_FALSE(sim_host_control(0x40, (uint8_t)usb_vendor_request::set_line_coding, 0, 0, coding, sizeof(coding)));
+    TEST_ASSERT_FALSE(sim_host_control(0xc0, (uint8_t)usb_vendor_request::set_line_coding, 0, 0, result, sizeof(result)));
+}
+
+// Holdback time below a USB frame: a continuous burst is sent in several packets
+void test_holdback_time_us()
+{
+    uint32_t value;
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::holdback_len, 64));
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::holdback_time_us, 100));
+    TEST_ASSERT_TRUE(sim_host_get_param(usb_serial_param::holdback_time_us, &value));
+    TEST_ASSERT_EQUAL_UINT32(100, value);
+    TEST_ASSERT_TRUE(sim_host_get_param(usb_serial_param::holdback_time, &value));
+    TEST_ASSERT_EQUAL_UINT32(0, value);
+    TEST_ASSERT_FALSE(sim_host_set_param(usb_serial_param::holdback_time_us, 1000001));
+
+    // 50 bytes at 1 Mbps take 500 us (with the default of 3 ms, they are sent in 2 packets)
+    std::vector<uint8_t> data = test_data(50);
+    sim_peer_send(data.data(), data.size());
+    sim_run(5);
+
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(4, sim_host_in_packets().size());
+    TEST_ASSERT_EQUAL_size_t(50, sim_host_received().data.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), sim_host_received().data.data(), data.size());
+}
+
+// Boot timing: configuration after the disconnect period, first byte once data has passed
+void test_boot_timing()
+{
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(20000, boot_timing.configured_us());
+    TEST_ASSERT_EQUAL_UINT32(0, boot_timing.first_byte_us());
+
+    uint8_t data[] = { 0x55 };
+    sim_peer_send(data, sizeof(data));
+    sim_run(10);
+    TEST_ASSERT_GREATER_THAN_UINT32(boot_timing.configured_us(), boot_timing.first_byte_us());
+}
+
+// DTR/RTS sequence entering the target's bootloader; opening the port does not reset the target
+void test_target_boot_sequence()
+{
+    TEST_ASSERT_FALSE(sim_target_in_reset());
+    TEST_ASSERT_FALSE(sim_target_boot0_asserted());
+
+    TEST_ASSERT_TRUE(sim_host_set_control_lines(false, true));
+    TEST_ASSERT_TRUE(sim_target_in_reset());
+    TEST_ASSERT_FALSE(sim_target_boot0_asserted());
+
+    TEST_ASSERT_TRUE(sim_host_set_control_lines(true, false));
+    TEST_ASSERT_FALSE(sim_target_in_reset());
+    TEST_ASSERT_TRUE(sim_target_boot0_asserted());
+
+    // BOOT0 is held after the reset has been released
+    TEST_ASSERT_TRUE(sim_host_set_control_lines(true, true));
+    TEST_ASSERT_TRUE(sim_target_boot0_asserted());
+    sim_run(20);
+    TEST_ASSERT_FALSE(sim_target_boot0_asserted());
+    TEST_ASSERT_FALSE(sim_target_in_reset());
+}
+
+// Upload mode switches the baud rate and uses maximum-size TX transfers until it is ended
+void test_upload_mode()
+{
+    uint32_t value;
+    TEST_ASSERT_FALSE(sim_host_set_param(usb_serial_param::upload_baudrate, 5900000)); // 6 Mbps achieved
+    TEST_ASSERT_EQUAL_INT(1000000, uart.baudrate());
+
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::upload_baudrate, 6000000));
+    TEST_ASSERT_TRUE(sim_host_get_param(usb_serial_param::upload_baudrate, &value));
+    TEST_ASSERT_EQUAL_UINT32(6000000, value);
+    TEST_ASSERT_EQUAL_INT(uart.tx_buf_len, uart.tx_chunk_size());
+
+    std::vector<uint8_t> data = test_data(3000);
+    sim_host_write(data.data(), data.size());
+    TEST_ASSERT_TRUE(sim_run_until([] { return sim_peer_received().data.size() >= 3000; }, 1000));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), sim_peer_received().data.data(), data.size());
+
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::upload_baudrate, 0));
+    TEST_ASSERT_TRUE(sim_host_get_param(usb_serial_param::upload_baudrate, &value));
+    TEST_ASSERT_EQUAL_UINT32(0, value);
+    TEST_ASSERT_EQUAL_INT(1000000, uart.baudrate());
+    TEST_ASSERT_EQUAL_INT(0, uart.tx_chunk_size_setting());
+}
+
+// Frames with an invalid CRC are counted and notified; the data is delivered unchanged
+void test_rx_frame_crc()
+{
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::flush_delimiter, 0x7e));
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::rx_frame_crc, USB_SERIAL_CRC_32));
+    std::vector<uint8_t> data;
+    append_frame(data, 5, 1, USB_SERIAL_CRC_32, 0x7e);
+    append_frame(data, 100, 2, USB_SERIAL_CRC_32, 0x7e);
+    append_frame(data, 33, 3, USB_SERIAL_CRC_32, 0x7e);
+    data[20] ^= 0x04; // corrupt second frame
+    sim_peer_send(data.data(), data.size());
+    sim_run(2 * USB_COMM_INTERVAL);
+
+    TEST_ASSERT_EQUAL_UINT32(3, perf_counters.rx_crc_frames);
+    TEST_ASSERT_EQUAL_UINT32(1, perf_counters.rx_crc_errors);
+    TEST_ASSERT_TRUE(is_crc_error_notified());
+    TEST_ASSERT_EQUAL_size_t(data.size(), sim_host_received().data.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), sim_host_received().data.data(), data.size());
+}
+
+// Non-reflected CRC variant (MPEG-2, big-endian trailer)
+void test_rx_frame_crc_mpeg2()
+{
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::flush_delimiter, 0));
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::rx_frame_crc, USB_SERIAL_CRC_32_MPEG2));
+    std::vector<uint8_t> data;
+    for (int i = 0; i < 10; i++)
+        append_frame(data, 7 + i * 11, (uint8_t)i, USB_SERIAL_CRC_32_MPEG2, 0);
+    sim_peer_send(data.data(), data.size());
+    sim_run(20);
+
+    TEST_ASSERT_EQUAL_UINT32(10, perf_counters.rx_crc_frames);
+    TEST_ASSERT_EQUAL_UINT32(0, perf_counters.rx_crc_errors);
+    TEST_ASSERT_FALSE(is_crc_error_notified());
+}
+
+// Telemetry records are sent at the configured interval and add up to the transferred data
+void test_telemetry()
+{
+    TEST_ASSERT_FALSE(sim_host_set_param(usb_serial_param::telemetry_interval, 5));
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::telemetry_interval, 20));
+    std::vector<uint8_t> data = test_data(3000);
+    sim_host_write(data.data(), data.size());
+    sim_peer_send(data.data(), 1000);
+    sim_run(200);
+
+    const std::vector<sim_telemetry> &records = sim_host_telemetry();
+    // at most one record per interval (delivered when the host polls the COMM endpoint)
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(5, records.size());
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(10, records.size());
+    uint32_t out_bytes = 0;
+    uint32_t in_bytes = 0;
+    uint16_t tx_buf_peak = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        TEST_ASSERT_EQUAL_UINT16(i, records[i].seq);
+        out_bytes += records[i].record.usb_out_bytes;
+        in_bytes += records[i].record.usb_in_bytes;
+        tx_buf_peak = std::max(tx_buf_peak, records[i].record.tx_buf_peak);
+        TEST_ASSERT_EQUAL_UINT16(0, records[i].record.rx_overruns);
+    }
+    TEST_ASSERT_EQUAL_UINT32(3000, out_bytes);
+    TEST_ASSERT_EQUAL_UINT32(1000, in_bytes);
+    TEST_ASSERT_GREATER_THAN_UINT32(0, tx_buf_peak);
+    TEST_ASSERT_EQUAL_UINT16(0, records.back().record.tx_buf_peak); // idle at the end
+
+    // a record already submitted is still delivered
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::telemetry_interval, 0));
+    sim_run(20);
+    size_t num_records = records.size();
+    sim_run(100);
+    TEST_ASSERT_EQUAL_size_t(num_records, records.size());
+}
+
+// Telemetry after the host has reset the performance counters: no bogus deltas
+void test_telemetry_counter_reset()
+{
+    TEST_ASSERT_TRUE(sim_host_set_param(usb_serial_param::telemetry_interval, 20));
+    std::vector<uint8_t> data = test_data(1000);
+    sim_host_write(data.data(), data.size());
+    sim_run(50);
+
+    uint8_t counters[64];
+    TEST_ASSERT_TRUE(sim_host_control(0xc0, (uint8_t)usb_vendor_request::get_counters, 1, 0, counters, sizeof(counters)));
+    size_t num_records = sim_host_telemetry().size();
+    sim_host_write(data.data(), 500);
+    sim_run(100);
+
+    const std::vector<sim_telemetry> &records = sim_host_telemetry();
+    TEST_ASSERT_GREATER_THAN_UINT32(num_records, records.size());
+    uint32_t out_bytes = 0;
+    for (size_t i = num_records; i < records.size(); i++)
+        out_bytes += records[i].record.usb_out_bytes;
+    // bytes not yet reported before the reset are not included
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(500, out_bytes);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(1500, out_bytes);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_out_flow_control);
+    RUN_TEST(test_out_deferred_ack);
+    RUN_TEST(test_in_zlp_after_full_packet);
+    RUN_TEST(test_in_no_zlp_after_short_packet);
+    RUN_TEST(test_rx_flow_control);
+    RUN_TEST(test_rx_overrun);
+    RUN_TEST(test_duplex_max_bit_rate);
+    RUN_TEST(test_over8_baudrate_error);
+    RUN_TEST(test_vendor_line_coding);
+    RUN_TEST(test_holdback_time_us);
+    RUN_TEST(test_boot_timing);
+    RUN_TEST(test_target_boot_sequence);
+    RUN_TEST(test_upload_mode);
+    RUN_TEST(test_rx_frame_crc);
+    RUN_TEST(test_rx_frame_crc_mpeg2);
+    RUN_TEST(test_telemetry);
+    RUN_TEST(test_telemetry_counter_reset);
+    return UNITY_END();
+}
@@ -0,0 +1,203 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Event loop driving the loopback test on multiple serial ports at once (for Windows).
+//
+
+#include "multi_port.hpp"
+#include "test_stream.hpp"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <windows.h>
+
+static constexpr double NO_DATA_TIMEOUT = 1.0; // in s
+static constexpr int RECV_BUF_LEN = 16384;
+
+struct multi_port_engine::port {
+    serial_port serial;
+    multi_port_result result;
+    test_stream tx_stream;
+    test_stream rx_stream;
+    std::vector<uint8_t> tx_buf;
+    std::vector<uint8_t> rx_buf;
+    OVERLAPPED tx_overlapped = { 0 };
+    OVERLAPPED rx_overlapped = { 0 };
+    int tx_len = 0; // length of pending write (0 if none)
+    bool is_rx_pending = false;
+    int bytes_sent = 0;
+    double start_time = 0;
+    double last_rx_time = 0;
+    bool is_done = false;
+
+    port(int stream_index, int data_bits) : tx_stream(stream_index, data_bits), rx_stream(stream_index, data_bits), rx_buf(RECV_BUF_LEN) { }
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+multi_port_engine::multi_port_engine(const multi_port_settings& settings)
+: settings(settings), completion_port(NULL) { }
+
+multi_port_engine::~multi_port_engine() {
+    for (auto& p : ports)
+        p->serial.close();
+    if (completion_port != NULL)
+        CloseHandle(completion_port);
+}
+
+void multi_port_engine::add_port(const std::string& path, int stream_index) {
+    auto p = std::make_unique<port>(stream_index, settings.data_bits);
+    p->result.path = path;
+    p->tx_buf.resize(settings.chunk_size);
+    ports.push_back(std::move(p));
+}
+
+void multi_port_engine::run() {
+    completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if (completion_port == NULL)
+        throw serial_error("Failed to create I/O completion port", GetLastError());
+
+    for (auto& p : ports) {
+        p->serial.open(p->result.path.c_str(), settings.bit_rate, settings.data_bits, settings.with_parity);
+        p->serial.drain();
+        if (CreateIoCompletionPort(p->serial.handle(), completion_port, (ULONG_PTR)p.get(), 0) == NULL)
+            throw serial_error("Failed to register serial port", GetLastError());
+    }
+
+    double start_time = now();
+    for (auto& p : ports) {
+        p->start_time = start_time;
+        p->last_rx_time = start_time;
+        start_receive(*p);
+        try_send(*p);
+    }
+
+    int num_active = (int)ports.size();
+    while (true) {
+        // a read completes with 0 bytes after the read timeout of the port (see serial_port::open())
+        DWORD len = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED* overlapped = NULL;
+        BOOL ok = GetQueuedCompletionStatus(completion_port, &len, &key, &overlapped, 100);
+        double t = now();
+
+        if (overlapped != NULL) {
+            port& p = *reinterpret_cast<port*>(key);
+            if (overlapped == &p.rx_overlapped) {
+                p.is_rx_pending = false;
+                if (!ok && !p.is_done)
+                    fail(p, "Failed to receive data", GetLastError());
+                else if (ok)
+                    on_received(p, (int)len, t);
+                start_receive(p);
+            } else {
+                p.tx_len = 0;
+                if (!ok && !p.is_done)
+                    fail(p, "Failed to transmit data", GetLastError());
+            }
+            try_send(p);
+        }
+
+        // wait for all ports to finish, then for all I/O operations to complete
+        num_active = 0;
+        bool has_pending_io = false;
+        for (auto& p : ports) {
+            if (!p->is_done && t - p->last_rx_time > NO_DATA_TIMEOUT)
+                fail(*p, "No more data");
+            if (!p->is_done)
+                num_active++;
+            if (p->is_rx_pending || p->tx_len != 0)
+                has_pending_io = true;
+        }
+        if (num_active == 0 && !has_pending_io)
+            break;
+    }
+
+    for (auto& p : ports) {
+        p->serial.drain();
+        p->serial.close();
+    }
+}
+
+void multi_port_engine::try_send(port& p) {
+    if (p.is_done || p.tx_len != 0)
+        return;
+
+    // next chunk (if the window allows)
+    int m = std::min(settings.chunk_size, settings.num_bytes - p.bytes_sent);
+    int in_transit = p.bytes_sent - p.result.bytes_received;
+    if (m == 0 || (in_transit > 0 && in_transit + m > settings.max_outstanding_bytes))
+        return;
+
+    p.tx_stream.generate(p.tx_buf.data(), m);
+    p.bytes_sent += m;
+
+    // the completion is reported to the completion port (even if it completes immediately)
+    memset(&p.tx_overlapped, 0, sizeof(p.tx_overlapped));
+    p.tx_len = m;
+    if (WriteFile(p.serial.handle(), p.tx_buf.data(), m, NULL, &p.tx_overlapped) == 0) {
+        DWORD err = GetLastError();
+        if (err != ERROR_IO_PENDING) {
+            p.tx_len = 0;
+            fail(p, "Failed to start transmitting data", err);
+        }
+    }
+}
+
+void multi_port_engine::start_receive(port& p) {
+    if (p.is_done || p.is_rx_pending)
+        return;
+
+    memset(&p.rx_overlapped, 0, sizeof(p.rx_overlapped));
+    p.is_rx_pending = true;
+    if (ReadFile(p.serial.handle(), p.rx_buf.data(), RECV_BUF_LEN, NULL, &p.rx_overlapped) == 0) {
+        DWORD err = GetLastError();
+        if (err != ERROR_IO_PENDING) {
+            p.is_rx_pending = false;
+            fail(p, "Failed to start receiving data", err);
+        }
+    }
+}
+
+void multi_port_engine::on_received(port& p, int len, double t) {
+    if (p.is_done || len == 0)
+        return;
+
+    if (p.rx_stream.verify(p.rx_buf.data(), len) >= 0) {
+        fail(p, "Invalid data");
+        return;
+    }
+
+    p.result.bytes_received += len;
+    p.last_rx_time = t;
+
+    if (p.result.bytes_received >= settings.num_bytes) {
+        p.result.duration = t - p.start_time;
+        p.is_done = true;
+    }
+}
+
+void multi_port_engine::fail(port& p, const char* message, int errnum) {
+    serial_error error(message, errnum);
+    p.result.error = error.what();
+    p.result.duration = now() - p.start_time;
+    p.is_done = true;
+
+    // pending operations complete with an error
+    CancelIoEx(p.serial.handle(), NULL);
+}
+
+std::vector<multi_port_result> multi_port_engine::results() const {
+    std::vector<multi_port_result> res;
+    for (auto& p : ports)
+        res.push_back(p->result);
+    return res;
+}
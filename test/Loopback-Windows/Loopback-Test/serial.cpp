@@ -43,9 +43,9 @@ void serial_port::open(const char* port, int bit_rate, int data_bits, bool with_
     GetCommState(hComPort, &dcbSerialParams);
 
     dcbSerialParams.BaudRate = bit_rate;
-    dcbSerialParams.ByteSize = 8;
+    dcbSerialParams.ByteSize = data_bits;
     dcbSerialParams.StopBits = ONESTOPBIT;
-    dcbSerialParams.Parity = NOPARITY;
+    dcbSerialParams.Parity = with_parity ? EVENPARITY : NOPARITY;
 
     BOOL result = SetCommState(hComPort, &dcbSerialParams);
     if (result == 0) {
@@ -108,6 +108,12 @@ void serial_port::transmit(const uint8_t* data, int data_len) {
         throw serial_error("Failed to transmit data");
 }
 
+void serial_port::transmit(const serial_chunk* chunks, int num_chunks) {
+    // no gather write for serial ports
+    for (int i = 0; i < num_chunks; i++)
+        transmit(chunks[i].data, chunks[i].len);
+}
+
 
 int serial_port::receive(uint8_t* data, int data_len) {
     if (_hEvent == NULL) {
@@ -0,0 +1,561 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Raw bulk endpoint benchmark (libusb)
+//
+// Drives the CDC data endpoints of the device directly through libusb, bypassing
+// the host's CDC ACM and tty drivers. The DATA interface (and the associated
+// communication interface) is claimed, the line coding is set with a control
+// request and many asynchronous bulk transfers are kept queued in each direction.
+// The results are an upper bound for what the firmware can achieve, to compare
+// with the results of the loopback test.
+//
+// Modes:
+// - loopback: data is sent and received, TX is expected to be wired to RX;
+//   the received data is verified
+// - out: data is only sent (UART TX, no wiring needed)
+// - in: data is only received (from a peer sending on UART RX)
+//
+// Reported per direction: throughput, bulk packets per USB frame (full-speed,
+// 1 ms frames), short transfers and transfers terminated by a zero-length packet.
+//
+// With --telemetry, the device's telemetry notifications (TELEMETRY_ENABLE firmware
+// build) are enabled and printed as they arrive on the COMM endpoint.
+//
+// Comand line syntax: bulk-bench [ OPTIONS... ]
+//
+
+#include "cxxopts.hpp"
+#include "test_stream.hpp"
+#include <libusb.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace std::chrono;
+
+static constexpr uint16_t DEFAULT_VID = 0x0483;
+static constexpr uint16_t DEFAULT_PID = 0xa4f6;
+static constexpr int DEFAULT_DATA_INTF = 1; // INTF_DATA_1 (see usb_conf.h)
+
+static constexpr uint8_t CDC_REQUEST_TYPE_OUT = 0x21; // class, interface, host to device
+static constexpr uint8_t CDC_SET_LINE_CODING = 0x20;
+static constexpr uint8_t CDC_SET_CONTROL_LINE_STATE = 0x22;
+static constexpr uint16_t CDC_DTR_RTS = 0x03;
+
+static constexpr uint8_t VENDOR_REQUEST_TYPE_OUT = 0x40; // vendor, device, host to device
+static constexpr uint8_t VENDOR_REQUEST_SET_PARAM = 0x02;
+static constexpr uint16_t PARAM_TELEMETRY_INTERVAL = 14;
+static constexpr uint8_t NOTIF_TELEMETRY = 0xf0;
+static constexpr int NOTIF_HEADER_LEN = 8;
+static constexpr int TELEMETRY_RECORD_LEN = 16;
+
+static constexpr int PACKET_SIZE = 64; // full-speed bulk packet size
+static constexpr unsigned CONTROL_TIMEOUT = 1000; // in ms
+static constexpr int DRAIN_TIMEOUT = 1000; // wait for the loopback data after the end of the test (in ms)
+
+enum class bench_mode { loopback, out, in };
+
+/// Statistics of one direction
+struct direction_stats {
+    uint64_t bytes;
+    uint64_t transfers;
+    uint64_t packets; // incl. zero-length packets
+    uint64_t short_transfers; // completed with less data than requested
+    uint64_t zlp_transfers; // terminated by a zero-length packet
+    uint64_t errors; // failed transfers
+};
+
+/// Asynchronous bulk transfers of one direction
+struct bulk_stream {
+    uint8_t ep;
+    bool is_in;
+    int transfer_size;
+    std::vector<libusb_transfer*> transfers;
+    std::vector<std::vector<uint8_t>> buffers;
+    int in_flight;
+    bool is_stopping;
+    direction_stats stats;
+    direction_stats reported; // stats at the last progress line
+};
+
+// parsed command line arguments
+static uint16_t vid = DEFAULT_VID;
+static uint16_t pid = DEFAULT_PID;
+static int data_intf = DEFAULT_DATA_INTF;
+static bench_mode mode = bench_mode::loopback;
+static int bitrate;
+static int test_duration; // in s
+static int num_transfers; // queued transfers per direction
+static int out_size;
+static int in_size;
+static int telemetry_interval; // in ms, 0 if disabled
+
+static libusb_device_handle* device_handle;
+static bulk_stream out_stream;
+static bulk_stream in_stream;
+static uint8_t comm_ep;
+static libusb_transfer* telemetry_transfer;
+static uint8_t telemetry_buf[64];
+static bool is_telemetry_active;
+static bool is_telemetry_stopping;
+static test_stream tx_data;
+static test_stream rx_data;
+static bool has_mismatch;
+static uint64_t mismatch_pos;
+
+static int check_usage(int argc, char* argv[]);
+static void open_device();
+static void close_device();
+static void find_endpoints();
+static void set_line_coding();
+static void run_bench();
+static void start_stream(bulk_stream& stream);
+static void submit_transfer(bulk_stream& stream, libusb_transfer* transfer);
+static void LIBUSB_CALL on_transfer_completed(libusb_transfer* transfer);
+static void cancel_stream(bulk_stream& stream);
+static void start_telemetry();
+static void stop_telemetry();
+static void LIBUSB_CALL on_telemetry_received(libusb_transfer* transfer);
+static void print_progress(double elapsed);
+static void print_stats(const char* label, const direction_stats& stats, double elapsed);
+
+/// Error of a libusb function
+struct usb_error : std::runtime_error {
+    usb_error(const char* message, int code)
+    : std::runtime_error(std::string(message) + ": " + libusb_strerror((libusb_error)code)) { }
+};
+
+
+int main(int argc, char* argv[]) {
+    int ret = check_usage(argc, argv);
+    if (ret != 0)
+        return ret;
+
+    ret = libusb_init(nullptr);
+    if (ret < 0) {
+        std::cerr << "libusb: " << libusb_strerror((libusb_error)ret) << std::endl;
+        return 1;
+    }
+
+    try {
+        open_device();
+        set_line_coding();
+        run_bench();
+        ret = has_mismatch ? 1 : 0;
+    }
+    catch (std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        ret = 1;
+    }
+
+    close_device();
+    libusb_exit(nullptr);
+    return ret;
+}
+
+
+int check_usage(int argc, char* argv[]) {
+
+    cxxopts::Options options("bulk-bench", "Raw bulk endpoint benchmark (bypassing the CDC ACM driver)");
+
+    options.add_options()
+        ("device", "USB device (vid:pid, in hex)", cxxopts::value<std::string>()->default_value("0483:a4f6"))
+        ("i,interface", "CDC data interface (INTF_DATA_1 or INTF_DATA_2, the communication interface precedes it)", cxxopts::value<int>()->default_value(std::to_string(DEFAULT_DATA_INTF)))
+        ("m,mode", "Test mode (loopback, out or in)", cxxopts::value<std::string>()->default_value("loopback"))
+        ("b,bitrate", "Bit rate (1200 .. 99,999,999 bps)", cxxopts::value<int>()->default_value("2000000"))
+        ("t,duration", "Test duration (in s)", cxxopts::value<int>()->default_value("10"))
+        ("q,queue", "Number of transfers queued per direction", cxxopts::value<int>()->default_value("16"))
+        ("out-size", "Size of OUT transfers (in bytes)", cxxopts::value<int>()->default_value("4096"))
+        ("in-size", "Size of IN transfers (in bytes, multiple of 64)", cxxopts::value<int>()->default_value("4096"))
+        ("telemetry", "Enable the telemetry notifications with the specified interval (in ms) and print them (requires TELEMETRY_ENABLE firmware build)", cxxopts::value<int>()->default_value("0"))
+        ("h,help", "Show usage");
+
+    try {
+        auto result = options.parse(argc, argv);
+
+        if (result.count("help") != 0) {
+            std::cout << options.help() << std::endl;
+            return 2;
+        }
+
+        unsigned int v, p;
+        if (sscanf(result["device"].as<std::string>().c_str(), "%x:%x", &v, &p) != 2)
+            throw cxxopts::OptionParseException("invalid device (expected vid:pid)");
+        vid = (uint16_t)v;
+        pid = (uint16_t)p;
+
+        data_intf = result["interface"].as<int>();
+        if (data_intf < 1)
+            throw cxxopts::OptionParseException("invalid data interface");
+
+        std::string mode_name = result["mode"].as<std::string>();
+        if (mode_name == "loopback")
+            mode = bench_mode::loopback;
+        else if (mode_name == "out")
+            mode = bench_mode::out;
+        else if (mode_name == "in")
+            mode = bench_mode::in;
+        else
+            throw cxxopts::OptionParseException("invalid mode '" + mode_name + "'");
+
+        bitrate = result["bitrate"].as<int>();
+        test_duration = std::max(result["duration"].as<int>(), 1);
+        num_transfers = std::max(result["queue"].as<int>(), 1);
+        out_size = std::max(result["out-size"].as<int>(), 1);
+        in_size = result["in-size"].as<int>();
+        if (in_size < PACKET_SIZE || in_size % PACKET_SIZE != 0)
+            throw cxxopts::OptionParseException("IN transfer size must be a multiple of 64");
+        telemetry_interval = result["telemetry"].as<int>();
+        if (telemetry_interval != 0 && (telemetry_interval < 10 || telemetry_interval > 60000))
+            throw cxxopts::OptionParseException("telemetry interval must be between 10 and 60000 ms");
+    }
+    catch (const cxxopts::OptionException& e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        std::cout << options.help() << std::endl;
+        return 3;
+    }
+
+    return 0;
+}
+
+
+void open_device() {
+    device_handle = libusb_open_device_with_vid_pid(nullptr, vid, pid);
+    if (device_handle == nullptr)
+        throw std::runtime_error("USB device not found (or no permission to open it)");
+
+    // the CDC ACM driver has claimed the interfaces; it's reattached when they are released
+    libusb_set_auto_detach_kernel_driver(device_handle, 1);
+
+    // the communication interface is needed for the line coding requests
+    int ret = libusb_claim_interface(device_handle, data_intf - 1);
+    if (ret < 0)
+        throw usb_error("Cannot claim communication interface", ret);
+    ret = libusb_claim_interface(device_handle, data_intf);
+    if (ret < 0)
+        throw usb_error("Cannot claim data interface", ret);
+
+    find_endpoints();
+}
+
+
+void close_device() {
+    if (device_handle == nullptr)
+        return;
+
+    libusb_release_interface(device_handle, data_intf);
+    libusb_release_interface(device_handle, data_intf - 1);
+    libusb_close(device_handle);
+    device_handle = nullptr;
+}
+
+
+// Gets the bulk endpoints from the data interface descriptor (and the notification endpoint)
+void find_endpoints() {
+    libusb_config_descriptor* config;
+    int ret = libusb_get_active_config_descriptor(libusb_get_device(device_handle), &config);
+    if (ret < 0)
+        throw usb_error("Cannot read configuration descriptor", ret);
+
+    out_stream.ep = 0;
+    in_stream.ep = 0;
+    for (int i = 0; i < config->bNumInterfaces; i++) {
+        const libusb_interface_descriptor& intf = config->interface[i].altsetting[0];
+        if (intf.bInterfaceNumber == data_intf - 1 && intf.bNumEndpoints > 0)
+            comm_ep = intf.endpoint[0].bEndpointAddress;
+        if (intf.bInterfaceNumber != data_intf)
+            continue;
+
+        for (int j = 0; j < intf.bNumEndpoints; j++) {
+            const libusb_endpoint_descriptor& ep = intf.endpoint[j];
+            if ((ep.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+                continue;
+            if ((ep.bEndpointAddress & LIBUSB_ENDPOINT_IN) != 0)
+                in_stream.ep = ep.bEndpointAddress;
+            else
+                out_stream.ep = ep.bEndpointAddress;
+        }
+    }
+    libusb_free_config_descriptor(config);
+
+    if (out_stream.ep == 0 || in_stream.ep == 0)
+        throw std::runtime_error("Data interface with bulk endpoints not found");
+}
+
+
+// Sets the line coding (8N1) and DTR/RTS like the serial driver when opening the port
+void set_line_coding() {
+    uint8_t line_coding[7] = {
+        (uint8_t)bitrate, (uint8_t)(bitrate >> 8), (uint8_t)(bitrate >> 16), (uint8_t)(bitrate >> 24),
+        0, // 1 stop bit
+        0, // no parity
+        8 // data bits
+    };
+
+    int ret = libusb_control_transfer(device_handle, CDC_REQUEST_TYPE_OUT, CDC_SET_LINE_CODING, 0,
+        data_intf - 1, line_coding, sizeof(line_coding), CONTROL_TIMEOUT);
+    if (ret < 0)
+        throw usb_error("SET_LINE_CODING failed", ret);
+
+    ret = libusb_control_transfer(device_handle, CDC_REQUEST_TYPE_OUT, CDC_SET_CONTROL_LINE_STATE, CDC_DTR_RTS,
+        data_intf - 1, nullptr, 0, CONTROL_TIMEOUT);
+    if (ret < 0)
+        throw usb_error("SET_CONTROL_LINE_STATE failed", ret);
+}
+
+
+void run_bench() {
+    out_stream.is_in = false;
+    out_stream.transfer_size = out_size;
+    in_stream.is_in = true;
+    in_stream.transfer_size = in_size;
+
+    printf("Bulk endpoints 0x%02x (OUT) and 0x%02x (IN), %d bps, %d transfers of %d/%d bytes queued\n",
+        out_stream.ep, in_stream.ep, bitrate, num_transfers, out_size, in_size);
+
+    if (telemetry_interval != 0)
+        start_telemetry();
+
+    auto start_time = steady_clock::now();
+    if (mode != bench_mode::in)
+        start_stream(out_stream);
+    if (mode != bench_mode::out)
+        start_stream(in_stream);
+
+    auto end_time = start_time + seconds(test_duration);
+    auto next_progress = start_time + seconds(1);
+    bool is_draining = false;
+    direction_stats out_result = {};
+    direction_stats in_result = {};
+    auto drain_end = end_time + milliseconds(DRAIN_TIMEOUT);
+
+    while (out_stream.in_flight > 0 || in_stream.in_flight > 0 || is_telemetry_active) {
+        timeval tv = { 0, 100000 };
+        int ret = libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+            throw usb_error("Event handling failed", ret);
+
+        auto now = steady_clock::now();
+        if (now >= next_progress && now < end_time) {
+            print_progress(duration_cast<duration<double>>(now - start_time).count());
+            next_progress += seconds(1);
+        }
+
+        if (!is_draining && now >= end_time) {
+            // stop sending and wait until the loopback data has been received
+            is_draining = true;
+            out_result = out_stream.stats;
+            in_result = in_stream.stats;
+            out_stream.is_stopping = true;
+            if (mode != bench_mode::loopback)
+                cancel_stream(in_stream);
+        }
+
+        if (is_draining && !in_stream.is_stopping && out_stream.in_flight == 0
+                && (in_stream.stats.bytes >= out_stream.stats.bytes || now >= drain_end || has_mismatch))
+            cancel_stream(in_stream);
+
+        if (is_draining && is_telemetry_active && !is_telemetry_stopping && out_stream.in_flight == 0 && in_stream.in_flight == 0)
+            stop_telemetry();
+    }
+
+    // throughput over the test duration (excl. draining)
+    printf("\n");
+    if (mode != bench_mode::in)
+        print_stats("OUT", out_result, test_duration);
+    if (mode != bench_mode::out)
+        print_stats("IN", in_result, test_duration);
+    printf("UART limit: %.1f KB/s (8N1)\n", bitrate / 10.0 / 1000);
+
+    if (mode == bench_mode::loopback) {
+        if (has_mismatch)
+            printf("Data mismatch at byte %llu\n", (unsigned long long)mismatch_pos);
+        else if (in_stream.stats.bytes < out_stream.stats.bytes)
+            printf("Missing data: %llu bytes\n", (unsigned long long)(out_stream.stats.bytes - in_stream.stats.bytes));
+        else
+            printf("Received data verified\n");
+    }
+
+    for (auto transfer : out_stream.transfers)
+        libusb_free_transfer(transfer);
+    for (auto transfer : in_stream.transfers)
+        libusb_free_transfer(transfer);
+}
+
+
+// Allocates and submits the transfers of a direction
+void start_stream(bulk_stream& stream) {
+    stream.buffers.resize(num_transfers);
+    for (int i = 0; i < num_transfers; i++) {
+        stream.buffers[i].resize(stream.transfer_size);
+        libusb_transfer* transfer = libusb_alloc_transfer(0);
+        if (transfer == nullptr)
+            throw std::runtime_error("Cannot allocate transfer");
+        libusb_fill_bulk_transfer(transfer, device_handle, stream.ep, stream.buffers[i].data(), stream.transfer_size,
+            on_transfer_completed, &stream, 0);
+        stream.transfers.push_back(transfer);
+        submit_transfer(stream, transfer);
+    }
+}
+
+
+void submit_transfer(bulk_stream& stream, libusb_transfer* transfer) {
+    if (!stream.is_in)
+        tx_data.generate(transfer->buffer, transfer->length);
+
+    int ret = libusb_submit_transfer(transfer);
+    if (ret < 0)
+        throw usb_error("Cannot submit transfer", ret);
+    stream.in_flight += 1;
+}
+
+
+void LIBUSB_CALL on_transfer_completed(libusb_transfer* transfer) {
+    bulk_stream& stream = *(bulk_stream*)transfer->user_data;
+    stream.in_flight -= 1;
+
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+        return;
+
+    direction_stats& stats = stream.stats;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        stats.errors += 1;
+        fprintf(stderr, "Transfer on endpoint 0x%02x failed: %s\n", stream.ep,
+            libusb_error_name(transfer->status == LIBUSB_TRANSFER_STALL ? LIBUSB_ERROR_PIPE : LIBUSB_ERROR_IO));
+        stream.is_stopping = true;
+        return;
+    }
+
+    int len = transfer->actual_length;
+    stats.bytes += len;
+    stats.transfers += 1;
+    stats.packets += (len + PACKET_SIZE - 1) / PACKET_SIZE;
+    if (len < transfer->length) {
+        stats.short_transfers += 1;
+        // a transfer ending on a packet boundary before it's full has been terminated by a ZLP
+        if (len % PACKET_SIZE == 0) {
+            stats.zlp_transfers += 1;
+            stats.packets += 1;
+        }
+    }
+
+    if (stream.is_in && mode == bench_mode::loopback && !has_mismatch) {
+        int pos = rx_data.verify(transfer->buffer, len);
+        if (pos >= 0) {
+            has_mismatch = true;
+            mismatch_pos = stats.bytes - len + pos;
+        }
+    }
+
+    if (stream.is_stopping)
+        return;
+
+    try {
+        submit_transfer(stream, transfer);
+    }
+    catch (usb_error& error) {
+        fprintf(stderr, "%s\n", error.what());
+        stream.is_stopping = true;
+    }
+}
+
+
+void cancel_stream(bulk_stream& stream) {
+    stream.is_stopping = true;
+    for (auto transfer : stream.transfers)
+        libusb_cancel_transfer(transfer);
+}
+
+
+// Enables the telemetry notifications and starts reading them
+void start_telemetry() {
+    if (comm_ep == 0)
+        throw std::runtime_error("Notification endpoint not found");
+
+    uint8_t value[4] = { (uint8_t)telemetry_interval, (uint8_t)(telemetry_interval >> 8), 0, 0 };
+    int ret = libusb_control_transfer(device_handle, VENDOR_REQUEST_TYPE_OUT, VENDOR_REQUEST_SET_PARAM,
+        PARAM_TELEMETRY_INTERVAL, 0, value, sizeof(value), CONTROL_TIMEOUT);
+    if (ret < 0)
+        throw usb_error("Telemetry not available", ret);
+
+    telemetry_transfer = libusb_alloc_transfer(0);
+    if (telemetry_transfer == nullptr)
+        throw std::runtime_error("Cannot allocate transfer");
+    libusb_fill_interrupt_transfer(telemetry_transfer, device_handle, comm_ep, telemetry_buf, sizeof(telemetry_buf),
+        on_telemetry_received, nullptr, 0);
+    ret = libusb_submit_transfer(telemetry_transfer);
+    if (ret < 0)
+        throw usb_error("Cannot submit transfer", ret);
+    is_telemetry_active = true;
+}
+
+
+// Disables the telemetry notifications and cancels the pending transfer
+void stop_telemetry() {
+    is_telemetry_stopping = true;
+    uint8_t value[4] = { 0, 0, 0, 0 };
+    libusb_control_transfer(device_handle, VENDOR_REQUEST_TYPE_OUT, VENDOR_REQUEST_SET_PARAM,
+        PARAM_TELEMETRY_INTERVAL, 0, value, sizeof(value), CONTROL_TIMEOUT);
+    libusb_cancel_transfer(telemetry_transfer);
+}
+
+
+void LIBUSB_CALL on_telemetry_received(libusb_transfer* transfer) {
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        // cancelled at the end of the test (or failed)
+        is_telemetry_active = false;
+        libusb_free_transfer(transfer);
+        telemetry_transfer = nullptr;
+        return;
+    }
+
+    const uint8_t* buf = transfer->buffer;
+    if (transfer->actual_length >= NOTIF_HEADER_LEN + TELEMETRY_RECORD_LEN && buf[1] == NOTIF_TELEMETRY) {
+        auto u16 = [buf](int offset) { return (unsigned)(buf[offset] | (buf[offset + 1] << 8)); };
+        auto u32 = [u16](int offset) { return u16(offset) | (u16(offset + 2) << 16); };
+        const int r = NOTIF_HEADER_LEN;
+        printf("telemetry #%-5u OUT %7u bytes, IN %7u bytes, TX peak %5u, RX peak %5u, paused %5u ms, overruns %u\n",
+            u16(2), u32(r), u32(r + 4), u16(r + 8), u16(r + 10), u16(r + 12), u16(r + 14));
+    }
+
+    int ret = libusb_submit_transfer(transfer);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot submit transfer: %s\n", libusb_strerror((libusb_error)ret));
+        is_telemetry_active = false;
+        libusb_free_transfer(transfer);
+        telemetry_transfer = nullptr;
+    }
+}
+
+
+void print_progress(double elapsed) {
+    direction_stats out = out_stream.stats;
+    direction_stats in = in_stream.stats;
+    uint64_t out_bytes = out.bytes - out_stream.reported.bytes;
+    uint64_t in_bytes = in.bytes - in_stream.reported.bytes;
+    uint64_t in_packets = in.packets - in_stream.reported.packets;
+    out_stream.reported = out;
+    in_stream.reported = in;
+
+    printf("%5.1fs: OUT %8.1f KB/s, IN %8.1f KB/s, %5.2f IN packets/frame\n", elapsed,
+        out_bytes / 1000.0, in_bytes / 1000.0, in_packets / 1000.0);
+}
+
+
+void print_stats(const char* label, const direction_stats& stats, double elapsed) {
+    double frames = elapsed * 1000; // full-speed frames
+    printf("%-3s  %10llu bytes  %8.1f KB/s  %llu transfers  %llu packets (%.2f/frame)  %llu short  %llu ZLP  %llu errors\n",
+        label, (unsigned long long)stats.bytes, stats.bytes / elapsed / 1000, (unsigned long long)stats.transfers,
+        (unsigned long long)stats.packets, stats.packets / frames, (unsigned long long)stats.short_transfers,
+        (unsigned long long)stats.zlp_transfers, (unsigned long long)stats.errors);
+}
@@ -0,0 +1,281 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Traffic capture log (memory-mapped binary file).
+//
+
+#include "capture_log.hpp"
+#include <chrono>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std::chrono;
+
+static constexpr int64_t SEGMENT_SIZE = 16 * 1024 * 1024;
+static constexpr int HEADER_SIZE = 16;
+static const char MAGIC[8] = { 'U', 'S', 'B', 'S', 'C', 'A', 'P', 1 };
+static constexpr uint32_t READ_FLAG = 0x80000000;
+
+static int64_t now_us() {
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+capture_writer::capture_writer()
+: start_time(0), last_time(0), file_size(0), segment_offset(0), segment(nullptr),
+#if defined(_WIN32)
+    file(INVALID_HANDLE_VALUE), mapping(nullptr) { }
+#else
+    fd(-1) { }
+#endif
+
+capture_writer::~capture_writer() {
+    close();
+}
+
+
+bool capture_writer::open(const char* path) {
+    close();
+
+#if defined(_WIN32)
+    file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+#else
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+#endif
+
+    file_size = 0;
+    if (!map_segment(0)) {
+        close();
+        return false;
+    }
+
+    uint8_t header[HEADER_SIZE] = { 0 };
+    memcpy(header, MAGIC, sizeof(MAGIC));
+    put(header, HEADER_SIZE);
+
+    start_time = now_us();
+    last_time = start_time;
+    return true;
+}
+
+
+void capture_writer::record(capture_direction direction, const uint8_t* data, int len) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (segment == nullptr)
+        return;
+
+    int64_t time = now_us();
+    uint32_t header[2];
+    header[0] = (uint32_t)(time - last_time);
+    header[1] = (uint32_t)len | (direction == capture_direction::read ? READ_FLAG : 0);
+    last_time = time;
+
+    put(header, sizeof(header));
+    put(data, len);
+}
+
+
+void capture_writer::close() {
+    if (segment != nullptr)
+        unmap_segment();
+
+#if defined(_WIN32)
+    if (file != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER size;
+        size.QuadPart = file_size;
+        SetFilePointerEx(file, size, nullptr, FILE_BEGIN);
+        SetEndOfFile(file);
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (fd >= 0) {
+        if (ftruncate(fd, file_size) != 0) {
+            // the file keeps the zero padding of the last segment
+        }
+        ::close(fd);
+        fd = -1;
+    }
+#endif
+}
+
+
+void capture_writer::put(const void* data, int len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (len > 0) {
+        int64_t offset = file_size - segment_offset;
+        if (offset == SEGMENT_SIZE) {
+            // map the next segment (the only system calls while recording)
+            unmap_segment();
+            if (!map_segment(segment_offset + SEGMENT_SIZE))
+                return;
+            offset = 0;
+        }
+
+        int n = SEGMENT_SIZE - offset < len ? (int)(SEGMENT_SIZE - offset) : len;
+        memcpy(segment + offset, p, n);
+        file_size += n;
+        p += n;
+        len -= n;
+    }
+}
+
+
+bool capture_writer::map_segment(int64_t offset) {
+    int64_t end = offset + SEGMENT_SIZE;
+#if defined(_WIN32)
+    // the file mapping grows the file to the mapping size
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)end, nullptr);
+    if (mapping == nullptr)
+        return false;
+    void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, SEGMENT_SIZE);
+    if (view == nullptr) {
+        CloseHandle(mapping);
+        mapping = nullptr;
+        return false;
+    }
+#else
+    if (ftruncate(fd, end) != 0)
+        return false;
+    void* view = mmap(nullptr, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if (view == MAP_FAILED)
+        return false;
+#endif
+
+    segment = static_cast<uint8_t*>(view);
+    segment_offset = offset;
+    return true;
+}
+
+
+void capture_writer::unmap_segment() {
+#if defined(_WIN32)
+    UnmapViewOfFile(segment);
+    CloseHandle(mapping);
+    mapping = nullptr;
+#else
+    munmap(segment, SEGMENT_SIZE);
+#endif
+    segment = nullptr;
+}
+
+
+capture_reader::capture_reader()
+: data(nullptr), data_size(0), pos(0), time(0),
+#if defined(_WIN32)
+    file(INVALID_HANDLE_VALUE), mapping(nullptr) { }
+#else
+    fd(-1) { }
+#endif
+
+capture_reader::~capture_reader() {
+    close();
+}
+
+
+bool capture_reader::open(const char* path) {
+    close();
+
+#if defined(_WIN32)
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < HEADER_SIZE) {
+        close();
+        return false;
+    }
+    data_size = size.QuadPart;
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+        close();
+        return false;
+    }
+    data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < HEADER_SIZE) {
+        close();
+        return false;
+    }
+    data_size = st.st_size;
+    void* view = mmap(nullptr, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    data = view != MAP_FAILED ? static_cast<const uint8_t*>(view) : nullptr;
+#endif
+
+    if (data == nullptr || memcmp(data, MAGIC, sizeof(MAGIC)) != 0) {
+        close();
+        return false;
+    }
+
+    rewind();
+    return true;
+}
+
+
+bool capture_reader::next(capture_chunk& chunk) {
+    uint32_t header[2];
+    if (pos + (int64_t)sizeof(header) > data_size)
+        return false;
+    memcpy(header, data + pos, sizeof(header));
+
+    int len = header[1] & ~READ_FLAG;
+    if (pos + (int64_t)sizeof(header) + len > data_size)
+        return false; // truncated record
+
+    time += header[0];
+    chunk.time = time / 1e6;
+    chunk.direction = (header[1] & READ_FLAG) != 0 ? capture_direction::read : capture_direction::write;
+    chunk.data = data + pos + sizeof(header);
+    chunk.len = len;
+    pos += sizeof(header) + len;
+    return true;
+}
+
+
+void capture_reader::rewind() {
+    pos = HEADER_SIZE;
+    time = 0;
+}
+
+
+void capture_reader::close() {
+#if defined(_WIN32)
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+    if (mapping != nullptr)
+        CloseHandle(mapping);
+    mapping = nullptr;
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (data != nullptr)
+        munmap(const_cast<uint8_t*>(data), data_size);
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+#endif
+    data = nullptr;
+    data_size = 0;
+}
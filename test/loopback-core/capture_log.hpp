@@ -0,0 +1,168 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Traffic capture log (memory-mapped binary file).
+//
+// File format (little endian):
+// - Header: magic "USBSCAP" + version byte (8 bytes), reserved (8 bytes)
+// - Records: time since previous record (uint32, in µs),
+//   direction (bit 31, 1 = read) and length (bits 0 to 30) (uint32), data
+//
+
+#pragma once
+
+#include <mutex>
+#include <stdint.h>
+
+
+/**
+ * Direction of a captured chunk (as seen from the host).
+ */
+enum class capture_direction {
+    /// Written by the host (host to device)
+    write,
+    /// Read by the host (device to host)
+    read
+};
+
+
+/**
+ * Captured chunk.
+ */
+struct capture_chunk {
+    /// Time since the start of the capture (in s)
+    double time;
+    /// Direction
+    capture_direction direction;
+    /// Data (points into the mapped file)
+    const uint8_t* data;
+    /// Length of the data (in bytes)
+    int len;
+};
+
+
+/**
+ * Writes a capture log.
+ *
+ * The file is memory-mapped in segments of 16 MB. Recording a chunk copies
+ * it into the mapped segment and only issues system calls when the next
+ * segment needs to be mapped. It is safe to record from multiple threads.
+ */
+class capture_writer {
+public:
+    /**
+     * Creates a new instance (in closed state).
+     */
+    capture_writer();
+
+    /**
+     * Destroys the instance (closes the file if needed).
+     */
+    ~capture_writer();
+
+    /**
+     * Creates the capture file and starts the capture clock.
+     * @param path file path
+     * @return `true` if successful, `false` if the file cannot be created
+     */
+    bool open(const char* path);
+
+    /**
+     * Records a chunk (time stamped with the current time).
+     * @param direction direction
+     * @param data chunk data
+     * @param len length of the data (in bytes)
+     */
+    void record(capture_direction direction, const uint8_t* data, int len);
+
+    /**
+     * Truncates the file to the recorded data and closes it.
+     */
+    void close();
+
+    /**
+     * Gets the size of the recorded data (including the header).
+     * @return size (in bytes)
+     */
+    int64_t size() const { return file_size; }
+
+private:
+    void put(const void* data, int len);
+    bool map_segment(int64_t offset);
+    void unmap_segment();
+
+    std::mutex mutex;
+    int64_t start_time; // in µs
+    int64_t last_time; // in µs
+    int64_t file_size;
+    int64_t segment_offset;
+    uint8_t* segment;
+#if defined(_WIN32)
+    void* file;
+    void* mapping;
+#else
+    int fd;
+#endif
+};
+
+
+/**
+ * Reads a capture log.
+ *
+ * The entire file is memory-mapped read-only and the chunks are
+ * returned without copying.
+ */
+class capture_reader {
+public:
+    /**
+     * Creates a new instance (in closed state).
+     */
+    capture_reader();
+
+    /**
+     * Destroys the instance (closes the file if needed).
+     */
+    ~capture_reader();
+
+    /**
+     * Opens and maps the capture file.
+     * @param path file path
+     * @return `true` if successful, `false` if the file cannot be opened or isn't a capture log
+     */
+    bool open(const char* path);
+
+    /**
+     * Gets the next chunk.
+     * @param chunk receives the chunk
+     * @return `true` if successful, `false` at the end of the log
+     */
+    bool next(capture_chunk& chunk);
+
+    /**
+     * Restarts reading at the first chunk.
+     */
+    void rewind();
+
+    /**
+     * Closes the file.
+     */
+    void close();
+
+private:
+    const uint8_t* data;
+    int64_t data_size;
+    int64_t pos;
+    int64_t time; // in µs
+#if defined(_WIN32)
+    void* file;
+    void* mapping;
+#else
+    int fd;
+#endif
+};
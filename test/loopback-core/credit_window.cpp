@@ -0,0 +1,87 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Lock-free window limiting the data in transit.
+//
+
+#include "credit_window.hpp"
+
+#if defined(__linux__)
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static_assert(sizeof(std::atomic<int32_t>) == sizeof(int32_t), "atomic must be usable as futex word");
+
+void credit_window::wait(int32_t expected) {
+    // the timeout covers a cancellation between checking and waiting
+    timespec timeout = { 0, 100000000 };
+    syscall(SYS_futex, reinterpret_cast<int32_t*>(&in_transit), FUTEX_WAIT_PRIVATE, expected, &timeout, nullptr, 0);
+}
+
+void credit_window::wake() {
+    syscall(SYS_futex, reinterpret_cast<int32_t*>(&in_transit), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+#else
+
+void credit_window::wait(int32_t expected) {
+    // the timeout covers a wakeup between checking and waiting
+    std::unique_lock<std::mutex> lock(wait_mutex);
+    wait_condition.wait_for(lock, std::chrono::milliseconds(100), [&] {
+        return in_transit.load() != expected || is_cancelled;
+    });
+}
+
+void credit_window::wake() {
+    { std::lock_guard<std::mutex> lock(wait_mutex); }
+    wait_condition.notify_one();
+}
+
+#endif
+
+void credit_window::reset(int32_t limit) {
+    this->limit = limit;
+    in_transit = 0;
+    waiting_for = 0;
+    is_cancelled = false;
+}
+
+bool credit_window::acquire(int32_t n) {
+    while (!is_cancelled) {
+        int32_t current = in_transit.load();
+        if (current + n <= limit) {
+            in_transit.fetch_add(n);
+            return true;
+        }
+
+        // announce the threshold, then check again so a release in-between is not missed
+        waiting_for = n;
+        current = in_transit.load();
+        if (current + n > limit && !is_cancelled)
+            wait(current);
+        waiting_for = 0;
+    }
+
+    return false;
+}
+
+void credit_window::release(int32_t n) {
+    int32_t current = in_transit.fetch_sub(n) - n;
+    int32_t needed = waiting_for.load();
+    if (needed != 0 && current + needed <= limit)
+        wake();
+}
+
+void credit_window::cancel() {
+    is_cancelled = true;
+    wake();
+}
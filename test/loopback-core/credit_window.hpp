@@ -0,0 +1,69 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Lock-free window limiting the data in transit.
+//
+
+#pragma once
+
+#include <atomic>
+#if !defined(__linux__)
+#include <condition_variable>
+#include <mutex>
+#endif
+#include <stdint.h>
+
+/**
+ * Window limiting the data in transit between a single sender and a single receiver.
+ *
+ * The amount of data in transit is an atomic counter. The sender only blocks
+ * (on a futex on Linux, on a condition variable elsewhere) if the window is full, and the receiver only issues a wakeup if
+ * the sender is blocked and the window has dropped below the sender's threshold.
+ */
+struct credit_window {
+    /**
+     * Resets the window.
+     * @param limit maximum data in transit (in bytes)
+     */
+    void reset(int32_t limit);
+
+    /**
+     * Reserves space for data to be sent (called by the sender).
+     *
+     * Blocks until the data fits into the window or the window is cancelled.
+     *
+     * @param n number of bytes (at most the limit)
+     * @return `true` if the space has been reserved, `false` if cancelled
+     */
+    bool acquire(int32_t n);
+
+    /**
+     * Releases the space of received data (called by the receiver).
+     * @param n number of bytes
+     */
+    void release(int32_t n);
+
+    /**
+     * Cancels the window and wakes up the sender.
+     */
+    void cancel();
+
+private:
+    void wait(int32_t expected);
+    void wake();
+
+    std::atomic<int32_t> in_transit{ 0 }; // futex word (on Linux)
+    std::atomic<int32_t> waiting_for{ 0 }; // bytes the blocked sender needs (0 if not blocked)
+    std::atomic<bool> is_cancelled{ false };
+    int32_t limit = 0;
+#if !defined(__linux__)
+    std::mutex wait_mutex;
+    std::condition_variable wait_condition;
+#endif
+};
@@ -0,0 +1,178 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Reader stall patterns and flow control measurements.
+//
+
+#include "flow_stress.hpp"
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+
+using namespace std::chrono;
+
+static double now() {
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Prints the minimum, average and maximum of the values.
+ * @param label label (incl. padding)
+ * @param values values
+ * @param scale factor applied to the values
+ * @param unit unit of the scaled values
+ * @param precision number of decimal places
+ */
+static void print_range(const char* label, const std::vector<double>& values, double scale, const char* unit,
+    int precision = 1) {
+    if (values.empty()) {
+        printf("  %s-\n", label);
+        return;
+    }
+    double sum = 0;
+    for (double value : values)
+        sum += value;
+    auto range = std::minmax_element(values.begin(), values.end());
+    printf("  %s%.*f / %.*f / %.*f %s (min / avg / max)\n", label, precision, *range.first * scale,
+        precision, sum / values.size() * scale, precision, *range.second * scale, unit);
+}
+
+
+flow_stress::flow_stress(stall_pattern pattern, int stall_time, int stall_interval, int drain_rate,
+    int num_bytes, double block_threshold)
+: pattern(pattern), stall_time(stall_time / 1000.0), stall_interval(stall_interval / 1000.0),
+    drain_rate(drain_rate), num_bytes(num_bytes), block_threshold(block_threshold), rng(1) { }
+
+
+bool flow_stress::parse_pattern(const std::string& name, stall_pattern& pattern) {
+    if (name == "periodic")
+        pattern = stall_pattern::periodic;
+    else if (name == "random")
+        pattern = stall_pattern::random;
+    else if (name == "slow-drain")
+        pattern = stall_pattern::slow_drain;
+    else
+        return false;
+    return true;
+}
+
+
+int flow_stress::before_receive(const std::atomic<int>& bytes_sent, int bytes_received, int len) {
+    double t = now();
+    if (start_time == 0) {
+        start_time = t;
+        last_progress = t;
+        schedule_next_stall(t);
+    }
+    monitor(bytes_sent, bytes_received, t);
+
+    if (pattern == stall_pattern::slow_drain) {
+        while (true) {
+            double allowed = drain_rate * (t - start_time) - bytes_received;
+            if (allowed >= 1)
+                return std::min(len, (int)allowed);
+            std::this_thread::sleep_for(milliseconds(1));
+            t = now();
+            monitor(bytes_sent, bytes_received, t);
+        }
+    }
+
+    if (t < next_stall)
+        return len;
+
+    // stall while monitoring the sender
+    double stall_start = t;
+    double stall_end = t + next_duration;
+    int sent_at_start = last_sent;
+    stall_record record = { 0, 0, -1, -1 };
+    while (t < stall_end) {
+        std::this_thread::sleep_for(milliseconds(1));
+        t = now();
+        monitor(bytes_sent, bytes_received, t);
+        if (writer_blocked && record.block_time < 0)
+            record.block_time = std::max(last_progress - stall_start, 0.0);
+    }
+    record.duration = t - stall_start;
+    record.absorbed = last_sent - sent_at_start;
+    stalls.push_back(record);
+
+    // the recovery is measured once the sender makes progress again
+    awaiting_recovery = writer_blocked;
+    sent_at_stall_end = last_sent;
+    stall_end_time = t;
+    schedule_next_stall(t);
+    return len;
+}
+
+
+void flow_stress::monitor(const std::atomic<int>& bytes_sent, int bytes_received, double t) {
+    int sent = bytes_sent.load();
+    if (sent != last_sent) {
+        if (writer_blocked) {
+            blocked_time += t - last_progress;
+            writer_blocked = false;
+        }
+        if (awaiting_recovery && sent != sent_at_stall_end) {
+            stalls.back().recovery_time = t - stall_end_time;
+            awaiting_recovery = false;
+        }
+        last_sent = sent;
+        last_progress = t;
+
+    } else if (!writer_blocked && sent < num_bytes && t - last_progress > block_threshold) {
+        writer_blocked = true;
+        num_blocks++;
+    }
+
+    peak_in_transit = std::max(peak_in_transit, sent - bytes_received);
+}
+
+
+void flow_stress::schedule_next_stall(double t) {
+    if (pattern == stall_pattern::random) {
+        std::exponential_distribution<double> interval(1 / stall_interval);
+        std::uniform_real_distribution<double> duration(0.5 * stall_time, 1.5 * stall_time);
+        next_stall = t + interval(rng);
+        next_duration = duration(rng);
+    } else {
+        next_stall = t + stall_interval;
+        next_duration = stall_time;
+    }
+}
+
+
+void flow_stress::print() const {
+    if (pattern == stall_pattern::slow_drain) {
+        printf("Flow control stress (slow drain at %d bytes/s):\n", drain_rate);
+    } else {
+        printf("Flow control stress (%s stalls of %.0f ms every %.0f ms):\n",
+            pattern == stall_pattern::random ? "random" : "periodic", stall_time * 1e3, stall_interval * 1e3);
+
+        std::vector<double> durations;
+        std::vector<double> absorbed;
+        std::vector<double> block_times;
+        std::vector<double> recovery_times;
+        for (auto& stall : stalls) {
+            durations.push_back(stall.duration);
+            absorbed.push_back(stall.absorbed);
+            if (stall.block_time >= 0)
+                block_times.push_back(stall.block_time);
+            if (stall.recovery_time >= 0)
+                recovery_times.push_back(stall.recovery_time);
+        }
+        printf("  Stalls:                %zu (writer blocked in %zu)\n", stalls.size(), block_times.size());
+        print_range("Stall duration:        ", durations, 1e3, "ms");
+        print_range("Absorbed during stall: ", absorbed, 1, "bytes", 0);
+        print_range("Writer blocked after:  ", block_times, 1e3, "ms");
+        print_range("Recovery after stall:  ", recovery_times, 1e3, "ms");
+    }
+    printf("  Peak data in transit:  %d bytes\n", peak_in_transit);
+    printf("  Writer blocked:        %d times, %.1f ms in total\n", num_blocks, blocked_time * 1e3);
+}
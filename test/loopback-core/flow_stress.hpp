@@ -0,0 +1,113 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Reader stall patterns and flow control measurements.
+//
+
+#pragma once
+
+#include <atomic>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * Reader stall pattern.
+ */
+enum class stall_pattern {
+    /// Stalls of fixed length at fixed intervals
+    periodic,
+    /// Stalls of random length (50% to 150% of stall time) at random intervals (exponentially distributed)
+    random,
+    /// No stalls, but the data is read at a limited rate
+    slow_drain
+};
+
+/**
+ * Flow control stress test.
+ *
+ * Stalls the receiver according to the stall pattern while the sender keeps sending.
+ * During and after each stall, the progress of the sender is monitored to measure
+ * how much data the device and the host absorb until the writes block (i.e. the
+ * device NAKs the OUT packets), and how long it takes until the writes resume
+ * after the stall.
+ */
+class flow_stress {
+public:
+    /**
+     * Creates a new instance.
+     * @param pattern stall pattern
+     * @param stall_time stall duration (in ms)
+     * @param stall_interval time between stalls (in ms)
+     * @param drain_rate read rate for slow drain (in bytes/s)
+     * @param num_bytes number of bytes the sender sends in total
+     * @param block_threshold time without progress after which the sender is considered blocked (in s)
+     */
+    flow_stress(stall_pattern pattern, int stall_time, int stall_interval, int drain_rate,
+        int num_bytes, double block_threshold);
+
+    /**
+     * Parses the name of a stall pattern.
+     * @param name pattern name (`periodic`, `random` or `slow-drain`)
+     * @param pattern receives the pattern
+     * @return `true` if successful, `false` if the name is invalid
+     */
+    static bool parse_pattern(const std::string& name, stall_pattern& pattern);
+
+    /**
+     * Called by the receiver before each read.
+     *
+     * Stalls if a stall is due and limits the read length for slow drain.
+     *
+     * @param bytes_sent number of bytes sent so far (updated by the sender)
+     * @param bytes_received number of bytes received so far
+     * @param len maximum read length (in bytes)
+     * @return read length (in bytes)
+     */
+    int before_receive(const std::atomic<int>& bytes_sent, int bytes_received, int len);
+
+    /**
+     * Prints the measurements.
+     */
+    void print() const;
+
+private:
+    void monitor(const std::atomic<int>& bytes_sent, int bytes_received, double now);
+    void schedule_next_stall(double now);
+
+    struct stall_record {
+        double duration; // in s
+        int absorbed; // bytes sent during the stall
+        double block_time; // time from stall start until the writer blocked (in s, -1 if it hasn't)
+        double recovery_time; // time from stall end until the writer resumed (in s, -1 if not measured)
+    };
+
+    stall_pattern pattern;
+    double stall_time;
+    double stall_interval;
+    int drain_rate;
+    int num_bytes;
+    double block_threshold;
+    std::mt19937 rng;
+
+    double start_time = 0;
+    double next_stall = 0;
+    double next_duration = 0;
+    std::vector<stall_record> stalls;
+    bool awaiting_recovery = false;
+    int sent_at_stall_end = 0;
+    double stall_end_time = 0;
+
+    int last_sent = 0;
+    double last_progress = 0; // time the sender has last made progress
+    bool writer_blocked = false;
+    int num_blocks = 0;
+    double blocked_time = 0;
+    int peak_in_transit = 0;
+};
@@ -0,0 +1,72 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Round-trip latency statistics.
+//
+
+#include "latency.hpp"
+#include <algorithm>
+#include <math.h>
+#include <string>
+#include <stdio.h>
+
+static constexpr int histogram_width = 50;
+
+double latency_stats::percentile(double p) {
+    if (samples.empty())
+        return 0;
+
+    if (sorted_len != samples.size()) {
+        std::sort(samples.begin(), samples.end());
+        sorted_len = samples.size();
+    }
+
+    // nearest rank
+    size_t rank = (size_t)ceil(p / 100 * samples.size());
+    return samples[std::min(std::max(rank, (size_t)1), samples.size()) - 1];
+}
+
+void latency_stats::print(const char* title) {
+    if (samples.empty())
+        return;
+
+    printf("%s (%zu round trips, in ms):\n", title, samples.size());
+    printf("  min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+        percentile(0) * 1e3, percentile(50) * 1e3, percentile(90) * 1e3,
+        percentile(99) * 1e3, percentile(99.9) * 1e3, percentile(100) * 1e3);
+
+    int counts[num_buckets] = { 0 };
+    for (double rtt : samples) {
+        int bucket = 0;
+        double limit = first_bucket;
+        while (rtt >= limit && bucket < num_buckets - 1) {
+            limit *= bucket_factor;
+            bucket++;
+        }
+        counts[bucket]++;
+    }
+
+    // print the buckets from the first to the last non-empty one
+    int first = 0;
+    while (counts[first] == 0)
+        first++;
+    int last = num_buckets - 1;
+    while (counts[last] == 0)
+        last--;
+    int max_count = *std::max_element(counts, counts + num_buckets);
+
+    for (int i = first; i <= last; i++) {
+        double limit = first_bucket * pow(bucket_factor, i);
+        int width = (counts[i] * histogram_width + max_count - 1) / max_count;
+        if (i < num_buckets - 1)
+            printf("  < %8.3f ms %7d %s\n", limit * 1e3, counts[i], std::string(width, '#').c_str());
+        else
+            printf("  >=%8.3f ms %7d %s\n", limit / bucket_factor * 1e3, counts[i], std::string(width, '#').c_str());
+    }
+}
@@ -0,0 +1,56 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Round-trip latency statistics.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Collection of round-trip times with percentiles and a log-scale histogram.
+ */
+struct latency_stats {
+    /// Bucket boundaries of the histogram grow by this factor
+    static constexpr double bucket_factor = 1.4142135623730951; // sqrt(2)
+    /// Upper boundary of the first histogram bucket (in s)
+    static constexpr double first_bucket = 32e-6;
+    /// Number of histogram buckets (the last one collects all larger values)
+    static constexpr int num_buckets = 28;
+
+    /// Round-trip times (in s)
+    std::vector<double> samples;
+
+    /**
+     * Adds a round-trip time.
+     * @param rtt round-trip time (in s)
+     */
+    void add(double rtt) { samples.push_back(rtt); }
+
+    /**
+     * Gets the specified percentile.
+     *
+     * Sorts the samples if needed.
+     *
+     * @param p percentile (0 to 100)
+     * @return round-trip time (in s)
+     */
+    double percentile(double p);
+
+    /**
+     * Prints the percentiles and the histogram.
+     * @param title title line
+     */
+    void print(const char* title);
+
+private:
+    size_t sorted_len = 0;
+};
@@ -0,0 +1,873 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Benchmark core shared by all platforms: command line options, test modes
+// (transfer, latency, sweep, multiple ports, capture and replay) and reporting.
+//
+
+#include "loopback.hpp"
+#include "latency.hpp"
+#include "test_stream.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string.h>
+#include <thread>
+
+using namespace std::chrono;
+
+static constexpr int RECV_BUF_LEN = 16384;
+
+/**
+ * Forwards the data received on one port to another port and records it (until stopped).
+ * @param from port to receive from
+ * @param to port to transmit to
+ * @param direction direction recorded in the log
+ * @param log capture log
+ * @param stopped flag to stop forwarding
+ * @param num_chunks receives the number of forwarded chunks
+ * @param num_bytes receives the number of forwarded bytes
+ */
+static void forward(serial_port& from, serial_port& to, capture_direction direction, capture_writer& log,
+    const std::atomic<bool>& stopped, int64_t& num_chunks, int64_t& num_bytes);
+
+/**
+ * Prints a hex dump of the specified buffer.
+ * @param title Title to print at start of line
+ * @param buf buffer start
+ * @para buf_len buffer length
+ */
+static void hex_dump(const char* title, const uint8_t* buf, size_t buf_len);
+
+
+void add_loopback_options(cxxopts::Options& options, int default_chunk_size) {
+    options.add_options()
+        ("t,tx-port", "Serial port for transmission", cxxopts::value<std::string>())
+        ("r,rx-port", "Serial port for reception (default: same as tx-port)", cxxopts::value<std::string>())
+        ("n,numbytes", "Number of bytes to transmit", cxxopts::value<int>()->default_value("300000"))
+        ("b,bitrate", "Bit rate (1200 .. 99,999,999 bps)", cxxopts::value<int>()->default_value("921600"))
+        ("p,parity", "Enable parity bit")
+        ("d,databits", "Data bits (7 or 8)", cxxopts::value<int>()->default_value("8"))
+        ("s,rx-sleep", "Sleep before reception (in s)", cxxopts::value<int>()->default_value("0"))
+        ("o,outstanding", "Maximum data outstanding in transit (in bytes)", cxxopts::value<int>()->default_value("999999999"))
+        ("c,chunk-size", "Size of the chunks written to the serial port (in bytes)", cxxopts::value<int>()->default_value(std::to_string(default_chunk_size)))
+        ("aliases", "Open the port with the firmware's default baud rate aliases for 3M, 4M, 4.8M and 6M bps")
+        ("client", "Transfer through the asynchronous serial client (ring-buffered reader and writer threads) and print its statistics")
+        ("low-latency", "Enable the low latency mode of the serial driver (Linux only)")
+        ("latency", "Measure the round-trip latency of messages sent ping-pong style instead of running the loopback test")
+        ("msg-sizes", "Message sizes for latency mode (comma-separated, in bytes)", cxxopts::value<std::vector<int>>()->default_value("1,16,64,256"))
+        ("round-trips", "Number of round trips per message size and bit rate in latency mode", cxxopts::value<int>()->default_value("1000"))
+        ("stall", "Stall the receiver while the sender keeps sending and measure the flow control (periodic, random or slow-drain)", cxxopts::value<std::string>())
+        ("stall-time", "Duration of the receiver stalls (in ms)", cxxopts::value<int>()->default_value("200"))
+        ("stall-interval", "Time between receiver stalls (in ms, average for random stalls)", cxxopts::value<int>()->default_value("1000"))
+        ("drain-rate", "Read rate for slow drain (in bytes/s)", cxxopts::value<int>()->default_value("20000"))
+        ("sweep", "Repeat the loopback test for each combination of bit rate, data format and chunk size and write the results as CSV")
+        ("bitrates", "Bit rates for latency and sweep mode (comma-separated, default: bit rate)", cxxopts::value<std::vector<int>>())
+        ("formats", "Data formats for sweep mode (comma-separated, 8N1, 7E1 or 8E1)", cxxopts::value<std::vector<std::string>>()->default_value("8N1"))
+        ("chunk-sizes", "Write chunk sizes for sweep mode (comma-separated, in bytes, default: chunk size)", cxxopts::value<std::vector<int>>())
+        ("csv", "CSV output file for sweep mode (default: standard output)", cxxopts::value<std::string>()->default_value("-"))
+        ("multi", "Run the test on all the specified ports at once, each wired to itself (comma-separated)", cxxopts::value<std::vector<std::string>>())
+        ("threads", "Number of event loop threads for --multi", cxxopts::value<int>()->default_value("1"))
+        ("scaling", "With --multi, repeat the test with 1 to N ports and write the results as CSV")
+        ("capture", "Forward the traffic between --host-port and tx-port and record it in the specified file", cxxopts::value<std::string>())
+        ("host-port", "Serial port used by the host application during capture (e.g. end of a virtual null modem)", cxxopts::value<std::string>())
+        ("replay", "Replay the data written by the host in the specified capture file and verify the echo", cxxopts::value<std::string>())
+        ("speed", "Replay speed factor (2 = twice as fast as captured, 0 = as fast as possible)", cxxopts::value<double>()->default_value("1"));
+    options.positional_help("tx-port [ rx-port ]").show_positional_help();
+}
+
+
+void read_loopback_options(const cxxopts::ParseResult& result, loopback_settings& settings) {
+    if (result.count("multi") > 0)
+        settings.multi_port_paths = result["multi"].as<std::vector<std::string>>();
+    settings.num_threads = std::max(result["threads"].as<int>(), 1);
+    settings.with_scaling = result.count("scaling") > 0;
+    if (result.count("capture") > 0) {
+        settings.capture_path = result["capture"].as<std::string>();
+        if (result.count("host-port") == 0)
+            throw cxxopts::OptionParseException("--capture requires --host-port");
+        settings.host_port_path = result["host-port"].as<std::string>();
+    }
+    if (result.count("replay") > 0)
+        settings.replay_path = result["replay"].as<std::string>();
+    settings.replay_speed = std::max(result["speed"].as<double>(), 0.0);
+
+    settings.bit_rate = result["bitrate"].as<int>();
+    settings.bit_rate = std::min(std::max(settings.bit_rate, 1200), 99999999);
+    settings.num_bytes = result["numbytes"].as<int>();
+    settings.num_bytes = std::min(std::max(settings.num_bytes, 1), 1000000000);
+    settings.data_bits = result["databits"].as<int>();
+    if (result.count("tx-port") > 0)
+        settings.send_port_path = result["tx-port"].as<std::string>();
+    settings.rx_delay = result["rx-sleep"].as<int>();
+    settings.max_outstanding_bytes = std::max(result["outstanding"].as<int>(), 1);
+    settings.with_parity = result.count("parity") > 0;
+    settings.run_latency = result.count("latency") > 0;
+    settings.latency_msg_sizes = result["msg-sizes"].as<std::vector<int>>();
+    for (int& size : settings.latency_msg_sizes)
+        size = std::min(std::max(size, 1), 4096);
+    settings.latency_round_trips = std::max(result["round-trips"].as<int>(), 1);
+    settings.chunk_size = std::min(std::max(result["chunk-size"].as<int>(), 1), 65536);
+    settings.use_aliases = result.count("aliases") > 0;
+    settings.use_client = result.count("client") > 0;
+    settings.low_latency = result.count("low-latency") > 0;
+    settings.with_stalls = result.count("stall") > 0;
+    if (settings.with_stalls) {
+        std::string name = result["stall"].as<std::string>();
+        if (!flow_stress::parse_pattern(name, settings.stalls))
+            throw cxxopts::OptionParseException("invalid stall pattern '" + name + "'");
+    }
+    settings.stall_time = std::max(result["stall-time"].as<int>(), 1);
+    settings.stall_interval = std::max(result["stall-interval"].as<int>(), 1);
+    settings.drain_rate = std::max(result["drain-rate"].as<int>(), 1);
+    settings.run_sweep = result.count("sweep") > 0;
+    if (result.count("bitrates") > 0)
+        settings.sweep_bit_rates = result["bitrates"].as<std::vector<int>>();
+    else
+        settings.sweep_bit_rates = { settings.bit_rate };
+    for (int& rate : settings.sweep_bit_rates)
+        rate = std::min(std::max(rate, 1200), 99999999);
+    settings.sweep_formats = result["formats"].as<std::vector<std::string>>();
+    for (auto& format : settings.sweep_formats) {
+        if (format != "8N1" && format != "7E1" && format != "8E1")
+            throw cxxopts::OptionParseException("invalid data format '" + format + "'");
+    }
+    if (result.count("chunk-sizes") > 0)
+        settings.sweep_chunk_sizes = result["chunk-sizes"].as<std::vector<int>>();
+    else
+        settings.sweep_chunk_sizes = { settings.chunk_size };
+    for (int& size : settings.sweep_chunk_sizes)
+        size = std::min(std::max(size, 1), 65536);
+    settings.csv_path = result["csv"].as<std::string>();
+    if (settings.with_parity)
+        settings.data_bits = std::min(std::max(settings.data_bits, 7), 8);
+    else
+        settings.data_bits = 8;
+    if (result.count("rx-port") > 0)
+        settings.recv_port_path = result["rx-port"].as<std::string>();
+    else
+        settings.recv_port_path = settings.send_port_path;
+}
+
+
+loopback_test::loopback_test(const loopback_settings& settings) : settings(settings) { }
+
+
+int loopback_test::run() {
+    if (!settings.capture_path.empty())
+        return capture();
+
+    if (!settings.replay_path.empty())
+        return replay_test();
+
+    if (settings.run_latency)
+        return latency_test();
+
+    if (settings.run_sweep)
+        return sweep();
+
+    if (!settings.multi_port_paths.empty())
+        return multi_port_test();
+
+    return transfer_test();
+}
+
+
+int loopback_test::transfer_test() {
+    try {
+        test_cancelled = false;
+        stress.reset();
+        if (settings.with_stalls) {
+            // the sender is considered blocked if it doesn't complete a chunk in twice the expected time
+            double bits_per_byte = settings.data_bits + (settings.with_parity ? 1 : 0) + 2;
+            double chunk_time = settings.chunk_size * bits_per_byte / settings.bit_rate;
+            stress = std::make_unique<flow_stress>(settings.stalls, settings.stall_time, settings.stall_interval,
+                settings.drain_rate, settings.num_bytes, 2 * chunk_time + 0.01);
+        }
+
+        open_ports(settings.use_client);
+        if (on_transfer_start)
+            on_transfer_start();
+
+        // Run send function in separate thread
+        outstanding_data.reset(settings.max_outstanding_bytes);
+        bytes_sent = 0;
+        std::thread sender(&loopback_test::send, this);
+
+        if (settings.rx_delay != 0)
+            std::this_thread::sleep_for(seconds(settings.rx_delay));
+
+        // receive data
+        auto start_time = steady_clock::now();
+        recv();
+        auto end_time = steady_clock::now();
+        double transfer_time = duration<double>(end_time - start_time).count();
+
+        // release the sender if the reception has been cancelled
+        outstanding_data.cancel();
+        sender.join();
+
+        if (on_transfer_end)
+            on_transfer_end();
+        close_ports();
+
+        if (!test_cancelled) {
+            int data_bits = settings.data_bits;
+            int br = (int)((double)settings.num_bytes * data_bits / transfer_time);
+            double expected_net_rate = (double)settings.bit_rate * data_bits / ((double)data_bits + (settings.with_parity ? 1 : 0) + 2);
+            printf("Successfully sent %d bytes in %.1fs\n", settings.num_bytes, transfer_time);
+            printf("Gross bit rate: %d bps\n", settings.bit_rate);
+            printf("Net bit rate:   %d bps\n", br);
+            printf("Overhead: %.1f%%\n", expected_net_rate * 100.0 / br - 100);
+            if (num_lost_bytes > 0)
+                printf("Lost bytes: %d\n", num_lost_bytes);
+            if (settings.use_client && settings.recv_port_path != settings.send_port_path) {
+                send_client_stats.print("Serial client (tx-port)");
+                recv_client_stats.print("Serial client (rx-port)");
+            }
+            else if (settings.use_client) {
+                send_client_stats.print("Serial client");
+            }
+        }
+        if (stress)
+            stress->print();
+    }
+    catch (serial_error& error) {
+        std::cerr << error.what() << std::endl;
+        return 2;
+    }
+
+    return test_cancelled || num_lost_bytes > 0 ? 3 : 0;
+}
+
+
+double loopback_test::run_transfer() {
+    test_cancelled = false;
+    open_ports(settings.use_client);
+
+    outstanding_data.reset(settings.max_outstanding_bytes);
+    bytes_sent = 0;
+    std::thread sender(&loopback_test::send, this);
+    auto start_time = steady_clock::now();
+    recv();
+    auto end_time = steady_clock::now();
+
+    // release the sender if the reception has been cancelled
+    outstanding_data.cancel();
+    sender.join();
+    close_ports();
+
+    return duration<double>(end_time - start_time).count();
+}
+
+
+void loopback_test::send() {
+    test_stream stream(0, settings.data_bits);
+    int chunk_size = settings.chunk_size;
+    int num_bytes = settings.num_bytes;
+    std::vector<uint8_t> buf(chunk_size);
+
+    try {
+
+        int n = num_bytes;
+        while (n > 0 && !test_cancelled) {
+            int m = std::min(std::min(chunk_size, n), settings.max_outstanding_bytes);
+            stream.generate(buf.data(), m);
+
+            // wait until outstanding data is low enough to send next chunk
+            if (!outstanding_data.acquire(m))
+                return;
+
+            if (on_transmit)
+                on_transmit(num_bytes - n + m);
+
+            if (send_client)
+                send_client->write(buf.data(), m);
+            else
+                send_port.transmit(buf.data(), m);
+            bytes_sent += m;
+            n -= m;
+        }
+    }
+    catch (serial_error& error) {
+        std::cerr << error.what() << std::endl;
+        test_cancelled = true;
+    }
+}
+
+
+void loopback_test::recv() {
+    num_lost_bytes = 0;
+    std::vector<uint8_t> buf(RECV_BUF_LEN);
+    test_stream stream(0, settings.data_bits);
+    serial_client* client = recv_client ? recv_client.get() : send_client.get();
+
+    try {
+
+        int n = 0;
+        while (n < settings.num_bytes && !test_cancelled) {
+            int len = RECV_BUF_LEN;
+            if (stress)
+                len = stress->before_receive(bytes_sent, n, len);
+
+            int k = client != nullptr ? client->read(buf.data(), len) : recv_port.receive(buf.data(), len);
+            if (k == 0) {
+                std::cerr << "No more data from " << settings.recv_port_path << " after " << n << " bytes" << std::endl;
+                test_cancelled = true;
+                return;
+            }
+
+            if (on_receive) {
+                k = on_receive(buf.data(), k);
+                if (k == 0)
+                    continue;
+            }
+
+            // update outstanding data (wakes up the sender if needed)
+            outstanding_data.release(k);
+
+            int pos = stream.verify(buf.data(), k);
+            if (pos >= 0 && on_data_loss) {
+                // resynchronize if the device has reported the loss of data
+                int lost = on_data_loss();
+                test_stream resynced = stream;
+                resynced.skip(lost);
+                if (lost > 0 && resynced.verify(buf.data() + pos, k - pos) < 0) {
+                    std::cerr << lost << " bytes lost at pos " << n + pos << ", resynchronized" << std::endl;
+                    stream = resynced;
+                    outstanding_data.release(lost);
+                    num_lost_bytes += lost;
+                    n += lost;
+                    pos = -1;
+                }
+            }
+            if (pos >= 0) {
+                std::cerr << "Invalid data at pos " << n + pos << std::endl;
+                hex_dump("Expected: ", stream.expected(), k);
+                hex_dump("Received: ", buf.data(), k);
+                test_cancelled = true;
+                return;
+            }
+            n += k;
+        }
+
+    }
+    catch (serial_error& error) {
+        std::cerr << error.what() << std::endl;
+        test_cancelled = true;
+    }
+}
+
+
+int loopback_test::latency_test() {
+    constexpr int num_warmup = 10; // round trips not included in the statistics
+    constexpr int max_timeouts = 10; // consecutive receive timeouts (100ms each)
+    test_stream stream(0, settings.data_bits);
+
+    try {
+        for (int rate : settings.sweep_bit_rates) {
+            settings.bit_rate = rate;
+            open_ports();
+
+            for (int size : settings.latency_msg_sizes) {
+                std::vector<uint8_t> msg(size);
+                std::vector<uint8_t> buf(size);
+                latency_stats stats;
+
+                for (int i = 0; i < num_warmup + settings.latency_round_trips; i++) {
+                    stream.generate(msg.data(), size);
+
+                    auto start_time = steady_clock::now();
+                    send_port.transmit(msg.data(), size);
+
+                    int n = 0;
+                    int timeouts = 0;
+                    while (n < size) {
+                        int k = recv_port.receive(buf.data() + n, size - n);
+                        if (k == 0) {
+                            timeouts++;
+                            if (timeouts == max_timeouts) {
+                                std::cerr << "No more data from " << settings.recv_port_path << " after " << n
+                                    << " bytes of message " << i << std::endl;
+                                close_ports();
+                                return 3;
+                            }
+                        }
+                        n += k;
+                    }
+                    auto end_time = steady_clock::now();
+
+                    if (memcmp(buf.data(), msg.data(), size) != 0) {
+                        std::cerr << "Invalid data in message " << i << std::endl;
+                        hex_dump("Expected: ", msg.data(), size);
+                        hex_dump("Received: ", buf.data(), size);
+                        close_ports();
+                        return 3;
+                    }
+
+                    if (i >= num_warmup)
+                        stats.add(duration<double>(end_time - start_time).count());
+                }
+
+                char title[80];
+                snprintf(title, sizeof(title), "Latency %d bytes at %d bps", size, rate);
+                stats.print(title);
+            }
+
+            close_ports();
+        }
+    }
+    catch (serial_error& error) {
+        std::cerr << error.what() << std::endl;
+        return 2;
+    }
+
+    return 0;
+}
+
+
+int loopback_test::sweep() {
+    std::ofstream csv_file;
+    if (settings.csv_path != "-") {
+        csv_file.open(settings.csv_path);
+        if (!csv_file) {
+            std::cerr << "Cannot create " << settings.csv_path << std::endl;
+            return 2;
+        }
+    }
+    std::ostream& csv = settings.csv_path != "-" ? csv_file : std::cout;
+
+    csv << "bit_rate,data_bits,parity,chunk_size,bytes,duration_s,net_bit_rate,overhead_pct,wall_time_s,result" << std::endl;
+    int num_failed = 0;
+
+    for (int rate : settings.sweep_bit_rates) {
+        for (auto& format : settings.sweep_formats) {
+            for (int size : settings.sweep_chunk_sizes) {
+                settings.bit_rate = rate;
+                settings.data_bits = format[0] - '0';
+                settings.with_parity = format[1] == 'E';
+                settings.chunk_size = size;
+
+                auto wall_start = steady_clock::now();
+                double transfer_time = 0;
+                std::string result = "ok";
+                try {
+                    transfer_time = run_transfer();
+                    if (test_cancelled)
+                        result = "failed";
+                    else if (num_lost_bytes > 0)
+                        result = "lost " + std::to_string(num_lost_bytes) + " bytes";
+                }
+                catch (serial_error& error) {
+                    result = error.what();
+                }
+                double wall_time = duration<double>(steady_clock::now() - wall_start).count();
+
+                double br = 0;
+                double overhead = 0;
+                int data_bits = settings.data_bits;
+                if (result == "ok") {
+                    br = settings.num_bytes * data_bits / transfer_time;
+                    double expected_net_rate = (double)rate * data_bits / ((double)data_bits + (settings.with_parity ? 1 : 0) + 2);
+                    overhead = expected_net_rate * 100.0 / br - 100;
+                } else {
+                    num_failed++;
+                }
+
+                char line[160];
+                snprintf(line, sizeof(line), "%d,%d,%s,%d,%d,%.3f,%.0f,%.1f,%.3f,",
+                    rate, data_bits, settings.with_parity ? "even" : "none", size, settings.num_bytes,
+                    transfer_time, br, overhead, wall_time);
+                csv << line << '"' << result << '"' << std::endl;
+            }
+        }
+    }
+
+    return num_failed > 0 ? 3 : 0;
+}
+
+
+std::vector<multi_port_result> loopback_test::run_multi_port(int num_ports, double* wall_time) {
+    multi_port_settings port_settings = {
+        port_bit_rate(settings.bit_rate), settings.data_bits, settings.with_parity,
+        settings.num_bytes, settings.chunk_size, settings.max_outstanding_bytes
+    };
+
+    // distribute the ports over the event loop threads
+    int n_threads = std::min(settings.num_threads, num_ports);
+    std::vector<std::unique_ptr<multi_port_engine>> engines;
+    for (int i = 0; i < n_threads; i++)
+        engines.push_back(std::make_unique<multi_port_engine>(port_settings));
+    for (int i = 0; i < num_ports; i++)
+        engines[i % n_threads]->add_port(settings.multi_port_paths[i], i);
+
+    std::vector<std::string> errors(n_threads);
+    auto start_time = steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_threads; i++) {
+        threads.emplace_back([&, i] {
+            try {
+                engines[i]->run();
+            }
+            catch (serial_error& error) {
+                errors[i] = error.what();
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    *wall_time = duration<double>(steady_clock::now() - start_time).count();
+
+    // results in the order of the ports
+    std::vector<multi_port_result> results(num_ports);
+    for (int i = 0; i < n_threads; i++) {
+        auto engine_results = engines[i]->results();
+        for (size_t j = 0; j < engine_results.size(); j++) {
+            results[j * n_threads + i] = engine_results[j];
+            if (!errors[i].empty() && engine_results[j].error.empty()
+                    && engine_results[j].bytes_received < settings.num_bytes)
+                results[j * n_threads + i].error = errors[i];
+        }
+    }
+    return results;
+}
+
+
+int loopback_test::multi_port_test() {
+    int max_ports = (int)settings.multi_port_paths.size();
+    int num_threads = settings.num_threads;
+    bool with_scaling = settings.with_scaling;
+    int data_bits = settings.data_bits;
+    int num_failed = 0;
+
+    if (with_scaling)
+        printf("num_ports,threads,aggregate_net_bit_rate,min_net_bit_rate,max_net_bit_rate,wall_time_s,failed\n");
+
+    for (int num_ports = with_scaling ? 1 : max_ports; num_ports <= max_ports; num_ports++) {
+        double wall_time;
+        auto results = run_multi_port(num_ports, &wall_time);
+
+        double total_bits = 0;
+        double transfer_time = 0; // until the last port has finished
+        double min_rate = 1e12;
+        double max_rate = 0;
+        int failed = 0;
+        for (auto& result : results) {
+            double rate = result.duration > 0 ? result.bytes_received * data_bits / result.duration : 0;
+            total_bits += (double)result.bytes_received * data_bits;
+            transfer_time = std::max(transfer_time, result.duration);
+            min_rate = std::min(min_rate, rate);
+            max_rate = std::max(max_rate, rate);
+            if (!result.error.empty())
+                failed++;
+
+            if (!with_scaling) {
+                if (result.error.empty())
+                    printf("%s: %d bytes in %.1fs, net bit rate %.0f bps\n", result.path.c_str(),
+                        result.bytes_received, result.duration, rate);
+                else
+                    printf("%s: %s after %d bytes\n", result.path.c_str(), result.error.c_str(), result.bytes_received);
+            }
+        }
+        num_failed += failed;
+
+        if (with_scaling) {
+            printf("%d,%d,%.0f,%.0f,%.0f,%.3f,%d\n", num_ports, std::min(num_threads, num_ports),
+                total_bits / transfer_time, min_rate, max_rate, wall_time, failed);
+            fflush(stdout);
+        } else {
+            printf("Aggregate (%d ports, %d threads): net bit rate %.0f bps (per port: %.0f .. %.0f bps)\n",
+                num_ports, std::min(num_threads, num_ports), total_bits / transfer_time, min_rate, max_rate);
+        }
+    }
+
+    return num_failed > 0 ? 3 : 0;
+}
+
+
+int loopback_test::capture() {
+    capture_writer log;
+    if (!log.open(settings.capture_path.c_str())) {
+        std::cerr << "Cannot create " << settings.capture_path << std::endl;
+        return 2;
+    }
+
+    serial_port host_port;
+    try {
+        open_ports();
+        host_port.open(settings.host_port_path.c_str(), settings.bit_rate, settings.data_bits, settings.with_parity);
+    }
+    catch (serial_error& error) {
+        std::cerr << error.what() << std::endl;
+        return 2;
+    }
+
+    std::atomic<bool> stopped{ false };
+    int64_t num_write_chunks = 0;
+    int64_t num_write_bytes = 0;
+    int64_t num_read_chunks = 0;
+    int64_t num_read_bytes = 0;
+    auto start_time = steady_clock::now();
+    std::thread writer(forward, std::ref(host_port), std::ref(send_port), capture_direction::write,
+        std::ref(log), std::cref(stopped), std::ref(num_write_chunks), std::ref(num_write_bytes));
+    std::thread reader(forward, std::ref(recv_port), std::ref(host_port), capture_direction::read,
+        std::ref(log), std::cref(stopped), std::ref(num_read_chunks), std::ref(num_read_bytes));
+
+    std::cout << "Capturing traffic between " << settings.host_port_path << " and " << settings.send_port_path
+        << ", press Enter to stop" << std::endl;
+    std::cin.get();
+
+    stopped = true;
+    writer.join();
+    reader.join();
+    double capture_time = duration<double>(steady_clock::now() - start_time).count();
+    host_port.close();
+    close_ports();
+    log.close();
+
+    printf("Captured %.1fs: %lld write chunks (%lld bytes), %lld read chunks (%lld bytes)\n", capture_time,
+        (long long)num_write_chunks, (long long)num_write_bytes, (long long)num_read_chunks, (long long)num_read_bytes);
+    printf("Capture file:   %lld bytes\n", (long long)log.size());
+    return 0;
+}
+
+
+int loopback_test::replay_test() {
+    constexpr int max_timeouts = 10; // consecutive receive timeouts while data is expected
+    capture_reader log;
+    if (!log.open(settings.replay_path.c_str())) {
+        std::cerr << "Cannot open " << settings.replay_path << " or not a capture file" << std::endl;
+        return 2;
+    }
+
+    // only the data written by the host is replayed
+    std::vector<capture_chunk> chunks;
+    capture_chunk chunk;
+    int total_bytes = 0;
+    int64_t num_read_bytes = 0;
+    double capture_time = 0;
+    while (log.next(chunk)) {
+        capture_time = chunk.time;
+        if (chunk.direction == capture_direction::write) {
+            chunks.push_back(chunk);
+            total_bytes += chunk.len;
+        }
+        else {
+            num_read_bytes += chunk.len;
+        }
+    }
+    printf("Capture: %.1fs, %zu write chunks (%d bytes), %lld bytes read\n", capture_time, chunks.size(),
+        total_bytes, (long long)num_read_bytes);
+    if (chunks.empty()) {
+        std::cerr << "No data written by the host in " << settings.replay_path << std::endl;
+        return 3;
+    }
+
+    double speed = settings.replay_speed;
+    std::vector<steady_clock::time_point> send_times(chunks.size());
+    std::atomic<size_t> num_chunks_sent{ 0 };
+    double max_lag = 0;
+    latency_stats echo_times;
+    uint8_t mask = settings.data_bits == 7 ? 0x7f : 0xff;
+
+    try {
+        test_cancelled = false;
+        open_ports();
+        bytes_sent = 0;
+        auto start_time = steady_clock::now();
+
+        std::thread sender([&]() {
+            try {
+                for (size_t i = 0; i < chunks.size() && !test_cancelled; i++) {
+                    if (speed > 0) {
+                        auto due = start_time + duration_cast<steady_clock::duration>(duration<double>(chunks[i].time / speed));
+                        std::this_thread::sleep_until(due);
+                        max_lag = std::max(max_lag, duration<double>(steady_clock::now() - due).count());
+                    }
+                    send_times[i] = steady_clock::now();
+                    num_chunks_sent = i + 1;
+                    send_port.transmit(chunks[i].data, chunks[i].len);
+                    bytes_sent += chunks[i].len;
+                }
+            }
+            catch (serial_error& error) {
+                std::cerr << error.what() << std::endl;
+                test_cancelled = true;
+            }
+        });
+
+        // receive and verify the echo chunk by chunk
+        std::vector<uint8_t> buf(RECV_BUF_LEN);
+        size_t chunk_index = 0;
+        int chunk_offset = 0;
+        int n = 0;
+        int timeouts = 0;
+        while (n < total_bytes && !test_cancelled) {
+            int k = recv_port.receive(buf.data(), RECV_BUF_LEN);
+            if (k == 0) {
+                // the capture can contain long pauses, so only time out if data is expected
+                if (bytes_sent > n && ++timeouts == max_timeouts) {
+                    std::cerr << "No more data from " << settings.recv_port_path << " after " << n << " bytes" << std::endl;
+                    test_cancelled = true;
+                }
+                continue;
+            }
+            timeouts = 0;
+            auto now = steady_clock::now();
+
+            for (int i = 0; i < k && !test_cancelled; ) {
+                const capture_chunk& expected = chunks[chunk_index];
+                int m = std::min(k - i, expected.len - chunk_offset);
+                for (int j = 0; j < m; j++) {
+                    if (((buf[i + j] ^ expected.data[chunk_offset + j]) & mask) != 0) {
+                        std::cerr << "Invalid data at pos " << n + i + j << " (chunk " << chunk_index << ")" << std::endl;
+                        hex_dump("Expected: ", expected.data + chunk_offset, m);
+                        hex_dump("Received: ", buf.data() + i, m);
+                        test_cancelled = true;
+                        break;
+                    }
+                }
+                i += m;
+                chunk_offset += m;
+                if (chunk_offset == expected.len) {
+                    if (chunk_index < num_chunks_sent)
+                        echo_times.add(duration<double>(now - send_times[chunk_index]).count());
+                    chunk_index++;
+                    chunk_offset = 0;
+                }
+            }
+            n += k;
+        }
+        double replay_time = duration<double>(steady_clock::now() - start_time).count();
+
+        sender.join();
+        close_ports();
+
+        if (!test_cancelled) {
+            printf("Successfully replayed %zu chunks (%d bytes) in %.1fs", chunks.size(), total_bytes, replay_time);
+            if (speed > 0)
+                printf(" (speed %gx)\n", speed);
+            else
+                printf(" (as fast as possible)\n");
+            printf("Net bit rate:   %d bps\n", (int)(total_bytes * 8.0 / replay_time));
+            if (speed > 0)
+                printf("Max send lag:   %.2f ms\n", max_lag * 1e3);
+            echo_times.print("Echo time per chunk (from write to complete echo)");
+        }
+    }
+    catch (serial_error& error) {
+        std::cerr << error.what() << std::endl;
+        return 2;
+    }
+
+    return test_cancelled ? 3 : 0;
+}
+
+
+void loopback_test::open_ports(bool with_client) {
+    if (with_client) {
+        serial_client_config config;
+        config.bit_rate = settings.bit_rate;
+        config.data_bits = settings.data_bits;
+        config.with_parity = settings.with_parity;
+        config.use_aliases = settings.use_aliases;
+        config.low_latency = settings.low_latency;
+        send_client.reset(new serial_client());
+        send_client->open(settings.send_port_path.c_str(), config);
+        if (settings.send_port_path != settings.recv_port_path) {
+            recv_client.reset(new serial_client());
+            recv_client->open(settings.recv_port_path.c_str(), config);
+        }
+        return;
+    }
+
+    int rate = port_bit_rate(settings.bit_rate);
+    send_port.open(settings.send_port_path.c_str(), rate, settings.data_bits, settings.with_parity);
+
+    if (settings.send_port_path == settings.recv_port_path) {
+        recv_port = send_port;
+
+    }
+    else {
+        recv_port.open(settings.recv_port_path.c_str(), rate, settings.data_bits, settings.with_parity);
+    }
+
+#if defined(__linux__)
+    if (settings.low_latency && !send_port.set_low_latency())
+        std::cerr << "Low latency mode not supported by " << settings.send_port_path << std::endl;
+    if (settings.low_latency && settings.recv_port_path != settings.send_port_path)
+        recv_port.set_low_latency();
+#endif
+
+    recv_port.drain();
+}
+
+
+void loopback_test::close_ports() {
+    if (send_client) {
+        send_client_stats = send_client->stats();
+        send_client->close();
+        send_client.reset();
+        if (recv_client) {
+            recv_client_stats = recv_client->stats();
+            recv_client->close();
+            recv_client.reset();
+        }
+        return;
+    }
+
+    recv_port.drain();
+    send_port.close();
+    if (settings.recv_port_path != settings.send_port_path)
+        recv_port.close();
+}
+
+
+int loopback_test::port_bit_rate(int rate) const {
+    return settings.use_aliases ? serial_client::alias_bit_rate(rate) : rate;
+}
+
+
+void forward(serial_port& from, serial_port& to, capture_direction direction, capture_writer& log,
+    const std::atomic<bool>& stopped, int64_t& num_chunks, int64_t& num_bytes) {
+    std::vector<uint8_t> buf(RECV_BUF_LEN);
+
+    try {
+        while (!stopped) {
+            int n = from.receive(buf.data(), RECV_BUF_LEN);
+            if (n == 0)
+                continue;
+
+            log.record(direction, buf.data(), n);
+            to.transmit(buf.data(), n);
+            num_chunks++;
+            num_bytes += n;
+        }
+    }
+    catch (serial_error& error) {
+        std::cerr << error.what() << std::endl;
+    }
+}
+
+
+void hex_dump(const char* title, const uint8_t* buf, size_t buf_len)
+{
+    std::cerr << title;
+
+    for (size_t i = 0; i < buf_len; i++) {
+        if (i > 0)
+            std::cerr << ' ';
+        std::cerr << std::hex << std::setfill('0') << std::setw(2) << (int)buf[i];
+    }
+
+    std::cerr << std::endl;
+}
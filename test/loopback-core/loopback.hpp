@@ -0,0 +1,213 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Benchmark core shared by all platforms: command line options, test modes
+// (transfer, latency, sweep, multiple ports, capture and replay) and reporting.
+//
+
+#pragma once
+
+#include "capture_log.hpp"
+#include "credit_window.hpp"
+#include "cxxopts.hpp"
+#include "flow_stress.hpp"
+#include "multi_port.hpp"
+#include "serial.hpp"
+#include "serial_client.hpp"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Loopback test settings (from the command line).
+ */
+struct loopback_settings {
+    std::string send_port_path;
+    std::string recv_port_path;
+    int num_bytes;
+    int bit_rate;
+    int data_bits;
+    bool with_parity;
+    int rx_delay; // in s
+    int max_outstanding_bytes;
+    int chunk_size;
+    bool use_aliases;
+    bool use_client; // transfer through serial_client
+    bool low_latency; // Linux only
+
+    bool run_latency;
+    std::vector<int> latency_msg_sizes;
+    int latency_round_trips;
+
+    bool with_stalls;
+    stall_pattern stalls;
+    int stall_time; // in ms
+    int stall_interval; // in ms
+    int drain_rate; // in bytes/s
+
+    bool run_sweep;
+    std::vector<int> sweep_bit_rates; // also used for latency mode
+    std::vector<std::string> sweep_formats;
+    std::vector<int> sweep_chunk_sizes;
+    std::string csv_path;
+
+    std::vector<std::string> multi_port_paths;
+    int num_threads;
+    bool with_scaling;
+
+    std::string capture_path;
+    std::string host_port_path; // port the host application uses during capture
+    std::string replay_path;
+    double replay_speed; // 0 for as fast as possible
+};
+
+/**
+ * Adds the command line options shared by all platforms.
+ * @param options options to add to
+ * @param default_chunk_size default size of the chunks written to the serial port (in bytes)
+ */
+void add_loopback_options(cxxopts::Options& options, int default_chunk_size);
+
+/**
+ * Reads the command line options shared by all platforms.
+ *
+ * Throws a `cxxopts::OptionParseException` if an option is invalid.
+ *
+ * @param result parsed command line
+ * @param settings receives the settings
+ */
+void read_loopback_options(const cxxopts::ParseResult& result, loopback_settings& settings);
+
+/**
+ * Loopback test.
+ *
+ * Runs the test modes selected by the settings. Platform-specific instrumentation
+ * can hook into the transfer test.
+ */
+class loopback_test {
+public:
+    /**
+     * Creates a new instance.
+     * @param settings test settings
+     */
+    loopback_test(const loopback_settings& settings);
+
+    /**
+     * Runs the test mode selected by the settings (capture, replay, latency,
+     * sweep, multiple ports or a single transfer).
+     *
+     * @return 0 if successful, 2 for a serial port error, 3 if the test has failed
+     */
+    int run();
+
+    /**
+     * Runs the loopback test once, prints the results.
+     *
+     * If a stall pattern is configured, the receiver stalls accordingly
+     * and the flow control measurements are printed as well.
+     *
+     * @return 0 if successful, 2 for a serial port error, 3 if the test has failed
+     */
+    int transfer_test();
+
+    /**
+     * Runs the loopback test once with the current settings
+     * (opens the ports, transfers the data and closes the ports).
+     *
+     * Throws a `serial_error` if a port cannot be opened.
+     *
+     * @return duration of the transfer (in s)
+     */
+    double run_transfer();
+
+    /**
+     * Measures the round-trip time of messages sent ping-pong style
+     * for each message size and bit rate and prints the statistics.
+     *
+     * @return 0 if successful, 2 for a serial port error, 3 if the test has failed
+     */
+    int latency_test();
+
+    /**
+     * Repeats the loopback test for each combination of bit rate, data format and
+     * write chunk size and writes the results as CSV.
+     *
+     * @return 0 if all tests were successful, other value otherwise
+     */
+    int sweep();
+
+    /**
+     * Runs the loopback test on multiple ports at once and prints the results
+     * (or the scaling from 1 to N ports as CSV).
+     *
+     * @return 0 if all tests were successful, other value otherwise
+     */
+    int multi_port_test();
+
+    /**
+     * Captures the traffic between a host application and the device.
+     *
+     * The data is forwarded between the host port (used by the host application)
+     * and the device port (tx-port), and each forwarded chunk is recorded with
+     * a time stamp, until Enter is pressed.
+     *
+     * @return 0 if successful, 2 for a serial port or file error
+     */
+    int capture();
+
+    /**
+     * Replays the data written by the host in a captured session with the
+     * original timing (scaled by the replay speed) and verifies the echo.
+     *
+     * @return 0 if successful, 2 for a serial port or file error, 3 if the test has failed
+     */
+    int replay_test();
+
+    /**
+     * Gets if the last transfer has failed.
+     * @return `true` if it has failed
+     */
+    bool has_failed() const { return test_cancelled; }
+
+    /// Settings (the sweep modifies bit rate, data format and chunk size)
+    loopback_settings settings;
+
+    /// Called after the ports have been opened and before the transfer (optional)
+    std::function<void()> on_transfer_start;
+    /// Called after the transfer and before the ports are closed (optional)
+    std::function<void()> on_transfer_end;
+    /// Called before each write with the total number of bytes sent after the write (optional)
+    std::function<void(int num_bytes)> on_transmit;
+    /// Called for each received chunk, returns the length of the payload moved to the start of the buffer (optional)
+    std::function<int(uint8_t* buf, int len)> on_receive;
+    /// Called if the received data doesn't match, returns the number of bytes the device reports as lost since the last call (optional)
+    std::function<int()> on_data_loss;
+
+private:
+    void open_ports(bool with_client = false);
+    void close_ports();
+    int port_bit_rate(int rate) const;
+    void send();
+    void recv();
+    std::vector<multi_port_result> run_multi_port(int num_ports, double* wall_time);
+
+    serial_port send_port;
+    serial_port recv_port;
+    std::unique_ptr<serial_client> send_client; // with --client
+    std::unique_ptr<serial_client> recv_client; // with --client and two ports
+    serial_client_stats send_client_stats;
+    serial_client_stats recv_client_stats;
+    std::atomic<bool> test_cancelled{ false };
+    std::atomic<int> bytes_sent{ 0 };
+    std::unique_ptr<flow_stress> stress; // during flow control stress test
+    int num_lost_bytes = 0;
+    credit_window outstanding_data; // limits the data in transit (see --outstanding)
+};
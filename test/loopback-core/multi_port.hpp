@@ -0,0 +1,102 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Event loop driving the loopback test on multiple serial ports at once.
+//
+// The event loop (multi_port.cpp) is provided by the platform-specific test
+// directories: epoll on Linux, kqueue on macOS, I/O completion port on Windows.
+//
+
+#pragma once
+
+#include "serial.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Loopback test settings (the same for all ports).
+ */
+struct multi_port_settings {
+    int bit_rate;
+    int data_bits;
+    bool with_parity;
+    int num_bytes;
+    int chunk_size;
+    int max_outstanding_bytes;
+};
+
+/**
+ * Result of the loopback test of a single port.
+ */
+struct multi_port_result {
+    std::string path;
+    int bytes_received = 0;
+    double duration = 0; // in s
+    std::string error; // empty if successful
+};
+
+/**
+ * Loopback test engine driving multiple serial ports with non-blocking I/O from a
+ * single thread.
+ *
+ * Each port is expected to be wired to itself (TX to RX) and gets its own
+ * pseudo random data stream.
+ */
+class multi_port_engine {
+public:
+    /**
+     * Creates a new engine.
+     * @param settings test settings
+     */
+    multi_port_engine(const multi_port_settings& settings);
+    ~multi_port_engine();
+
+    /**
+     * Adds a serial port.
+     * @param path serial port path
+     * @param stream_index index selecting the pseudo random data stream
+     */
+    void add_port(const std::string& path, int stream_index);
+
+    /**
+     * Runs the loopback test on all ports until all data has been received
+     * or the ports have failed.
+     *
+     * Throws a `serial_error` if a port cannot be opened.
+     */
+    void run();
+
+    /**
+     * Gets the results of all ports.
+     * @return results (in the order the ports have been added)
+     */
+    std::vector<multi_port_result> results() const;
+
+private:
+    struct port;
+
+#if defined(_WIN32)
+    void try_send(port& p);
+    void start_receive(port& p);
+    void on_received(port& p, int len, double now);
+#else
+    bool try_send(port& p);
+    bool try_receive(port& p, double now);
+#endif
+    void fail(port& p, const char* message, int errnum = 0);
+
+    multi_port_settings settings;
+    std::vector<std::unique_ptr<port>> ports;
+#if defined(_WIN32)
+    void* completion_port;
+#else
+    int event_fd; // epoll or kqueue instance
+#endif
+};
@@ -0,0 +1,170 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2020 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Pseudo random number generator
+//
+
+#include "prng.hpp"
+
+// Length of the blocks verified in a single pass (in bytes)
+static constexpr size_t VERIFY_BLOCK_LEN = 64;
+
+/**
+ * Linear map over GF(2)^32, stored as the images of the 32 unit vectors.
+ *
+ * A xorshift step is such a map, so n steps can be computed as the n-th
+ * power of the step's matrix.
+ */
+struct gf2_matrix {
+    uint32_t col[32];
+};
+
+static uint32_t xorshift(uint32_t x) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static uint32_t apply(const gf2_matrix& m, uint32_t v) {
+    uint32_t r = 0;
+    for (int j = 0; v != 0; j++, v >>= 1) {
+        if ((v & 1) != 0)
+            r ^= m.col[j];
+    }
+    return r;
+}
+
+static gf2_matrix multiply(const gf2_matrix& a, const gf2_matrix& b) {
+    gf2_matrix r;
+    for (int j = 0; j < 32; j++)
+        r.col[j] = apply(a, b.col[j]);
+    return r;
+}
+
+static inline void store_word(uint8_t* buf, uint32_t x) {
+    buf[0] = x;
+    buf[1] = x >> 8;
+    buf[2] = x >> 16;
+    buf[3] = x >> 24;
+}
+
+static inline uint32_t load_word(const uint8_t* buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+
+prng::prng(uint32_t init) : state(init), nbytes(0), bits(0) { }
+
+
+uint32_t prng::next() {
+    state = xorshift(state);
+    return state;
+}
+
+
+void prng::fill(uint8_t* buf, size_t len, uint8_t mask) {
+    size_t i = 0;
+
+    // bytes left over from the current word
+    for (; nbytes > 0 && i < len; i++) {
+        buf[i] = bits & mask;
+        bits >>= 8;
+        nbytes--;
+    }
+
+    // whole words
+    uint32_t word_mask = mask * 0x01010101u;
+    for (; i + 4 <= len; i += 4)
+        store_word(buf + i, next() & word_mask);
+
+    // start of the next word
+    if (i < len) {
+        bits = next();
+        nbytes = 4;
+        for (; i < len; i++) {
+            buf[i] = bits & mask;
+            bits >>= 8;
+            nbytes--;
+        }
+    }
+}
+
+
+int prng::verify(const uint8_t* buf, size_t len, uint8_t mask) {
+    size_t i = 0;
+
+    // bytes left over from the current word
+    for (; nbytes > 0 && i < len; i++) {
+        if (buf[i] != (uint8_t)(bits & mask))
+            return (int)i;
+        bits >>= 8;
+        nbytes--;
+    }
+
+    // blocks of whole words: the differences are accumulated over the block,
+    // the mismatch is only located (below) if there is one
+    uint32_t word_mask = mask * 0x01010101u;
+    while (i + VERIFY_BLOCK_LEN <= len) {
+        uint32_t block_start = state;
+        uint32_t diff = 0;
+        for (size_t j = 0; j < VERIFY_BLOCK_LEN; j += 4)
+            diff |= load_word(buf + i + j) ^ (next() & word_mask);
+        if (diff != 0) {
+            state = block_start;
+            break;
+        }
+        i += VERIFY_BLOCK_LEN;
+    }
+
+    // remaining bytes (or the block with the mismatch)
+    for (; i < len; i++) {
+        if (nbytes == 0) {
+            bits = next();
+            nbytes = 4;
+        }
+        if (buf[i] != (uint8_t)(bits & mask))
+            return (int)i;
+        bits >>= 8;
+        nbytes--;
+    }
+
+    return -1;
+}
+
+
+void prng::skip(uint64_t len) {
+    // bytes left over from the current word
+    for (; nbytes > 0 && len > 0; len--) {
+        bits >>= 8;
+        nbytes--;
+    }
+
+    jump(len / 4);
+
+    int rem = (int)(len % 4);
+    if (rem != 0) {
+        bits = next() >> (8 * rem);
+        nbytes = 4 - rem;
+    }
+}
+
+
+void prng::jump(uint64_t num_words) {
+    // matrix of 2^k steps, starting with a single step
+    gf2_matrix m;
+    for (int j = 0; j < 32; j++)
+        m.col[j] = xorshift(1u << j);
+
+    while (num_words != 0) {
+        if ((num_words & 1) != 0)
+            state = apply(m, state);
+        num_words >>= 1;
+        if (num_words != 0)
+            m = multiply(m, m);
+    }
+}
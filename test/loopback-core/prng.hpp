@@ -15,6 +15,9 @@
 
 /**
  * Pseudo Random Number Generator
+ *
+ * 32-bit xorshift generator. The random data is the sequence of the generated
+ * 32-bit words, each emitted least significant byte first.
  */
 struct prng {
     /**
@@ -31,18 +34,35 @@ struct prng {
      * Fills the buffer with pseudo random data
      * @param buf buffer receiving the random data
      * @param len length of the buffer (in bytes)
+     * @param mask mask applied to each byte (e.g. 0x7f for 7 data bits)
      */
-    void fill(uint8_t* buf, size_t len);
+    void fill(uint8_t* buf, size_t len, uint8_t mask = 0xff);
     
     /**
      * Verifies that the specified bytes match the random data generated by this instance.
+     *
+     * If the data doesn't match, the generator is positioned at the mismatch,
+     * i.e. the next generated byte is the one expected at the mismatch position.
+     *
      * @param buf buffer receiving the random data
      * @param len length of the buffer (in bytes)
+     * @param mask mask applied to each generated byte before comparing it
      * @return -1 if the data matches, the position of the mismatch otherwise
      */
-    int verify(const uint8_t* buf, size_t len);
+    int verify(const uint8_t* buf, size_t len, uint8_t mask = 0xff);
+
+    /**
+     * Skips the specified number of bytes of random data.
+     *
+     * Jumps ahead in O(log n) steps instead of generating the skipped data.
+     *
+     * @param len number of bytes to skip
+     */
+    void skip(uint64_t len);
 
 private:
+    void jump(uint64_t num_words);
+
     uint32_t state;
     int nbytes;
     uint32_t bits;
@@ -7,15 +7,30 @@
 //
 // Loopback test
 //
-// Serial port class (for Windows).
+// Serial port class.
+//
+// The interface is shared by all platforms. The implementation (serial.cpp)
+// is provided by the platform-specific test directories.
 //
 
 #pragma once
 
 #include <exception>
+#include <stdint.h>
 #include <string>
 
 
+/**
+ * Chunk of data to transmit (for batched transmission).
+ */
+struct serial_chunk {
+    /// Data
+    const uint8_t* data;
+    /// Length of data, in bytes
+    int len;
+};
+
+
 /**
  * Serial port.
  *
@@ -38,8 +53,10 @@ public:
      */
     serial_port();
     
+#if defined(_WIN32)
     ~serial_port();
-    
+
+#endif
     /**
      * Open the specified serial port.
      *
@@ -62,6 +79,14 @@ public:
      * @param data_len length of data, in bytes
      */
     void transmit(const uint8_t* data, int data_len);
+
+    /**
+     * Transmit several chunks of data at once (like `writev`).
+     *
+     * @param chunks chunks to transmit
+     * @param num_chunks number of chunks
+     */
+    void transmit(const serial_chunk* chunks, int num_chunks);
     
     /**
      * Receive data from the serial port.
@@ -76,10 +101,39 @@ public:
      * Drains any pending data.
      */
     void drain();
+
+#if defined(__linux__)
+    /**
+     * Enables the low latency mode of the driver (`ASYNC_LOW_LATENCY`).
+     *
+     * @return `true` if enabled, `false` if the driver doesn't support it
+     */
+    bool set_low_latency();
+#endif
+
+#if defined(_WIN32)
+    /**
+     * Gets the handle (for I/O completion ports).
+     *
+     * @return handle, `NULL` if the port is closed
+     */
+    void* handle() const { return _hComPort; }
+#else
+    /**
+     * Gets the file descriptor (for event loops).
+     *
+     * @return file descriptor, -1 if the port is closed
+     */
+    int fd() const { return _fd; }
+#endif
     
 private:
+#if defined(_WIN32)
     void* _hComPort;
     void* _hEvent;
+#else
+    int _fd;
+#endif
 };
 
 
@@ -0,0 +1,277 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Asynchronous serial client (ring-buffered reader and writer thread per port).
+//
+
+#include "serial_client.hpp"
+#include <stdio.h>
+
+using namespace std::chrono;
+
+static constexpr milliseconds POLL_INTERVAL(100);
+
+// Default baud rate aliases of the firmware (requested, actual), see doc/vendor-requests.md
+static const std::pair<int, int> default_baud_aliases[] = {
+    { 75, 6000000 },
+    { 110, 4800000 },
+    { 134, 4000000 },
+    { 150, 3000000 },
+};
+
+/**
+ * Adds a latency sample (called by a single thread only).
+ */
+static void add_sample(std::atomic<int64_t>& count, std::atomic<double>& sum, std::atomic<double>& max, double latency) {
+    sum.store(sum.load() + latency);
+    if (latency > max.load())
+        max.store(latency);
+    count++;
+}
+
+
+serial_client::serial_client() { }
+
+serial_client::~serial_client() {
+    try {
+        close();
+    }
+    catch (serial_error&) {
+        // ignore
+    }
+}
+
+
+void serial_client::open(const char* path, const serial_client_config& config) {
+    close();
+
+    int rate = config.use_aliases ? alias_bit_rate(config.bit_rate) : config.bit_rate;
+    port.open(path, rate, config.data_bits, config.with_parity);
+#if defined(__linux__)
+    if (config.low_latency && !port.set_low_latency())
+        fprintf(stderr, "Low latency mode not supported by %s\n", path);
+#endif
+
+    tx_ring.reset(new spsc_ring(config.tx_buffer_size));
+    rx_ring.reset(new spsc_ring(config.rx_buffer_size));
+    tx_times.reset(new spsc_queue<timestamp, 256>());
+    rx_times.reset(new spsc_queue<timestamp, 256>());
+    num_transmits = 0;
+    num_receives = 0;
+    num_tx_samples = 0;
+    tx_latency_sum = 0;
+    tx_latency_max = 0;
+    num_rx_samples = 0;
+    rx_latency_sum = 0;
+    rx_latency_max = 0;
+    failed = false;
+    stopped = false;
+    open_time = steady_clock::now();
+
+    writer = std::thread(&serial_client::write_loop, this);
+    reader = std::thread(&serial_client::read_loop, this);
+}
+
+
+void serial_client::close() {
+    if (stopped)
+        return;
+
+    stopped = true;
+    tx_ring->interrupt();
+    rx_ring->interrupt();
+    writer.join();
+    reader.join();
+    port.close();
+}
+
+
+void serial_client::write(const uint8_t* data, int len) {
+    check_error();
+    tx_times->push({ tx_ring->total_written() + len, steady_clock::now() });
+    queue(data, len);
+    tx_ring->notify();
+}
+
+
+void serial_client::write(const serial_chunk* chunks, int num_chunks) {
+    check_error();
+    uint64_t end_pos = tx_ring->total_written();
+    for (int i = 0; i < num_chunks; i++)
+        end_pos += chunks[i].len;
+    tx_times->push({ end_pos, steady_clock::now() });
+
+    // a single wakeup for the entire batch
+    for (int i = 0; i < num_chunks; i++)
+        queue(chunks[i].data, chunks[i].len);
+    tx_ring->notify();
+}
+
+
+void serial_client::queue(const uint8_t* data, int len) {
+    while (true) {
+        int n = tx_ring->write(data, len, false);
+        data += n;
+        len -= n;
+        if (len == 0)
+            return;
+
+        // buffer full: let the writer thread transmit the queued data
+        tx_ring->notify();
+        int space = len < tx_ring->capacity() ? len : tx_ring->capacity();
+        while (!tx_ring->wait_for_space(space, POLL_INTERVAL)) {
+            check_error();
+            if (stopped)
+                throw serial_error("Serial client is closed");
+        }
+    }
+}
+
+
+void serial_client::flush() {
+    while (tx_ring->total_consumed() != tx_ring->total_written()) {
+        check_error();
+        if (stopped)
+            return;
+        tx_ring->wait_for_space(tx_ring->capacity(), POLL_INTERVAL);
+    }
+}
+
+
+int serial_client::read(uint8_t* data, int len, milliseconds timeout) {
+    check_error();
+    if (!rx_ring->wait_for_data(timeout)) {
+        check_error();
+        return 0;
+    }
+
+    int n = rx_ring->read(data, len);
+
+    auto now = steady_clock::now();
+    uint64_t pos = rx_ring->total_consumed();
+    const timestamp* ts;
+    while ((ts = rx_times->front()) != nullptr && ts->end_pos <= pos) {
+        add_sample(num_rx_samples, rx_latency_sum, rx_latency_max, duration<double>(now - ts->time).count());
+        rx_times->pop();
+    }
+    return n;
+}
+
+
+void serial_client::write_loop() {
+    try {
+        while (!stopped) {
+            if (!tx_ring->wait_for_data(POLL_INTERVAL))
+                continue;
+
+            // pass all queued data to the driver at once
+            serial_chunk chunks[2];
+            int num_chunks = tx_ring->peek(chunks);
+            int len = 0;
+            for (int i = 0; i < num_chunks; i++)
+                len += chunks[i].len;
+            port.transmit(chunks, num_chunks);
+            num_transmits++;
+            tx_ring->consume(len);
+
+            auto now = steady_clock::now();
+            uint64_t pos = tx_ring->total_consumed();
+            const timestamp* ts;
+            while ((ts = tx_times->front()) != nullptr && ts->end_pos <= pos) {
+                add_sample(num_tx_samples, tx_latency_sum, tx_latency_max, duration<double>(now - ts->time).count());
+                tx_times->pop();
+            }
+        }
+    }
+    catch (serial_error& error) {
+        error_message = error.what();
+        failed = true;
+        tx_ring->interrupt();
+        rx_ring->interrupt();
+    }
+}
+
+
+void serial_client::read_loop() {
+    try {
+        while (!stopped) {
+            // receive directly into the ring buffer
+            uint8_t* ptr;
+            int space = rx_ring->prepare(ptr);
+            if (space == 0) {
+                rx_ring->wait_for_space(1, POLL_INTERVAL);
+                continue;
+            }
+
+            int n = port.receive(ptr, space);
+            if (n == 0)
+                continue;
+
+            rx_times->push({ rx_ring->total_written() + n, steady_clock::now() });
+            rx_ring->commit(n);
+            num_receives++;
+        }
+    }
+    catch (serial_error& error) {
+        error_message = error.what();
+        failed = true;
+        tx_ring->interrupt();
+        rx_ring->interrupt();
+    }
+}
+
+
+void serial_client::check_error() {
+    if (failed)
+        throw serial_error(error_message.c_str());
+}
+
+
+serial_client_stats serial_client::stats() const {
+    serial_client_stats stats{};
+    if (!tx_ring)
+        return stats;
+
+    stats.elapsed = duration<double>(steady_clock::now() - open_time).count();
+    stats.bytes_transmitted = tx_ring->total_consumed();
+    stats.bytes_received = rx_ring->total_written();
+    stats.num_transmits = num_transmits;
+    stats.num_receives = num_receives;
+    int64_t n = num_tx_samples;
+    stats.tx_latency_avg = n > 0 ? tx_latency_sum / n : 0;
+    stats.tx_latency_max = tx_latency_max;
+    n = num_rx_samples;
+    stats.rx_latency_avg = n > 0 ? rx_latency_sum / n : 0;
+    stats.rx_latency_max = rx_latency_max;
+    return stats;
+}
+
+
+int serial_client::alias_bit_rate(int bit_rate) {
+    for (auto& alias : default_baud_aliases) {
+        if (alias.second == bit_rate)
+            return alias.first;
+    }
+    return bit_rate;
+}
+
+
+void serial_client_stats::print(const char* title) const {
+    printf("%s:\n", title);
+    printf("  Transmitted: %lld bytes in %lld calls (%.0f bytes/call), %.0f bytes/s\n",
+        (long long)bytes_transmitted, (long long)num_transmits,
+        num_transmits > 0 ? (double)bytes_transmitted / num_transmits : 0.0,
+        elapsed > 0 ? bytes_transmitted / elapsed : 0.0);
+    printf("  Received:    %lld bytes in %lld calls (%.0f bytes/call), %.0f bytes/s\n",
+        (long long)bytes_received, (long long)num_receives,
+        num_receives > 0 ? (double)bytes_received / num_receives : 0.0,
+        elapsed > 0 ? bytes_received / elapsed : 0.0);
+    printf("  TX latency:  avg %.3f ms, max %.3f ms (from write() to driver)\n", tx_latency_avg * 1e3, tx_latency_max * 1e3);
+    printf("  RX latency:  avg %.3f ms, max %.3f ms (from driver to read())\n", rx_latency_avg * 1e3, rx_latency_max * 1e3);
+}
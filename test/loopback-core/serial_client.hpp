@@ -0,0 +1,202 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Asynchronous serial client (ring-buffered reader and writer thread per port).
+//
+// The client is independent of the loopback test and can be used by other host
+// applications together with serial.hpp and the platform's serial.cpp
+// (see the serial-client library target of the Linux build).
+//
+
+#pragma once
+
+#include "serial.hpp"
+#include "spsc_ring.hpp"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+/**
+ * Serial client configuration.
+ */
+struct serial_client_config {
+    /// Bit rate (in bps)
+    int bit_rate = 115200;
+    /// Number of data bits (7 or 8)
+    int data_bits = 8;
+    /// Whether to use an additional parity bit
+    bool with_parity = false;
+    /// Size of the transmit ring buffer (in bytes)
+    int tx_buffer_size = 65536;
+    /// Size of the receive ring buffer (in bytes)
+    int rx_buffer_size = 65536;
+    /// Whether to open the port with the firmware's baud rate alias if the bit rate has one
+    bool use_aliases = false;
+    /// Whether to enable the driver's low latency mode (`ASYNC_LOW_LATENCY`, Linux only)
+    bool low_latency = false;
+};
+
+
+/**
+ * Serial client statistics.
+ */
+struct serial_client_stats {
+    /// Time since the port has been opened (in s)
+    double elapsed;
+    /// Number of bytes passed to the driver
+    int64_t bytes_transmitted;
+    /// Number of bytes received from the driver
+    int64_t bytes_received;
+    /// Number of transmit calls to the driver
+    int64_t num_transmits;
+    /// Number of receive calls to the driver that returned data
+    int64_t num_receives;
+    /// Average and maximum time from `write()` until the data has been passed to the driver (in s)
+    double tx_latency_avg, tx_latency_max;
+    /// Average and maximum time from the reception from the driver until `read()` (in s)
+    double rx_latency_avg, rx_latency_max;
+
+    /**
+     * Prints the statistics.
+     * @param title title line
+     */
+    void print(const char* title) const;
+};
+
+
+/**
+ * Asynchronous serial client.
+ *
+ * A writer thread transmits the data queued with `write()` from a ring buffer,
+ * passing all queued data to the driver in a single call. A reader thread
+ * receives data directly into a second ring buffer, from where `read()` takes it.
+ * The ring buffers are lock-free. So `write()` and `read()` only block if the
+ * transmit buffer is full or the receive buffer is empty.
+ *
+ * `write()` and `read()` may be called from two separate threads.
+ *
+ * I/O errors of the threads are reported by the next call to `write()` or `read()`.
+ */
+class serial_client {
+public:
+    /**
+     * Creates a new instance (in closed state).
+     */
+    serial_client();
+
+    /**
+     * Destroys the instance (closes the port if needed).
+     */
+    ~serial_client();
+
+    serial_client(const serial_client&) = delete;
+    serial_client& operator=(const serial_client&) = delete;
+
+    /**
+     * Opens the serial port and starts the reader and writer thread.
+     *
+     * Throws a `serial_error` if the port cannot be opened.
+     *
+     * @param path serial port path name
+     * @param config configuration
+     */
+    void open(const char* path, const serial_client_config& config);
+
+    /**
+     * Stops the threads and closes the serial port.
+     *
+     * Data not yet transmitted is discarded (use `flush()` before).
+     */
+    void close();
+
+    /**
+     * Queues data for transmission.
+     *
+     * Blocks while the transmit buffer is full.
+     *
+     * @param data data
+     * @param len length of the data (in bytes)
+     */
+    void write(const uint8_t* data, int len);
+
+    /**
+     * Queues several chunks of data for transmission at once.
+     *
+     * The writer thread is woken up once for the entire batch.
+     *
+     * @param chunks chunks
+     * @param num_chunks number of chunks
+     */
+    void write(const serial_chunk* chunks, int num_chunks);
+
+    /**
+     * Waits until all queued data has been passed to the driver.
+     */
+    void flush();
+
+    /**
+     * Reads received data.
+     * @param data buffer receiving the data
+     * @param len length of the buffer (in bytes)
+     * @param timeout maximum time to wait for data
+     * @return number of bytes read (0 on timeout)
+     */
+    int read(uint8_t* data, int len, std::chrono::milliseconds timeout = std::chrono::milliseconds(100));
+
+    /**
+     * Gets the statistics.
+     * @return statistics
+     */
+    serial_client_stats stats() const;
+
+    /**
+     * Gets the bit rate to open the port with, using the firmware's default baud rate aliases.
+     *
+     * If there is an alias for the bit rate, the alias is returned,
+     * otherwise the bit rate itself (see doc/vendor-requests.md).
+     *
+     * @param bit_rate bit rate (in bps)
+     * @return bit rate to open the port with
+     */
+    static int alias_bit_rate(int bit_rate);
+
+private:
+    struct timestamp {
+        uint64_t end_pos; // stream position after the data
+        std::chrono::steady_clock::time_point time;
+    };
+
+    void write_loop();
+    void read_loop();
+    void check_error();
+    void queue(const uint8_t* data, int len);
+
+    serial_port port;
+    std::unique_ptr<spsc_ring> tx_ring;
+    std::unique_ptr<spsc_ring> rx_ring;
+    std::unique_ptr<spsc_queue<timestamp, 256>> tx_times; // write() calls not yet passed to the driver
+    std::unique_ptr<spsc_queue<timestamp, 256>> rx_times; // received chunks not yet read
+    std::thread writer;
+    std::thread reader;
+    std::atomic<bool> stopped{ true };
+    std::atomic<bool> failed{ false };
+    std::string error_message;
+    std::chrono::steady_clock::time_point open_time;
+
+    std::atomic<int64_t> num_transmits{ 0 };
+    std::atomic<int64_t> num_receives{ 0 };
+    std::atomic<int64_t> num_tx_samples{ 0 };
+    std::atomic<double> tx_latency_sum{ 0 };
+    std::atomic<double> tx_latency_max{ 0 };
+    std::atomic<int64_t> num_rx_samples{ 0 };
+    std::atomic<double> rx_latency_sum{ 0 };
+    std::atomic<double> rx_latency_max{ 0 };
+};
@@ -0,0 +1,147 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Single producer, single consumer ring buffers.
+//
+
+#include "spsc_ring.hpp"
+#include <string.h>
+
+
+spsc_ring::spsc_ring(int min_capacity) {
+    size_t capacity = 64;
+    while (capacity < (size_t)min_capacity)
+        capacity *= 2;
+    buffer.resize(capacity);
+    mask = capacity - 1;
+}
+
+
+int spsc_ring::prepare(uint8_t*& ptr) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    size_t free_space = buffer.size() - (size_t)(h - tail.load(std::memory_order_acquire));
+    size_t offset = (size_t)h & mask;
+    ptr = buffer.data() + offset;
+    size_t contiguous = buffer.size() - offset;
+    return (int)(free_space < contiguous ? free_space : contiguous);
+}
+
+
+void spsc_ring::commit(int len) {
+    head.store(head.load(std::memory_order_relaxed) + len);
+    notify();
+}
+
+
+int spsc_ring::write(const uint8_t* data, int len, bool wake) {
+    int n = 0;
+    while (n < len) {
+        uint8_t* ptr;
+        int space = prepare(ptr);
+        if (space == 0)
+            break;
+        int m = space < len - n ? space : len - n;
+        memcpy(ptr, data + n, m);
+        n += m;
+        // publish after each contiguous part so a wrap-around doesn't overwrite unconsumed data
+        head.store(head.load(std::memory_order_relaxed) + m);
+    }
+    if (n > 0 && wake)
+        notify();
+    return n;
+}
+
+
+int spsc_ring::peek(serial_chunk chunks[2]) const {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    size_t available = (size_t)(head.load(std::memory_order_acquire) - t);
+    if (available == 0)
+        return 0;
+
+    size_t offset = (size_t)t & mask;
+    size_t contiguous = buffer.size() - offset;
+    chunks[0].data = buffer.data() + offset;
+    if (available <= contiguous) {
+        chunks[0].len = (int)available;
+        return 1;
+    }
+    chunks[0].len = (int)contiguous;
+    chunks[1].data = buffer.data();
+    chunks[1].len = (int)(available - contiguous);
+    return 2;
+}
+
+
+void spsc_ring::consume(int len) {
+    tail.store(tail.load(std::memory_order_relaxed) + len);
+    notify();
+}
+
+
+int spsc_ring::read(uint8_t* data, int len) {
+    serial_chunk chunks[2];
+    int num_chunks = peek(chunks);
+    int n = 0;
+    for (int i = 0; i < num_chunks && n < len; i++) {
+        int m = chunks[i].len < len - n ? chunks[i].len : len - n;
+        memcpy(data + n, chunks[i].data, m);
+        n += m;
+    }
+    if (n > 0)
+        consume(n);
+    return n;
+}
+
+
+bool spsc_ring::wait_for_data(std::chrono::milliseconds timeout) {
+    auto has_data = [this]() { return head.load() != tail.load() || interrupted; };
+    if (has_data())
+        return !interrupted;
+
+    num_waiting++;
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait_for(lock, timeout, has_data);
+    num_waiting--;
+    return head.load() != tail.load() && !interrupted;
+}
+
+
+bool spsc_ring::wait_for_space(int len, std::chrono::milliseconds timeout) {
+    auto has_space = [this, len]() {
+        return buffer.size() - (size_t)(head.load() - tail.load()) >= (size_t)len || interrupted;
+    };
+    if (has_space())
+        return !interrupted;
+
+    num_waiting++;
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait_for(lock, timeout, has_space);
+    num_waiting--;
+    return buffer.size() - (size_t)(head.load() - tail.load()) >= (size_t)len && !interrupted;
+}
+
+
+void spsc_ring::interrupt() {
+    interrupted = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+    }
+    cond.notify_all();
+}
+
+
+void spsc_ring::notify() {
+    // only take the lock if a thread is waiting
+    if (num_waiting.load() == 0)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+    }
+    cond.notify_all();
+}
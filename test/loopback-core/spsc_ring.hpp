@@ -0,0 +1,188 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Single producer, single consumer ring buffers.
+//
+
+#pragma once
+
+#include "serial.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Byte ring buffer for a single producer and a single consumer thread.
+ *
+ * The head and tail positions are atomic counters, so reading and writing
+ * don't take a lock. The mutex and condition variable are only used if
+ * a thread waits for data or space.
+ */
+class spsc_ring {
+public:
+    /**
+     * Creates a new ring buffer.
+     * @param min_capacity minimum capacity (rounded up to a power of 2, in bytes)
+     */
+    explicit spsc_ring(int min_capacity);
+
+    /**
+     * Gets the capacity.
+     * @return capacity (in bytes)
+     */
+    int capacity() const { return (int)mask + 1; }
+
+    /**
+     * Gets the total number of bytes written so far.
+     * @return number of bytes
+     */
+    uint64_t total_written() const { return head.load(); }
+
+    /**
+     * Gets the total number of bytes consumed so far.
+     * @return number of bytes
+     */
+    uint64_t total_consumed() const { return tail.load(); }
+
+    /**
+     * Gets the contiguous free space (called by the producer).
+     *
+     * Data written to the space becomes visible with `commit()`.
+     *
+     * @param ptr receives a pointer to the free space
+     * @return length of the free space (in bytes)
+     */
+    int prepare(uint8_t*& ptr);
+
+    /**
+     * Makes the written data visible to the consumer (called by the producer).
+     * @param len length of the data (in bytes)
+     */
+    void commit(int len);
+
+    /**
+     * Copies as much data into the buffer as fits (called by the producer).
+     * @param data data
+     * @param len length of the data (in bytes)
+     * @param wake whether to wake up a waiting consumer (use `notify()` later if not)
+     * @return number of bytes copied
+     */
+    int write(const uint8_t* data, int len, bool wake = true);
+
+    /**
+     * Gets the available data as up to two chunks (called by the consumer).
+     *
+     * The data is released with `consume()`.
+     *
+     * @param chunks receives the chunks
+     * @return number of chunks (0 if the buffer is empty)
+     */
+    int peek(serial_chunk chunks[2]) const;
+
+    /**
+     * Releases consumed data (called by the consumer).
+     * @param len length of the data (in bytes)
+     */
+    void consume(int len);
+
+    /**
+     * Copies as much data from the buffer as available (called by the consumer).
+     * @param data buffer receiving the data
+     * @param len length of the buffer (in bytes)
+     * @return number of bytes copied
+     */
+    int read(uint8_t* data, int len);
+
+    /**
+     * Waits until data is available (called by the consumer).
+     * @param timeout maximum time to wait
+     * @return `true` if data is available, `false` if the wait has timed out or has been interrupted
+     */
+    bool wait_for_data(std::chrono::milliseconds timeout);
+
+    /**
+     * Waits until the specified space is free (called by the producer).
+     * @param len free space (in bytes)
+     * @param timeout maximum time to wait
+     * @return `true` if the space is free, `false` if the wait has timed out or has been interrupted
+     */
+    bool wait_for_space(int len, std::chrono::milliseconds timeout);
+
+    /**
+     * Wakes up the waiting threads if there are any.
+     */
+    void notify();
+
+    /**
+     * Wakes up all waiting threads and makes all further waits fail (e.g. to shut down).
+     */
+    void interrupt();
+
+private:
+    std::vector<uint8_t> buffer;
+    size_t mask;
+    std::atomic<uint64_t> head{ 0 }; // written by producer
+    std::atomic<uint64_t> tail{ 0 }; // written by consumer
+    std::atomic<int> num_waiting{ 0 };
+    std::atomic<bool> interrupted{ false };
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+
+/**
+ * Fixed-size queue for a single producer and a single consumer thread.
+ *
+ * If the queue is full, new items are dropped. `N` must be a power of 2.
+ */
+template <class T, int N>
+class spsc_queue {
+public:
+    /**
+     * Adds an item (called by the producer).
+     * @param item item
+     * @return `true` if added, `false` if the queue is full
+     */
+    bool push(const T& item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == N)
+            return false;
+        items[h % N] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Gets the oldest item (called by the consumer).
+     * @return pointer to the item, `nullptr` if the queue is empty
+     */
+    const T* front() const {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return nullptr;
+        return &items[t % N];
+    }
+
+    /**
+     * Removes the oldest item (called by the consumer, only if the queue isn't empty).
+     */
+    void pop() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    std::array<T, N> items;
+    std::atomic<uint32_t> head{ 0 };
+    std::atomic<uint32_t> tail{ 0 };
+};
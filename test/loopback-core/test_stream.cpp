@@ -0,0 +1,34 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Pseudo random test data stream (generator and verifier).
+//
+
+#include "test_stream.hpp"
+
+static constexpr uint32_t PRNG_INIT = 0x7b;
+
+test_stream::test_stream(int stream_index, int data_bits)
+: prandom(PRNG_INIT + 0x9e3779b9u * stream_index), mask(data_bits == 7 ? 0x7f : 0xff) { }
+
+void test_stream::generate(uint8_t* buf, int len) {
+    prandom.fill(buf, len, mask);
+}
+
+int test_stream::verify(const uint8_t* buf, int len) {
+    prng start = prandom;
+    int pos = prandom.verify(buf, len, mask);
+
+    // only generate the expected data if needed for reporting
+    if (pos >= 0) {
+        expected_buf.resize(len);
+        start.fill(expected_buf.data(), len, mask);
+    }
+    return pos;
+}
@@ -0,0 +1,70 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Pseudo random test data stream (generator and verifier).
+//
+
+#pragma once
+
+#include "prng.hpp"
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Pseudo random test data stream.
+ *
+ * The sender generates the data and the receiver verifies it using a separate
+ * instance with the same stream index. Each stream index produces a different
+ * data stream, so mixed up connections are detected. With 7 data bits, the
+ * high bit of each byte is cleared.
+ */
+struct test_stream {
+    /**
+     * Creates a new stream.
+     * @param stream_index index selecting the data stream
+     * @param data_bits number of data bits (7 or 8)
+     */
+    test_stream(int stream_index = 0, int data_bits = 8);
+
+    /**
+     * Generates the next data of the stream.
+     * @param buf buffer receiving the data
+     * @param len length of the buffer (in bytes)
+     */
+    void generate(uint8_t* buf, int len);
+
+    /**
+     * Verifies that the data matches the next data of the stream.
+     *
+     * If it doesn't match, the expected data is available from `expected()`
+     * and the stream is positioned at the mismatch.
+     *
+     * @param buf received data
+     * @param len length of the data (in bytes)
+     * @return -1 if it matches, the position of the mismatch otherwise
+     */
+    int verify(const uint8_t* buf, int len);
+
+    /**
+     * Skips data of the stream (e.g. to resynchronize after a reported data loss).
+     * @param len number of bytes to skip
+     */
+    void skip(int len) { prandom.skip(len); }
+
+    /**
+     * Gets the expected data of the last failed call to `verify()`.
+     * @return expected data
+     */
+    const uint8_t* expected() const { return expected_buf.data(); }
+
+private:
+    prng prandom;
+    uint8_t mask;
+    std::vector<uint8_t> expected_buf;
+};
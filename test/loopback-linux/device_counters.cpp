@@ -0,0 +1,289 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Performance counters of the USB-to-serial adapter (for Linux).
+//
+
+#include "device_counters.hpp"
+#include "serial.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/usbdevice_fs.h>
+
+static constexpr uint8_t VENDOR_REQUEST_TYPE_IN = 0xc0; // vendor, device, device to host
+static constexpr uint8_t VENDOR_REQUEST_TYPE_OUT = 0x40; // vendor, device, host to device
+static constexpr uint8_t VENDOR_REQUEST_SET_PARAM = 0x02;
+static constexpr uint8_t VENDOR_REQUEST_GET_COUNTERS = 0x03;
+static constexpr uint8_t VENDOR_REQUEST_GET_LOOP_STATS = 0x04;
+static constexpr uint8_t VENDOR_REQUEST_RUN_BENCH = 0x07;
+static constexpr uint8_t VENDOR_REQUEST_GET_FRAME_TIME = 0x08;
+static constexpr uint8_t VENDOR_REQUEST_GET_TRACE = 0x09;
+
+// GET_TRACE response: header and 14 records fit the control buffer of the device
+static constexpr int TRACE_HEADER_LEN = 12;
+static constexpr int TRACE_RECORD_LEN = 8;
+static constexpr int TRACE_MAX_RECORDS = 14;
+
+/**
+ * Read an integer value from a sysfs file.
+ * @param path file path
+ * @return value
+ */
+static int read_sysfs_int(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (f == nullptr)
+        throw serial_error("Unable to read USB device info", errno);
+    int value = -1;
+    int n = fscanf(f, "%d", &value);
+    fclose(f);
+    if (n != 1)
+        throw serial_error("Invalid USB device info");
+    return value;
+}
+
+/**
+ * Get the path of the USB device file for the specified serial port.
+ * @param port_path serial port path name, like `/dev/ttyACM0`
+ * @return USB device file path, like `/dev/bus/usb/001/004`
+ */
+static std::string usb_device_path(const char* port_path) {
+    char resolved[PATH_MAX];
+    if (realpath(port_path, resolved) == nullptr)
+        throw serial_error("Unable to resolve serial port path", errno);
+
+    // /sys/class/tty/ttyACMx/device links to the USB interface
+    std::string intf_link = std::string("/sys/class/tty/") + basename(resolved) + "/device";
+    char intf_path[PATH_MAX];
+    if (realpath(intf_link.c_str(), intf_path) == nullptr)
+        throw serial_error("Serial port is not a USB device", errno);
+
+    // parent directory is the USB device
+    std::string dev_dir = dirname(intf_path);
+    int bus_num = read_sysfs_int(dev_dir + "/busnum");
+    int dev_num = read_sysfs_int(dev_dir + "/devnum");
+
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d", bus_num, dev_num);
+    return path;
+}
+
+/**
+ * Execute a vendor-specific IN request on the USB device behind the specified serial port.
+ *
+ * If the device returns less data than the size of the result, the remainder is set to 0.
+ *
+ * @param port_path serial port path name, like `/dev/ttyACM0`
+ * @param request request code
+ * @param value request value (`wValue`)
+ * @param result buffer receiving the result
+ * @param result_len length of result buffer, in bytes (max. 256)
+ * @param host_before optionally receives the host time before the request is issued (steady clock, in s)
+ * @param host_after optionally receives the host time after the request has completed (steady clock, in s)
+ */
+static void vendor_request_in(const char* port_path, uint8_t request, uint16_t value, void* result, size_t result_len,
+        double* host_before = nullptr, double* host_after = nullptr) {
+    using clock = std::chrono::steady_clock;
+
+    std::string dev_path = usb_device_path(port_path);
+    int fd = ::open(dev_path.c_str(), O_RDWR);
+    if (fd == -1)
+        throw serial_error("Unable to open USB device", errno);
+
+    uint8_t buf[256] = { 0 };
+    struct usbdevfs_ctrltransfer ctrl = { };
+    ctrl.bRequestType = VENDOR_REQUEST_TYPE_IN;
+    ctrl.bRequest = request;
+    ctrl.wValue = value;
+    ctrl.wIndex = 0;
+    ctrl.wLength = std::min(result_len, sizeof(buf));
+    ctrl.timeout = 1000;
+    ctrl.data = buf;
+
+    clock::time_point before = clock::now();
+    int n = ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+    int err = errno;
+    clock::time_point after = clock::now();
+    ::close(fd);
+    if (host_before != nullptr)
+        *host_before = std::chrono::duration<double>(before.time_since_epoch()).count();
+    if (host_after != nullptr)
+        *host_after = std::chrono::duration<double>(after.time_since_epoch()).count();
+    if (n < 0)
+        throw serial_error("Vendor request failed", err);
+
+    memset(result, 0, result_len);
+    memcpy(result, buf, std::min((size_t)n, result_len));
+}
+
+void device_set_param(const char* port_path, uint16_t param, uint32_t value) {
+    std::string dev_path = usb_device_path(port_path);
+    int fd = ::open(dev_path.c_str(), O_RDWR);
+    if (fd == -1)
+        throw serial_error("Unable to open USB device", errno);
+
+    uint8_t buf[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+    struct usbdevfs_ctrltransfer ctrl = { };
+    ctrl.bRequestType = VENDOR_REQUEST_TYPE_OUT;
+    ctrl.bRequest = VENDOR_REQUEST_SET_PARAM;
+    ctrl.wValue = param;
+    ctrl.wIndex = 0;
+    ctrl.wLength = sizeof(buf);
+    ctrl.timeout = 1000;
+    ctrl.data = buf;
+
+    int n = ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+    int err = errno;
+    ::close(fd);
+    if (n < 0)
+        throw serial_error("Setting parameter failed", err);
+}
+
+void device_counters::read(const char* port_path, bool reset) {
+    vendor_request_in(port_path, VENDOR_REQUEST_GET_COUNTERS, reset ? 1 : 0, this, sizeof(*this));
+}
+
+void device_counters::print() const {
+    printf("Device counters:\n");
+    printf("  USB OUT bytes:     %'u\n", usb_out_bytes);
+    printf("  USB IN bytes:      %'u\n", usb_in_bytes);
+    printf("  USB OUT packets:   %'u\n", usb_out_packets);
+    printf("  USB IN packets:    %'u (%'u ZLPs)\n", usb_in_packets, usb_in_zlps);
+    printf("  OUT pauses:        %'u (%'u ms)\n", out_pauses, out_paused_time);
+    printf("  RX overruns:       %'u (%'u bytes lost)\n", rx_overruns, rx_lost_bytes);
+    printf("  Parity errors:     %'u\n", parity_errors);
+    printf("  Framing errors:    %'u\n", framing_errors);
+    printf("  TX buffer peak:    %'u bytes\n", tx_buf_peak);
+    printf("  RX buffer peak:    %'u bytes\n", rx_buf_peak);
+    printf("  Notifications:     %'u\n", serial_state_notifs);
+}
+
+void device_loop_stats::read(const char* port_path, bool reset) {
+    vendor_request_in(port_path, VENDOR_REQUEST_GET_LOOP_STATS, reset ? 1 : 0, this, sizeof(*this));
+}
+
+void device_loop_stats::print() const {
+    if (iterations == 0 || clock_freq == 0)
+        return;
+
+    double cycle_ns = 1e9 / clock_freq;
+    printf("Device main loop:\n");
+    printf("  Iterations:        %'u\n", iterations);
+    printf("  Idle iterations:   %.1f%%\n", idle_iterations * 100.0 / iterations);
+    printf("  Max. period:       %.1f us\n", max_period * cycle_ns / 1000);
+    printf("  Period histogram:\n");
+    for (int i = 0; i < num_buckets; i++) {
+        if (histogram[i] == 0)
+            continue;
+        double upper = (i < num_buckets - 1 ? (1u << i) : max_period + 1) * cycle_ns / 1000;
+        printf("    < %9.2f us: %'u\n", upper, histogram[i]);
+    }
+}
+
+void device_bench::run(const char* port_path) {
+    vendor_request_in(port_path, VENDOR_REQUEST_RUN_BENCH, 0, this, sizeof(*this));
+}
+
+void device_bench::print() const {
+    printf("Device benchmark (clock cycles per 64 byte packet, %.0f MHz):\n", clock_freq / 1e6);
+    printf("  Firmware in RAM:             %s\n", (flags & flag_ramfunc) != 0 ? "yes" : "no");
+    printf("  USB library in RAM:          %s\n", (flags & flag_qsb_ramfunc) != 0 ? "yes" : "no");
+    printf("  Copy to PMA:                 %'u (reference loop: %'u)\n", copy_to_pma, ref_copy_to_pma);
+    printf("  Copy to PMA (unaligned):     %'u (reference loop: %'u)\n", copy_to_pma_unaligned, ref_copy_to_pma_unaligned);
+    printf("  Copy 2 chunks to PMA:        %'u\n", copy_chunks_to_pma);
+    printf("  Copy from PMA:               %'u (reference loop: %'u)\n", copy_from_pma, ref_copy_from_pma);
+    printf("  Copy from PMA (unaligned):   %'u (reference loop: %'u)\n", copy_from_pma_unaligned, ref_copy_from_pma_unaligned);
+}
+
+static uint32_t get_uint32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void device_trace::read(const char* port_path) {
+    records.clear();
+    num_lost = 0;
+
+    uint8_t buf[TRACE_HEADER_LEN + TRACE_MAX_RECORDS * TRACE_RECORD_LEN];
+    uint32_t seq = 0;
+    uint32_t end = 0;
+    uint32_t prev_timestamp = 0;
+    double time = 0;
+    bool is_first_request = true;
+
+    while (true) {
+        vendor_request_in(port_path, VENDOR_REQUEST_GET_TRACE, (uint16_t)seq, buf, sizeof(buf));
+        uint32_t write_count = get_uint32(buf);
+        uint32_t first = get_uint32(buf + 4);
+        clock_freq = get_uint32(buf + 8);
+        if (clock_freq == 0)
+            throw serial_error("Invalid trace");
+
+        if (is_first_request) {
+            // the first response starts with the oldest record;
+            // records added while reading are ignored
+            end = write_count;
+            is_first_request = false;
+        } else if (first != seq) {
+            num_lost += first - seq;
+        }
+        seq = first;
+        if ((int32_t)(end - seq) <= 0)
+            break;
+
+        uint32_t n = std::min(end - seq, (uint32_t)TRACE_MAX_RECORDS);
+        for (uint32_t i = 0; i < n; i++) {
+            const uint8_t* p = buf + TRACE_HEADER_LEN + i * TRACE_RECORD_LEN;
+            uint32_t timestamp = get_uint32(p);
+            uint32_t event_arg = get_uint32(p + 4);
+            if (!records.empty())
+                time += (uint32_t)(timestamp - prev_timestamp) / (double)clock_freq;
+            prev_timestamp = timestamp;
+            records.push_back({ time, (uint8_t)(event_arg & 0x7f), (uint8_t)((event_arg >> 7) & 1), event_arg >> 8 });
+        }
+        seq += n;
+    }
+}
+
+void device_trace::print() const {
+    static const char* const event_names[] = {
+        "?",
+        "bus reset",
+        "configured",
+        "OUT paused (TX free)",
+        "OUT unpaused (TX free)",
+        "TX DMA start",
+        "TX DMA done",
+        "RX overrun (lost)",
+        "set line coding",
+        "set control line state",
+    };
+
+    printf("Device trace (%zu records", records.size());
+    if (num_lost > 0)
+        printf(", %'u overwritten while reading", num_lost);
+    printf("):\n");
+
+    for (auto& r : records) {
+        const char* name = r.event < sizeof(event_names) / sizeof(event_names[0]) ? event_names[r.event] : "?";
+        printf("  %10.3f ms  port %d  %-24s %'u\n", r.time * 1e3, r.port + 1, name, r.arg);
+    }
+}
+
+void device_frame_time::read(const char* port_path, double* host_before, double* host_after) {
+    vendor_request_in(port_path, VENDOR_REQUEST_GET_FRAME_TIME, 0, this, sizeof(*this), host_before, host_after);
+    if (clock_freq == 0)
+        throw serial_error("Invalid frame time");
+}
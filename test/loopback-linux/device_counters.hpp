@@ -0,0 +1,206 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Performance counters of the USB-to-serial adapter (for Linux).
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Performance counters of the USB-to-serial adapter.
+ *
+ * The layout must match `perf_counters_impl` of the firmware.
+ * Counters not supported by the device firmware remain 0.
+ */
+struct device_counters {
+    uint32_t usb_out_bytes;
+    uint32_t usb_in_bytes;
+    uint32_t usb_out_packets;
+    uint32_t usb_in_packets;
+    uint32_t usb_in_zlps;
+    uint32_t out_pauses;
+    uint32_t out_paused_time;
+    uint32_t rx_overruns;
+    uint32_t parity_errors;
+    uint32_t framing_errors;
+    uint32_t tx_buf_peak;
+    uint32_t rx_buf_peak;
+    uint32_t rx_lost_bytes;
+    uint32_t serial_state_notifs;
+
+    /**
+     * Read the performance counters of the USB device behind the specified serial port.
+     *
+     * The counters are read with a vendor-specific control request via usbdevfs.
+     * This requires write access to the USB device file (`/dev/bus/usb/BBB/DDD`).
+     *
+     * Throws a `serial_error` if the counters cannot be read.
+     *
+     * @param port_path serial port path name, like `/dev/ttyACM0`
+     * @param reset whether to reset the counters after reading them
+     */
+    void read(const char* port_path, bool reset = false);
+
+    /**
+     * Print the counters.
+     */
+    void print() const;
+};
+
+
+/**
+ * Main loop statistics of the USB-to-serial adapter.
+ *
+ * Only available if the firmware has been built with `LOOP_STATS_ENABLE`.
+ * The layout must match `loop_stats_data` of the firmware.
+ */
+struct device_loop_stats {
+    static constexpr int num_buckets = 24;
+
+    uint32_t iterations;
+    uint32_t idle_iterations;
+    uint32_t max_period;
+    uint32_t clock_freq;
+    uint32_t histogram[num_buckets];
+
+    /**
+     * Read the main loop statistics of the USB device behind the specified serial port.
+     *
+     * Throws a `serial_error` if the statistics cannot be read.
+     *
+     * @param port_path serial port path name, like `/dev/ttyACM0`
+     * @param reset whether to reset the statistics after reading them
+     */
+    void read(const char* port_path, bool reset = false);
+
+    /**
+     * Print the statistics.
+     */
+    void print() const;
+};
+
+
+/**
+ * Microbenchmark results of the USB-to-serial adapter.
+ *
+ * Only available if the firmware has been built with `BENCH_ENABLE`.
+ * The layout must match `bench_results` of the firmware.
+ */
+struct device_bench {
+    static constexpr uint32_t flag_ramfunc = 0x01;
+    static constexpr uint32_t flag_qsb_ramfunc = 0x02;
+
+    uint32_t clock_freq;
+    uint32_t flags;
+    uint32_t copy_to_pma;
+    uint32_t copy_to_pma_unaligned;
+    uint32_t copy_chunks_to_pma;
+    uint32_t copy_from_pma;
+    uint32_t copy_from_pma_unaligned;
+    uint32_t ref_copy_to_pma;
+    uint32_t ref_copy_to_pma_unaligned;
+    uint32_t ref_copy_from_pma;
+    uint32_t ref_copy_from_pma_unaligned;
+
+    /**
+     * Run the microbenchmark on the USB device behind the specified serial port.
+     *
+     * Throws a `serial_error` if the benchmark cannot be run.
+     *
+     * @param port_path serial port path name, like `/dev/ttyACM0`
+     */
+    void run(const char* port_path);
+
+    /**
+     * Print the results.
+     */
+    void print() const;
+};
+
+
+/**
+ * Event trace of the USB-to-serial adapter.
+ *
+ * Only available if the firmware has been built with `TRACE_ENABLE`.
+ */
+struct device_trace {
+    struct record {
+        double time; // time relative to first record (in s)
+        uint8_t event; // event ID (without port bit)
+        uint8_t port; // serial port (0 or 1)
+        uint32_t arg; // argument
+    };
+
+    uint32_t clock_freq;
+    uint32_t num_lost; // number of records overwritten while reading
+    std::vector<record> records;
+
+    /**
+     * Read the trace of the USB device behind the specified serial port.
+     *
+     * Reads all records in the trace ring with several requests.
+     *
+     * Throws a `serial_error` if the trace cannot be read.
+     *
+     * @param port_path serial port path name, like `/dev/ttyACM0`
+     */
+    void read(const char* port_path);
+
+    /**
+     * Print the trace as a timeline.
+     */
+    void print() const;
+};
+
+
+/**
+ * Set a parameter of the first serial port of the USB-to-serial adapter.
+ *
+ * The parameter is set with the vendor-specific SET_PARAM request via usbdevfs.
+ *
+ * Throws a `serial_error` if the parameter cannot be set.
+ *
+ * @param port_path serial port path name, like `/dev/ttyACM0`
+ * @param param parameter ID
+ * @param value parameter value
+ */
+void device_set_param(const char* port_path, uint16_t param, uint32_t value);
+
+
+/**
+ * USB frame time of the USB-to-serial adapter.
+ *
+ * Only available if the firmware has been built with `CLOCK_SYNC_ENABLE`.
+ * The layout must match `clock_sync_data` of the firmware.
+ */
+struct device_frame_time {
+    uint32_t frame_number;
+    uint32_t sof_count;
+    uint32_t millis;
+    uint32_t systick;
+    uint32_t sof_ticks;
+    uint32_t request_ticks;
+    uint32_t clock_freq;
+
+    /**
+     * Read the frame time of the USB device behind the specified serial port.
+     *
+     * Throws a `serial_error` if the frame time cannot be read.
+     *
+     * @param port_path serial port path name, like `/dev/ttyACM0`
+     * @param host_before receives the host time before the control request was issued (steady clock, in s)
+     * @param host_after receives the host time after the control request has completed (steady clock, in s)
+     */
+    void read(const char* port_path, double* host_before, double* host_after);
+};
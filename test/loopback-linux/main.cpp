@@ -15,39 +15,84 @@
 //
 // Comand line syntax: loopback-test [ OPTIONS... ] tx-port [ rx-port ]
 //
+// With --latency, messages are sent ping-pong style instead and the round-trip
+// time percentiles and histogram are printed per message size and bit rate.
+//
+// With --sweep, the loopback test is repeated for each combination of bit rate,
+// data format and write chunk size, and the results are written as CSV.
+//
+// With --self-test, the test runs against an internal pseudo terminal pair
+// echoing the data to check that the test itself is not the bottleneck.
+//
+// With --multi, the test runs on several ports at once (each wired to itself),
+// driven by a single-threaded event loop (or one per thread with --threads).
+//
+// With --stall, the receiver periodically stops reading (or reads slowly) to
+// measure how much data is absorbed until the writer blocks and how fast it recovers.
+//
+// With --capture, the traffic between a host application (connected to --host-port)
+// and the device is forwarded and recorded. --replay re-sends the recorded host
+// data with the original timing (see --speed) and verifies the echo.
+//
+// With --client, the transfer goes through the asynchronous serial client
+// (serial_client.hpp), and its throughput and latency counters are printed.
+//
 // Specify the same port for tx-port and rx-port for single port configuration.
 //
+// The test modes are implemented by the benchmark core shared with the macOS and
+// Windows tests (see ../loopback-core). This file adds the Linux-only
+// instrumentation (device counters, benchmark, clock sync, framed RX, trace)
+// and the self-test.
+//
 
 #include "cxxopts.hpp"
-#include "prng.hpp"
+#include "device_counters.hpp"
+#include "loopback.hpp"
+#include "rx_frames.hpp"
 #include "serial.hpp"
 #include <algorithm>
-#include <condition_variable>
-#include <iomanip>
+#include <atomic>
+#include <iostream>
 #include <mutex>
 #include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 
 using namespace std::chrono;
 
-static constexpr uint32_t PRNG_INIT = 0x7b;
+static constexpr uint16_t PARAM_FRAMED_RX = 8;
 
 // parsed command line arguments
-static std::string send_port_path;
-static std::string recv_port_path;
-static int num_bytes;
-static int bit_rate;
-static int data_bits;
-static bool with_parity;
-static int rx_delay;
-static int max_outstanding_bytes;
-
-static serial_port send_port;
-static serial_port recv_port;
-static volatile bool test_cancelled = false;
-
-static int outstanding_bytes;
-std::mutex outstanding_data_mutex; // protects outstanding_bytes
-std::condition_variable outstanding_data_condition; // to be used with outstanding_data_mutex
+static loopback_settings settings;
+static bool run_bench;
+static bool run_clock_sync;
+static bool with_rx_timestamps;
+static bool with_trace;
+static bool run_self_test;
+
+static bool has_device_counters;
+static bool has_device_loop_stats;
+static uint32_t reported_lost_bytes; // RX bytes lost according to the device counters
+
+static constexpr int RECV_BUF_LEN = 16384;
+static constexpr double SELF_TEST_MIN_RATE = 12e6; // twice the fastest device bit rate
+
+// Relation between device clock and host clock
+struct clock_ref {
+    double host_time; // host time (steady clock, in s)
+    uint32_t device_ticks; // device time at host time (in clock cycles)
+    uint32_t clock_freq; // device clock frequency (in Hz)
+};
+
+// for framed RX mode
+static rx_frame_decoder frame_decoder;
+static std::vector<std::pair<int, double>> send_log; // number of bytes sent after each write, host time of write
+std::mutex send_log_mutex; // protects send_log
+static bool has_clock_refs;
+static clock_ref clock_ref_start;
+static clock_ref clock_ref_end;
 
 /**
  * Checks the program arguments
@@ -58,41 +103,70 @@ std::condition_variable outstanding_data_condition; // to be used with outstandi
 static int check_usage(int argc, char* argv[]);
 
 /**
- * Open the serial port(s) specified on the command line
+ * Resets the performance counters of the device (if supported by the device)
+ */
+static void reset_device_counters();
+
+/**
+ * Prints the performance counters of the device (if supported by the device)
+ */
+static void print_device_counters();
+
+/**
+ * Prints the event trace of the device
+ */
+static void print_device_trace();
+
+/**
+ * Samples the USB frame time of the device and prints the estimated
+ * request latency and clock drifts (if supported by the device)
  *
  * @return 0 on success, other value on error
  */
-static int open_ports();
+static int clock_sync();
+
+/**
+ * Runs the loopback test against a pseudo terminal pair echoing the data
+ * and checks that the achieved rate is well above the fastest device bit rate
+ *
+ * @param test loopback test
+ * @return 0 if the rate has been achieved, other value otherwise
+ */
+static int self_test(loopback_test& test);
 
 /**
- * Close  the serial port(s)
+ * Runs the loopback test once and prints the results and the device instrumentation
+ * @param test loopback test
+ * @return 0 on success, other value on error
  */
-static void close_ports();
+static int transfer_test(loopback_test& test);
 
 /**
- * Sends pseudo random data to the serial port
+ * Gets the current host time.
+ * @return time (steady clock, in s)
  */
-static void send();
+static double host_now();
 
 /**
- * Receives data from the serial port and compares it with the expected data
+ * Samples the USB frame time of the device to relate the device clock to the host clock.
+ * @param ref receives the sample with the shortest request round trip
+ * @return `true` if successful, `false` if not supported by the device
  */
-static void recv();
+static bool sample_clock_ref(clock_ref& ref);
 
 /**
- * Clears the high bit of each byte in the buffer.
- * @param buf buffer to be modified
- * @param buf_len length of buffer (in bytes)
+ * Prints the latency of the data received in framed RX mode
  */
-static void clear_high_bit(uint8_t* buf, size_t buf_len);
+static void print_rx_latency();
 
 /**
- * Prints a hex dump of the specified buffer.
- * @param title Title to print at start of line
- * @param buf buffer start
- * @para buf_len buffer length
+ * Computes the slope of the least squares line through the points.
+ * @param x x coordinates
+ * @param y y coordinates
+ * @param n number of points
+ * @return slope
  */
-static void hex_dump(const char* title, const uint8_t* buf, size_t buf_len);
+static double slope(const double* x, const double* y, int n);
 
 
 /**
@@ -106,44 +180,32 @@ int main(int argc, char* argv[]) {
     if (check_usage(argc, argv) != 0)
         exit(1);
 
-    try {
-        open_ports();
-
-        // Run send function in separate thread
-        std::thread sender(send);
-
-        if (rx_delay != 0)
-            std::this_thread::sleep_for(seconds(rx_delay));
-
-        // start time
-        time_point<high_resolution_clock> start_time = high_resolution_clock::now();
-
-        // receive data
-        recv();
+    if (run_bench) {
+        try {
+            device_bench bench;
+            bench.run(settings.send_port_path.c_str());
+            bench.print();
+            return 0;
+        }
+        catch (serial_error& error) {
+            std::cerr << "Benchmark not available: " << error.what() << std::endl;
+            return 2;
+        }
+    }
 
-        // end time
-        time_point<high_resolution_clock> end_time = high_resolution_clock::now();
-        double duration = static_cast<double>(duration_cast<milliseconds>(end_time - start_time).count()) / 1000.0;
+    if (run_clock_sync)
+        return clock_sync();
 
-        sender.join();
-        close_ports();
+    loopback_test test(settings);
 
-        if (!test_cancelled) {
-            int br = (int)((double)num_bytes * data_bits / duration);
-            double expected_net_rate = (double)bit_rate * data_bits / ((double)data_bits + (with_parity ? 1 : 0) + 2);
-            printf("Successfully sent %d bytes in %.1fs\n", num_bytes, duration);
-            printf("Gross bit rate: %d bps\n", bit_rate);
-            printf("Net bit rate:   %d bps\n", br);
-            printf("Overhead: %.1f%%\n", expected_net_rate * 100.0 / br - 100);
-        }
+    if (run_self_test)
+        return self_test(test);
 
-    }
-    catch (serial_error& error) {
-        std::cerr << error.what() << std::endl;
-        return 2;
-    }
+    if (!settings.capture_path.empty() || !settings.replay_path.empty() || settings.run_latency || settings.run_sweep
+        || !settings.multi_port_paths.empty())
+        return test.run();
 
-    return test_cancelled ? 3 : 0;
+    return transfer_test(test);
 }
 
 
@@ -151,23 +213,21 @@ int check_usage(int argc, char* argv[]) {
 
     cxxopts::Options options("loopback", "Serial port loopback test");
 
+    add_loopback_options(options, 4096);
     options.add_options()
-        ("t,tx-port", "Serial port for transmission", cxxopts::value<std::string>())
-        ("r,rx-port", "Serial port for reception (default: same as tx-port)", cxxopts::value<std::string>())
-        ("n,numbytes", "Number of bytes to transmit", cxxopts::value<int>()->default_value("300000"))
-        ("b,bitrate", "Bit rate (1200 .. 99,999,999 bps)", cxxopts::value<int>()->default_value("921600"))
-        ("p,parity", "Enable parity bit")
-        ("d,databits", "Data bits (7 or 8)", cxxopts::value<int>()->default_value("8"))
-        ("s,rx-sleep", "Sleep before reception (in s)", cxxopts::value<int>()->default_value("0"))
-        ("o,outstanding", "Maximum data outstanding in transit (in bytes)", cxxopts::value<int>()->default_value("999999999"))
+        ("bench", "Run the firmware microbenchmark instead of the loopback test (requires BENCH_ENABLE firmware build)")
+        ("clock-sync", "Sample the USB frame time to estimate latency and clock drift instead of running the loopback test (requires CLOCK_SYNC_ENABLE firmware build)")
+        ("rx-timestamps", "Receive in framed RX mode and print the latency of received data (requires RX_TIMESTAMPS_ENABLE firmware build, CLOCK_SYNC_ENABLE for the breakdown)")
+        ("trace", "Print the firmware event trace after the loopback test (requires TRACE_ENABLE firmware build)")
+        ("self-test", "Run the test against an internal pseudo terminal pair to check the throughput of the test itself (no serial port needed)")
         ("h,help", "Show usage");
-    options.positional_help("tx-port [ rx-port ]").show_positional_help();
 
     try {
         options.parse_positional({ "tx-port", "rx-port" });
         auto result = options.parse(argc, argv);
 
-        if (result.count("tx-port") == 0)
+        run_self_test = result.count("self-test") > 0;
+        if (result.count("tx-port") == 0 && !run_self_test && result.count("multi") == 0)
             throw cxxopts::OptionParseException("'tx-port' not specified");
 
         if (result.count("help") != 0) {
@@ -175,23 +235,11 @@ int check_usage(int argc, char* argv[]) {
             return 2;
         }
 
-        bit_rate = result["bitrate"].as<int>();
-        bit_rate = std::min(std::max(bit_rate, 1200), 99999999);
-        num_bytes = result["numbytes"].as<int>();
-        num_bytes = std::min(std::max(num_bytes, 1), 1000000000);
-        data_bits = result["databits"].as<int>();
-        send_port_path = result["tx-port"].as<std::string>();
-        rx_delay = result["rx-sleep"].as<int>();
-        max_outstanding_bytes = result["outstanding"].as<int>();
-        with_parity = result.count("parity") > 0;
-        if (with_parity)
-            data_bits = std::min(std::max(data_bits, 7), 8);
-        else
-            data_bits = 8;
-        if (result.count("rx-port") > 0)
-            recv_port_path = result["rx-port"].as<std::string>();
-        else
-            recv_port_path = send_port_path;
+        read_loopback_options(result, settings);
+        run_bench = result.count("bench") > 0;
+        run_clock_sync = result.count("clock-sync") > 0;
+        with_rx_timestamps = result.count("rx-timestamps") > 0;
+        with_trace = result.count("trace") > 0;
 
     }
     catch (const cxxopts::OptionException& e) {
@@ -204,131 +252,314 @@ int check_usage(int argc, char* argv[]) {
 }
 
 
-void send() {
-    prng prandom(PRNG_INIT);
-    uint8_t buf[64];
-
-    try {
-
-        int n = num_bytes;
-        while (n > 0 && !test_cancelled) {
-            int m = std::min((int)sizeof(buf), n);
-            prandom.fill(buf, m);
-            if (data_bits == 7)
-                clear_high_bit(buf, m);
-            
-            // wait until outstanding data is low enough to send next chunk
-            {
-                std::unique_lock<std::mutex> lock(outstanding_data_mutex);
-                outstanding_data_condition.wait(lock, []{
-                    return outstanding_bytes + sizeof(buf) <= max_outstanding_bytes
-                        || test_cancelled;
-                });
-                if (test_cancelled)
-                    return;
+int transfer_test(loopback_test& test) {
+    if (with_rx_timestamps) {
+        test.on_transfer_start = [] {
+            try {
+                device_set_param(settings.send_port_path.c_str(), PARAM_FRAMED_RX, 1);
             }
-            
-            send_port.transmit(buf, m);
-            n -= m;
-            
-            // update outstanding data
-            {
-                std::unique_lock<std::mutex> lock(outstanding_data_mutex);
-                outstanding_bytes += m;
+            catch (serial_error& error) {
+                throw serial_error((std::string("Framed RX mode not available: ") + error.what()).c_str());
             }
+            has_clock_refs = sample_clock_ref(clock_ref_start);
+        };
+        test.on_transfer_end = [] {
+            device_set_param(settings.send_port_path.c_str(), PARAM_FRAMED_RX, 0);
+            has_clock_refs = has_clock_refs && sample_clock_ref(clock_ref_end);
+        };
+        test.on_transmit = [](int num_bytes) {
+            std::unique_lock<std::mutex> lock(send_log_mutex);
+            send_log.push_back({ num_bytes, host_now() });
+        };
+        test.on_receive = [](uint8_t* buf, int len) {
+            return frame_decoder.decode(buf, len, host_now());
+        };
+    }
+
+    // the counters are reset after the ports have been opened
+    auto on_start = test.on_transfer_start;
+    test.on_transfer_start = [on_start] {
+        reset_device_counters();
+        reported_lost_bytes = 0;
+        if (on_start)
+            on_start();
+    };
+
+    // resynchronize the verification after RX buffer overruns reported by the device
+    test.on_data_loss = [] {
+        if (!has_device_counters)
+            return 0;
+        try {
+            device_counters counters;
+            counters.read(settings.send_port_path.c_str());
+            int lost = (int)(counters.rx_lost_bytes - reported_lost_bytes);
+            reported_lost_bytes = counters.rx_lost_bytes;
+            return lost;
         }
+        catch (serial_error&) {
+            return 0;
+        }
+    };
+
+    int ret = test.transfer_test();
+    if (ret == 2)
+        return ret;
+
+    print_device_counters();
+    if (with_rx_timestamps && !test.has_failed())
+        print_rx_latency();
+    if (with_trace)
+        print_device_trace();
+
+    return ret;
+}
+
+
+void reset_device_counters() {
+    try {
+        device_counters counters;
+        counters.read(settings.send_port_path.c_str(), true);
+        has_device_counters = true;
     }
     catch (serial_error& error) {
-        std::cerr << error.what() << std::endl;
-        test_cancelled = true;
+        std::cerr << "Device counters not available: " << error.what() << std::endl;
+        has_device_counters = false;
+        return;
+    }
+
+    try {
+        // only available if enabled in firmware build
+        device_loop_stats loop_stats;
+        loop_stats.read(settings.send_port_path.c_str(), true);
+        has_device_loop_stats = true;
+    }
+    catch (serial_error&) {
+        has_device_loop_stats = false;
     }
 }
 
 
-void recv() {
-    uint8_t buf[64];
-    uint8_t expected[64];
-    prng prandom(PRNG_INIT);
+void print_device_counters() {
+    if (!has_device_counters)
+        return;
 
     try {
-
-        int n = 0;
-        while (n < num_bytes && !test_cancelled) {
-            int k = recv_port.receive(buf, sizeof(buf));
-            if (k == 0) {
-                std::cerr << "No more data from " << recv_port_path << " after " << n << " bytes" << std::endl;
-                test_cancelled = true;
-                return;
-            }
-            
-            // update outstanding data and notify sender
-            {
-                std::unique_lock<std::mutex> lock(outstanding_data_mutex);
-                outstanding_bytes -= k;
-            }
-            outstanding_data_condition.notify_one();
-
-            prandom.fill(expected, k);
-            if (data_bits == 7)
-                clear_high_bit(expected, k);
-            if (memcmp(buf, expected, k) != 0) {
-                std::cerr << "Invalid data at pos " << n << std::endl;
-                hex_dump("Expected: ", expected, k);
-                hex_dump("Received: ", buf, k);
-                test_cancelled = true;
-                return;
-            }
-            n += k;
+        device_counters counters;
+        counters.read(settings.send_port_path.c_str());
+        counters.print();
+
+        if (has_device_loop_stats) {
+            device_loop_stats loop_stats;
+            loop_stats.read(settings.send_port_path.c_str());
+            loop_stats.print();
         }
-
     }
     catch (serial_error& error) {
         std::cerr << error.what() << std::endl;
-        test_cancelled = true;
-        outstanding_data_condition.notify_one();
     }
 }
 
 
-int open_ports() {
-    send_port.open(send_port_path.c_str(), bit_rate, data_bits, with_parity);
+void print_device_trace() {
+    try {
+        device_trace trace;
+        trace.read(settings.send_port_path.c_str());
+        trace.print();
+    }
+    catch (serial_error& error) {
+        std::cerr << "Trace not available: " << error.what() << std::endl;
+    }
+}
+
 
-    if (send_port_path == recv_port_path) {
-        recv_port = send_port;
+int clock_sync() {
+    constexpr int num_samples = 50;
+    double host_time[num_samples]; // host time at the middle of the request (in s)
+    double device_time[num_samples]; // device time when the request was processed (in s)
+    double frame_time[num_samples]; // USB frame time when the request was processed (in s)
+    double min_rtt = 1e9;
+    double sum_rtt = 0;
 
+    try {
+        device_frame_time first;
+        for (int i = 0; i < num_samples; i++) {
+            device_frame_time ft;
+            double before, after;
+            ft.read(settings.send_port_path.c_str(), &before, &after);
+            if (i == 0)
+                first = ft;
+
+            double rtt = after - before;
+            min_rtt = std::min(min_rtt, rtt);
+            sum_rtt += rtt;
+            host_time[i] = (before + after) / 2;
+
+            // relative to the first sample (the device timestamps wrap around)
+            double ticks_per_frame = ft.clock_freq / 1000.0;
+            device_time[i] = (uint32_t)(ft.request_ticks - first.request_ticks) / (double)ft.clock_freq;
+            frame_time[i] = ((uint32_t)(ft.sof_count - first.sof_count)
+                + (uint32_t)(ft.request_ticks - ft.sof_ticks) / ticks_per_frame
+                - (uint32_t)(first.request_ticks - first.sof_ticks) / ticks_per_frame) / 1000.0;
+
+            std::this_thread::sleep_for(milliseconds(100));
+        }
+
+        printf("Clock synchronization (%d samples over %.1fs):\n",
+            num_samples, host_time[num_samples - 1] - host_time[0]);
     }
-    else {
-        recv_port.open(recv_port_path.c_str(), bit_rate, data_bits, with_parity);
+    catch (serial_error& error) {
+        std::cerr << "Frame time not available: " << error.what() << std::endl;
+        return 2;
     }
 
-    recv_port.drain();
+    printf("  Request round trip:          %.1f us (min), %.1f us (avg)\n", min_rtt * 1e6, sum_rtt / num_samples * 1e6);
+    printf("  Device clock vs. host clock: %+.1f ppm\n", (slope(host_time, device_time, num_samples) - 1) * 1e6);
+    printf("  USB frames vs. host clock:   %+.1f ppm\n", (slope(host_time, frame_time, num_samples) - 1) * 1e6);
+    printf("  Device clock vs. USB frames: %+.1f ppm\n", (slope(frame_time, device_time, num_samples) - 1) * 1e6);
     return 0;
 }
 
+int self_test(loopback_test& test) {
+    int master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd == -1 || grantpt(master_fd) != 0 || unlockpt(master_fd) != 0) {
+        std::cerr << "Cannot create pseudo terminal" << std::endl;
+        return 2;
+    }
+    test.settings.send_port_path = test.settings.recv_port_path = ptsname(master_fd);
+    test.settings.num_bytes = std::max(test.settings.num_bytes, 20000000);
+    int num_bytes = test.settings.num_bytes;
+
+    // echo all data written to the pseudo terminal
+    std::atomic<bool> stop_echo{ false };
+    std::thread echo([&] {
+        std::vector<uint8_t> buf(RECV_BUF_LEN);
+        pollfd fds = { master_fd, POLLIN, 0 };
+        while (!stop_echo) {
+            if (poll(&fds, 1, 100) <= 0)
+                continue;
+            ssize_t n = read(master_fd, buf.data(), buf.size());
+            for (ssize_t i = 0; i < n; ) {
+                ssize_t k = write(master_fd, buf.data() + i, n - i);
+                if (k <= 0)
+                    break;
+                i += k;
+            }
+        }
+    });
 
-void close_ports() {
-    recv_port.drain();
-    send_port.close();
-    if (recv_port_path != send_port_path)
-        recv_port.close();
-}
+    int ret = 0;
+    try {
+        double transfer_time = test.run_transfer();
+        double br = num_bytes * 8 / transfer_time;
+        if (test.has_failed()) {
+            ret = 3;
+        } else {
+            bool ok = br >= SELF_TEST_MIN_RATE;
+            printf("Self-test: %d bytes in %.2fs through pseudo terminal (chunk size %d)\n", num_bytes, transfer_time, test.settings.chunk_size);
+            printf("Net bit rate: %.1f Mbps (required: %.1f Mbps) - %s\n", br / 1e6, SELF_TEST_MIN_RATE / 1e6, ok ? "passed" : "FAILED");
+            ret = ok ? 0 : 3;
+        }
+    }
+    catch (serial_error& error) {
+        std::cerr << error.what() << std::endl;
+        ret = 2;
+    }
 
+    stop_echo = true;
+    echo.join();
+    close(master_fd);
+    return ret;
+}
 
-void clear_high_bit(uint8_t* buf, size_t buf_len) {
-    for (int i = 0; i < buf_len; i++)
-        buf[i] &= 0x7f;
+double host_now() {
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
 }
 
+bool sample_clock_ref(clock_ref& ref) {
+    double min_rtt = 1e9;
+    try {
+        for (int i = 0; i < 10; i++) {
+            device_frame_time ft;
+            double before, after;
+            ft.read(settings.send_port_path.c_str(), &before, &after);
+            if (after - before < min_rtt) {
+                min_rtt = after - before;
+                ref = { (before + after) / 2, ft.request_ticks, ft.clock_freq };
+            }
+        }
+        return true;
+    }
+    catch (serial_error&) {
+        return false;
+    }
+}
 
-void hex_dump(const char* title, const uint8_t* buf, size_t buf_len)
-{
-    std::cerr << title;
+void print_rx_latency() {
+    struct stats {
+        double sum = 0;
+        double max = 0;
+        void add(double value) { sum += value; max = std::max(max, value); }
+    };
+
+    stats to_device; // host write to arrival in RX buffer
+    stats holdback; // arrival in RX buffer to submission
+    stats to_host; // submission to host read
+    stats total; // host write to host read
+
+    // device time to host time (linear between the two clock references)
+    double freq = clock_ref_start.clock_freq;
+    double scale = 1;
+    if (has_clock_refs) {
+        double device_span = (uint32_t)(clock_ref_end.device_ticks - clock_ref_start.device_ticks) / freq;
+        scale = (clock_ref_end.host_time - clock_ref_start.host_time) / device_span;
+    }
+    auto to_host_time = [&](uint32_t ticks) {
+        return clock_ref_start.host_time + (int32_t)(ticks - clock_ref_start.device_ticks) / freq * scale;
+    };
+
+    size_t log_index = 0;
+    for (auto& frame : frame_decoder.frames) {
+        // the first write containing the first payload byte
+        while (log_index + 1 < send_log.size() && send_log[log_index].first <= (int)frame.stream_pos)
+            log_index++;
+        double send_time = send_log[log_index].second;
+
+        total.add(frame.host_time - send_time);
+        if (has_clock_refs) {
+            double arrival_time = to_host_time(frame.arrival_ticks);
+            double submit_time = to_host_time(frame.submit_ticks);
+            to_device.add(arrival_time - send_time);
+            holdback.add(submit_time - arrival_time);
+            to_host.add(frame.host_time - submit_time);
+        }
+    }
 
-    for (size_t i = 0; i < buf_len; i++) {
-        if (i > 0)
-            std::cerr << ' ';
-        std::cerr << std::hex << std::setfill('0') << std::setw(2) << (int)buf[i];
+    size_t n = frame_decoder.frames.size();
+    if (n == 0)
+        return;
+    printf("RX latency (%zu packets, avg / max):\n", n);
+    if (has_clock_refs) {
+        printf("  UART dwell (host write to RX buffer): %7.3f / %7.3f ms\n", to_device.sum / n * 1e3, to_device.max * 1e3);
+        printf("  Holdback (RX buffer to submission):   %7.3f / %7.3f ms\n", holdback.sum / n * 1e3, holdback.max * 1e3);
+        printf("  USB/host (submission to host read):   %7.3f / %7.3f ms\n", to_host.sum / n * 1e3, to_host.max * 1e3);
+    } else {
+        printf("  (breakdown requires CLOCK_SYNC_ENABLE firmware build)\n");
     }
+    printf("  Total (host write to host read):      %7.3f / %7.3f ms\n", total.sum / n * 1e3, total.max * 1e3);
+}
 
-    std::cerr << std::endl;
+double slope(const double* x, const double* y, int n) {
+    double mean_x = 0;
+    double mean_y = 0;
+    for (int i = 0; i < n; i++) {
+        mean_x += x[i] / n;
+        mean_y += y[i] / n;
+    }
+    double sxy = 0;
+    double sxx = 0;
+    for (int i = 0; i < n; i++) {
+        sxy += (x[i] - mean_x) * (y[i] - mean_y);
+        sxx += (x[i] - mean_x) * (x[i] - mean_x);
+    }
+    return sxy / sxx;
 }
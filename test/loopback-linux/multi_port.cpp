@@ -0,0 +1,197 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Event loop driving the loopback test on multiple serial ports at once (for Linux).
+//
+
+#include "multi_port.hpp"
+#include "test_stream.hpp"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+static constexpr double NO_DATA_TIMEOUT = 1.0; // in s
+static constexpr int RECV_BUF_LEN = 16384;
+
+struct multi_port_engine::port {
+    serial_port serial;
+    multi_port_result result;
+    test_stream tx_stream;
+    test_stream rx_stream;
+    std::vector<uint8_t> tx_buf;
+    int tx_buf_len = 0; // number of bytes in tx_buf
+    int tx_buf_pos = 0; // number of bytes of tx_buf already written
+    int bytes_sent = 0;
+    double start_time = 0;
+    double last_rx_time = 0;
+    bool is_done = false;
+
+    port(int stream_index, int data_bits) : tx_stream(stream_index, data_bits), rx_stream(stream_index, data_bits) { }
+};
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+multi_port_engine::multi_port_engine(const multi_port_settings& settings)
+: settings(settings), event_fd(-1) { }
+
+multi_port_engine::~multi_port_engine() {
+    for (auto& p : ports)
+        p->serial.close();
+    if (event_fd != -1)
+        close(event_fd);
+}
+
+void multi_port_engine::add_port(const std::string& path, int stream_index) {
+    auto p = std::make_unique<port>(stream_index, settings.data_bits);
+    p->result.path = path;
+    p->tx_buf.resize(settings.chunk_size);
+    ports.push_back(std::move(p));
+}
+
+void multi_port_engine::run() {
+    event_fd = epoll_create1(0);
+    if (event_fd == -1)
+        throw serial_error("Failed to create epoll instance", errno);
+
+    for (auto& p : ports) {
+        p->serial.open(p->result.path.c_str(), settings.bit_rate, settings.data_bits, settings.with_parity);
+        p->serial.drain();
+        int fd = p->serial.fd();
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        // edge-triggered: each event is handled until the operation would block
+        epoll_event ev = { };
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = p.get();
+        if (epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            throw serial_error("Failed to register serial port", errno);
+    }
+
+    double start_time = now();
+    for (auto& p : ports) {
+        p->start_time = start_time;
+        p->last_rx_time = start_time;
+    }
+
+    int num_active = (int)ports.size();
+    std::vector<epoll_event> events(ports.size());
+    while (num_active > 0) {
+        int n = epoll_wait(event_fd, events.data(), (int)events.size(), 100);
+        if (n == -1 && errno != EINTR)
+            throw serial_error("Failed to wait for serial port events", errno);
+
+        double t = now();
+        for (int i = 0; i < n; i++) {
+            port& p = *static_cast<port*>(events[i].data.ptr);
+            if (p.is_done)
+                continue;
+            if ((events[i].events & EPOLLIN) != 0 && try_receive(p, t))
+                try_send(p); // window might have opened
+            if ((events[i].events & EPOLLOUT) != 0)
+                try_send(p);
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) != 0 && !p.is_done)
+                fail(p, "Serial port error or hang-up");
+        }
+
+        num_active = 0;
+        for (auto& p : ports) {
+            if (!p->is_done && t - p->last_rx_time > NO_DATA_TIMEOUT)
+                fail(*p, "No more data");
+            if (!p->is_done)
+                num_active++;
+        }
+    }
+
+    for (auto& p : ports) {
+        epoll_ctl(event_fd, EPOLL_CTL_DEL, p->serial.fd(), nullptr);
+        fcntl(p->serial.fd(), F_SETFL, fcntl(p->serial.fd(), F_GETFL) & ~O_NONBLOCK);
+        p->serial.drain();
+        p->serial.close();
+    }
+}
+
+bool multi_port_engine::try_send(port& p) {
+    bool has_sent = false;
+
+    while (!p.is_done) {
+        if (p.tx_buf_pos == p.tx_buf_len) {
+            // next chunk (if the window allows)
+            int m = std::min(settings.chunk_size, settings.num_bytes - p.bytes_sent);
+            int in_transit = p.bytes_sent - p.result.bytes_received;
+            if (m == 0 || (in_transit > 0 && in_transit + m > settings.max_outstanding_bytes))
+                break;
+            p.tx_stream.generate(p.tx_buf.data(), m);
+            p.tx_buf_len = m;
+            p.tx_buf_pos = 0;
+            p.bytes_sent += m;
+        }
+
+        ssize_t k = write(p.serial.fd(), p.tx_buf.data() + p.tx_buf_pos, p.tx_buf_len - p.tx_buf_pos);
+        if (k == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                fail(p, "Failed to transmit data", errno);
+            break;
+        }
+        p.tx_buf_pos += (int)k;
+        has_sent = true;
+    }
+
+    return has_sent;
+}
+
+bool multi_port_engine::try_receive(port& p, double t) {
+    uint8_t buf[RECV_BUF_LEN];
+    bool has_received = false;
+
+    while (!p.is_done) {
+        ssize_t k = read(p.serial.fd(), buf, sizeof(buf));
+        if (k == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                fail(p, "Failed to receive data", errno);
+            break;
+        }
+        if (k == 0)
+            break;
+
+        if (p.rx_stream.verify(buf, (int)k) >= 0) {
+            fail(p, "Invalid data");
+            break;
+        }
+
+        p.result.bytes_received += (int)k;
+        p.last_rx_time = t;
+        has_received = true;
+
+        if (p.result.bytes_received >= settings.num_bytes) {
+            p.result.duration = t - p.start_time;
+            p.is_done = true;
+        }
+    }
+
+    return has_received;
+}
+
+void multi_port_engine::fail(port& p, const char* message, int errnum) {
+    serial_error error(message, errnum);
+    p.result.error = error.what();
+    p.result.duration = now() - p.start_time;
+    p.is_done = true;
+}
+
+std::vector<multi_port_result> multi_port_engine::results() const {
+    std::vector<multi_port_result> res;
+    for (auto& p : ports)
+        res.push_back(p->result);
+    return res;
+}
@@ -0,0 +1,50 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Decoder for the framed RX mode with arrival timestamps.
+//
+
+#include "rx_frames.hpp"
+#include "serial.hpp"
+#include <string.h>
+
+static uint32_t get_u32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+size_t rx_frame_decoder::decode(uint8_t* buf, size_t len, double host_time) {
+    size_t out = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (payload_left > 0) {
+            buf[out++] = buf[i];
+            payload_left--;
+            stream_pos++;
+            continue;
+        }
+
+        header[header_pos++] = buf[i];
+        if (header_pos < header_len)
+            continue;
+
+        header_pos = 0;
+        uint16_t offset = header[2] | (header[3] << 8);
+        if (header[0] != header_magic || header[1] == 0)
+            throw serial_error("Invalid packet header in framed RX mode");
+        // the device position is continuous unless data has been lost
+        if (!frames.empty() && offset != next_offset)
+            throw serial_error("Gap in data received in framed RX mode");
+        next_offset = offset + header[1];
+
+        frames.push_back({ stream_pos, get_u32(header + 4), get_u32(header + 8), (uint16_t)(header[12] | (header[13] << 8)), host_time });
+        payload_left = header[1];
+    }
+
+    return out;
+}
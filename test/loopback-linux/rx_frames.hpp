@@ -0,0 +1,69 @@
+//
+//  USB Serial
+//
+// Copyright (c) 2022 Manuel Bleichenbacher
+// Licensed under MIT License
+// https://opensource.org/licenses/MIT
+//
+// Loopback test
+//
+// Decoder for the framed RX mode with arrival timestamps.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Decoder for data received in framed RX mode.
+ *
+ * In framed RX mode, each USB packet starts with a header carrying the
+ * position of the first payload byte in the received data stream and
+ * the device times when it arrived in the UART RX buffer and when the
+ * packet was submitted. The layout must match `usb_serial_rx_header`
+ * of the firmware.
+ */
+struct rx_frame_decoder {
+    static constexpr uint8_t header_magic = 0xa5;
+    static constexpr size_t header_len = 14;
+
+    /// Metadata of a received packet
+    struct frame {
+        /// position of the first payload byte in the decoded data stream
+        uint32_t stream_pos;
+        /// device time the first payload byte arrived in the RX buffer (in clock cycles)
+        uint32_t arrival_ticks;
+        /// device time the packet was submitted (in clock cycles)
+        uint32_t submit_ticks;
+        /// USB frame number when the packet was submitted (11 bits)
+        uint16_t submit_frame;
+        /// host time the header was received (steady clock, in s)
+        double host_time;
+    };
+
+    /// Metadata of all received packets
+    std::vector<frame> frames;
+
+    /**
+     * Decodes received data.
+     *
+     * The headers are removed and the payload is moved to the start of the buffer.
+     *
+     * Throws a `serial_error` if the data is not framed correctly.
+     *
+     * @param buf received data
+     * @param len length of received data, in bytes
+     * @param host_time host time the data was received (steady clock, in s)
+     * @return length of payload, in bytes
+     */
+    size_t decode(uint8_t* buf, size_t len, double host_time);
+
+private:
+    uint8_t header[header_len];
+    size_t header_pos = 0;
+    size_t payload_left = 0;
+    uint32_t stream_pos = 0;
+    uint16_t next_offset = 0;
+};
@@ -15,9 +15,12 @@
 #include <sys/ioctl.h>
 #include <string.h>
 #include <termios.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <IOKit/serial/ioss.h>
 
+static constexpr int IOV_MAX_CHUNKS = 16;
+
 /**
  * Sets the specified bits in the specified flags value.
  * @param flags flags value
@@ -98,6 +101,43 @@ void serial_port::transmit(const uint8_t* data, int data_len) {
         throw serial_error("Failed to transmit data");
 }
 
+void serial_port::transmit(const serial_chunk* chunks, int num_chunks) {
+    struct iovec iov[IOV_MAX_CHUNKS];
+    while (num_chunks > 0) {
+        int n = num_chunks < IOV_MAX_CHUNKS ? num_chunks : IOV_MAX_CHUNKS;
+        size_t total = 0;
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = const_cast<uint8_t*>(chunks[i].data);
+            iov[i].iov_len = chunks[i].len;
+            total += chunks[i].len;
+        }
+
+        // continue after partial writes
+        struct iovec* v = iov;
+        int num_v = n;
+        while (total > 0) {
+            ssize_t res = ::writev(_fd, v, num_v);
+            if (res == -1)
+                throw serial_error("Failed to transmit data", errno);
+            if (res == 0)
+                throw serial_error("Failed to transmit data");
+            total -= res;
+            while (num_v > 0 && (size_t)res >= v->iov_len) {
+                res -= v->iov_len;
+                v++;
+                num_v--;
+            }
+            if (num_v > 0) {
+                v->iov_base = static_cast<uint8_t*>(v->iov_base) + res;
+                v->iov_len -= res;
+            }
+        }
+
+        chunks += n;
+        num_chunks -= n;
+    }
+}
+
 int serial_port::receive(uint8_t* data, int data_len) {
     size_t res = ::read(_fd, data, data_len);
     if (res == -1)
@@ -0,0 +1,126 @@
+/*
+ * USB Serial - Throttler firmware
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Throttled channel from one USART to another (DMA driven).
+ */
+
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/usart.h>
+#include "channel.h"
+
+void channel::setup()
+{
+	// RX: USART data register to buffer
+	dma_channel_reset(DMA1, rx_dma_chan);
+	dma_set_peripheral_address(DMA1, rx_dma_chan, (uint32_t)&USART_DR(rx_usart));
+	dma_set_read_from_peripheral(DMA1, rx_dma_chan);
+	dma_enable_memory_increment_mode(DMA1, rx_dma_chan);
+	dma_set_memory_size(DMA1, rx_dma_chan, DMA_CCR_MSIZE_8BIT);
+	dma_set_peripheral_size(DMA1, rx_dma_chan, DMA_CCR_PSIZE_8BIT);
+	dma_set_priority(DMA1, rx_dma_chan, DMA_CCR_PL_HIGH);
+
+	// TX: buffer to USART data register
+	dma_channel_reset(DMA1, tx_dma_chan);
+	dma_set_peripheral_address(DMA1, tx_dma_chan, (uint32_t)&USART_DR(tx_usart));
+	dma_set_read_from_memory(DMA1, tx_dma_chan);
+	dma_enable_memory_increment_mode(DMA1, tx_dma_chan);
+	dma_set_memory_size(DMA1, tx_dma_chan, DMA_CCR_MSIZE_8BIT);
+	dma_set_peripheral_size(DMA1, tx_dma_chan, DMA_CCR_PSIZE_8BIT);
+	dma_set_priority(DMA1, tx_dma_chan, DMA_CCR_PL_MEDIUM);
+
+	usart_enable_rx_dma(rx_usart);
+	usart_enable_tx_dma(tx_usart);
+
+	reset();
+}
+
+void channel::reset()
+{
+	dma_disable_channel(DMA1, rx_dma_chan);
+	dma_disable_channel(DMA1, tx_dma_chan);
+	dma_clear_interrupt_flags(DMA1, rx_dma_chan, DMA_TCIF);
+	dma_clear_interrupt_flags(DMA1, tx_dma_chan, DMA_TCIF);
+	buffer.clear();
+	rx_len = 0;
+	rx_committed = 0;
+	tx_len = 0;
+	overrun_pending = false;
+	credit = 0;
+	rx_count = 0;
+	tx_count = 0;
+	overruns = 0;
+}
+
+void channel::poll()
+{
+	poll_rx();
+	poll_tx();
+}
+
+void channel::poll_rx()
+{
+	// the overrun flag is cleared when the DMA reads DR after SR has been read
+	bool overrun = (USART_SR(rx_usart) & USART_SR_ORE) != 0;
+	if (overrun && !overrun_pending)
+		overruns++;
+	overrun_pending = overrun;
+
+	if (rx_len != 0)
+	{
+		// add the bytes received so far to the buffer
+		uint16_t received = rx_len - dma_get_number_of_data(DMA1, rx_dma_chan);
+		buffer.commit(received - rx_committed);
+		rx_count += received - rx_committed;
+		rx_committed = received;
+		if (received < rx_len)
+			return;
+
+		dma_disable_channel(DMA1, rx_dma_chan);
+		dma_clear_interrupt_flags(DMA1, rx_dma_chan, DMA_TCIF);
+		rx_len = 0;
+	}
+
+	// start the next transfer if the throttle allows it
+	int32_t len = buffer.write_span();
+	if (len > credit)
+		len = credit;
+	if (len > RX_CHUNK_SIZE)
+		len = RX_CHUNK_SIZE;
+	if (len <= 0)
+		return;
+
+	credit -= len;
+	rx_len = len;
+	rx_committed = 0;
+	dma_set_memory_address(DMA1, rx_dma_chan, (uint32_t)buffer.write_ptr());
+	dma_set_number_of_data(DMA1, rx_dma_chan, len);
+	dma_enable_channel(DMA1, rx_dma_chan);
+}
+
+void channel::poll_tx()
+{
+	if (tx_len != 0)
+	{
+		if (!dma_get_interrupt_flag(DMA1, tx_dma_chan, DMA_TCIF))
+			return;
+
+		dma_disable_channel(DMA1, tx_dma_chan);
+		dma_clear_interrupt_flags(DMA1, tx_dma_chan, DMA_TCIF);
+		buffer.consume(tx_len);
+		tx_count += tx_len;
+		tx_len = 0;
+	}
+
+	uint16_t len = buffer.read_span();
+	if (len == 0)
+		return;
+
+	tx_len = len;
+	dma_set_memory_address(DMA1, tx_dma_chan, (uint32_t)buffer.read_ptr());
+	dma_set_number_of_data(DMA1, tx_dma_chan, len);
+	dma_enable_channel(DMA1, tx_dma_chan);
+}
@@ -0,0 +1,79 @@
+/*
+ * USB Serial - Throttler firmware
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Throttled channel from one USART to another (DMA driven).
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "ring_buffer.h"
+
+#define BUF_SIZE 2048
+#define RX_CHUNK_SIZE 256
+
+/**
+ * @brief Channel passing data from the RX of one USART to the TX of another one.
+ *
+ * Both directions use DMA in normal mode. The RX DMA is only started for as
+ * many bytes as the throttle credit allows. Once it has completed, the USART's
+ * data register remains full and the USART deasserts RTS until the next RX DMA
+ * is started (hardware flow control). The TX DMA sends the contiguous data in
+ * the buffer; CTS is handled by the USART.
+ *
+ * The RTS behaviour is taken from the reference manual (RM0008) and has not
+ * been verified on hardware yet.
+ */
+struct channel
+{
+	/// USART receiving data
+	uint32_t rx_usart;
+	/// DMA channel for receiving (DMA1)
+	uint8_t rx_dma_chan;
+	/// USART transmitting data
+	uint32_t tx_usart;
+	/// DMA channel for transmitting (DMA1)
+	uint8_t tx_dma_chan;
+
+	/// Number of bytes that may be received (granted by the throttle profile)
+	int32_t credit;
+	/// Total number of bytes received
+	uint32_t rx_count;
+	/// Total number of bytes transmitted
+	uint32_t tx_count;
+	/// Number of overrun errors (sender has ignored RTS)
+	uint32_t overruns;
+
+	/**
+	 * @brief Sets up the DMA channels (the USARTs must be configured).
+	 */
+	void setup();
+
+	/**
+	 * @brief Stops the DMA transfers and discards the buffered data.
+	 */
+	void reset();
+
+	/**
+	 * @brief Checks the DMA progress and starts new transfers (called from the main loop).
+	 */
+	void poll();
+
+private:
+	void poll_rx();
+	void poll_tx();
+
+	ring_buffer<BUF_SIZE> buffer;
+	/// Length of the running RX DMA transfer (0 if idle)
+	uint16_t rx_len;
+	/// Number of bytes of the running RX DMA transfer already added to the buffer
+	uint16_t rx_committed;
+	/// Length of the running TX DMA transfer (0 if idle)
+	uint16_t tx_len;
+	/// Indicates that the current overrun has already been counted
+	bool overrun_pending;
+};
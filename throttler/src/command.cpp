@@ -0,0 +1,285 @@
+/*
+ * USB Serial - Throttler firmware
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Command console on USART3.
+ */
+
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/usart.h>
+#include <string.h>
+#include "command.h"
+#include "flow_monitor.h"
+#include "throttler.h"
+
+#define LINE_LEN 64
+#define MAX_ARGS 4
+
+static char line[LINE_LEN];
+static uint32_t line_len;
+
+// output is buffered and sent one character per poll so the channels are not delayed
+static ring_buffer<1024> output;
+
+// print each measured flow control event
+static bool monitoring;
+
+static const char help_text[] =
+	"Commands:\r\n"
+	"  status                        show baud rate, profile and counters\r\n"
+	"  baud <bps>                    set baud rate of USART1 and USART2\r\n"
+	"  unlimited                     no throttling\r\n"
+	"  steady <bytes/ms> [<burst>]   fixed rate with maximum burst\r\n"
+	"  bursty <bytes> <ms>           burst of bytes every period\r\n"
+	"  periodic <pass ms> <stall ms> alternate between unthrottled and stalled\r\n"
+	"  random <bytes/ms> <max stall> random rate with random stalls\r\n"
+	"  flow                          show flow control reaction statistics (USART2)\r\n"
+	"  monitor                       toggle printing each flow control event\r\n"
+	"  clear                         reset the counters and statistics\r\n";
+
+static void print(const char *text)
+{
+	while (*text != 0 && output.avail() > 0)
+		output.put((uint8_t)*text++);
+}
+
+static void print_num(uint32_t value)
+{
+	char digits[11];
+	int n = 0;
+	do
+	{
+		digits[n++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value != 0);
+
+	while (n > 0 && output.avail() > 0)
+		output.put((uint8_t)digits[--n]);
+}
+
+static bool parse_num(const char *text, uint32_t *value)
+{
+	if (*text == 0)
+		return false;
+
+	uint32_t v = 0;
+	for (; *text != 0; text++)
+	{
+		if (*text < '0' || *text > '9' || v > (UINT32_MAX - 9) / 10)
+			return false;
+		v = v * 10 + (uint32_t)(*text - '0');
+	}
+	*value = v;
+	return true;
+}
+
+static void print_status()
+{
+	print("Baud rate: ");
+	print_num(baud_rate);
+	print(" bps (USART1 ");
+	print_num(effective_baud_rate(USART1));
+	print(", USART2 ");
+	print_num(effective_baud_rate(USART2));
+	print(")\r\nProfile: ");
+	const throttle_profile &profile = profiles[0];
+	print(profile.name());
+	print(" (rate ");
+	print_num(profile.rate);
+	print(" bytes/ms, burst ");
+	print_num(profile.burst);
+	print(" bytes, period ");
+	print_num(profile.period);
+	print(" ms, stall ");
+	print_num(profile.stall);
+	print(" ms)\r\n");
+
+	for (int i = 0; i < 2; i++)
+	{
+		print(i == 0 ? "USART1 -> USART2: " : "USART2 -> USART1: ");
+		print_num(channels[i].rx_count);
+		print(" bytes in, ");
+		print_num(channels[i].tx_count);
+		print(" bytes out, ");
+		print_num(channels[i].overruns);
+		print(" overruns\r\n");
+	}
+}
+
+static void print_flow_stats()
+{
+	for (int i = 0; i < 2; i++)
+	{
+		const flow_stats &stats = flow_statistics[i];
+		print(i == 0 ? "RTS stop (bridge overshoot): " : "CTS stop (throttler overshoot): ");
+		print_num(stats.count);
+		print(" events, ");
+		print_num(stats.count_with_data);
+		print(" with data");
+		if (stats.count_with_data > 0)
+		{
+			print(", avg ");
+			print_num(stats.sum_us / stats.count_with_data);
+			print(" us / ");
+			print_num(stats.sum_bytes / stats.count_with_data);
+			print(" bytes, max ");
+			print_num(stats.max_us);
+			print(" us / ");
+			print_num(stats.max_bytes);
+			print(" bytes");
+		}
+		print("\r\n");
+	}
+}
+
+static void print_flow_event(const flow_event &event)
+{
+	print(event.type == flow_event_type::rts_stop ? "RTS stop: " : "CTS stop: ");
+	print_num(event.overshoot_us);
+	print(" us, ");
+	print_num(event.overshoot_bytes);
+	print(event.timed_out ? " bytes (timed out)\r\n" : " bytes\r\n");
+}
+
+static void set_profile(throttle_type type, uint32_t rate, uint32_t burst, uint32_t period, uint32_t stall)
+{
+	for (auto &profile : profiles)
+	{
+		profile.type = type;
+		profile.rate = (int32_t)rate;
+		profile.burst = (int32_t)burst;
+		profile.period = period;
+		profile.stall = stall;
+		profile.restart();
+	}
+	print_status();
+}
+
+static void execute(char *cmd)
+{
+	// split into arguments
+	char *args[MAX_ARGS];
+	int num_args = 0;
+	char *p = strtok(cmd, " ");
+	while (p != nullptr && num_args < MAX_ARGS)
+	{
+		args[num_args++] = p;
+		p = strtok(nullptr, " ");
+	}
+	if (num_args == 0)
+		return;
+
+	uint32_t values[MAX_ARGS - 1] = {0};
+	int num_values = 0;
+	for (int i = 1; i < num_args; i++)
+	{
+		if (!parse_num(args[i], &values[i - 1]))
+		{
+			print("Invalid number: ");
+			print(args[i]);
+			print("\r\n");
+			return;
+		}
+		num_values++;
+	}
+
+	const char *name = args[0];
+	if (strcmp(name, "help") == 0)
+		print(help_text);
+	else if (strcmp(name, "status") == 0)
+		print_status();
+	else if (strcmp(name, "clear") == 0)
+	{
+		for (auto &ch : channels)
+			ch.rx_count = ch.tx_count = ch.overruns = 0;
+		flow_monitor_clear();
+		print_status();
+	}
+	else if (strcmp(name, "flow") == 0)
+		print_flow_stats();
+	else if (strcmp(name, "monitor") == 0)
+	{
+		monitoring = !monitoring;
+		print(monitoring ? "Monitoring on\r\n" : "Monitoring off\r\n");
+	}
+	else if (strcmp(name, "baud") == 0 && num_values == 1 && values[0] >= 1200)
+	{
+		set_baud_rate(values[0]);
+		print_status();
+	}
+	else if (strcmp(name, "unlimited") == 0 && num_values == 0)
+		set_profile(throttle_type::unlimited, 0, 0, 0, 0);
+	else if (strcmp(name, "steady") == 0 && num_values >= 1 && values[0] > 0)
+		set_profile(throttle_type::steady, values[0], num_values >= 2 ? values[1] : 8 * values[0], 0, 0);
+	else if (strcmp(name, "bursty") == 0 && num_values == 2 && values[1] > 0)
+		set_profile(throttle_type::bursty, 0, values[0], values[1], 0);
+	else if (strcmp(name, "periodic") == 0 && num_values == 2 && values[0] > 0)
+		set_profile(throttle_type::periodic, 0, 0, values[0], values[1]);
+	else if (strcmp(name, "random") == 0 && num_values == 2)
+		set_profile(throttle_type::random, values[0], 0, 0, values[1]);
+	else
+		print("Invalid command (see 'help')\r\n");
+}
+
+void command_setup()
+{
+	rcc_periph_clock_enable(RCC_USART3);
+	rcc_periph_clock_enable(RCC_GPIOB);
+
+	gpio_set_mode(GPIOB, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO10); // TX
+	gpio_set_mode(GPIOB, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, GPIO11);				  // RX
+
+	usart_set_baudrate(USART3, 115200);
+	usart_set_databits(USART3, 8);
+	usart_set_stopbits(USART3, USART_STOPBITS_1);
+	usart_set_parity(USART3, USART_PARITY_NONE);
+	usart_set_mode(USART3, USART_MODE_TX_RX);
+	usart_set_flow_control(USART3, USART_FLOWCONTROL_NONE);
+	usart_enable(USART3);
+
+	print("Throttler ready (type 'help')\r\n");
+}
+
+void command_poll()
+{
+	if (!output.empty() && (USART_SR(USART3) & USART_SR_TXE) != 0)
+		USART_DR(USART3) = output.get();
+
+	// print events while there is room in the output buffer (discard them otherwise)
+	flow_event event;
+	if ((!monitoring || output.avail() >= 64) && flow_monitor_next_event(&event) && monitoring)
+		print_flow_event(event);
+
+	if ((USART_SR(USART3) & USART_SR_RXNE) == 0)
+		return;
+
+	char c = (char)USART_DR(USART3);
+	if (c == '\r' || c == '\n')
+	{
+		if (line_len == 0)
+			return;
+		print("\r\n");
+		line[line_len] = 0;
+		line_len = 0;
+		execute(line);
+	}
+	else if (c == '\b' || c == 0x7f)
+	{
+		if (line_len > 0)
+		{
+			line_len--;
+			print("\b \b");
+		}
+	}
+	else if (line_len < LINE_LEN - 1)
+	{
+		// echo
+		line[line_len++] = c;
+		char echo[2] = {c, 0};
+		print(echo);
+	}
+}
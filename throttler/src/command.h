@@ -0,0 +1,34 @@
+/*
+ * USB Serial - Throttler firmware
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Command console on USART3 (PB10 TX, PB11 RX, 115,200 bps, no flow control).
+ *
+ * Commands (one per line):
+ *   help                          list the commands
+ *   status                        show baud rate, profile and counters
+ *   baud <bps>                    set the baud rate of USART1 and USART2
+ *   unlimited                     no throttling
+ *   steady <bytes/ms> [<burst>]   fixed rate with maximum burst
+ *   bursty <bytes> <ms>           burst of bytes every period
+ *   periodic <pass ms> <stall ms> alternate between unthrottled and stalled
+ *   random <bytes/ms> <max stall> random rate with random stalls
+ *   flow                          show flow control reaction statistics (USART2)
+ *   monitor                       toggle printing each flow control event
+ *   clear                         reset the counters and statistics
+ */
+
+#pragma once
+
+/**
+ * @brief Sets up USART3 for the command console.
+ */
+void command_setup();
+
+/**
+ * @brief Processes received characters and pending output (called from the main loop).
+ */
+void command_poll();
@@ -0,0 +1,203 @@
+/*
+ * USB Serial - Throttler firmware
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Flow control reaction measurement (TIM2 input capture on USART2).
+ */
+
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include "flow_monitor.h"
+
+#define WINDOW_MS 60 // below the 65 ms wrap-around of the 16-bit timer
+#define EVENT_QUEUE_SIZE 16
+
+/// Measurement window after a stop edge
+struct window
+{
+	bool active;
+	uint16_t start; // timer value of stop edge
+	uint16_t age;   // in ms
+	bool has_early_edge;
+	uint16_t early_edge; // data edge captured before the window was opened by the interrupt
+};
+
+flow_stats flow_statistics[2];
+
+static window windows[2];
+static bool waiting_for_stop[2];
+static uint32_t byte_time_ns = 10000000000ULL / 115200;
+
+static flow_event event_queue[EVENT_QUEUE_SIZE];
+static volatile uint8_t queue_head;
+static volatile uint8_t queue_tail;
+
+// Per event type: input capture channel of the flow control line and of the data line
+static const tim_ic_id control_ic[2] = {TIM_IC2, TIM_IC1};
+static const uint32_t data_flag[2] = {TIM_SR_CC4IF, TIM_SR_CC3IF};
+
+// Gets the last captured data edge (reading CCR clears the flag)
+static uint16_t data_capture(int index)
+{
+	return index == 0 ? TIM_CCR4(TIM2) : TIM_CCR3(TIM2);
+}
+
+static void close_window(int index, bool timed_out)
+{
+	window &win = windows[index];
+	win.active = false;
+
+	flow_event event = {(flow_event_type)index, timed_out, 0, 0};
+	bool has_edge = win.has_early_edge;
+	uint16_t last_edge = win.early_edge;
+	if ((TIM_SR(TIM2) & data_flag[index]) != 0)
+	{
+		// last data edge since the stop edge
+		last_edge = data_capture(index);
+		has_edge = true;
+	}
+	if (has_edge)
+	{
+		event.overshoot_us = (uint16_t)(last_edge - win.start);
+		event.overshoot_bytes = (uint16_t)(event.overshoot_us * 1000 / byte_time_ns + 1);
+	}
+
+	flow_stats &stats = flow_statistics[index];
+	stats.count++;
+	if (event.overshoot_bytes > 0)
+	{
+		stats.count_with_data++;
+		stats.sum_us += event.overshoot_us;
+		stats.sum_bytes += event.overshoot_bytes;
+		if (event.overshoot_us > stats.max_us)
+			stats.max_us = event.overshoot_us;
+		if (event.overshoot_bytes > stats.max_bytes)
+			stats.max_bytes = event.overshoot_bytes;
+	}
+
+	uint8_t head = queue_head;
+	if ((uint8_t)(head - queue_tail) < EVENT_QUEUE_SIZE)
+	{
+		event_queue[head % EVENT_QUEUE_SIZE] = event;
+		queue_head = head + 1;
+	}
+}
+
+static void on_control_edge(int index, uint16_t time)
+{
+	tim_ic_id ic = control_ic[index];
+	if (waiting_for_stop[index])
+	{
+		// line deasserted (high): start measurement window
+		timer_ic_set_polarity(TIM2, ic, TIM_IC_FALLING);
+		waiting_for_stop[index] = false;
+		window &win = windows[index];
+		win.start = time;
+		win.age = 0;
+		win.active = true;
+
+		// keep a data edge captured between the stop edge and the interrupt
+		win.has_early_edge = false;
+		if ((TIM_SR(TIM2) & data_flag[index]) != 0)
+		{
+			uint16_t edge = data_capture(index);
+			if ((int16_t)(edge - time) >= 0)
+			{
+				win.early_edge = edge;
+				win.has_early_edge = true;
+			}
+		}
+	}
+	else
+	{
+		// line asserted again (low)
+		timer_ic_set_polarity(TIM2, ic, TIM_IC_RISING);
+		waiting_for_stop[index] = true;
+		if (windows[index].active)
+			close_window(index, false);
+	}
+}
+
+extern "C" void tim2_isr()
+{
+	uint32_t sr = TIM_SR(TIM2);
+	if ((sr & TIM_SR_CC2IF) != 0)
+		on_control_edge(0, TIM_CCR2(TIM2)); // RTS (PA1)
+	if ((sr & TIM_SR_CC1IF) != 0)
+		on_control_edge(1, TIM_CCR1(TIM2)); // CTS (PA0)
+}
+
+void flow_monitor_setup()
+{
+	rcc_periph_clock_enable(RCC_TIM2);
+
+	// 1 MHz (the timer clock is twice the APB1 clock as APB1 is divided by 2)
+	timer_set_mode(TIM2, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
+	timer_set_prescaler(TIM2, rcc_apb1_frequency * 2 / 1000000 - 1);
+	timer_set_period(TIM2, 0xffff);
+	// load the prescaler (it is buffered until the next update event)
+	timer_generate_event(TIM2, TIM_EGR_UG);
+
+	timer_ic_set_input(TIM2, TIM_IC1, TIM_IC_IN_TI1);
+	timer_ic_set_input(TIM2, TIM_IC2, TIM_IC_IN_TI2);
+	timer_ic_set_input(TIM2, TIM_IC3, TIM_IC_IN_TI3);
+	timer_ic_set_input(TIM2, TIM_IC4, TIM_IC_IN_TI4);
+
+	// The F1 timers cannot capture both edges: the polarity of the flow control
+	// lines is flipped after each edge, starting with the current level.
+	waiting_for_stop[0] = gpio_get(GPIOA, GPIO1) == 0;
+	waiting_for_stop[1] = gpio_get(GPIOA, GPIO0) == 0;
+	timer_ic_set_polarity(TIM2, TIM_IC2, waiting_for_stop[0] ? TIM_IC_RISING : TIM_IC_FALLING);
+	timer_ic_set_polarity(TIM2, TIM_IC1, waiting_for_stop[1] ? TIM_IC_RISING : TIM_IC_FALLING);
+	timer_ic_set_polarity(TIM2, TIM_IC3, TIM_IC_FALLING);
+	timer_ic_set_polarity(TIM2, TIM_IC4, TIM_IC_FALLING);
+
+	timer_ic_enable(TIM2, TIM_IC1);
+	timer_ic_enable(TIM2, TIM_IC2);
+	timer_ic_enable(TIM2, TIM_IC3);
+	timer_ic_enable(TIM2, TIM_IC4);
+
+	timer_enable_irq(TIM2, TIM_DIER_CC1IE | TIM_DIER_CC2IE);
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+	timer_enable_counter(TIM2);
+}
+
+void flow_monitor_set_baud_rate(uint32_t baud)
+{
+	byte_time_ns = 10000000000ULL / baud;
+}
+
+void flow_monitor_tick()
+{
+	cm_disable_interrupts();
+	for (int i = 0; i < 2; i++)
+	{
+		if (windows[i].active && ++windows[i].age >= WINDOW_MS)
+			close_window(i, true);
+	}
+	cm_enable_interrupts();
+}
+
+bool flow_monitor_next_event(flow_event *event)
+{
+	uint8_t tail = queue_tail;
+	if (tail == queue_head)
+		return false;
+	*event = event_queue[tail % EVENT_QUEUE_SIZE];
+	queue_tail = tail + 1;
+	return true;
+}
+
+void flow_monitor_clear()
+{
+	cm_disable_interrupts();
+	for (auto &stats : flow_statistics)
+		stats = {};
+	cm_enable_interrupts();
+}
@@ -0,0 +1,91 @@
+/*
+ * USB Serial - Throttler firmware
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Flow control reaction measurement (TIM2 input capture on USART2).
+ *
+ * TIM2 runs at 1 MHz and captures the USART2 lines:
+ *   CH1 PA0 CTS (input, RTS of the bridge), both edges (polarity flipped after each edge)
+ *   CH2 PA1 RTS (output, CTS of the bridge), both edges (polarity flipped after each edge)
+ *   CH3 PA2 TX, falling edges (no interrupt, last edge only)
+ *   CH4 PA3 RX, falling edges (no interrupt, last edge only)
+ *
+ * When the throttler deasserts RTS, the bridge should stop sending. The time
+ * from the RTS edge to the last RX edge before RTS is asserted again (or 60 ms
+ * have elapsed) is the bridge's overshoot. When the bridge deasserts its RTS
+ * (CTS of the throttler, e.g. at its high-water mark), the time to the last TX
+ * edge is the overshoot of the throttler, i.e. the data still arriving at the
+ * bridge after its high-water mark. The number of bytes is derived from the
+ * time and the byte time (10 bits per byte) and includes the byte in flight.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/// Flow control event type
+enum class flow_event_type : uint8_t
+{
+	/// Throttler has deasserted RTS (bridge must stop sending)
+	rts_stop,
+	/// Bridge has deasserted its RTS (throttler's CTS)
+	cts_stop
+};
+
+/// Measured flow control event
+struct flow_event
+{
+	flow_event_type type;
+	/// Indicates that the stop has lasted longer than the measurement window
+	bool timed_out;
+	/// Time from the edge to the last data edge (in µs, 0 if no data)
+	uint16_t overshoot_us;
+	/// Overshoot (in bytes)
+	uint16_t overshoot_bytes;
+};
+
+/// Statistics per event type
+struct flow_stats
+{
+	uint32_t count;
+	/// Number of events with data after the edge
+	uint32_t count_with_data;
+	uint32_t sum_us;
+	uint32_t max_us;
+	uint32_t sum_bytes;
+	uint32_t max_bytes;
+};
+
+/// Statistics: [0] RTS stop, [1] CTS stop
+extern flow_stats flow_statistics[2];
+
+/**
+ * @brief Sets up TIM2 for input capture (the USARTs must be configured).
+ */
+void flow_monitor_setup();
+
+/**
+ * @brief Sets the baud rate used to derive the number of bytes.
+ * @param baud baud rate (in bps)
+ */
+void flow_monitor_set_baud_rate(uint32_t baud);
+
+/**
+ * @brief Closes measurement windows that have timed out (called every ms).
+ */
+void flow_monitor_tick();
+
+/**
+ * @brief Gets the next measured event (for printing individual events).
+ * @param event receives the event
+ * @return `true` if an event was available
+ */
+bool flow_monitor_next_event(flow_event *event);
+
+/**
+ * @brief Resets the statistics.
+ */
+void flow_monitor_clear();
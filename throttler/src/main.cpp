@@ -8,34 +8,36 @@
  * Test fixture for testing hardware flow control (CTS/RTS).
  * 
  * This firmware passes data received on UART1 RX to UART2 TX and vice versa 
- * (UART2 RX to UART1 TX). At the interface, it works with 115,200 bps.
+ * (UART2 RX to UART1 TX). At the interface, it works with 115,200 bps by default.
  * Internally, it throttles the speed to 2 bytes/ms (about about 20,000 bps).
+ *
+ * The data is moved by DMA. The throttle limits the length of the RX DMA
+ * transfers so the USART deasserts RTS while the throttle holds back data.
+ * Baud rate (up to 4.5 Mbps for USART1 and 2.25 Mbps for USART2) and throttle
+ * profile can be changed at run-time on the command console (USART3, see command.h).
+ * The reaction time to flow control changes on USART2 is measured with TIM2
+ * (see flow_monitor.h).
  */
 
 #include <libopencmsis/core_cm3.h>
+#include <libopencm3/cm3/systick.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/usart.h>
-#include <algorithm>
+#include "command.h"
+#include "flow_monitor.h"
+#include "throttler.h"
 
-#define BUF_SIZE 512
+#define DEFAULT_BAUD_RATE 115200
 #define MAX_CAPACITY 16
 #define SPEED 2 // bytes per ms
 
 static volatile bool tick_occurred;
 
-static int32_t capacity_ch_a;
-static int32_t capacity_ch_b;
-
-static int32_t size_ch_a;
-static int32_t head_ch_a;
-static int32_t tail_ch_a;
-static int32_t size_ch_b;
-static int32_t head_ch_b;
-static int32_t tail_ch_b;
-
-uint8_t buffer_ch_a[BUF_SIZE];
-uint8_t buffer_ch_b[BUF_SIZE];
+channel channels[2];
+throttle_profile profiles[2];
+uint32_t baud_rate = DEFAULT_BAUD_RATE;
 
 extern "C" void sys_tick_handler()
 {
@@ -57,9 +59,10 @@ static void clock_setup()
 
 static void uart_setup()
 {
-	// Enable USART interface clock
+	// Enable USART interface and DMA clock
 	rcc_periph_clock_enable(RCC_USART1);
 	rcc_periph_clock_enable(RCC_USART2);
+	rcc_periph_clock_enable(RCC_DMA1);
 
 	// Enable pin clock
 	rcc_periph_clock_enable(RCC_GPIOA);
@@ -80,7 +83,7 @@ static void uart_setup()
 	gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, GPIO11);			   // CTS
 
 	// Configure USART1
-	usart_set_baudrate(USART1, 115200);
+	usart_set_baudrate(USART1, DEFAULT_BAUD_RATE);
 	usart_set_databits(USART1, 8);
 	usart_set_stopbits(USART1, USART_STOPBITS_1);
 	usart_set_parity(USART1, USART_PARITY_NONE);
@@ -98,7 +101,7 @@ static void uart_setup()
 	gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, GPIO0);			  // CTS
 
 	// Configure USART2
-	usart_set_baudrate(USART2, 115200);
+	usart_set_baudrate(USART2, DEFAULT_BAUD_RATE);
 	usart_set_databits(USART2, 8);
 	usart_set_stopbits(USART2, USART_STOPBITS_1);
 	usart_set_parity(USART2, USART_PARITY_NONE);
@@ -107,65 +110,74 @@ static void uart_setup()
 	usart_enable(USART2);
 }
 
-int main()
+static void channel_setup()
 {
-	clock_setup();
-	uart_setup();
-
-	while (1)
+	// DMA1 channels: USART1 TX 4, RX 5; USART2 RX 6, TX 7
+	channels[0].rx_usart = USART1;
+	channels[0].rx_dma_chan = DMA_CHANNEL5;
+	channels[0].tx_usart = USART2;
+	channels[0].tx_dma_chan = DMA_CHANNEL7;
+	channels[1].rx_usart = USART2;
+	channels[1].rx_dma_chan = DMA_CHANNEL6;
+	channels[1].tx_usart = USART1;
+	channels[1].tx_dma_chan = DMA_CHANNEL4;
+
+	for (int i = 0; i < 2; i++)
 	{
-		// --- Channel A: USART 1 to USART 2 ---
+		channels[i].setup();
+		profiles[i].type = throttle_type::steady;
+		profiles[i].rate = SPEED;
+		profiles[i].burst = MAX_CAPACITY;
+		profiles[i].restart();
+	}
+}
 
-		if (size_ch_a > 0 && (USART_SR(USART2) & USART_SR_TXE) != 0)
-		{
-			// send byte
-			USART_DR(USART2) = buffer_ch_a[tail_ch_a];
-			tail_ch_a++;
-			if (tail_ch_a >= BUF_SIZE)
-				tail_ch_a = 0;
-			size_ch_a--;
-		}
+void set_baud_rate(uint32_t baud)
+{
+	uint32_t max_usart1 = rcc_apb2_frequency / 16;
+	uint32_t max_usart2 = rcc_apb1_frequency / 16;
 
-		if (capacity_ch_a > 0 && size_ch_a < BUF_SIZE && (USART_SR(USART1) & USART_SR_RXNE) != 0)
-		{
-			// receive byte
-			capacity_ch_a--;
-			buffer_ch_a[head_ch_a] = (uint8_t)USART_DR(USART1);
-			head_ch_a++;
-			if (head_ch_a >= BUF_SIZE)
-				head_ch_a = 0;
-			size_ch_a++;
-		}
+	// stop the DMA transfers before the USARTs are reconfigured
+	for (auto &ch : channels)
+		ch.reset();
+
+	usart_disable(USART1);
+	usart_disable(USART2);
+	usart_set_baudrate(USART1, baud < max_usart1 ? baud : max_usart1);
+	usart_set_baudrate(USART2, baud < max_usart2 ? baud : max_usart2);
+	usart_enable(USART1);
+	usart_enable(USART2);
+	baud_rate = baud;
+	flow_monitor_set_baud_rate(effective_baud_rate(USART2));
+}
 
-		// --- Channel B: USART 2 to USART 1 ---
+uint32_t effective_baud_rate(uint32_t usart)
+{
+	uint32_t clock = usart == USART1 ? rcc_apb2_frequency : rcc_apb1_frequency;
+	return clock / USART_BRR(usart);
+}
 
-		if (size_ch_b > 0 && (USART_SR(USART1) & USART_SR_TXE) != 0)
-		{
-			// send byte
-			USART_DR(USART1) = buffer_ch_b[tail_ch_b];
-			tail_ch_b++;
-			if (tail_ch_b >= BUF_SIZE)
-				tail_ch_b = 0;
-			size_ch_b--;
-		}
+int main()
+{
+	clock_setup();
+	uart_setup();
+	channel_setup();
+	flow_monitor_setup();
+	command_setup();
 
-		if (capacity_ch_b > 0 && size_ch_b < BUF_SIZE && (USART_SR(USART2) & USART_SR_RXNE) != 0)
-		{
-			// receive byte
-			capacity_ch_b--;
-			buffer_ch_b[head_ch_b] = (uint8_t)USART_DR(USART2);
-			head_ch_b++;
-			if (head_ch_b >= BUF_SIZE)
-				head_ch_b = 0;
-			size_ch_b++;
-		}
+	while (1)
+	{
+		channels[0].poll();
+		channels[1].poll();
+		command_poll();
 
-		// Increase capacity on each systick
+		// Update the credit on each systick
 
 		if (tick_occurred)
 		{
-			capacity_ch_a = std::min(capacity_ch_a + SPEED, (int32_t)MAX_CAPACITY);
-			capacity_ch_b = std::min(capacity_ch_b + SPEED, (int32_t)MAX_CAPACITY);
+			channels[0].credit = profiles[0].tick(channels[0].credit);
+			channels[1].credit = profiles[1].tick(channels[1].credit);
+			flow_monitor_tick();
 			tick_occurred = false;
 		}
 	}
@@ -0,0 +1,91 @@
+/*
+ * USB Serial - Throttler firmware
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Throttle profiles (shape of the slow consumer).
+ */
+
+#include "throttle_profile.h"
+
+// Credit granted per ms if unthrottled (more than 4.5 Mbps)
+#define UNLIMITED_CREDIT 1024
+
+void throttle_profile::restart()
+{
+	phase = 0;
+	stall_remaining = 0;
+	rng_state = 0x2545f491;
+}
+
+int32_t throttle_profile::tick(int32_t credit)
+{
+	switch (type)
+	{
+	case throttle_type::unlimited:
+		return UNLIMITED_CREDIT;
+
+	case throttle_type::steady:
+		credit += rate;
+		return credit < burst ? credit : burst;
+
+	case throttle_type::bursty:
+		phase++;
+		if (phase < period)
+			return credit;
+		phase = 0;
+		return burst;
+
+	case throttle_type::periodic:
+		phase++;
+		if (phase >= period + stall)
+			phase = 0;
+		return phase < period ? UNLIMITED_CREDIT : 0;
+
+	case throttle_type::random:
+		if (stall_remaining > 0)
+		{
+			stall_remaining--;
+			return 0;
+		}
+		if (stall > 0 && random_number(100) == 0)
+		{
+			stall_remaining = 1 + random_number(stall);
+			return 0;
+		}
+		credit += random_number(2 * rate + 1);
+		return credit < 4 * rate + 16 ? credit : 4 * rate + 16;
+	}
+	return credit;
+}
+
+const char *throttle_profile::name() const
+{
+	switch (type)
+	{
+	case throttle_type::unlimited:
+		return "unlimited";
+	case throttle_type::steady:
+		return "steady";
+	case throttle_type::bursty:
+		return "bursty";
+	case throttle_type::periodic:
+		return "periodic";
+	case throttle_type::random:
+		return "random";
+	}
+	return "?";
+}
+
+uint32_t throttle_profile::random_number(uint32_t range)
+{
+	// xorshift32
+	uint32_t x = rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	rng_state = x;
+	return x % range;
+}
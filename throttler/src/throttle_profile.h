@@ -0,0 +1,75 @@
+/*
+ * USB Serial - Throttler firmware
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Throttle profiles (shape of the slow consumer).
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/// Throttle profile type
+enum class throttle_type : uint8_t
+{
+	/// No throttling
+	unlimited,
+	/// Fixed rate (`rate` bytes/ms) with a maximum burst of `burst` bytes
+	steady,
+	/// `burst` bytes every `period` ms
+	bursty,
+	/// Unthrottled for `period` ms, then stalled for `stall` ms
+	periodic,
+	/// Random rate (0 to 2 × `rate` bytes/ms) with random stalls of up to `stall` ms (1% chance per ms)
+	random
+};
+
+/**
+ * @brief Throttle profile.
+ *
+ * Called every millisecond to grant the credit, i.e. the number of bytes
+ * a channel may receive.
+ */
+struct throttle_profile
+{
+	throttle_type type;
+	/// Rate (in bytes/ms)
+	int32_t rate;
+	/// Burst size (in bytes)
+	int32_t burst;
+	/// Period (in ms)
+	uint32_t period;
+	/// Stall duration (in ms)
+	uint32_t stall;
+
+	/**
+	 * @brief Restarts the profile (e.g. after it has been changed).
+	 */
+	void restart();
+
+	/**
+	 * @brief Updates the credit for the next millisecond.
+	 * @param credit current credit (in bytes)
+	 * @return new credit (in bytes)
+	 */
+	int32_t tick(int32_t credit);
+
+	/**
+	 * @brief Gets the profile name.
+	 * @return name
+	 */
+	const char *name() const;
+
+private:
+	uint32_t random_number(uint32_t range);
+
+	/// Time within the current period (in ms)
+	uint32_t phase;
+	/// Remaining stall time of random profile (in ms)
+	uint32_t stall_remaining;
+	/// State of random number generator
+	uint32_t rng_state;
+};
@@ -0,0 +1,40 @@
+/*
+ * USB Serial - Throttler firmware
+ *
+ * Copyright (c) 2020 Manuel Bleichenbacher
+ * Licensed under MIT License
+ * https://opensource.org/licenses/MIT
+ *
+ * Throttler state shared between main loop and command console.
+ */
+
+#pragma once
+
+#include "channel.h"
+#include "throttle_profile.h"
+
+/// Channels: [0] USART1 RX to USART2 TX, [1] USART2 RX to USART1 TX
+extern channel channels[2];
+
+/// Throttle profiles of the channels
+extern throttle_profile profiles[2];
+
+/// Current baud rate of USART1 and USART2 (as requested)
+extern uint32_t baud_rate;
+
+/**
+ * @brief Changes the baud rate of USART1 and USART2.
+ *
+ * The channels are reset. The rate is limited to the USART's maximum
+ * (fPCLK / 16, i.e. 4.5 Mbps for USART1 and 2.25 Mbps for USART2).
+ *
+ * @param baud baud rate (in bps)
+ */
+void set_baud_rate(uint32_t baud);
+
+/**
+ * @brief Gets the effective baud rate of a USART (derived from the baud rate register).
+ * @param usart USART
+ * @return baud rate (in bps)
+ */
+uint32_t effective_baud_rate(uint32_t usart);